@@ -5,14 +5,19 @@
 #include <stdlib.h>
 #include <netdb.h>
 
+#ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_wifi.h"
 #include "esp_event_loop.h"
-#include "esp_log.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
+#else
+/* Host (Linux) build, see the host folder in the top of the repo. */
+#include <arpa/inet.h>
+#endif /* ESP_PLATFORM */
+#include "esp_log.h"
 
 #include "libcoap.h"
 #include "coap_dtls.h"
@@ -49,9 +54,10 @@ extern uint8_t client_key_end[]		asm("_binary_coap_client_key_end");
 #define SQ_COAP_ERR_FAIL	(2)
 
 extern const char *TAG;
-static coap_optlist_t *optlist = NULL;
+extern coap_optlist_t *optlist;
 
 int sq_coap_init(coap_context_t **, coap_session_t **);
+int sq_coap_path_optlist(coap_optlist_t **, const char *);
 void sq_coap_cleanup(coap_context_t *, coap_session_t *);
 
 #endif
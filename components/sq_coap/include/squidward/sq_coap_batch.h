@@ -0,0 +1,65 @@
+#ifndef SQUIDWARD_COAP_BATCH_H
+#define SQUIDWARD_COAP_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+
+#define SQ_COAP_BATCH_BYTES		CONFIG_SQ_COAP_BATCH_BYTES
+#define SQ_COAP_BATCH_RECORDS	CONFIG_SQ_COAP_BATCH_RECORDS
+#define SQ_COAP_BATCH_DEADLINE	CONFIG_SQ_COAP_BATCH_DEADLINE_MS
+#define SQ_COAP_BATCH_HDR_LEN	2	/* record length, big endian */
+
+/* Why a batch was sent */
+#define SQ_COAP_BATCH_FLUSH_BYTES		(0)
+#define SQ_COAP_BATCH_FLUSH_RECORDS		(1)
+#define SQ_COAP_BATCH_FLUSH_DEADLINE	(2)
+#define SQ_COAP_BATCH_FLUSH_CALLER		(3)
+
+/**
+ * @brief Sends one batch as the payload of a request, e.g. sq_coap_send.
+ *
+ * @return 0 on success, anything else keeps the batch for the next flush.
+ */
+typedef int (*sq_coap_batch_send_t)(void *arg, const uint8_t *data, size_t len, unsigned int records);
+
+/*
+ * Collects application records into one payload, so that a number of
+ * small records costs one request (CoAP header, DTLS record, radio
+ * wake-up) instead of one each. Each record is its length followed by
+ * the data:
+ *
+ *   | len (2 bytes, big endian) | data (len bytes) | len | data | ...
+ *
+ * A batch is sent when the next record does not fit in the byte limit,
+ * when it has the maximum number of records, or when the oldest record
+ * has waited for the deadline (checked by sq_coap_batch_poll).
+ */
+typedef struct {
+	uint8_t					*buf;
+	size_t					size;			/* byte limit of a batch */
+	size_t					len;
+	unsigned int			records;
+	unsigned int			max_records;
+	unsigned int			deadline_ms;
+	coap_tick_t				first;			/* when the oldest record in the batch was added */
+	sq_coap_batch_send_t	send;
+	void					*send_arg;
+
+	/* Statistics */
+	uint32_t				batches;
+	uint32_t				sent_records;
+	uint32_t				sent_bytes;
+	uint32_t				flushes[4];		/* per SQ_COAP_BATCH_FLUSH_ reason */
+	unsigned int			last_records;	/* records in the last batch */
+} sq_coap_batch_t;
+
+int sq_coap_batch_init(sq_coap_batch_t *, size_t bytes, unsigned int records, unsigned int deadline_ms,
+					   sq_coap_batch_send_t send, void *arg);
+int sq_coap_batch_add(sq_coap_batch_t *, const uint8_t *, size_t);
+int sq_coap_batch_flush(sq_coap_batch_t *);
+int sq_coap_batch_poll(sq_coap_batch_t *);
+void sq_coap_batch_free(sq_coap_batch_t *);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef SQUIDWARD_COAP_BLOCK_H
+#define SQUIDWARD_COAP_BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+
+#define SQ_COAP_BLOCK_WINDOW	CONFIG_SQ_COAP_BLOCK_WINDOW
+#define SQ_COAP_BLOCK_SZX		CONFIG_SQ_COAP_BLOCK_SZX
+#define SQ_COAP_BLOCK_TIMEOUT	CONFIG_SQ_COAP_BLOCK_TIMEOUT_MS
+#define SQ_COAP_BLOCK_RETRIES	4
+
+#define SQ_COAP_BLOCK_WINDOW_MAX	16
+#define SQ_COAP_BLOCK_ETAG_LEN		8
+
+/* Block size control, see block_adapt in sq_coap_block.c */
+#ifdef CONFIG_SQ_COAP_BLOCK_ADAPTIVE
+#define SQ_COAP_BLOCK_SZX_MIN		CONFIG_SQ_COAP_BLOCK_SZX_MIN
+#else
+#define SQ_COAP_BLOCK_SZX_MIN		SQ_COAP_BLOCK_SZX
+#endif
+#define SQ_COAP_BLOCK_MIN_SIZE		(1u << (SQ_COAP_BLOCK_SZX_MIN + 4))
+#define SQ_COAP_BLOCK_LOSS_WINDOW	16	/* blocks the loss rate is taken over */
+#define SQ_COAP_BLOCK_LOSS_SHRINK	2	/* losses in the window that halve the block size */
+#define SQ_COAP_BLOCK_GROW_AFTER	32	/* blocks without loss before doubling it */
+#define SQ_COAP_BLOCK_OVERHEAD		32	/* CoAP header, token and options of a block response */
+
+/* Transfer status */
+#define SQ_COAP_BLOCK_BUSY	(0)
+#define SQ_COAP_BLOCK_DONE	(1)
+#define SQ_COAP_BLOCK_ERR	(2)
+#define SQ_COAP_BLOCK_VALID	(3)	/* 2.03, the representation of the known ETag is current */
+
+/**
+ * @brief Called with the payload of the transfer, in order.
+ *
+ * @return 0 on success, anything else aborts the transfer.
+ */
+typedef int (*sq_coap_block_write_t)(void *arg, const uint8_t *data, size_t len);
+
+/**
+ * @brief Optional, number of bytes the writer takes without blocking.
+ *
+ * Block requests are held back while the writer is busy.
+ */
+typedef size_t (*sq_coap_block_space_t)(void *arg);
+
+typedef struct {
+	unsigned int	num;		/* block number requested for this slot */
+	int				state;
+	size_t			len;		/* payload length, when received */
+	unsigned int	retries;
+	coap_tick_t		sent;		/* first request, for the RTT */
+	coap_tick_t		timeout;	/* when to request the block again */
+} sq_coap_block_slot_t;
+
+/*
+ * Block-wise (Block2) GET with several blocks in flight. Block n is always
+ * kept in slot n % window, blocks arriving ahead of next_block are buffered
+ * there until the blocks before them have been handed to the writer.
+ */
+typedef struct {
+	coap_session_t			*session;
+	unsigned int			window;
+	unsigned int			szx;
+	unsigned int			max_szx;		/* size the buffers are for */
+	unsigned int			new_szx;		/* size to change to, at the next boundary */
+	int						opened;			/* first block received, window open */
+	unsigned int			first_block;	/* block the transfer started at */
+	unsigned int			next_block;		/* next block to hand to the writer */
+	unsigned int			next_req;		/* next block to request */
+	size_t					size;			/* size of the resource, when known */
+	unsigned int			last_block;		/* last block of the resource, when known */
+	int						last_known;
+	int						status;
+	int						changed;		/* ETag differs from the expected one */
+	uint8_t					etag[SQ_COAP_BLOCK_ETAG_LEN];
+	size_t					etag_len;
+	int						etag_check;		/* etag is the expected one, not just the last seen */
+	uint8_t					known_etag[SQ_COAP_BLOCK_ETAG_LEN];	/* sent with the first request */
+	size_t					known_etag_len;
+	uint8_t					*buf;			/* window * block size bytes */
+	sq_coap_block_slot_t	slot[SQ_COAP_BLOCK_WINDOW_MAX];
+	coap_optlist_t			*path;			/* URI path, if not the one of SQ_COAP_URI */
+	sq_coap_block_write_t	write;
+	sq_coap_block_space_t	space;
+	void					*write_arg;
+
+	/* Statistics */
+	uint32_t				requests;
+	uint32_t				retransmits;
+	uint32_t				reordered;
+	uint32_t				duplicates;
+	uint32_t				throttled;		/* times the window was held back by the writer */
+	uint32_t				resizes;
+	uint32_t				loss_hist;		/* one bit per block, 1 if it had to be requested again */
+	uint32_t				clean;			/* blocks since the last loss or resize */
+	uint32_t				srtt_ms;
+	uint32_t				rttvar_ms;
+	uint32_t				rtt_min_ms;
+} sq_coap_block_t;
+
+int sq_coap_block_init(sq_coap_block_t *, coap_session_t *, unsigned int window, unsigned int szx,
+					   sq_coap_block_write_t, void *);
+void sq_coap_block_set_space(sq_coap_block_t *, sq_coap_block_space_t);
+int sq_coap_block_set_path(sq_coap_block_t *, const char *);
+void sq_coap_block_set_size(sq_coap_block_t *, size_t);
+void sq_coap_block_set_etag(sq_coap_block_t *, const uint8_t *, size_t);
+void sq_coap_block_set_known_etag(sq_coap_block_t *, const uint8_t *, size_t);
+int sq_coap_block_start(sq_coap_block_t *);
+int sq_coap_block_start_at(sq_coap_block_t *, size_t);
+int sq_coap_block_response(sq_coap_block_t *, coap_pdu_t *);
+int sq_coap_block_poll(sq_coap_block_t *);
+void sq_coap_block_free(sq_coap_block_t *);
+
+#endif
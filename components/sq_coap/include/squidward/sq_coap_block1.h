@@ -0,0 +1,62 @@
+#ifndef SQUIDWARD_COAP_BLOCK1_H
+#define SQUIDWARD_COAP_BLOCK1_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+#include "squidward/sq_coap_block.h"
+
+#define SQ_COAP_BLOCK1_WINDOW	CONFIG_SQ_COAP_BLOCK1_WINDOW
+#define SQ_COAP_BLOCK1_SZX		CONFIG_SQ_COAP_BLOCK1_SZX
+
+/* Transfer status and timeouts are those of the Block2 engine, SQ_COAP_BLOCK_* */
+
+typedef struct {
+	unsigned int	num;		/* block number sent from this slot */
+	int				state;
+	unsigned int	retries;
+	coap_tick_t		timeout;	/* when to send the block again */
+} sq_coap_block1_slot_t;
+
+/*
+ * Block-wise (Block1) upload of a payload that does not fit in one PDU.
+ * Block n is always sent from slot n % window. The first block goes
+ * alone, the server may ask for a smaller block size in its answer, then
+ * up to window blocks are in flight. A block that is not answered is sent
+ * again, nothing else.
+ */
+typedef struct {
+	coap_session_t			*session;
+	unsigned int			window;
+	unsigned int			szx;
+	int						opened;			/* first block answered, window open */
+	uint8_t					code;			/* request method */
+	const uint8_t			*data;			/* payload, owned by the caller */
+	size_t					len;
+	unsigned int			next_ack;		/* first block without an answer */
+	unsigned int			next_send;		/* next block to send */
+	unsigned int			last_block;
+	int						status;
+	uint8_t					resp_code;		/* code of the final response */
+	sq_coap_block1_slot_t	slot[SQ_COAP_BLOCK_WINDOW_MAX];
+	coap_optlist_t			*path;			/* URI path, if not the one of SQ_COAP_URI */
+
+	/* Statistics, of the last upload */
+	uint32_t				blocks;			/* blocks sent, retransmissions included */
+	uint32_t				retransmits;
+	uint32_t				duplicates;
+	uint32_t				incomplete;		/* 4.08, the server is missing an earlier block */
+	uint32_t				resizes;
+} sq_coap_block1_t;
+
+int sq_coap_block1_needed(coap_session_t *, size_t len);
+int sq_coap_block1_init(sq_coap_block1_t *, coap_session_t *, unsigned int window, unsigned int szx);
+int sq_coap_block1_set_path(sq_coap_block1_t *, const char *);
+int sq_coap_block1_start(sq_coap_block1_t *, uint8_t code, const uint8_t *data, size_t len);
+int sq_coap_block1_match(const coap_pdu_t *);
+int sq_coap_block1_response(sq_coap_block1_t *, coap_pdu_t *);
+int sq_coap_block1_poll(sq_coap_block1_t *);
+void sq_coap_block1_free(sq_coap_block1_t *);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SQUIDWARD_COAP_OBSERVE_H
+#define SQUIDWARD_COAP_OBSERVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+
+#define SQ_COAP_OBSERVE_MAX_AGE		60		/* s, when a notification has no Max-Age */
+#define SQ_COAP_OBSERVE_MARGIN		5000	/* ms past Max-Age before registering again */
+#define SQ_COAP_OBSERVE_RETRY		30000	/* ms before a registration without answer is sent again */
+#define SQ_COAP_OBSERVE_FRESH		128		/* s, RFC 7641 3.4, a notification after this long is always new */
+#define SQ_COAP_OBSERVE_ETAG_LEN	8
+
+/**
+ * @brief Called with the payload of each new notification.
+ *
+ * Late notifications, older than one already seen, are dropped.
+ */
+typedef void (*sq_coap_observe_notify_t)(void *arg, const uint8_t *data, size_t len);
+
+/*
+ * Observe (RFC 7641) registration on one resource of the server. The
+ * server sends a notification when the resource changes, instead of the
+ * client polling it. The registration is renewed when the server has
+ * been quiet for longer than the Max-Age of the last notification, and
+ * sent again when it is not answered.
+ */
+typedef struct {
+	coap_session_t				*session;
+	coap_optlist_t				*path;
+	uint8_t						token[2];
+	sq_coap_observe_notify_t	notify;
+	void						*notify_arg;
+	int							active;		/* started and not stopped */
+	int							registered;	/* the server has confirmed the registration */
+	int							seen;		/* a notification since the last registration */
+	uint32_t					seq;		/* Observe value of the last notification */
+	coap_tick_t					last;		/* when it arrived */
+	coap_tick_t					next;		/* when to register (again) */
+	uint8_t						etag[SQ_COAP_OBSERVE_ETAG_LEN];	/* of the last notification */
+	size_t						etag_len;
+	int							more;		/* the last notification was the first block of several */
+
+	/* Statistics */
+	uint32_t					registrations;
+	uint32_t					notifications;
+	uint32_t					stale;		/* notifications older than the last one */
+} sq_coap_observe_t;
+
+int sq_coap_observe_init(sq_coap_observe_t *, coap_session_t *, const char *path,
+						 sq_coap_observe_notify_t notify, void *arg);
+int sq_coap_observe_start(sq_coap_observe_t *);
+int sq_coap_observe_response(sq_coap_observe_t *, coap_pdu_t *);
+int sq_coap_observe_poll(sq_coap_observe_t *);
+int sq_coap_observe_stop(sq_coap_observe_t *);
+void sq_coap_observe_free(sq_coap_observe_t *);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef SQUIDWARD_COAP_REQ_H
+#define SQUIDWARD_COAP_REQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+
+#define SQ_COAP_REQ_MAX			CONFIG_SQ_COAP_REQ_MAX
+#define SQ_COAP_REQ_NSTART		CONFIG_SQ_COAP_REQ_NSTART
+#define SQ_COAP_REQ_ACK_TIMEOUT	CONFIG_SQ_COAP_REQ_ACK_TIMEOUT_MS
+#define SQ_COAP_REQ_WAIT		(SQ_COAP_TIME_SEC * 1000)	/* ms, when submitted with timeout 0 */
+
+/* Completion status, passed to the callback */
+#define SQ_COAP_REQ_OK			(0)	/* a response was received, of any code */
+#define SQ_COAP_REQ_TIMEOUT		(1)
+#define SQ_COAP_REQ_CANCELLED	(2)
+#define SQ_COAP_REQ_ERR			(3)
+
+/**
+ * @brief Called once when a request completes.
+ *
+ * The slot of the request is free again when it is called, new requests
+ * may be submitted from it.
+ * @param[in] status	SQ_COAP_REQ_OK, or why there was no response.
+ * @param[in] received	The response, NULL unless status is SQ_COAP_REQ_OK.
+ */
+typedef void (*sq_coap_req_done_t)(void *arg, int status, coap_pdu_t *received);
+
+typedef struct {
+	int					state;
+	uint8_t				token;		/* second byte of the token, after the tag */
+	uint16_t			mid;		/* message ID, the same for every retransmission */
+	uint32_t			order;		/* submission order, queued requests start by it */
+	uint8_t				code;		/* request method */
+	coap_optlist_t		*path;		/* URI path, if not the one of SQ_COAP_URI */
+	const uint8_t		*data;		/* payload, owned by the caller until done */
+	size_t				len;
+	unsigned int		retries;
+	coap_tick_t			deadline;	/* when to give up */
+	coap_tick_t			timeout;	/* when to send the request again */
+	sq_coap_req_done_t	done;
+	void				*done_arg;
+} sq_coap_req_slot_t;
+
+/*
+ * Requests that are in flight at the same time on one session, up to
+ * nstart of them, with responses matched to requests by token. The rest
+ * wait in the table until a request ahead of them completes. Lets
+ * independent requests (telemetry, configuration, manifest check) share
+ * one wake-up of the radio instead of running one after another.
+ */
+typedef struct {
+	coap_session_t		*session;
+	unsigned int		nstart;
+	unsigned int		inflight;
+	uint8_t				next_token;
+	uint32_t			next_order;
+	sq_coap_req_slot_t	slot[SQ_COAP_REQ_MAX];
+
+	/* Statistics */
+	uint32_t			submitted;
+	uint32_t			completed;
+	uint32_t			timeouts;
+	uint32_t			retransmits;
+	uint32_t			duplicates;		/* responses to requests that had completed */
+	uint32_t			max_inflight;
+} sq_coap_req_t;
+
+int sq_coap_req_init(sq_coap_req_t *, coap_session_t *, unsigned int nstart);
+int sq_coap_req_submit(sq_coap_req_t *, uint8_t code, const char *path, const uint8_t *data, size_t len,
+					   unsigned int timeout_ms, sq_coap_req_done_t done, void *arg);
+int sq_coap_req_cancel(sq_coap_req_t *, int handle);
+int sq_coap_req_response(sq_coap_req_t *, coap_pdu_t *);
+int sq_coap_req_poll(sq_coap_req_t *);
+unsigned int sq_coap_req_pending(const sq_coap_req_t *);
+int sq_coap_req_run(sq_coap_req_t *, coap_context_t *);
+void sq_coap_req_free(sq_coap_req_t *);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SQUIDWARD_COAP_TELEMETRY_H
+#define SQUIDWARD_COAP_TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "squidward/sq_coap.h"
+
+#define SQ_COAP_TELEMETRY_BUFFER		CONFIG_SQ_COAP_TELEMETRY_BUFFER
+#define SQ_COAP_TELEMETRY_MSG_MAX		CONFIG_SQ_COAP_TELEMETRY_MSG_MAX
+#define SQ_COAP_TELEMETRY_ACK_EVERY		CONFIG_SQ_COAP_TELEMETRY_ACK_EVERY
+#define SQ_COAP_TELEMETRY_ACK_TIMEOUT	CONFIG_SQ_COAP_TELEMETRY_ACK_TIMEOUT_MS
+#define SQ_COAP_TELEMETRY_RETRIES		4
+#define SQ_COAP_TELEMETRY_SEQ_LEN		4	/* sequence number in front of each message */
+#define SQ_COAP_TELEMETRY_RANGE_LEN		8	/* first and last sequence number of an ack range */
+
+/* Send mode */
+#define SQ_COAP_TELEMETRY_CON	(0)	/* every message CON, ACKed and sent again by libcoap */
+#define SQ_COAP_TELEMETRY_NON	(1)	/* NON, acknowledged in ranges now and then */
+
+#ifdef CONFIG_SQ_COAP_TELEMETRY_NON
+#define SQ_COAP_TELEMETRY_MODE	SQ_COAP_TELEMETRY_NON
+#else
+#define SQ_COAP_TELEMETRY_MODE	SQ_COAP_TELEMETRY_CON
+#endif
+
+typedef struct {
+	int				state;
+	uint32_t		seq;
+	unsigned int	retries;
+	coap_tick_t		sent;
+	size_t			len;
+	uint8_t			data[SQ_COAP_TELEMETRY_SEQ_LEN + SQ_COAP_TELEMETRY_MSG_MAX];
+} sq_coap_telemetry_entry_t;
+
+/*
+ * Telemetry messages, POSTed to the URI of SQ_COAP_URI with a 32 bit
+ * big-endian sequence number in front of the payload.
+ *
+ * In NON mode the messages carry No-Response (RFC 7967) for 2.xx, except
+ * every SQ_COAP_TELEMETRY_ACK_EVERY-th one, which asks for an answer. The
+ * server answers it with the ranges of sequence numbers it has, each as
+ * first and last (inclusive) 32 bit big-endian numbers. Messages below
+ * the highest acknowledged one that are missing from the ranges are sent
+ * again, nothing else. When the answer is lost, an empty POST asks again.
+ * An answer without ranges, from a server that does not keep them, counts
+ * as acknowledging everything up to the message it answers.
+ *
+ * The messages are kept until acknowledged, in a buffer of
+ * SQ_COAP_TELEMETRY_BUFFER messages. When it is full the oldest one is
+ * dropped, a message is not worth blocking the sender for.
+ */
+typedef struct {
+	coap_session_t				*session;
+	int							mode;
+	uint32_t					next_seq;
+	unsigned int				since_ack;	/* messages since the last one that asked for an answer */
+	int							ask_next;	/* the next message asks, see sq_coap_telemetry_ask */
+	unsigned int				ack_retries;
+	coap_tick_t					ack_due;	/* answer expected by then, else ask again */
+	uint8_t						probe;		/* number of the last empty POST */
+	uint32_t					probe_seq;	/* next_seq when it was sent */
+	sq_coap_telemetry_entry_t	entry[SQ_COAP_TELEMETRY_BUFFER];
+
+	/* Statistics */
+	uint32_t					messages;
+	uint32_t					datagrams;		/* messages, retransmissions and empty POSTs sent */
+	uint32_t					retransmits;
+	uint32_t					ack_requests;
+	uint32_t					acks;
+	uint32_t					dropped;
+} sq_coap_telemetry_t;
+
+int sq_coap_telemetry_init(sq_coap_telemetry_t *, coap_session_t *, int mode);
+int sq_coap_telemetry_send(sq_coap_telemetry_t *, const uint8_t *data, size_t len);
+void sq_coap_telemetry_ask(sq_coap_telemetry_t *);
+int sq_coap_telemetry_flush(sq_coap_telemetry_t *);
+int sq_coap_telemetry_response(sq_coap_telemetry_t *, coap_pdu_t *);
+int sq_coap_telemetry_poll(sq_coap_telemetry_t *);
+unsigned int sq_coap_telemetry_pending(const sq_coap_telemetry_t *);
+
+#endif
@@ -4,10 +4,12 @@
 
 #include <sys/param.h>
 
-const char ant_setup_plain[]	= "Setting up plain conn\n";
-const char ant_setup_psk[]		= "Setting up PSK conn\n";
-const char ant_setup_pki[]		= "Setting up PKI conn\n";
-const char ant_setup_done[]		= "Setup done\n";
+#ifdef CONFIG_SQ_COAP_SESSION_NVS
+#include "nvs.h"
+#endif
+
+/* URI path and query options of SQ_COAP_URI, set up by sq_coap_init */
+coap_optlist_t *optlist = NULL;
 
 #ifdef CONFIG_COAP_MBEDTLS_PKI
 
@@ -26,6 +28,90 @@ int verify_cn_callback(const char *cn,
 }
 #endif /* CONFIG_COAP_MBEDTLS_PKI */
 
+#ifdef CONFIG_SQ_COAP_SESSION_NVS
+#define SQ_COAP_NVS_NAMESPACE	"sq_coap"
+#define SQ_COAP_NVS_SESSION		"dtls_session"
+#define SQ_COAP_SESSION_SIZE	512
+
+/* Full handshakes done when the session was last loaded or stored */
+static unsigned int nvs_full_handshakes;
+static int nvs_loaded;
+
+/**
+ * @brief Restore the DTLS session stored in NVS, if any.
+ */
+static void sq_coap_session_load(void)
+{
+	nvs_handle handle;
+	coap_dtls_handshake_stats_t stats;
+	size_t len = SQ_COAP_SESSION_SIZE;
+	uint8_t *buf;
+
+	/* Only once per boot, after that the session is cached in RAM */
+	if (nvs_loaded) {
+		return;
+	}
+	nvs_loaded = 1;
+
+	coap_dtls_get_handshake_stats(&stats);
+	nvs_full_handshakes = stats.full;
+
+	if (nvs_open(SQ_COAP_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+		return;
+	}
+	buf = malloc(len);
+	if (buf == NULL) {
+		nvs_close(handle);
+		return;
+	}
+	if (nvs_get_blob(handle, SQ_COAP_NVS_SESSION, buf, &len) == ESP_OK) {
+		if (coap_dtls_client_session_import(buf, len)) {
+#ifdef CONFIG_SQ_COAP_DBG
+			ESP_LOGI(TAG, "[%s] - DTLS session restored from NVS", __FUNCTION__);
+#endif
+		}
+	}
+	free(buf);
+	nvs_close(handle);
+}
+
+/**
+ * @brief Store the DTLS session in NVS.
+ *
+ * Only done after a full handshake, to not wear the flash on every resumed
+ * connection.
+ */
+static void sq_coap_session_store(void)
+{
+	nvs_handle handle;
+	coap_dtls_handshake_stats_t stats;
+	size_t len;
+	uint8_t *buf;
+
+	coap_dtls_get_handshake_stats(&stats);
+	if (stats.full == nvs_full_handshakes) {
+		return;
+	}
+
+	buf = malloc(SQ_COAP_SESSION_SIZE);
+	if (buf == NULL) {
+		return;
+	}
+	len = coap_dtls_client_session_export(buf, SQ_COAP_SESSION_SIZE);
+	if (len > 0 && nvs_open(SQ_COAP_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+		if (nvs_set_blob(handle, SQ_COAP_NVS_SESSION, buf, len) == ESP_OK &&
+			nvs_commit(handle) == ESP_OK) {
+			nvs_full_handshakes = stats.full;
+#ifdef CONFIG_SQ_COAP_DBG
+			ESP_LOGI(TAG, "[%s] - DTLS session stored in NVS (%d bytes)", __FUNCTION__, len);
+#endif
+		}
+		nvs_close(handle);
+	}
+	free(buf);
+}
+#endif /* CONFIG_SQ_COAP_SESSION_NVS */
+
 /**
  * @brief Initialize a CoAP session.
  * 
@@ -46,6 +132,9 @@ int sq_coap_init(coap_context_t **ctx, coap_session_t **session)
 	char *phostname = NULL;
 
 	coap_set_log_level(SQ_COAP_LOG_LEVEL);
+#ifdef CONFIG_COAP_MEM_POOL
+	coap_mem_set_phase(COAP_MEM_PHASE_SETUP);
+#endif
 
 #define BUFSIZE 40
 	unsigned char _buf[BUFSIZE];
@@ -168,14 +257,18 @@ int sq_coap_init(coap_context_t **ctx, coap_session_t **session)
 		return SQ_COAP_ERR_FAIL;
 #endif /* CONFIG_MBEDTLS_TLS_CLIENT */
 
+#ifdef CONFIG_SQ_COAP_SESSION_NVS
+		sq_coap_session_load();
+#endif
+
 #ifdef CONFIG_COAP_MBEDTLS_PSK
-		sq_uart_send(ant_setup_psk, sizeof(ant_setup_psk));
+		sq_uart_ant(SQ_UART_ANT_SETUP_PSK, 0);
 		*session = coap_new_client_session_psk(*ctx, NULL, &dst_addr,
 												uri.scheme == COAP_URI_SCHEME_COAPS ? COAP_PROTO_DTLS : COAP_PROTO_TLS,
 												SQ_COAP_PSK_IDENTITY,
 												(const uint8_t *) SQ_COAP_PSK_KEY,
 												sizeof(SQ_COAP_PSK_KEY) - 1);
-		sq_uart_send(ant_setup_done, sizeof(ant_setup_done));
+		sq_uart_ant(SQ_UART_ANT_SETUP_DONE, 0);
 #endif /* CONFIG_COAP_MBEDTLS_PSK */
 
 #ifdef CONFIG_COAP_MBEDTLS_PKI
@@ -228,18 +321,18 @@ int sq_coap_init(coap_context_t **ctx, coap_session_t **session)
 		dtls_pki.pki_key.key.pem_buf.ca_cert = ca_pem_start;
 		dtls_pki.pki_key.key.pem_buf.ca_cert_len = ca_pem_bytes;
 
-		sq_uart_send(ant_setup_pki, sizeof(ant_setup_pki));
+		sq_uart_ant(SQ_UART_ANT_SETUP_PKI, 0);
 		*session = coap_new_client_session_pki(*ctx, NULL, &dst_addr,
 												uri.scheme == COAP_URI_SCHEME_COAPS ? COAP_PROTO_DTLS : COAP_PROTO_TLS,
 												&dtls_pki);
-		sq_uart_send(ant_setup_done, sizeof(ant_setup_done));
+		sq_uart_ant(SQ_UART_ANT_SETUP_DONE, 0);
 #endif /* CONFIG_COAP_MBEDTLS_PKI */
 	} else {
-		sq_uart_send(ant_setup_plain, sizeof(ant_setup_plain));
+		sq_uart_ant(SQ_UART_ANT_SETUP_PLAIN, 0);
 		*session = coap_new_client_session(*ctx, NULL, &dst_addr,
 											uri.scheme == COAP_URI_SCHEME_COAP_TCP ? COAP_PROTO_TCP :
 											COAP_PROTO_UDP);
-		sq_uart_send(ant_setup_done, sizeof(ant_setup_done));
+		sq_uart_ant(SQ_UART_ANT_SETUP_DONE, 0);
 	}
 	if (!*session) {
 		ESP_LOGE(TAG, "coap_new_client_session() failed");
@@ -251,6 +344,44 @@ int sq_coap_init(coap_context_t **ctx, coap_session_t **session)
 	ESP_LOGI(TAG, "[%s] - session created at %p", __FUNCTION__, *session);
 #endif
 
+#ifdef CONFIG_COAP_MEM_POOL
+	/* DTLS sessions get there when the handshake completes */
+	if (uri.scheme != COAP_URI_SCHEME_COAPS && uri.scheme != COAP_URI_SCHEME_COAPS_TCP) {
+		coap_mem_set_phase(COAP_MEM_PHASE_STEADY);
+	}
+#endif
+
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Add the Uri-Path options of path to an option list.
+ *
+ * @param[in,out] list	The option list, NULL for a new one.
+ * @param[in] path		URI path of a resource on the server, e.g. "fota/manifest".
+ */
+int sq_coap_path_optlist(coap_optlist_t **list, const char *path)
+{
+#define PATH_BUFSIZE 64
+	unsigned char _buf[PATH_BUFSIZE];
+	unsigned char *buf = _buf;
+	size_t buflen = PATH_BUFSIZE;
+	int res;
+
+	res = coap_split_path((const uint8_t *)path, strlen(path), buf, &buflen);
+	if (res < 0) {
+		ESP_LOGE(TAG, "Bad URI path %s", path);
+		return SQ_COAP_ERR_FAIL;
+	}
+
+	while (res--) {
+		coap_insert_optlist(list,
+							coap_new_optlist(COAP_OPTION_URI_PATH,
+											 coap_opt_length(buf),
+											 coap_opt_value(buf)));
+		buf += coap_opt_size(buf);
+	}
+
 	return SQ_COAP_OK;
 }
 
@@ -258,11 +389,17 @@ void sq_coap_cleanup(coap_context_t *ctx, coap_session_t *session)
 {
 #ifdef CONFIG_SQ_COAP_DBG
 	ESP_LOGI(TAG, "[%s] - Entered function", __FUNCTION__);
+#endif
+#ifdef CONFIG_COAP_MEM_POOL
+	coap_mem_set_phase(COAP_MEM_PHASE_TEARDOWN);
 #endif
 	if (optlist) {
 		coap_delete_optlist(optlist);
 		optlist = NULL;
 	}
+#ifdef CONFIG_SQ_COAP_SESSION_NVS
+	sq_coap_session_store();
+#endif
 	if (session) {
 		coap_session_release(session);
 	}
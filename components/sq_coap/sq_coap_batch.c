@@ -0,0 +1,130 @@
+#include "squidward/sq_coap_batch.h"
+
+#ifdef CONFIG_SQ_COAP_DBG
+static const char *flush_reason[] = { "bytes", "records", "deadline", "flush" };
+#endif
+
+static int batch_send(sq_coap_batch_t *batch, int reason)
+{
+	if (batch->records == 0) {
+		return 0;
+	}
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - %u records in %u bytes (%s)", __FUNCTION__,
+			 batch->records, (unsigned int)batch->len, flush_reason[reason]);
+#endif
+	if (batch->send(batch->send_arg, batch->buf, batch->len, batch->records) != 0) {
+		ESP_LOGE(TAG, "Could not send a batch of %u records", batch->records);
+		return -1;
+	}
+
+	batch->batches++;
+	batch->sent_records += batch->records;
+	batch->sent_bytes += batch->len;
+	batch->flushes[reason]++;
+	batch->last_records = batch->records;
+	batch->len = 0;
+	batch->records = 0;
+	return 0;
+}
+
+/**
+ * @brief Set up a batch.
+ *
+ * @param[out] batch		The batch.
+ * @param[in] bytes			Largest payload, e.g. what fits in one PDU.
+ * @param[in] records		Most records in one batch.
+ * @param[in] deadline_ms	Longest time a record waits before it is sent.
+ * @param[in] send			Sends a batch.
+ * @param[in] arg			Passed to send.
+ */
+int sq_coap_batch_init(sq_coap_batch_t *batch, size_t bytes, unsigned int records, unsigned int deadline_ms,
+					   sq_coap_batch_send_t send, void *arg)
+{
+	memset(batch, 0, sizeof(*batch));
+
+	batch->buf = malloc(bytes);
+	if (batch->buf == NULL) {
+		ESP_LOGE(TAG, "Could not allocate a batch of %u bytes", (unsigned int)bytes);
+		return SQ_COAP_ERR_FAIL;
+	}
+	batch->size = bytes;
+	batch->max_records = records > 0 ? records : 1;
+	batch->deadline_ms = deadline_ms;
+	batch->send = send;
+	batch->send_arg = arg;
+
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Add a record, sending the batch first if the record does not fit.
+ *
+ * @return SQ_COAP_OK, or SQ_COAP_ERR_FAIL if the record is larger than a
+ *         batch or a batch could not be sent.
+ */
+int sq_coap_batch_add(sq_coap_batch_t *batch, const uint8_t *data, size_t len)
+{
+	size_t need = SQ_COAP_BATCH_HDR_LEN + len;
+
+	if (need > batch->size || len > 0xffff) {
+		ESP_LOGE(TAG, "Record of %u bytes does not fit in a batch", (unsigned int)len);
+		return SQ_COAP_ERR_FAIL;
+	}
+	if (batch->len + need > batch->size && batch_send(batch, SQ_COAP_BATCH_FLUSH_BYTES) != 0) {
+		return SQ_COAP_ERR_FAIL;
+	}
+
+	if (batch->records == 0) {
+		coap_ticks(&batch->first);
+	}
+	batch->buf[batch->len++] = (len >> 8) & 0xff;
+	batch->buf[batch->len++] = len & 0xff;
+	memcpy(batch->buf + batch->len, data, len);
+	batch->len += len;
+	batch->records++;
+
+	if (batch->records >= batch->max_records) {
+		return batch_send(batch, SQ_COAP_BATCH_FLUSH_RECORDS) == 0 ? SQ_COAP_OK : SQ_COAP_ERR_FAIL;
+	}
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Send what is in the batch now, e.g. before going to sleep.
+ */
+int sq_coap_batch_flush(sq_coap_batch_t *batch)
+{
+	return batch_send(batch, SQ_COAP_BATCH_FLUSH_CALLER) == 0 ? SQ_COAP_OK : SQ_COAP_ERR_FAIL;
+}
+
+/**
+ * @brief Send the batch if the oldest record has waited for the deadline.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the deadline, to be used as timeout for
+ *         coap_run_once, or -1 if a batch could not be sent.
+ */
+int sq_coap_batch_poll(sq_coap_batch_t *batch)
+{
+	coap_tick_t now;
+	coap_tick_t due;
+
+	if (batch->records == 0) {
+		return batch->deadline_ms;
+	}
+
+	coap_ticks(&now);
+	due = batch->first + (coap_tick_t)batch->deadline_ms * COAP_TICKS_PER_SECOND / 1000;
+	if (now >= due) {
+		return batch_send(batch, SQ_COAP_BATCH_FLUSH_DEADLINE) == 0 ? (int)batch->deadline_ms : -1;
+	}
+	return (due - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+void sq_coap_batch_free(sq_coap_batch_t *batch)
+{
+	free(batch->buf);
+	batch->buf = NULL;
+}
@@ -0,0 +1,683 @@
+#include "squidward/sq_coap_block.h"
+
+#define SLOT_FREE		(0)
+#define SLOT_REQUESTED	(1)
+#define SLOT_RECEIVED	(2)
+
+/* Tokens of block requests are the tag and SZX followed by the 24 bit block number */
+#define BLOCK_TOKEN_TAG	0xb0
+#define BLOCK_TOKEN_LEN	4
+
+#define BLOCK_SIZE(szx)	(1u << ((szx) + 4))
+
+static coap_tick_t block_timeout_ticks(unsigned int retries)
+{
+	return ((coap_tick_t)SQ_COAP_BLOCK_TIMEOUT << retries) * COAP_TICKS_PER_SECOND / 1000;
+}
+
+static sq_coap_block_slot_t *block_slot(sq_coap_block_t *blk, unsigned int num)
+{
+	return &blk->slot[num % blk->window];
+}
+
+static uint8_t *block_data(sq_coap_block_t *blk, unsigned int num)
+{
+	return blk->buf + (num % blk->window) * BLOCK_SIZE(blk->max_szx);
+}
+
+/**
+ * @brief Send a request for block num.
+ *
+ * The requests are NON, since libcoap only keeps one CON request in flight
+ * per session (NSTART = 1). Lost requests are sent again by
+ * sq_coap_block_poll.
+ */
+static int block_request(sq_coap_block_t *blk, unsigned int num)
+{
+	coap_pdu_t *pdu;
+	coap_optlist_t *option;
+	unsigned char buf[4];
+	uint8_t token[BLOCK_TOKEN_LEN];
+	sq_coap_block_slot_t *slot = block_slot(blk, num);
+	/* Options go in in order, the ETag after Uri-Host and before the rest */
+	int etag = !blk->opened && blk->known_etag_len > 0;
+
+	pdu = coap_new_pdu(blk->session);
+	if (!pdu) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return -1;
+	}
+	pdu->type = COAP_MESSAGE_NON;
+	pdu->tid = coap_new_message_id(blk->session);
+	pdu->code = COAP_REQUEST_GET;
+
+	token[0] = BLOCK_TOKEN_TAG | blk->szx;
+	token[1] = (num >> 16) & 0xff;
+	token[2] = (num >> 8) & 0xff;
+	token[3] = num & 0xff;
+	coap_add_token(pdu, sizeof(token), token);
+
+	/* add URI components from optlist */
+	for (option = optlist; option; option = option->next) {
+		if (etag && option->number > COAP_OPTION_ETAG) {
+			coap_add_option(pdu, COAP_OPTION_ETAG, blk->known_etag_len, blk->known_etag);
+			etag = 0;
+		}
+		switch (option->number) {
+		case COAP_OPTION_URI_PATH :
+		case COAP_OPTION_URI_QUERY :
+			if (blk->path) {
+				break;
+			}
+			/* fall through */
+		case COAP_OPTION_URI_HOST :
+		case COAP_OPTION_URI_PORT :
+			coap_add_option(pdu, option->number, option->length, option->data);
+			break;
+		default:
+			;     /* skip other options */
+		}
+	}
+	if (etag) {
+		coap_add_option(pdu, COAP_OPTION_ETAG, blk->known_etag_len, blk->known_etag);
+	}
+	for (option = blk->path; option; option = option->next) {
+		coap_add_option(pdu, option->number, option->length, option->data);
+	}
+
+	coap_add_option(pdu, COAP_OPTION_BLOCK2,
+					coap_encode_var_safe(buf, sizeof(buf), (num << 4) | blk->szx), buf);
+
+	if (coap_send(blk->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+
+	if (slot->state == SLOT_REQUESTED && slot->num == num) {
+		slot->retries++;
+		blk->retransmits++;
+	} else {
+		slot->num = num;
+		slot->state = SLOT_REQUESTED;
+		slot->retries = 0;
+	}
+	coap_ticks(&slot->timeout);
+	if (slot->retries == 0) {
+		slot->sent = slot->timeout;
+	}
+	slot->timeout += block_timeout_ticks(slot->retries);
+	blk->requests++;
+
+	return 0;
+}
+
+/**
+ * @brief Check if the writer can take one more block than is in flight.
+ */
+static int block_throttled(sq_coap_block_t *blk)
+{
+	if (blk->space == NULL) {
+		return 0;
+	}
+	/* Buffers are taken per block of the largest size */
+	if ((blk->next_req - blk->next_block + 1) * BLOCK_SIZE(blk->szx) > blk->space(blk->write_arg)) {
+		blk->throttled++;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Change to new_szx, if all blocks in flight have been received and
+ * the transfer is at a boundary of the new size.
+ */
+static void block_resize(sq_coap_block_t *blk)
+{
+	size_t offset = (size_t)blk->next_block << (blk->szx + 4);
+
+	if (blk->new_szx == blk->szx || blk->next_req != blk->next_block ||
+		offset % BLOCK_SIZE(blk->new_szx) != 0) {
+		return;
+	}
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - Block size %u -> %u at %u bytes, srtt %u ms", __FUNCTION__,
+			 BLOCK_SIZE(blk->szx), BLOCK_SIZE(blk->new_szx), (unsigned int)offset, blk->srtt_ms);
+#endif
+	blk->szx = blk->new_szx;
+	blk->next_block = offset >> (blk->szx + 4);
+	blk->next_req = blk->next_block;
+	if (blk->size) {
+		blk->last_block = (blk->size - 1) >> (blk->szx + 4);
+	}
+	blk->resizes++;
+	blk->clean = 0;
+	blk->loss_hist = 0;
+}
+
+/**
+ * @brief Block size controller, called for each block received (lost = 0)
+ * and each request sent again (lost = 1).
+ *
+ * Halves the block size when SQ_COAP_BLOCK_LOSS_SHRINK of the last
+ * SQ_COAP_BLOCK_LOSS_WINDOW blocks were lost, since a lost block costs its
+ * whole size again. Doubles it after SQ_COAP_BLOCK_GROW_AFTER blocks
+ * without loss, if the RTT has not grown meanwhile (queues building up).
+ */
+static void block_adapt(sq_coap_block_t *blk, int lost)
+{
+#ifdef CONFIG_SQ_COAP_BLOCK_ADAPTIVE
+	blk->loss_hist = (blk->loss_hist << 1) | (lost ? 1 : 0);
+	blk->clean = lost ? 0 : blk->clean + 1;
+
+	/* A change is already on its way */
+	if (blk->new_szx != blk->szx) {
+		return;
+	}
+
+	if (__builtin_popcount(blk->loss_hist & ((1u << SQ_COAP_BLOCK_LOSS_WINDOW) - 1)) >= SQ_COAP_BLOCK_LOSS_SHRINK) {
+		if (blk->szx > SQ_COAP_BLOCK_SZX_MIN) {
+			blk->new_szx = blk->szx - 1;
+		}
+		blk->loss_hist = 0;
+	} else if (blk->clean >= SQ_COAP_BLOCK_GROW_AFTER) {
+		if (blk->szx < blk->max_szx && blk->srtt_ms <= 2 * blk->rtt_min_ms) {
+			blk->new_szx = blk->szx + 1;
+		}
+		blk->clean = 0;
+	}
+#endif
+}
+
+/**
+ * @brief RTT estimate from blocks answered on their first request (Karn).
+ */
+static void block_rtt(sq_coap_block_t *blk, sq_coap_block_slot_t *slot)
+{
+	coap_tick_t now;
+	uint32_t rtt;
+
+	if (slot->retries > 0) {
+		return;
+	}
+	coap_ticks(&now);
+	rtt = (now - slot->sent) * 1000 / COAP_TICKS_PER_SECOND;
+
+	if (blk->srtt_ms == 0) {
+		blk->srtt_ms = rtt;
+		blk->rttvar_ms = rtt / 2;
+		blk->rtt_min_ms = rtt;
+	} else {
+		uint32_t delta = rtt > blk->srtt_ms ? rtt - blk->srtt_ms : blk->srtt_ms - rtt;
+
+		blk->rttvar_ms = (3 * blk->rttvar_ms + delta) / 4;
+		blk->srtt_ms = (7 * blk->srtt_ms + rtt) / 8;
+		if (rtt < blk->rtt_min_ms) {
+			blk->rtt_min_ms = rtt;
+		}
+	}
+}
+
+/**
+ * @brief Request new blocks until the window is full.
+ */
+static int block_fill_window(sq_coap_block_t *blk)
+{
+	unsigned int limit = blk->next_block + blk->window;
+
+	/* Not opened until the first block has arrived */
+	if (!blk->opened) {
+		return 0;
+	}
+
+	block_resize(blk);
+	if (blk->new_szx < blk->szx) {
+		/* Let the blocks in flight drain first */
+		limit = blk->next_req;
+	} else if (blk->new_szx > blk->szx) {
+		/* Only request up to where the next larger block starts */
+		unsigned int step = 1u << (blk->new_szx - blk->szx);
+		unsigned int boundary = (blk->next_req + step - 1) & ~(step - 1);
+
+		if (boundary < limit) {
+			limit = boundary;
+		}
+	}
+
+	while (blk->next_req < limit &&
+		   (!blk->last_known || blk->next_req <= blk->last_block) &&
+		   !block_throttled(blk)) {
+		if (block_request(blk, blk->next_req) != 0) {
+			return -1;
+		}
+		blk->next_req++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Hand the received blocks from next_block and on to the writer.
+ */
+static int block_flush(sq_coap_block_t *blk)
+{
+	sq_coap_block_slot_t *slot = block_slot(blk, blk->next_block);
+
+	while (slot->state == SLOT_RECEIVED && slot->num == blk->next_block) {
+		if (blk->write(blk->write_arg, block_data(blk, blk->next_block), slot->len) != 0) {
+			return -1;
+		}
+		slot->state = SLOT_FREE;
+		blk->next_block++;
+		slot = block_slot(blk, blk->next_block);
+	}
+	return 0;
+}
+
+static int block_fail(sq_coap_block_t *blk)
+{
+	blk->status = SQ_COAP_BLOCK_ERR;
+	return blk->status;
+}
+
+/**
+ * @brief Set up a block-wise transfer of the resource given by the URI.
+ *
+ * @param[in] blk		The transfer to set up.
+ * @param[in] session	The session to send the requests on.
+ * @param[in] window	Number of blocks in flight, 1 gives stop-and-wait.
+ * @param[in] szx		Preferred block size, 2^(szx + 4) bytes.
+ * @param[in] write		Called with the received data, in order.
+ * @param[in] arg		Passed to write.
+ */
+int sq_coap_block_init(sq_coap_block_t *blk, coap_session_t *session, unsigned int window, unsigned int szx,
+					   sq_coap_block_write_t write, void *arg)
+{
+	memset(blk, 0, sizeof(*blk));
+
+	if (window < 1) {
+		window = 1;
+	} else if (window > SQ_COAP_BLOCK_WINDOW_MAX) {
+		window = SQ_COAP_BLOCK_WINDOW_MAX;
+	}
+	if (szx > 6) {
+		szx = 6;
+	}
+	/* Blocks are not fragmented, keep them within one datagram */
+	while (szx > SQ_COAP_BLOCK_SZX_MIN &&
+		   BLOCK_SIZE(szx) + SQ_COAP_BLOCK_OVERHEAD > coap_session_max_pdu_size(session)) {
+		szx--;
+	}
+
+	blk->buf = malloc(window * BLOCK_SIZE(szx));
+	if (blk->buf == NULL) {
+		ESP_LOGE(TAG, "Could not allocate %u block buffers", window);
+		return SQ_COAP_ERR_FAIL;
+	}
+
+	blk->session = session;
+	blk->window = window;
+	blk->szx = szx;
+	blk->max_szx = szx;
+	blk->new_szx = szx;
+	blk->write = write;
+	blk->write_arg = arg;
+	blk->status = SQ_COAP_BLOCK_BUSY;
+
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Hold back block requests while the writer is busy.
+ *
+ * The writer must call coap_run_once_wake() when space grows, the I/O
+ * loop does not poll for it.
+ * @param[in] blk	The transfer.
+ * @param[in] space	Returns the number of bytes the writer takes without
+ *					blocking, called with the arg given to sq_coap_block_init.
+ */
+void sq_coap_block_set_space(sq_coap_block_t *blk, sq_coap_block_space_t space)
+{
+	blk->space = space;
+}
+
+/**
+ * @brief Fetch another resource on the server than the one in SQ_COAP_URI.
+ *
+ * @param[in] blk	The transfer, before it is started.
+ * @param[in] path	URI path of the resource, e.g. "fota/manifest".
+ */
+int sq_coap_block_set_path(sq_coap_block_t *blk, const char *path)
+{
+	return sq_coap_path_optlist(&blk->path, path);
+}
+
+/**
+ * @brief Give the size of the resource, when known beforehand (manifest).
+ *
+ * Without it, the size is taken from the Size2 option of the first block,
+ * if the server sends one.
+ */
+void sq_coap_block_set_size(sq_coap_block_t *blk, size_t size)
+{
+	blk->size = size;
+	if (size > 0) {
+		blk->last_block = (size - 1) >> (blk->szx + 4);
+		blk->last_known = 1;
+	}
+}
+
+/**
+ * @brief Only accept blocks of the representation with this ETag.
+ *
+ * Used when resuming a transfer, so that blocks of a resource that has
+ * changed on the server are not mixed with the ones already written.
+ */
+void sq_coap_block_set_etag(sq_coap_block_t *blk, const uint8_t *etag, size_t len)
+{
+	if (len > SQ_COAP_BLOCK_ETAG_LEN) {
+		len = SQ_COAP_BLOCK_ETAG_LEN;
+	}
+	memcpy(blk->etag, etag, len);
+	blk->etag_len = len;
+	blk->etag_check = 1;
+}
+
+/**
+ * @brief Ask the server whether the representation we have is still current.
+ *
+ * The ETag is sent with the first request (RFC 7252, 5.10.6.2). If the
+ * server answers 2.03 Valid the transfer ends with SQ_COAP_BLOCK_VALID
+ * without any payload, otherwise it goes on as usual.
+ */
+void sq_coap_block_set_known_etag(sq_coap_block_t *blk, const uint8_t *etag, size_t len)
+{
+	if (len > SQ_COAP_BLOCK_ETAG_LEN) {
+		len = SQ_COAP_BLOCK_ETAG_LEN;
+	}
+	memcpy(blk->known_etag, etag, len);
+	blk->known_etag_len = len;
+}
+
+/**
+ * @brief Request the first block.
+ *
+ * The window is opened when the first block has arrived, when the block
+ * size the server uses and the size of the resource are known.
+ */
+int sq_coap_block_start(sq_coap_block_t *blk)
+{
+	return sq_coap_block_start_at(blk, 0);
+}
+
+/**
+ * @brief Start the transfer at a byte offset, to resume an earlier one.
+ *
+ * Data is handed to the writer from offset on. The offset must be a
+ * multiple of SQ_COAP_BLOCK_MIN_SIZE, the transfer starts with the
+ * largest block size it is a multiple of.
+ */
+int sq_coap_block_start_at(sq_coap_block_t *blk, size_t offset)
+{
+	unsigned int num;
+
+	if (offset % SQ_COAP_BLOCK_MIN_SIZE != 0) {
+		ESP_LOGE(TAG, "Can not start at %u bytes, not a multiple of %u", (unsigned int)offset,
+				 SQ_COAP_BLOCK_MIN_SIZE);
+		return block_fail(blk);
+	}
+	while (blk->szx > SQ_COAP_BLOCK_SZX_MIN && offset % BLOCK_SIZE(blk->szx) != 0) {
+		blk->szx--;
+	}
+	blk->new_szx = blk->szx;
+	sq_coap_block_set_size(blk, blk->size);
+
+	num = offset >> (blk->szx + 4);
+	blk->first_block = num;
+	blk->next_block = num;
+	if (block_request(blk, num) != 0) {
+		return block_fail(blk);
+	}
+	blk->next_req = num + 1;
+	return blk->status;
+}
+
+/**
+ * @brief Handle a response to one of the block requests.
+ *
+ * To be called from the response handler of the context.
+ * @return SQ_COAP_BLOCK_BUSY while there are blocks left, SQ_COAP_BLOCK_DONE
+ *         when all data has been written or SQ_COAP_BLOCK_ERR.
+ */
+int sq_coap_block_response(sq_coap_block_t *blk, coap_pdu_t *received)
+{
+	coap_opt_iterator_t opt_iter;
+	coap_opt_t *block_opt;
+	coap_opt_t *size_opt;
+	sq_coap_block_slot_t *slot;
+	unsigned int num;
+	unsigned int szx;
+	unsigned int more;
+	unsigned char *data = NULL;
+	size_t data_len = 0;
+
+	if (blk->status != SQ_COAP_BLOCK_BUSY) {
+		return blk->status;
+	}
+
+	if (received->token_length != BLOCK_TOKEN_LEN || (received->token[0] & 0xf0) != BLOCK_TOKEN_TAG) {
+		/* Not ours */
+		return blk->status;
+	}
+	if ((received->token[0] & 0x0f) != blk->szx) {
+		/* A late answer to a request of the block size before the last change */
+		blk->duplicates++;
+		return blk->status;
+	}
+	num = (received->token[1] << 16) | (received->token[2] << 8) | received->token[3];
+
+	if (num < blk->next_block || num >= blk->next_block + blk->window) {
+		blk->duplicates++;
+		return blk->status;
+	}
+	slot = block_slot(blk, num);
+	if (slot->state != SLOT_REQUESTED || slot->num != num) {
+		blk->duplicates++;
+		return blk->status;
+	}
+
+	if (received->code == COAP_RESPONSE_CODE(203) && !blk->opened && blk->known_etag_len > 0) {
+		/* Nothing to transfer, what we have is current */
+		slot->state = SLOT_FREE;
+		blk->status = SQ_COAP_BLOCK_VALID;
+		return blk->status;
+	}
+
+	if (COAP_RESPONSE_CLASS(received->code) != 2) {
+		if (blk->last_known && num > blk->last_block) {
+			/* Asked for more than there was before the size was known */
+			slot->state = SLOT_FREE;
+			return blk->status;
+		}
+		ESP_LOGE(TAG, "Block %u failed with %d.%02d", num,
+				 received->code >> 5, received->code & 0x1f);
+		return block_fail(blk);
+	}
+
+	coap_get_data(received, &data_len, &data);
+
+	block_opt = coap_check_option(received, COAP_OPTION_ETAG, &opt_iter);
+	if (block_opt) {
+		size_t etag_len = coap_opt_length(block_opt);
+
+		if (etag_len > SQ_COAP_BLOCK_ETAG_LEN) {
+			etag_len = SQ_COAP_BLOCK_ETAG_LEN;
+		}
+		if (blk->etag_check &&
+			(etag_len != blk->etag_len || memcmp(coap_opt_value(block_opt), blk->etag, etag_len) != 0)) {
+			ESP_LOGE(TAG, "Resource changed on the server (ETag differs)");
+			blk->changed = 1;
+			return block_fail(blk);
+		}
+		memcpy(blk->etag, coap_opt_value(block_opt), etag_len);
+		blk->etag_len = etag_len;
+	}
+
+	block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
+	if (block_opt && !blk->opened && COAP_OPT_BLOCK_SZX(block_opt) < blk->szx) {
+		/*
+		 * The server uses a smaller block size than we asked for, the
+		 * answer is the first block of that size at the same offset.
+		 * Go on with its size, it will not take larger ones either.
+		 */
+		coap_tick_t sent = slot->sent;
+
+		szx = COAP_OPT_BLOCK_SZX(block_opt);
+		slot->state = SLOT_FREE;
+		num <<= blk->szx - szx;
+		blk->szx = szx;
+		blk->max_szx = szx;
+		blk->new_szx = szx;
+		blk->first_block = num;
+		blk->next_block = num;
+		blk->next_req = num + 1;
+		slot = block_slot(blk, num);
+		slot->num = num;
+		slot->state = SLOT_REQUESTED;
+		slot->retries = 0;
+		slot->sent = sent;
+	}
+	if (block_opt) {
+		if (coap_opt_block_num(block_opt) != num) {
+			ESP_LOGE(TAG, "Got block %u for request of block %u", coap_opt_block_num(block_opt), num);
+			return block_fail(blk);
+		}
+		szx = COAP_OPT_BLOCK_SZX(block_opt);
+		more = COAP_OPT_BLOCK_MORE(block_opt);
+	} else {
+		/* Everything fit in one response */
+		szx = blk->szx;
+		more = 0;
+	}
+
+	if (!blk->opened) {
+		size_opt = coap_check_option(received, COAP_OPTION_SIZE2, &opt_iter);
+		if (size_opt && more && !blk->size) {
+			blk->size = coap_decode_var_bytes(coap_opt_value(size_opt), coap_opt_length(size_opt));
+		}
+		sq_coap_block_set_size(blk, blk->size);
+		blk->opened = 1;
+	} else if (szx != blk->szx) {
+		ESP_LOGE(TAG, "Block size changed during transfer (szx %u to %u)", blk->szx, szx);
+		return block_fail(blk);
+	}
+
+	if (data_len > BLOCK_SIZE(blk->szx)) {
+		ESP_LOGE(TAG, "Block %u too large (%u bytes)", num, (unsigned int)data_len);
+		return block_fail(blk);
+	}
+
+	if (!more) {
+		blk->last_block = num;
+		blk->last_known = 1;
+	}
+
+	block_rtt(blk, slot);
+	block_adapt(blk, 0);
+
+	if (num == blk->next_block) {
+		/* In order, no need to buffer it */
+		if (data_len > 0 && blk->write(blk->write_arg, data, data_len) != 0) {
+			return block_fail(blk);
+		}
+		slot->state = SLOT_FREE;
+		blk->next_block++;
+	} else {
+		memcpy(block_data(blk, num), data, data_len);
+		slot->len = data_len;
+		slot->state = SLOT_RECEIVED;
+		blk->reordered++;
+	}
+
+	if (block_flush(blk) != 0) {
+		return block_fail(blk);
+	}
+
+	if (blk->last_known && blk->next_block > blk->last_block) {
+		blk->status = SQ_COAP_BLOCK_DONE;
+		return blk->status;
+	}
+
+	if (block_fill_window(blk) != 0) {
+		return block_fail(blk);
+	}
+
+	return blk->status;
+}
+
+/**
+ * @brief Request blocks again that have not been answered in time.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the next block request times out, to be
+ *         used as timeout for coap_run_once.
+ */
+int sq_coap_block_poll(sq_coap_block_t *blk)
+{
+	coap_tick_t now;
+	coap_tick_t next = 0;
+	unsigned int i;
+
+	if (blk->status != SQ_COAP_BLOCK_BUSY) {
+		return 0;
+	}
+
+	/* The writer may have caught up since the last response */
+	if (block_fill_window(blk) != 0) {
+		block_fail(blk);
+		return 0;
+	}
+
+	coap_ticks(&now);
+	for (i = 0; i < blk->window; i++) {
+		sq_coap_block_slot_t *slot = &blk->slot[i];
+
+		if (slot->state != SLOT_REQUESTED) {
+			continue;
+		}
+		if (slot->timeout <= now) {
+			if (slot->retries >= SQ_COAP_BLOCK_RETRIES) {
+				ESP_LOGE(TAG, "No response for block %u", slot->num);
+				block_fail(blk);
+				return 0;
+			}
+			if (block_request(blk, slot->num) != 0) {
+				block_fail(blk);
+				return 0;
+			}
+			block_adapt(blk, 1);
+		}
+		if (next == 0 || slot->timeout < next) {
+			next = slot->timeout;
+		}
+	}
+
+	if (next == 0) {
+		/*
+		 * Nothing in flight, only waiting for the writer. It wakes the loop
+		 * with coap_run_once_wake() when it has room again, which also ends
+		 * a wait that starts after it.
+		 */
+		return SQ_COAP_BLOCK_TIMEOUT;
+	}
+	return (next - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+void sq_coap_block_free(sq_coap_block_t *blk)
+{
+	free(blk->buf);
+	blk->buf = NULL;
+	if (blk->path) {
+		coap_delete_optlist(blk->path);
+		blk->path = NULL;
+	}
+}
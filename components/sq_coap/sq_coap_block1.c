@@ -0,0 +1,406 @@
+#include "squidward/sq_coap_block1.h"
+
+#define SLOT_FREE	(0)
+#define SLOT_SENT	(1)
+#define SLOT_ACKED	(2)	/* answered, ahead of next_ack */
+
+/* Tokens of blocks are the tag and SZX followed by the 24 bit block number */
+#define BLOCK1_TOKEN_TAG	0xc0
+#define BLOCK1_TOKEN_LEN	4
+
+#define BLOCK_SIZE(szx)	(1u << ((szx) + 4))
+
+static coap_tick_t block1_timeout_ticks(unsigned int retries)
+{
+	return ((coap_tick_t)SQ_COAP_BLOCK_TIMEOUT << retries) * COAP_TICKS_PER_SECOND / 1000;
+}
+
+static sq_coap_block1_slot_t *block1_slot(sq_coap_block1_t *b1, unsigned int num)
+{
+	return &b1->slot[num % b1->window];
+}
+
+static unsigned int block1_last(sq_coap_block1_t *b1)
+{
+	return b1->len > 0 ? (b1->len - 1) / BLOCK_SIZE(b1->szx) : 0;
+}
+
+static int block1_fail(sq_coap_block1_t *b1)
+{
+	b1->status = SQ_COAP_BLOCK_ERR;
+	return b1->status;
+}
+
+/**
+ * @brief Send block num, or send it again.
+ *
+ * The requests are NON, since libcoap only keeps one CON request in flight
+ * per session (NSTART = 1). Blocks without an answer are sent again by
+ * sq_coap_block1_poll.
+ */
+static int block1_send(sq_coap_block1_t *b1, unsigned int num)
+{
+	coap_pdu_t *pdu;
+	coap_optlist_t *option;
+	unsigned char buf[4];
+	uint8_t token[BLOCK1_TOKEN_LEN];
+	sq_coap_block1_slot_t *slot = block1_slot(b1, num);
+	size_t offset = (size_t)num * BLOCK_SIZE(b1->szx);
+	size_t len = b1->len - offset;
+	unsigned int more = num < b1->last_block;
+
+	if (len > BLOCK_SIZE(b1->szx)) {
+		len = BLOCK_SIZE(b1->szx);
+	}
+
+	pdu = coap_new_pdu(b1->session);
+	if (!pdu) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return -1;
+	}
+	pdu->type = COAP_MESSAGE_NON;
+	pdu->tid = coap_new_message_id(b1->session);
+	pdu->code = b1->code;
+
+	token[0] = BLOCK1_TOKEN_TAG | b1->szx;
+	token[1] = (num >> 16) & 0xff;
+	token[2] = (num >> 8) & 0xff;
+	token[3] = num & 0xff;
+	coap_add_token(pdu, sizeof(token), token);
+
+	/* add URI components from optlist */
+	for (option = optlist; option; option = option->next) {
+		switch (option->number) {
+		case COAP_OPTION_URI_PATH :
+		case COAP_OPTION_URI_QUERY :
+			if (b1->path) {
+				break;
+			}
+			/* fall through */
+		case COAP_OPTION_URI_HOST :
+		case COAP_OPTION_URI_PORT :
+			coap_add_option(pdu, option->number, option->length, option->data);
+			break;
+		default:
+			;     /* skip other options */
+		}
+	}
+	for (option = b1->path; option; option = option->next) {
+		coap_add_option(pdu, option->number, option->length, option->data);
+	}
+
+	coap_add_option(pdu, COAP_OPTION_BLOCK1,
+					coap_encode_var_safe(buf, sizeof(buf), (num << 4) | (more << 3) | b1->szx), buf);
+	if (num == 0) {
+		/* The server can refuse a payload that is too large before it is sent */
+		coap_add_option(pdu, COAP_OPTION_SIZE1,
+						coap_encode_var_safe(buf, sizeof(buf), b1->len), buf);
+	}
+	coap_add_data(pdu, len, b1->data + offset);
+
+	if (coap_send(b1->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+
+	if (slot->state == SLOT_SENT && slot->num == num) {
+		slot->retries++;
+		b1->retransmits++;
+	} else {
+		slot->num = num;
+		slot->state = SLOT_SENT;
+		slot->retries = 0;
+	}
+	coap_ticks(&slot->timeout);
+	slot->timeout += block1_timeout_ticks(slot->retries);
+	b1->blocks++;
+
+	return 0;
+}
+
+/**
+ * @brief Send blocks until the window is full. Only the first block is in
+ * flight until it has been answered.
+ */
+static int block1_fill_window(sq_coap_block1_t *b1)
+{
+	unsigned int window = b1->opened ? b1->window : 1;
+
+	while (b1->next_send <= b1->last_block && b1->next_send < b1->next_ack + window) {
+		if (block1_send(b1, b1->next_send) != 0) {
+			return -1;
+		}
+		b1->next_send++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Go on from block num with the smaller block size the server asked for.
+ */
+static int block1_resize(sq_coap_block1_t *b1, unsigned int num, unsigned int szx)
+{
+	unsigned int i;
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - Server asks for %u byte blocks", __FUNCTION__, BLOCK_SIZE(szx));
+#endif
+	num <<= b1->szx - szx;
+	b1->szx = szx;
+	b1->last_block = block1_last(b1);
+	b1->next_ack = num;
+	b1->next_send = num;
+	b1->resizes++;
+	for (i = 0; i < b1->window; i++) {
+		b1->slot[i].state = SLOT_FREE;
+	}
+	return block1_fill_window(b1);
+}
+
+/**
+ * @brief Is a payload of len bytes too large for one PDU of the session?
+ */
+int sq_coap_block1_needed(coap_session_t *session, size_t len)
+{
+	return len + SQ_COAP_BLOCK_OVERHEAD > coap_session_max_pdu_size(session);
+}
+
+/**
+ * @brief Set up a Block1 upload.
+ *
+ * @param[out] b1		The upload.
+ * @param[in] session	The session to send on.
+ * @param[in] window	Blocks in flight, 1 for plain RFC 7959 stop-and-wait.
+ *						More needs a server that takes blocks out of order.
+ * @param[in] szx		Block size exponent, size = 2^(szx + 4), lowered
+ *						until a block fits in one PDU.
+ */
+int sq_coap_block1_init(sq_coap_block1_t *b1, coap_session_t *session, unsigned int window, unsigned int szx)
+{
+	memset(b1, 0, sizeof(*b1));
+
+	if (window < 1) {
+		window = 1;
+	} else if (window > SQ_COAP_BLOCK_WINDOW_MAX) {
+		window = SQ_COAP_BLOCK_WINDOW_MAX;
+	}
+	if (szx > 6) {
+		szx = 6;
+	}
+	/* Blocks are not fragmented, keep them within one datagram */
+	while (szx > 0 && BLOCK_SIZE(szx) + SQ_COAP_BLOCK_OVERHEAD > coap_session_max_pdu_size(session)) {
+		szx--;
+	}
+
+	b1->session = session;
+	b1->window = window;
+	b1->szx = szx;
+	b1->status = SQ_COAP_BLOCK_DONE;
+
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Upload to path instead of the path of SQ_COAP_URI.
+ */
+int sq_coap_block1_set_path(sq_coap_block1_t *b1, const char *path)
+{
+	return sq_coap_path_optlist(&b1->path, path);
+}
+
+/**
+ * @brief Start uploading.
+ *
+ * @param[in] code	Method, COAP_REQUEST_POST or COAP_REQUEST_PUT.
+ * @param[in] data	The payload, must stay valid until the upload has ended.
+ * @param[in] len	Length of the payload.
+ */
+int sq_coap_block1_start(sq_coap_block1_t *b1, uint8_t code, const uint8_t *data, size_t len)
+{
+	unsigned int i;
+
+	b1->code = code;
+	b1->data = data;
+	b1->len = len;
+	b1->opened = 0;
+	b1->next_ack = 0;
+	b1->next_send = 0;
+	b1->last_block = block1_last(b1);
+	b1->resp_code = 0;
+	b1->status = SQ_COAP_BLOCK_BUSY;
+	b1->blocks = 0;
+	b1->retransmits = 0;
+	b1->duplicates = 0;
+	b1->incomplete = 0;
+	b1->resizes = 0;
+	for (i = 0; i < b1->window; i++) {
+		b1->slot[i].state = SLOT_FREE;
+	}
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - %u bytes in %u blocks of %u bytes", __FUNCTION__,
+			 (unsigned int)len, b1->last_block + 1, BLOCK_SIZE(b1->szx));
+#endif
+	if (block1_fill_window(b1) != 0) {
+		return block1_fail(b1);
+	}
+	return b1->status;
+}
+
+/**
+ * @brief Whether a response is the answer to a block, of this or an earlier upload.
+ */
+int sq_coap_block1_match(const coap_pdu_t *received)
+{
+	return received->token_length == BLOCK1_TOKEN_LEN && (received->token[0] & 0xf0) == BLOCK1_TOKEN_TAG;
+}
+
+/**
+ * @brief Handle the answer to a block.
+ *
+ * To be called from the response handler of the context, for the
+ * responses sq_coap_block1_match takes. Answers that come after the
+ * upload has ended are counted as duplicates and dropped.
+ * @return The transfer status, SQ_COAP_BLOCK_BUSY while more is to come.
+ *         The code of the final response is in resp_code when done.
+ */
+int sq_coap_block1_response(sq_coap_block1_t *b1, coap_pdu_t *received)
+{
+	coap_opt_iterator_t opt_iter;
+	coap_opt_t *block_opt;
+	sq_coap_block1_slot_t *slot;
+	unsigned int num;
+
+	if (!sq_coap_block1_match(received)) {
+		/* Not ours */
+		return b1->status;
+	}
+	if (b1->status != SQ_COAP_BLOCK_BUSY) {
+		/* Late or duplicate answer to a finished upload */
+		b1->duplicates++;
+		return b1->status;
+	}
+	if ((received->token[0] & 0x0f) != b1->szx) {
+		/* A late answer to a block of the size before the server asked for a smaller one */
+		b1->duplicates++;
+		return b1->status;
+	}
+	num = (received->token[1] << 16) | (received->token[2] << 8) | received->token[3];
+
+	slot = block1_slot(b1, num);
+	if (num < b1->next_ack || slot->state != SLOT_SENT || slot->num != num) {
+		b1->duplicates++;
+		return b1->status;
+	}
+
+	block_opt = coap_check_option(received, COAP_OPTION_BLOCK1, &opt_iter);
+
+	if (received->code == COAP_RESPONSE_CODE(408)) {
+		/* Earlier blocks have not arrived yet, this one is sent again later */
+		b1->incomplete++;
+		return b1->status;
+	}
+	if (received->code == COAP_RESPONSE_CODE(413) && !b1->opened &&
+		block_opt && COAP_OPT_BLOCK_SZX(block_opt) < b1->szx) {
+		/* Too large for the server, start over with the size it takes */
+		if (block1_resize(b1, 0, COAP_OPT_BLOCK_SZX(block_opt)) != 0) {
+			return block1_fail(b1);
+		}
+		return b1->status;
+	}
+	if (COAP_RESPONSE_CLASS(received->code) != 2) {
+		ESP_LOGE(TAG, "Block %u failed with %d.%02d", num,
+				 received->code >> 5, received->code & 0x1f);
+		b1->resp_code = received->code;
+		return block1_fail(b1);
+	}
+
+	if (num == b1->last_block) {
+		b1->resp_code = received->code;
+	}
+
+	if (!b1->opened) {
+		b1->opened = 1;
+		if (block_opt && COAP_OPT_BLOCK_SZX(block_opt) < b1->szx && num < b1->last_block) {
+			/* Keeps what it got, and wants the rest in smaller blocks */
+			if (block1_resize(b1, num + 1, COAP_OPT_BLOCK_SZX(block_opt)) != 0) {
+				return block1_fail(b1);
+			}
+			return b1->status;
+		}
+	}
+
+	slot->state = SLOT_ACKED;
+	while (b1->next_ack < b1->next_send) {
+		slot = block1_slot(b1, b1->next_ack);
+		if (slot->state != SLOT_ACKED) {
+			break;
+		}
+		slot->state = SLOT_FREE;
+		b1->next_ack++;
+	}
+
+	if (b1->next_ack > b1->last_block) {
+		b1->status = SQ_COAP_BLOCK_DONE;
+		return b1->status;
+	}
+
+	if (block1_fill_window(b1) != 0) {
+		return block1_fail(b1);
+	}
+	return b1->status;
+}
+
+/**
+ * @brief Send blocks again that have not been answered in time.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the next check is due, to be used as
+ *         timeout for coap_run_once.
+ */
+int sq_coap_block1_poll(sq_coap_block1_t *b1)
+{
+	coap_tick_t now;
+	coap_tick_t next = 0;
+	unsigned int i;
+
+	if (b1->status != SQ_COAP_BLOCK_BUSY) {
+		return 0;
+	}
+
+	coap_ticks(&now);
+	for (i = 0; i < b1->window; i++) {
+		sq_coap_block1_slot_t *slot = &b1->slot[i];
+
+		if (slot->state != SLOT_SENT) {
+			continue;
+		}
+		if (slot->timeout <= now) {
+			if (slot->retries >= SQ_COAP_BLOCK_RETRIES) {
+				ESP_LOGE(TAG, "No answer to block %u", slot->num);
+				block1_fail(b1);
+				return 0;
+			}
+			if (block1_send(b1, slot->num) != 0) {
+				block1_fail(b1);
+				return 0;
+			}
+		}
+		if (next == 0 || slot->timeout < next) {
+			next = slot->timeout;
+		}
+	}
+
+	if (next == 0) {
+		return SQ_COAP_BLOCK_TIMEOUT;
+	}
+	return (next - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+void sq_coap_block1_free(sq_coap_block1_t *b1)
+{
+	if (b1->path) {
+		coap_delete_optlist(b1->path);
+		b1->path = NULL;
+	}
+}
@@ -0,0 +1,247 @@
+#include "squidward/sq_coap_observe.h"
+
+/* Tokens of registrations are the tag followed by the number of the observer */
+#define OBSERVE_TOKEN_TAG	0x0b
+
+#define OBSERVE_REGISTER	0
+#define OBSERVE_DEREGISTER	1
+
+static coap_tick_t ms_ticks(unsigned int ms)
+{
+	return (coap_tick_t)ms * COAP_TICKS_PER_SECOND / 1000;
+}
+
+/**
+ * @brief Send a GET with the Observe option, to register or deregister.
+ *
+ * Registrations are CON, so that libcoap sends them again until the
+ * server answers.
+ */
+static int observe_request(sq_coap_observe_t *obs, unsigned int observe)
+{
+	coap_pdu_t *pdu;
+	coap_optlist_t *option;
+	unsigned char buf[4];
+	int added = 0;
+
+	pdu = coap_new_pdu(obs->session);
+	if (!pdu) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return -1;
+	}
+	pdu->type = observe == OBSERVE_REGISTER ? COAP_MESSAGE_CON : COAP_MESSAGE_NON;
+	pdu->tid = coap_new_message_id(obs->session);
+	pdu->code = COAP_REQUEST_GET;
+	coap_add_token(pdu, sizeof(obs->token), obs->token);
+
+	/* Options go in in order, Observe after Uri-Host and before Uri-Port */
+	for (option = optlist; option; option = option->next) {
+		if (!added && option->number > COAP_OPTION_OBSERVE) {
+			coap_add_option(pdu, COAP_OPTION_OBSERVE,
+							coap_encode_var_safe(buf, sizeof(buf), observe), buf);
+			added = 1;
+		}
+		if (option->number == COAP_OPTION_URI_HOST || option->number == COAP_OPTION_URI_PORT) {
+			coap_add_option(pdu, option->number, option->length, option->data);
+		}
+	}
+	if (!added) {
+		coap_add_option(pdu, COAP_OPTION_OBSERVE,
+						coap_encode_var_safe(buf, sizeof(buf), observe), buf);
+	}
+	for (option = obs->path; option; option = option->next) {
+		coap_add_option(pdu, option->number, option->length, option->data);
+	}
+
+	if (coap_send(obs->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Is a notification with Observe value seq newer than the last one?
+ *
+ * RFC 7641, 3.4: the 24 bit values wrap, and after 128 s a notification is
+ * taken as new whatever its value. The first one after a registration is
+ * always new: a restarted server counts from a lower value again.
+ */
+static int observe_fresh(sq_coap_observe_t *obs, uint32_t seq, coap_tick_t now)
+{
+	if (!obs->seen) {
+		return 1;
+	}
+	if ((obs->seq < seq && seq - obs->seq < (1u << 23)) ||
+		(obs->seq > seq && obs->seq - seq > (1u << 23))) {
+		return 1;
+	}
+	return now > obs->last + (coap_tick_t)SQ_COAP_OBSERVE_FRESH * COAP_TICKS_PER_SECOND;
+}
+
+/**
+ * @brief Set up an observer of the resource at path.
+ *
+ * @param[out] obs		The observer.
+ * @param[in] session	The session to register on.
+ * @param[in] path		URI path of the resource, e.g. "manifest".
+ * @param[in] notify	Called with the payload of each notification.
+ * @param[in] arg		Passed to notify.
+ */
+int sq_coap_observe_init(sq_coap_observe_t *obs, coap_session_t *session, const char *path,
+						 sq_coap_observe_notify_t notify, void *arg)
+{
+	static uint8_t observers;
+
+	memset(obs, 0, sizeof(*obs));
+	obs->session = session;
+	obs->notify = notify;
+	obs->notify_arg = arg;
+	obs->token[0] = OBSERVE_TOKEN_TAG;
+	obs->token[1] = observers++;
+
+	return sq_coap_path_optlist(&obs->path, path);
+}
+
+/**
+ * @brief Register on the resource. The first notification is the current state.
+ */
+int sq_coap_observe_start(sq_coap_observe_t *obs)
+{
+	coap_tick_t now;
+
+	coap_ticks(&now);
+	obs->active = 1;
+	obs->seen = 0;
+	obs->next = now + ms_ticks(SQ_COAP_OBSERVE_RETRY);
+	obs->registrations++;
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - Registering observer %u", __FUNCTION__, obs->token[1]);
+#endif
+	return observe_request(obs, OBSERVE_REGISTER) == 0 ? SQ_COAP_OK : SQ_COAP_ERR_FAIL;
+}
+
+/**
+ * @brief Handle a notification, or the answer to a registration.
+ *
+ * To be called from the response handler of the context.
+ * @return 1 if the response was for this observer, 0 if not.
+ */
+int sq_coap_observe_response(sq_coap_observe_t *obs, coap_pdu_t *received)
+{
+	coap_opt_iterator_t opt_iter;
+	coap_opt_t *opt;
+	coap_tick_t now;
+	unsigned int max_age = SQ_COAP_OBSERVE_MAX_AGE;
+	unsigned char *data = NULL;
+	size_t data_len = 0;
+
+	if (received->token_length != sizeof(obs->token) ||
+		memcmp(received->token, obs->token, sizeof(obs->token)) != 0) {
+		return 0;
+	}
+	if (!obs->active) {
+		/* Deregistered, the server will stop sending */
+		return 1;
+	}
+	coap_ticks(&now);
+
+	if (COAP_RESPONSE_CLASS(received->code) != 2) {
+		/* The server has dropped the registration, try again later */
+		ESP_LOGW(TAG, "Observe ended with %d.%02d", received->code >> 5, received->code & 0x1f);
+		obs->registered = 0;
+		obs->next = now + ms_ticks(SQ_COAP_OBSERVE_RETRY);
+		return 1;
+	}
+
+	opt = coap_check_option(received, COAP_OPTION_MAXAGE, &opt_iter);
+	if (opt) {
+		max_age = coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+	}
+	/* Nothing heard by then, the registration is gone (server restart, NAT timeout) */
+	obs->next = now + (coap_tick_t)max_age * COAP_TICKS_PER_SECOND + ms_ticks(SQ_COAP_OBSERVE_MARGIN);
+
+	opt = coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter);
+	if (opt) {
+		uint32_t seq = coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+
+		/* Late, but the registration is still there */
+		if (!observe_fresh(obs, seq, now)) {
+			obs->stale++;
+			return 1;
+		}
+		obs->seq = seq;
+		obs->registered = 1;
+	} else {
+		/* Not observable, the registration is then a plain GET, polled at Max-Age */
+		obs->registered = 0;
+	}
+	obs->seen = 1;
+	obs->last = now;
+
+	opt = coap_check_option(received, COAP_OPTION_ETAG, &opt_iter);
+	obs->etag_len = 0;
+	if (opt && coap_opt_length(opt) <= SQ_COAP_OBSERVE_ETAG_LEN) {
+		obs->etag_len = coap_opt_length(opt);
+		memcpy(obs->etag, coap_opt_value(opt), obs->etag_len);
+	}
+	opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
+	obs->more = opt && COAP_OPT_BLOCK_MORE(opt);
+
+	obs->notifications++;
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - Notification %u of observer %u, max-age %u s", __FUNCTION__,
+			 obs->seq, obs->token[1], max_age);
+#endif
+
+	coap_get_data(received, &data_len, &data);
+	if (obs->notify) {
+		obs->notify(obs->notify_arg, data, data_len);
+	}
+	return 1;
+}
+
+/**
+ * @brief Register again when the registration has run out or was not answered.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the next check is due, to be used as
+ *         timeout for coap_run_once.
+ */
+int sq_coap_observe_poll(sq_coap_observe_t *obs)
+{
+	coap_tick_t now;
+
+	if (!obs->active) {
+		return SQ_COAP_OBSERVE_RETRY;
+	}
+	coap_ticks(&now);
+	if (now >= obs->next) {
+		ESP_LOGW(TAG, "No notification of observer %u in time, registering again", obs->token[1]);
+		obs->registered = 0;
+		sq_coap_observe_start(obs);
+	}
+	return (obs->next - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+/**
+ * @brief Deregister, the server stops sending notifications.
+ */
+int sq_coap_observe_stop(sq_coap_observe_t *obs)
+{
+	if (!obs->active) {
+		return SQ_COAP_OK;
+	}
+	obs->active = 0;
+	obs->registered = 0;
+	return observe_request(obs, OBSERVE_DEREGISTER) == 0 ? SQ_COAP_OK : SQ_COAP_ERR_FAIL;
+}
+
+void sq_coap_observe_free(sq_coap_observe_t *obs)
+{
+	if (obs->path) {
+		coap_delete_optlist(obs->path);
+		obs->path = NULL;
+	}
+}
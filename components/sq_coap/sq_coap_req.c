@@ -0,0 +1,396 @@
+#include "squidward/sq_coap_req.h"
+
+#define SLOT_FREE	(0)
+#define SLOT_QUEUED	(1)	/* waiting for a request ahead of it to complete */
+#define SLOT_SENT	(2)
+
+/* Tokens of requests are the tag followed by a number unique among the slots in use */
+#define REQ_TOKEN_TAG	0x0a
+#define REQ_TOKEN_LEN	2
+
+/* A handle is the token number and the slot, so a stale handle matches nothing */
+#define REQ_HANDLE(i, token)	(((token) << 8) | (i))
+
+static coap_tick_t ms_ticks(unsigned int ms)
+{
+	return (coap_tick_t)ms * COAP_TICKS_PER_SECOND / 1000;
+}
+
+static coap_tick_t req_timeout_ticks(unsigned int retries)
+{
+	return ms_ticks(SQ_COAP_REQ_ACK_TIMEOUT) << retries;
+}
+
+/**
+ * @brief Send the request of a slot, or send it again.
+ *
+ * The requests are NON, since libcoap only keeps one CON request in flight
+ * per session (NSTART = 1). Requests without a response are sent again by
+ * sq_coap_req_poll, with the same token and message ID, so that the server
+ * can tell a retransmission from a new request and does not apply a POST
+ * twice when only the response was lost.
+ */
+static int req_send(sq_coap_req_t *req, sq_coap_req_slot_t *slot)
+{
+	coap_pdu_t *pdu;
+	coap_optlist_t *option;
+	uint8_t token[REQ_TOKEN_LEN] = { REQ_TOKEN_TAG, slot->token };
+
+	pdu = coap_new_pdu(req->session);
+	if (!pdu) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return -1;
+	}
+	if (slot->state != SLOT_SENT) {
+		slot->mid = coap_new_message_id(req->session);
+	}
+	pdu->type = COAP_MESSAGE_NON;
+	pdu->tid = slot->mid;
+	pdu->code = slot->code;
+	coap_add_token(pdu, sizeof(token), token);
+
+	/* add URI components from optlist */
+	for (option = optlist; option; option = option->next) {
+		switch (option->number) {
+		case COAP_OPTION_URI_PATH :
+		case COAP_OPTION_URI_QUERY :
+			if (slot->path) {
+				break;
+			}
+			/* fall through */
+		case COAP_OPTION_URI_HOST :
+		case COAP_OPTION_URI_PORT :
+			coap_add_option(pdu, option->number, option->length, option->data);
+			break;
+		default:
+			;     /* skip other options */
+		}
+	}
+	for (option = slot->path; option; option = option->next) {
+		coap_add_option(pdu, option->number, option->length, option->data);
+	}
+	if (slot->len > 0) {
+		coap_add_data(pdu, slot->len, slot->data);
+	}
+
+	if (coap_send(req->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+
+	if (slot->state == SLOT_SENT) {
+		slot->retries++;
+		req->retransmits++;
+	} else {
+		slot->state = SLOT_SENT;
+		slot->retries = 0;
+		req->inflight++;
+		if (req->inflight > req->max_inflight) {
+			req->max_inflight = req->inflight;
+		}
+	}
+	coap_ticks(&slot->timeout);
+	slot->timeout += req_timeout_ticks(slot->retries);
+	if (slot->timeout > slot->deadline) {
+		slot->timeout = slot->deadline;
+	}
+	return 0;
+}
+
+/**
+ * @brief Free the slot and tell the caller how the request ended.
+ */
+static void req_complete(sq_coap_req_t *req, sq_coap_req_slot_t *slot, int status, coap_pdu_t *received)
+{
+	sq_coap_req_done_t done = slot->done;
+	void *arg = slot->done_arg;
+
+	if (slot->state == SLOT_SENT) {
+		req->inflight--;
+	}
+	if (slot->path) {
+		coap_delete_optlist(slot->path);
+	}
+	memset(slot, 0, sizeof(*slot));
+
+	req->completed++;
+	if (status == SQ_COAP_REQ_TIMEOUT) {
+		req->timeouts++;
+	}
+	if (done) {
+		done(arg, status, received);
+	}
+}
+
+/**
+ * @brief Send queued requests, oldest first, while fewer than nstart are in flight.
+ */
+static void req_start_queued(sq_coap_req_t *req)
+{
+	while (req->inflight < req->nstart) {
+		sq_coap_req_slot_t *oldest = NULL;
+		unsigned int i;
+
+		for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+			sq_coap_req_slot_t *slot = &req->slot[i];
+
+			if (slot->state == SLOT_QUEUED &&
+				(oldest == NULL || (int32_t)(slot->order - oldest->order) < 0)) {
+				oldest = slot;
+			}
+		}
+		if (oldest == NULL) {
+			return;
+		}
+		if (req_send(req, oldest) != 0) {
+			req_complete(req, oldest, SQ_COAP_REQ_ERR, NULL);
+		}
+	}
+}
+
+/**
+ * @brief Set up a request table on a session.
+ *
+ * @param[out] req		The request table.
+ * @param[in] session	The session to send on.
+ * @param[in] nstart	Most requests in flight at the same time, 0 for SQ_COAP_REQ_NSTART.
+ */
+int sq_coap_req_init(sq_coap_req_t *req, coap_session_t *session, unsigned int nstart)
+{
+	memset(req, 0, sizeof(*req));
+	req->session = session;
+	req->nstart = nstart > 0 ? nstart : SQ_COAP_REQ_NSTART;
+	if (req->nstart > SQ_COAP_REQ_MAX) {
+		req->nstart = SQ_COAP_REQ_MAX;
+	}
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Submit a request, sent at once if fewer than nstart are in flight.
+ *
+ * @param[in] req			The request table.
+ * @param[in] code			Method, e.g. COAP_REQUEST_POST.
+ * @param[in] path			URI path of the resource, NULL for the one of SQ_COAP_URI.
+ * @param[in] data			Payload, must stay valid until done is called.
+ * @param[in] len			Length of the payload, 0 for none.
+ * @param[in] timeout_ms	Time to wait for a response, counted from now and
+ *							including the time queued. 0 for SQ_COAP_REQ_WAIT.
+ * @param[in] done			Called when the request completes.
+ * @param[in] arg			Passed to done.
+ * @return A handle of the request, or -1 if the table is full or the
+ *         request could not be sent. done is not called then.
+ */
+int sq_coap_req_submit(sq_coap_req_t *req, uint8_t code, const char *path, const uint8_t *data, size_t len,
+					   unsigned int timeout_ms, sq_coap_req_done_t done, void *arg)
+{
+	sq_coap_req_slot_t *slot = NULL;
+	coap_tick_t now;
+	unsigned int i, j;
+	int handle;
+
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		if (req->slot[i].state == SLOT_FREE) {
+			slot = &req->slot[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		ESP_LOGE(TAG, "No free request slot, %d in use", SQ_COAP_REQ_MAX);
+		return -1;
+	}
+	if (path && sq_coap_path_optlist(&slot->path, path) != SQ_COAP_OK) {
+		if (slot->path) {
+			coap_delete_optlist(slot->path);
+			slot->path = NULL;
+		}
+		return -1;
+	}
+
+	/* A token not used by another slot, a late response must not match the wrong request */
+	do {
+		slot->token = req->next_token++;
+		for (j = 0; j < SQ_COAP_REQ_MAX; j++) {
+			if (j != i && req->slot[j].state != SLOT_FREE && req->slot[j].token == slot->token) {
+				break;
+			}
+		}
+	} while (j < SQ_COAP_REQ_MAX);
+
+	coap_ticks(&now);
+	slot->order = req->next_order++;
+	slot->code = code;
+	slot->data = data;
+	slot->len = len;
+	slot->deadline = now + ms_ticks(timeout_ms > 0 ? timeout_ms : SQ_COAP_REQ_WAIT);
+	slot->done = done;
+	slot->done_arg = arg;
+	slot->state = SLOT_QUEUED;
+	handle = REQ_HANDLE(i, slot->token);
+	req->submitted++;
+
+#ifdef CONFIG_SQ_COAP_DBG
+	ESP_LOGI(TAG, "[%s] - Request %d, %u bytes, %u in flight", __FUNCTION__,
+			 handle, (unsigned int)len, req->inflight);
+#endif
+
+	if (req->inflight < req->nstart && req_send(req, slot) != 0) {
+		if (slot->path) {
+			coap_delete_optlist(slot->path);
+		}
+		memset(slot, 0, sizeof(*slot));
+		req->submitted--;
+		return -1;
+	}
+	return handle;
+}
+
+/**
+ * @brief Drop a request. Its callback is called with SQ_COAP_REQ_CANCELLED.
+ *
+ * @return SQ_COAP_OK, or SQ_COAP_ERR_FAIL if the request had completed.
+ */
+int sq_coap_req_cancel(sq_coap_req_t *req, int handle)
+{
+	unsigned int i = handle & 0xff;
+	sq_coap_req_slot_t *slot;
+
+	if (handle < 0 || i >= SQ_COAP_REQ_MAX) {
+		return SQ_COAP_ERR_FAIL;
+	}
+	slot = &req->slot[i];
+	if (slot->state == SLOT_FREE || (int)REQ_HANDLE(i, slot->token) != handle) {
+		return SQ_COAP_ERR_FAIL;
+	}
+	req_complete(req, slot, SQ_COAP_REQ_CANCELLED, NULL);
+	req_start_queued(req);
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Hand a response to the request it answers.
+ *
+ * To be called from the response handler of the context.
+ * @return 1 if the response was for a request of this table, 0 if not.
+ */
+int sq_coap_req_response(sq_coap_req_t *req, coap_pdu_t *received)
+{
+	unsigned int i;
+
+	if (received->token_length != REQ_TOKEN_LEN || received->token[0] != REQ_TOKEN_TAG) {
+		return 0;
+	}
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		sq_coap_req_slot_t *slot = &req->slot[i];
+
+		if (slot->state == SLOT_SENT && slot->token == received->token[1]) {
+			req_complete(req, slot, SQ_COAP_REQ_OK, received);
+			req_start_queued(req);
+			return 1;
+		}
+	}
+	/* Answer to a request that was sent again, or that has timed out */
+	req->duplicates++;
+	return 1;
+}
+
+/**
+ * @brief Send requests again that have not been answered, and end the ones
+ * that have run out of time.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the next check is due, to be used as
+ *         timeout for coap_run_once. -1 if no request is pending.
+ */
+int sq_coap_req_poll(sq_coap_req_t *req)
+{
+	coap_tick_t now;
+	coap_tick_t next = 0;
+	unsigned int i;
+
+	coap_ticks(&now);
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		sq_coap_req_slot_t *slot = &req->slot[i];
+
+		if (slot->state == SLOT_FREE) {
+			continue;
+		}
+		if (slot->deadline <= now) {
+			ESP_LOGW(TAG, "No response to request %d in time", REQ_HANDLE(i, slot->token));
+			req_complete(req, slot, SQ_COAP_REQ_TIMEOUT, NULL);
+			continue;
+		}
+		if (slot->state == SLOT_SENT && slot->timeout <= now && req_send(req, slot) != 0) {
+			req_complete(req, slot, SQ_COAP_REQ_ERR, NULL);
+			continue;
+		}
+	}
+	req_start_queued(req);
+
+	/* Completed requests may have queued new ones from their callback */
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		sq_coap_req_slot_t *slot = &req->slot[i];
+		coap_tick_t due;
+
+		if (slot->state == SLOT_FREE) {
+			continue;
+		}
+		due = slot->state == SLOT_SENT ? slot->timeout : slot->deadline;
+		if (next == 0 || due < next) {
+			next = due;
+		}
+	}
+
+	if (next == 0) {
+		return -1;
+	}
+	return next > now ? (next - now) * 1000 / COAP_TICKS_PER_SECOND + 1 : 1;
+}
+
+/**
+ * @brief Number of requests that have not completed, queued or in flight.
+ */
+unsigned int sq_coap_req_pending(const sq_coap_req_t *req)
+{
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		if (req->slot[i].state != SLOT_FREE) {
+			pending++;
+		}
+	}
+	return pending;
+}
+
+/**
+ * @brief Run the I/O loop of the context until every request has completed.
+ *
+ * The response handler of the context must pass responses to
+ * sq_coap_req_response.
+ */
+int sq_coap_req_run(sq_coap_req_t *req, coap_context_t *ctx)
+{
+	int wait_ms;
+
+	while ((wait_ms = sq_coap_req_poll(req)) >= 0) {
+		if (coap_run_once(ctx, wait_ms) < 0) {
+			ESP_LOGE(TAG, "coap_run_once() failed");
+			return SQ_COAP_ERR_FAIL;
+		}
+	}
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Cancel whatever has not completed.
+ */
+void sq_coap_req_free(sq_coap_req_t *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < SQ_COAP_REQ_MAX; i++) {
+		if (req->slot[i].state != SLOT_FREE) {
+			req_complete(req, &req->slot[i], SQ_COAP_REQ_CANCELLED, NULL);
+		}
+	}
+}
@@ -0,0 +1,439 @@
+#include "squidward/sq_coap_telemetry.h"
+
+#define ENTRY_FREE	(0)
+#define ENTRY_SENT	(1)
+
+/* Tokens of messages are the tag followed by the sequence number */
+#define TELEMETRY_TOKEN_TAG	0x0c
+#define TELEMETRY_TOKEN_LEN	5
+/* Tokens of empty POSTs asking for an answer are the tag followed by their number */
+#define PROBE_TOKEN_TAG		0x0d
+#define PROBE_TOKEN_LEN		2
+
+#ifndef COAP_OPTION_NORESPONSE
+#define COAP_OPTION_NORESPONSE	258
+#endif
+#define NORESPONSE_2XX			0x02	/* RFC 7967, not interested in 2.xx */
+
+static coap_tick_t ms_ticks(unsigned int ms)
+{
+	return (coap_tick_t)ms * COAP_TICKS_PER_SECOND / 1000;
+}
+
+static coap_tick_t ack_timeout_ticks(unsigned int retries)
+{
+	return ms_ticks(SQ_COAP_TELEMETRY_ACK_TIMEOUT) << retries;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t val)
+{
+	p[0] = (val >> 24) & 0xff;
+	p[1] = (val >> 16) & 0xff;
+	p[2] = (val >> 8) & 0xff;
+	p[3] = val & 0xff;
+}
+
+/* Sequence numbers wrap, a is before b if less than half the space behind it */
+static int seq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/**
+ * @brief A message asking for an answer was sent, expect the answer in time.
+ */
+static void telemetry_asked(sq_coap_telemetry_t *tlm)
+{
+	coap_tick_t now;
+
+	coap_ticks(&now);
+	tlm->ack_due = now + ack_timeout_ticks(tlm->ack_retries);
+	tlm->since_ack = 0;
+	tlm->ask_next = 0;
+	tlm->ack_requests++;
+}
+
+static coap_pdu_t *telemetry_pdu(sq_coap_telemetry_t *tlm, uint8_t type, const uint8_t *token, size_t token_len)
+{
+	coap_pdu_t *pdu;
+
+	pdu = coap_new_pdu(tlm->session);
+	if (!pdu) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return NULL;
+	}
+	pdu->type = type;
+	pdu->tid = coap_new_message_id(tlm->session);
+	pdu->code = COAP_REQUEST_POST;
+	coap_add_token(pdu, token_len, token);
+	coap_add_optlist_pdu(pdu, &optlist);
+	return pdu;
+}
+
+/**
+ * @brief Send a message, or send it again.
+ *
+ * @param[in] ask	Leave out No-Response, the server answers with its ranges.
+ */
+static int telemetry_transmit(sq_coap_telemetry_t *tlm, sq_coap_telemetry_entry_t *entry, int ask)
+{
+	coap_pdu_t *pdu;
+	uint8_t token[TELEMETRY_TOKEN_LEN];
+	uint8_t no_response = NORESPONSE_2XX;
+
+	token[0] = TELEMETRY_TOKEN_TAG;
+	put_u32(&token[1], entry->seq);
+	pdu = telemetry_pdu(tlm, tlm->mode == SQ_COAP_TELEMETRY_CON ? COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+						token, sizeof(token));
+	if (!pdu) {
+		return -1;
+	}
+	/* No-Response comes after the URI options */
+	if (tlm->mode == SQ_COAP_TELEMETRY_NON && !ask) {
+		coap_add_option(pdu, COAP_OPTION_NORESPONSE, sizeof(no_response), &no_response);
+	}
+	coap_add_data(pdu, entry->len, entry->data);
+
+	if (coap_send(tlm->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+	coap_ticks(&entry->sent);
+	tlm->datagrams++;
+	if (tlm->mode == SQ_COAP_TELEMETRY_NON && ask) {
+		telemetry_asked(tlm);
+	}
+	return 0;
+}
+
+/**
+ * @brief Ask for the ranges with an empty POST, when nothing else is sent
+ * or the answer to the last question was lost.
+ */
+static int telemetry_probe(sq_coap_telemetry_t *tlm)
+{
+	coap_pdu_t *pdu;
+	uint8_t token[PROBE_TOKEN_LEN] = { PROBE_TOKEN_TAG, ++tlm->probe };
+
+	pdu = telemetry_pdu(tlm, COAP_MESSAGE_NON, token, sizeof(token));
+	if (!pdu) {
+		return -1;
+	}
+	if (coap_send(tlm->session, pdu) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+	tlm->probe_seq = tlm->next_seq;
+	tlm->datagrams++;
+	telemetry_asked(tlm);
+	return 0;
+}
+
+/**
+ * @brief Send again the messages below highest that the ranges left out.
+ * The last one asks for an answer, to learn if they got there.
+ */
+static void telemetry_resend_gaps(sq_coap_telemetry_t *tlm, uint32_t highest)
+{
+	unsigned int i, gaps = 0;
+
+	for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+		sq_coap_telemetry_entry_t *entry = &tlm->entry[i];
+
+		if (entry->state == ENTRY_SENT && seq_before(entry->seq, highest)) {
+			if (entry->retries >= SQ_COAP_TELEMETRY_RETRIES) {
+				ESP_LOGW(TAG, "Message %u lost %u times, dropped", entry->seq, entry->retries + 1);
+				entry->state = ENTRY_FREE;
+				tlm->dropped++;
+				continue;
+			}
+			gaps++;
+		}
+	}
+
+	for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER && gaps > 0; i++) {
+		sq_coap_telemetry_entry_t *entry = &tlm->entry[i];
+
+		if (entry->state != ENTRY_SENT || !seq_before(entry->seq, highest)) {
+			continue;
+		}
+		gaps--;
+		entry->retries++;
+		tlm->retransmits++;
+		/* On failure it stays in the buffer, and is found missing again by the next answer */
+		telemetry_transmit(tlm, entry, gaps == 0);
+	}
+}
+
+/**
+ * @brief Set up telemetry on a session.
+ *
+ * @param[out] tlm		The telemetry sender.
+ * @param[in] session	The session to send on.
+ * @param[in] mode		SQ_COAP_TELEMETRY_NON, or SQ_COAP_TELEMETRY_CON to compare with.
+ */
+int sq_coap_telemetry_init(sq_coap_telemetry_t *tlm, coap_session_t *session, int mode)
+{
+	memset(tlm, 0, sizeof(*tlm));
+	tlm->session = session;
+	tlm->mode = mode;
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Send a message, and keep it until acknowledged.
+ *
+ * @return SQ_COAP_OK, or SQ_COAP_ERR_FAIL if the message is larger than
+ *         SQ_COAP_TELEMETRY_MSG_MAX or could not be sent.
+ */
+int sq_coap_telemetry_send(sq_coap_telemetry_t *tlm, const uint8_t *data, size_t len)
+{
+	sq_coap_telemetry_entry_t *entry = NULL;
+	sq_coap_telemetry_entry_t *oldest = NULL;
+	unsigned int i, pending = 0;
+	int ask;
+
+	if (len > SQ_COAP_TELEMETRY_MSG_MAX) {
+		ESP_LOGE(TAG, "Telemetry message of %u bytes too large", (unsigned int)len);
+		return SQ_COAP_ERR_FAIL;
+	}
+
+	for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+		sq_coap_telemetry_entry_t *e = &tlm->entry[i];
+
+		if (e->state == ENTRY_FREE) {
+			if (entry == NULL) {
+				entry = e;
+			}
+			continue;
+		}
+		pending++;
+		if (oldest == NULL || seq_before(e->seq, oldest->seq)) {
+			oldest = e;
+		}
+	}
+	if (entry == NULL) {
+		ESP_LOGW(TAG, "Telemetry buffer full, message %u dropped", oldest->seq);
+		oldest->state = ENTRY_FREE;
+		tlm->dropped++;
+		entry = oldest;
+		pending--;
+	}
+
+	entry->seq = tlm->next_seq++;
+	put_u32(entry->data, entry->seq);
+	memcpy(entry->data + SQ_COAP_TELEMETRY_SEQ_LEN, data, len);
+	entry->len = SQ_COAP_TELEMETRY_SEQ_LEN + len;
+	entry->retries = 0;
+	entry->state = ENTRY_SENT;
+	tlm->messages++;
+
+	/* Ask every so often, and before the buffer overflows */
+	ask = tlm->mode == SQ_COAP_TELEMETRY_NON &&
+		  (++tlm->since_ack >= SQ_COAP_TELEMETRY_ACK_EVERY || pending + 1 == SQ_COAP_TELEMETRY_BUFFER ||
+		   tlm->ask_next);
+
+	if (telemetry_transmit(tlm, entry, ask) != 0) {
+		entry->state = ENTRY_FREE;
+		return SQ_COAP_ERR_FAIL;
+	}
+	if (!ask && pending == 0) {
+		/* Asked for at the latest when the timeout has run out, see sq_coap_telemetry_poll */
+		tlm->ack_due = entry->sent + ack_timeout_ticks(0);
+	}
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Have the next message ask for the ranges, when it is the last one
+ * for a while. Saves the empty POST of sq_coap_telemetry_flush.
+ */
+void sq_coap_telemetry_ask(sq_coap_telemetry_t *tlm)
+{
+	tlm->ask_next = 1;
+}
+
+/**
+ * @brief Ask for the ranges now, instead of waiting for more messages.
+ */
+int sq_coap_telemetry_flush(sq_coap_telemetry_t *tlm)
+{
+	if (tlm->mode != SQ_COAP_TELEMETRY_NON || sq_coap_telemetry_pending(tlm) == 0) {
+		return SQ_COAP_OK;
+	}
+	return telemetry_probe(tlm) == 0 ? SQ_COAP_OK : SQ_COAP_ERR_FAIL;
+}
+
+/**
+ * @brief Handle the answer to a message or an empty POST.
+ *
+ * To be called from the response handler of the context.
+ * @return 1 if the response was for telemetry, 0 if not.
+ */
+int sq_coap_telemetry_response(sq_coap_telemetry_t *tlm, coap_pdu_t *received)
+{
+	unsigned char *data = NULL;
+	size_t data_len = 0;
+	uint32_t upto;	/* acknowledged before it, if there are no ranges */
+	uint32_t asked = tlm->ack_requests;
+	unsigned int i;
+
+	if (received->token_length == TELEMETRY_TOKEN_LEN && received->token[0] == TELEMETRY_TOKEN_TAG) {
+		upto = get_u32(&received->token[1]) + 1;
+	} else if (received->token_length == PROBE_TOKEN_LEN && received->token[0] == PROBE_TOKEN_TAG) {
+		if (received->token[1] != tlm->probe) {
+			/* Answer to an earlier empty POST, the last one is answered too */
+			return 1;
+		}
+		upto = tlm->probe_seq;
+	} else {
+		return 0;
+	}
+
+	if (COAP_RESPONSE_CLASS(received->code) != 2) {
+		/* It got there all the same, sending it again does not help */
+		ESP_LOGW(TAG, "Telemetry answered with %d.%02d", received->code >> 5, received->code & 0x1f);
+	}
+	tlm->acks++;
+
+	if (tlm->mode == SQ_COAP_TELEMETRY_CON) {
+		for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+			if (tlm->entry[i].state == ENTRY_SENT && tlm->entry[i].seq == upto - 1) {
+				tlm->entry[i].state = ENTRY_FREE;
+			}
+		}
+		return 1;
+	}
+
+	tlm->ack_retries = 0;
+	coap_get_data(received, &data_len, &data);
+	if (COAP_RESPONSE_CLASS(received->code) == 2 &&
+		data_len > 0 && data_len % SQ_COAP_TELEMETRY_RANGE_LEN == 0) {
+		uint32_t highest = get_u32(data + 4);
+		size_t off;
+
+		for (off = 0; off < data_len; off += SQ_COAP_TELEMETRY_RANGE_LEN) {
+			uint32_t first = get_u32(data + off);
+			uint32_t last = get_u32(data + off + 4);
+
+			for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+				sq_coap_telemetry_entry_t *entry = &tlm->entry[i];
+
+				if (entry->state == ENTRY_SENT &&
+					!seq_before(entry->seq, first) && !seq_before(last, entry->seq)) {
+					entry->state = ENTRY_FREE;
+				}
+			}
+			if (seq_before(highest, last)) {
+				highest = last;
+			}
+		}
+		telemetry_resend_gaps(tlm, highest);
+	} else {
+		for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+			if (tlm->entry[i].state == ENTRY_SENT && seq_before(tlm->entry[i].seq, upto)) {
+				tlm->entry[i].state = ENTRY_FREE;
+			}
+		}
+	}
+
+	if (tlm->ack_requests == asked && sq_coap_telemetry_pending(tlm) > 0) {
+		/* Sent after the question, ask about them later */
+		coap_tick_t now;
+
+		coap_ticks(&now);
+		tlm->ack_due = now + ack_timeout_ticks(0);
+	}
+	return 1;
+}
+
+/**
+ * @brief Ask again when an answer is overdue, and give up on messages
+ * that have gone unanswered for too long.
+ *
+ * To be called from the I/O loop.
+ * @return The number of ms until the next check is due, to be used as
+ *         timeout for coap_run_once. -1 if every message is acknowledged.
+ */
+int sq_coap_telemetry_poll(sq_coap_telemetry_t *tlm)
+{
+	coap_tick_t now;
+	coap_tick_t next = 0;
+	unsigned int i;
+
+	if (sq_coap_telemetry_pending(tlm) == 0) {
+		return -1;
+	}
+	coap_ticks(&now);
+
+	if (tlm->mode == SQ_COAP_TELEMETRY_CON) {
+		/* libcoap sends them again, only forget the ones it has given up on */
+		coap_tick_t wait = ack_timeout_ticks(SQ_COAP_TELEMETRY_RETRIES + 1);
+
+		for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+			sq_coap_telemetry_entry_t *entry = &tlm->entry[i];
+
+			if (entry->state != ENTRY_SENT) {
+				continue;
+			}
+			if (entry->sent + wait <= now) {
+				ESP_LOGW(TAG, "No answer to message %u, dropped", entry->seq);
+				entry->state = ENTRY_FREE;
+				tlm->dropped++;
+				continue;
+			}
+			if (next == 0 || entry->sent + wait < next) {
+				next = entry->sent + wait;
+			}
+		}
+		if (next == 0) {
+			return -1;
+		}
+		return (next - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+	}
+
+	if (tlm->ack_due <= now) {
+		if (tlm->ack_retries >= SQ_COAP_TELEMETRY_RETRIES) {
+			ESP_LOGE(TAG, "No acknowledgement from the server, %u messages dropped",
+					 sq_coap_telemetry_pending(tlm));
+			for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+				if (tlm->entry[i].state == ENTRY_SENT) {
+					tlm->entry[i].state = ENTRY_FREE;
+					tlm->dropped++;
+				}
+			}
+			tlm->ack_retries = 0;
+			return -1;
+		}
+#ifdef CONFIG_SQ_COAP_DBG
+		ESP_LOGI(TAG, "[%s] - Asking for acknowledgement of %u messages", __FUNCTION__,
+				 sq_coap_telemetry_pending(tlm));
+#endif
+		tlm->ack_retries++;
+		if (telemetry_probe(tlm) != 0) {
+			/* Tried again at the next timeout */
+			tlm->ack_due = now + ack_timeout_ticks(tlm->ack_retries);
+		}
+	}
+	return (tlm->ack_due - now) * 1000 / COAP_TICKS_PER_SECOND + 1;
+}
+
+/**
+ * @brief Number of messages sent and not acknowledged.
+ */
+unsigned int sq_coap_telemetry_pending(const sq_coap_telemetry_t *tlm)
+{
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < SQ_COAP_TELEMETRY_BUFFER; i++) {
+		if (tlm->entry[i].state == ENTRY_SENT) {
+			pending++;
+		}
+	}
+	return pending;
+}
@@ -0,0 +1,271 @@
+#ifndef SQUIDWARD_FOTA_H
+#define SQUIDWARD_FOTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "mbedtls/sha256.h"
+
+#define SQ_FOTA_SECTOR_SIZE		4096
+#define SQ_FOTA_WRITER_BUFFERS	CONFIG_SQ_FOTA_WRITER_BUFFERS
+#define SQ_FOTA_WRITER_PRIO		CONFIG_SQ_FOTA_WRITER_PRIO
+#define SQ_FOTA_WRITER_STACK	CONFIG_SQ_FOTA_WRITER_STACK
+#define SQ_FOTA_ERASE_AHEAD		(CONFIG_SQ_FOTA_ERASE_AHEAD_KB * 1024)
+#ifdef CONFIG_SQ_FOTA_RESUME
+#define SQ_FOTA_CHECKPOINT_INTERVAL	(CONFIG_SQ_FOTA_CHECKPOINT_KB * 1024)
+#else
+#define SQ_FOTA_CHECKPOINT_INTERVAL	0
+#endif
+#ifdef CONFIG_SQ_FOTA_LZ
+#define SQ_FOTA_LZ_WINDOW_BITS	CONFIG_SQ_FOTA_LZ_WINDOW
+#else
+#define SQ_FOTA_LZ_WINDOW_BITS	8
+#endif
+
+#define SQ_FOTA_HASH_LEN		32 /* SHA-256 digest length */
+#define SQ_FOTA_VERSION_LEN		32
+#define SQ_FOTA_ETAG_LEN		8
+
+#define SQ_FOTA_OK			(0)
+#define SQ_FOTA_ERR_FAIL	(1)
+#define SQ_FOTA_ERR_VERIFY	(2)
+
+extern const char *TAG;
+
+/*
+ * Consumer of the firmware image. The stages of the update (flash writer,
+ * verification, ...) pass the data on to the next one through a sink,
+ * the last one writes to the partition: esp_ota_write on the ESP32 and a
+ * file on the host.
+ */
+typedef int (*sq_fota_write_t)(void *arg, const uint8_t *data, size_t len);
+
+typedef struct {
+	sq_fota_write_t	write;
+	void			*arg;
+} sq_fota_sink_t;
+
+/*
+ * Flash writer task. The network side fills sector sized buffers that are
+ * written by a separate task, so that receiving the next data and flash
+ * erase/program overlap.
+ */
+/*
+ * Work for the flash writer task while there is no data to write, e.g.
+ * erasing ahead. Does a small piece of it, and returns nonzero if there
+ * is more to do.
+ */
+typedef int (*sq_fota_idle_t)(void *arg);
+
+/*
+ * Called from the flash writer task each time a buffer has been written
+ * and sq_fota_writer_space has grown, e.g. to wake up the network loop
+ * that held back requests.
+ */
+typedef void (*sq_fota_freed_t)(void *arg);
+
+typedef struct {
+	sq_fota_sink_t		sink;
+	sq_fota_idle_t		idle;
+	void				*idle_arg;
+	sq_fota_freed_t		freed;
+	void				*freed_arg;
+	uint8_t				*buf[SQ_FOTA_WRITER_BUFFERS];
+	size_t				len[SQ_FOTA_WRITER_BUFFERS];
+	int					fill;		/* buffer being filled, -1 if none */
+	QueueHandle_t		free_q;
+	QueueHandle_t		full_q;
+	SemaphoreHandle_t	done;
+	volatile int		err;
+
+	/* Statistics */
+	uint32_t			written;
+	uint32_t			stalls;		/* writes that had to wait for a free buffer */
+	uint32_t			idle_runs;
+} sq_fota_writer_t;
+
+/*
+ * Description of the image on the server, fetched before the image. Given
+ * as text, one key=value per line:
+ *
+ *   version=1.0.1
+ *   size=812352
+ *   sha256=<64 hex digits>
+ *   block=1024
+ *   image_id=<64 hex digits>
+ *   delta_source=<64 hex digits>
+ *   encoding=heatshrink
+ *
+ * see tools/fota_manifest.sh. image_id is the digest esp_partition_get_sha256
+ * gives for the image once it is in flash (the one appended to the image),
+ * so that a device can tell it already runs it without any transfer.
+ * delta_source is given when a patch from that
+ * image is available, see tools/fota_delta.py, and encoding when the image
+ * is also available compressed, see tools/fota_compress.py. The size and
+ * digest are the ones of the uncompressed image.
+ */
+typedef struct {
+	char		version[SQ_FOTA_VERSION_LEN];
+	uint32_t	size;
+	uint8_t		sha256[SQ_FOTA_HASH_LEN];
+	uint32_t	block_size;
+	int			has_sha256;
+	uint8_t		image_id[SQ_FOTA_HASH_LEN];
+	int			has_image_id;
+	uint8_t		delta_source[SQ_FOTA_HASH_LEN];	/* image a patch is available for */
+	int			has_delta;
+	int			compressed;
+} sq_fota_manifest_t;
+
+/*
+ * SHA-256 of the image, computed while it passes on to the next sink, so
+ * that it can be verified without reading the partition back.
+ */
+typedef struct {
+	mbedtls_sha256_context	ctx;
+	sq_fota_sink_t			next;
+	uint32_t				len;
+	uint8_t					digest[SQ_FOTA_HASH_LEN];
+} sq_fota_hash_t;
+
+/* Reads the image a patch applies to: esp_partition_read on the ESP32 */
+typedef int (*sq_fota_read_t)(void *arg, size_t offset, uint8_t *data, size_t len);
+
+#define SQ_FOTA_DELTA_HDR_LEN	(4 + 4 + 2 * SQ_FOTA_HASH_LEN)
+#define SQ_FOTA_DELTA_BUFSIZE	256
+
+/*
+ * Applies a patch against the running image (see sq_fota_delta.c for the
+ * format) and passes the new image on. The patch is consumed as it
+ * arrives, RAM use is the header and a small work buffer.
+ */
+typedef struct {
+	sq_fota_sink_t	next;
+	sq_fota_read_t	read;
+	void			*read_arg;
+	uint8_t			source_sha256[SQ_FOTA_HASH_LEN];
+	int				state;
+	uint8_t			hdr[SQ_FOTA_DELTA_HDR_LEN];
+	size_t			hdr_len;
+	uint8_t			op;
+	uint32_t		arg[2];
+	int				nargs;
+	int				arg_idx;
+	int				shift;
+	uint32_t		off;		/* source offset of the current operation */
+	uint32_t		len;		/* bytes left of the current operation */
+	uint32_t		new_size;
+	uint32_t		out;
+	uint8_t			buf[SQ_FOTA_DELTA_BUFSIZE];
+
+	/* Statistics */
+	uint32_t		patch_bytes;
+	uint32_t		copied;
+	uint32_t		added;
+	uint32_t		inserted;
+} sq_fota_delta_t;
+
+#define SQ_FOTA_LZ_HDR_LEN	(4 + 1 + 1 + 4)
+#define SQ_FOTA_LZ_BUFSIZE	256
+
+/*
+ * Decompresses an image (see sq_fota_lz.c for the format) and passes it
+ * on. RAM use is the window, at most 2^SQ_FOTA_LZ_WINDOW_BITS bytes, and a
+ * small output buffer.
+ */
+typedef struct {
+	sq_fota_sink_t	next;
+	int				state;
+	uint8_t			hdr[SQ_FOTA_LZ_HDR_LEN];
+	size_t			hdr_len;
+	unsigned int	window_bits;
+	unsigned int	lookahead_bits;
+	uint32_t		mask;
+	uint32_t		bits;		/* input bits not used yet */
+	unsigned int	nbits;
+	uint32_t		index;		/* back reference offset */
+	uint32_t		size;
+	uint32_t		out;
+	uint32_t		head;
+	uint8_t			window[1 << SQ_FOTA_LZ_WINDOW_BITS];
+	uint8_t			buf[SQ_FOTA_LZ_BUFSIZE];
+	size_t			buf_len;
+
+	/* Statistics */
+	uint32_t		in_bytes;
+} sq_fota_lz_t;
+
+#define SQ_FOTA_CHECKPOINT_VERSION	1
+
+/*
+ * Progress of a download, kept in NVS so that it can be resumed after a
+ * lost link or a reboot. Only what has been written to flash counts, the
+ * hash is the one of those bytes.
+ */
+typedef struct {
+	uint32_t				version;
+	uint32_t				partition;	/* address of the update partition */
+	uint8_t					sha256[SQ_FOTA_HASH_LEN];	/* image being downloaded, from the manifest */
+	uint8_t					etag[SQ_FOTA_ETAG_LEN];
+	uint32_t				etag_len;
+	uint32_t				offset;		/* bytes of the image in flash */
+	mbedtls_sha256_context	hash;
+} sq_fota_checkpoint_t;
+
+/*
+ * Stage between the hash and the flash, saving a checkpoint every interval
+ * bytes that have been written.
+ */
+typedef struct {
+	sq_fota_sink_t			next;
+	sq_fota_hash_t			*hash;
+	sq_fota_checkpoint_t	ckpt;
+	uint32_t				interval;
+	uint32_t				saved;		/* offset of the last checkpoint */
+
+	/* Statistics */
+	uint32_t				saves;
+} sq_fota_resume_t;
+
+int sq_fota_manifest_parse(sq_fota_manifest_t *, const char *, size_t);
+void sq_fota_print_sha256(const uint8_t *, const char *);
+
+void sq_fota_hash_init(sq_fota_hash_t *, const sq_fota_sink_t *);
+int sq_fota_hash_write(void *, const uint8_t *, size_t);
+int sq_fota_hash_verify(sq_fota_hash_t *, const sq_fota_manifest_t *);
+
+void sq_fota_delta_init(sq_fota_delta_t *, const sq_fota_sink_t *, sq_fota_read_t, void *, const uint8_t *);
+int sq_fota_delta_write(void *, const uint8_t *, size_t);
+int sq_fota_delta_finish(sq_fota_delta_t *);
+
+void sq_fota_lz_init(sq_fota_lz_t *, const sq_fota_sink_t *);
+int sq_fota_lz_write(void *, const uint8_t *, size_t);
+int sq_fota_lz_finish(sq_fota_lz_t *);
+
+uint32_t sq_fota_resume_init(sq_fota_resume_t *, const sq_fota_sink_t *, sq_fota_hash_t *,
+							 uint32_t partition, const uint8_t *sha256, uint32_t block_size);
+void sq_fota_resume_set_etag(sq_fota_resume_t *, const uint8_t *, size_t);
+int sq_fota_resume_write(void *, const uint8_t *, size_t);
+int sq_fota_resume_save(sq_fota_resume_t *);
+
+int sq_fota_checkpoint_load(sq_fota_checkpoint_t *);
+int sq_fota_checkpoint_store(const sq_fota_checkpoint_t *);
+void sq_fota_checkpoint_clear(void);
+int sq_fota_manifest_etag_load(uint8_t *etag, size_t *len);
+void sq_fota_manifest_etag_store(const uint8_t *etag, size_t len);
+
+int sq_fota_writer_init(sq_fota_writer_t *, const sq_fota_sink_t *);
+void sq_fota_writer_set_idle(sq_fota_writer_t *, sq_fota_idle_t, void *);
+void sq_fota_writer_set_freed(sq_fota_writer_t *, sq_fota_freed_t, void *);
+int sq_fota_writer_write(void *, const uint8_t *, size_t);
+size_t sq_fota_writer_space(void *);
+int sq_fota_writer_finish(sq_fota_writer_t *);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef SQUIDWARD_FOTA_FLASH_H
+#define SQUIDWARD_FOTA_FLASH_H
+
+#include "esp_partition.h"
+
+#include "squidward/sq_fota.h"
+
+/*
+ * Writes the image to the update partition, erasing each sector when the
+ * write pointer gets to it, instead of esp_ota_begin erasing the whole
+ * partition up front. Writing can start at any offset, so that a transfer
+ * can be resumed without erasing what is already in flash. The image is
+ * validated by esp_ota_set_boot_partition.
+ *
+ * When the image size is known, sectors are also erased ahead of the write
+ * pointer while the writer task waits for data (sq_fota_flash_erase_ahead),
+ * so that the erase overlaps with the network instead of holding up writes.
+ */
+typedef struct {
+	const esp_partition_t	*part;
+	size_t					offset;		/* write pointer */
+	size_t					erased;		/* bytes erased from the start of the partition */
+	size_t					end;		/* erase ahead no further than this */
+	size_t					ahead;		/* bytes to keep erased ahead of offset */
+
+	/* Statistics */
+	uint32_t				sectors_erased;
+	uint32_t				sectors_ahead;	/* of those, erased while idle */
+	uint64_t				erase_us;		/* in erases holding up a write */
+	uint64_t				ahead_us;		/* in erases ahead */
+	uint64_t				write_us;
+} sq_fota_flash_t;
+
+int sq_fota_flash_begin(sq_fota_flash_t *, const esp_partition_t *, size_t offset);
+void sq_fota_flash_set_size(sq_fota_flash_t *, size_t);
+int sq_fota_flash_erase_ahead(void *);
+int sq_fota_flash_write(void *, const uint8_t *, size_t);
+
+#endif
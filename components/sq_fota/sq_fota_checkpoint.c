@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "nvs.h"
+
+#include "squidward/sq_fota.h"
+
+#define SQ_FOTA_NVS_NAMESPACE	"sq_fota"
+#define SQ_FOTA_NVS_CHECKPOINT	"checkpoint"
+#define SQ_FOTA_NVS_ETAG		"manifest_etag"
+
+/**
+ * @brief Read the checkpoint stored in NVS.
+ *
+ * @return SQ_FOTA_OK if there was one.
+ */
+int sq_fota_checkpoint_load(sq_fota_checkpoint_t *ckpt)
+{
+	nvs_handle handle;
+	size_t len = sizeof(*ckpt);
+	esp_err_t err;
+
+	if (nvs_open(SQ_FOTA_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	err = nvs_get_blob(handle, SQ_FOTA_NVS_CHECKPOINT, ckpt, &len);
+	nvs_close(handle);
+
+	return err == ESP_OK && len == sizeof(*ckpt) ? SQ_FOTA_OK : SQ_FOTA_ERR_FAIL;
+}
+
+/**
+ * @brief Store a checkpoint in NVS, replacing the previous one.
+ */
+int sq_fota_checkpoint_store(const sq_fota_checkpoint_t *ckpt)
+{
+	nvs_handle handle;
+	esp_err_t err;
+
+	if (nvs_open(SQ_FOTA_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	err = nvs_set_blob(handle, SQ_FOTA_NVS_CHECKPOINT, ckpt, sizeof(*ckpt));
+	if (err == ESP_OK) {
+		err = nvs_commit(handle);
+	}
+	nvs_close(handle);
+
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "Could not store the FOTA checkpoint (%s)", esp_err_to_name(err));
+		return SQ_FOTA_ERR_FAIL;
+	}
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Checkpoint at %u bytes", __FUNCTION__, ckpt->offset);
+#endif
+	return SQ_FOTA_OK;
+}
+
+/**
+ * @brief Forget the checkpoint, when the image is complete or another one is started.
+ */
+void sq_fota_checkpoint_clear(void)
+{
+	nvs_handle handle;
+
+	if (nvs_open(SQ_FOTA_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+		return;
+	}
+	if (nvs_erase_key(handle, SQ_FOTA_NVS_CHECKPOINT) == ESP_OK) {
+		nvs_commit(handle);
+	}
+	nvs_close(handle);
+}
+
+/**
+ * @brief Read the ETag of the last manifest that was found to be up to date.
+ *
+ * @param[out] etag	At least SQ_FOTA_ETAG_LEN bytes.
+ * @param[out] len	Length of the ETag.
+ * @return SQ_FOTA_OK if there was one.
+ */
+int sq_fota_manifest_etag_load(uint8_t *etag, size_t *len)
+{
+	nvs_handle handle;
+	esp_err_t err;
+
+	*len = SQ_FOTA_ETAG_LEN;
+	if (nvs_open(SQ_FOTA_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	err = nvs_get_blob(handle, SQ_FOTA_NVS_ETAG, etag, len);
+	nvs_close(handle);
+
+	return err == ESP_OK && *len > 0 ? SQ_FOTA_OK : SQ_FOTA_ERR_FAIL;
+}
+
+/**
+ * @brief Remember the ETag of a manifest for the image that is running.
+ *
+ * Only written when it differs from the stored one, the check runs on
+ * every update request.
+ */
+void sq_fota_manifest_etag_store(const uint8_t *etag, size_t len)
+{
+	uint8_t stored[SQ_FOTA_ETAG_LEN];
+	size_t stored_len;
+	nvs_handle handle;
+
+	if (len == 0 || len > SQ_FOTA_ETAG_LEN) {
+		return;
+	}
+	if (sq_fota_manifest_etag_load(stored, &stored_len) == SQ_FOTA_OK &&
+		stored_len == len && memcmp(stored, etag, len) == 0) {
+		return;
+	}
+	if (nvs_open(SQ_FOTA_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+		return;
+	}
+	if (nvs_set_blob(handle, SQ_FOTA_NVS_ETAG, etag, len) == ESP_OK) {
+		nvs_commit(handle);
+	}
+	nvs_close(handle);
+}
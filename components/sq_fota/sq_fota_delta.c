@@ -0,0 +1,255 @@
+#include <string.h>
+
+#include "squidward/sq_fota.h"
+
+/*
+ * Patch format, as written by tools/fota_delta.py:
+ *
+ *   "SQD1" | new size (u32 LE) | SHA-256 of source image | SHA-256 of new image
+ *
+ * followed by operations until the new image is complete, each an opcode
+ * byte and LEB128 encoded arguments:
+ *
+ *   COPY   off len			copy len bytes from the source at off
+ *   ADD    off len data	source bytes at off plus len bytes of data (mod 256)
+ *   INSERT len data		len new bytes
+ */
+#define DELTA_MAGIC			"SQD1"
+#define DELTA_MAGIC_LEN		4
+
+#define DELTA_OP_COPY		0x01
+#define DELTA_OP_ADD		0x02
+#define DELTA_OP_INSERT		0x03
+
+#define STATE_HEADER		(0)
+#define STATE_OP			(1)
+#define STATE_ARGS			(2)
+#define STATE_ADD			(3)
+#define STATE_INSERT		(4)
+#define STATE_DONE			(5)
+#define STATE_PASS			(6)
+#define STATE_ERR			(7)
+
+static int delta_fail(sq_fota_delta_t *delta, const char *msg)
+{
+	ESP_LOGE(TAG, "Delta update: %s", msg);
+	delta->state = STATE_ERR;
+	return -1;
+}
+
+static int delta_output(sq_fota_delta_t *delta, const uint8_t *data, size_t len)
+{
+	if (delta->out + len > delta->new_size) {
+		return delta_fail(delta, "patch gives a larger image than announced");
+	}
+	if (delta->next.write(delta->next.arg, data, len) != 0) {
+		delta->state = STATE_ERR;
+		return -1;
+	}
+	delta->out += len;
+	if (delta->out == delta->new_size) {
+		delta->state = STATE_DONE;
+	}
+	return 0;
+}
+
+static int delta_header(sq_fota_delta_t *delta)
+{
+	const uint8_t *hdr = delta->hdr;
+
+	delta->new_size = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((uint32_t)hdr[7] << 24);
+	if (memcmp(hdr + 8, delta->source_sha256, SQ_FOTA_HASH_LEN) != 0) {
+		sq_fota_print_sha256(hdr + 8, "Patch source");
+		sq_fota_print_sha256(delta->source_sha256, "Running image");
+		return delta_fail(delta, "patch is not for the running image");
+	}
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Patch for a %u byte image", __FUNCTION__, delta->new_size);
+#endif
+	delta->state = delta->new_size ? STATE_OP : STATE_DONE;
+	return 0;
+}
+
+/* Copy from the source image, in chunks of the work buffer */
+static int delta_copy(sq_fota_delta_t *delta, uint32_t off, uint32_t len)
+{
+	while (len > 0) {
+		size_t n = len < sizeof(delta->buf) ? len : sizeof(delta->buf);
+
+		if (delta->read(delta->read_arg, off, delta->buf, n) != 0) {
+			return delta_fail(delta, "could not read the source image");
+		}
+		if (delta_output(delta, delta->buf, n) != 0) {
+			return -1;
+		}
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* All arguments of the current operation have been read */
+static int delta_op(sq_fota_delta_t *delta)
+{
+	switch (delta->op) {
+	case DELTA_OP_COPY:
+		delta->state = STATE_OP;
+		delta->copied += delta->arg[1];
+		return delta_copy(delta, delta->arg[0], delta->arg[1]);
+	case DELTA_OP_ADD:
+		delta->off = delta->arg[0];
+		delta->len = delta->arg[1];
+		delta->state = delta->len ? STATE_ADD : STATE_OP;
+		return 0;
+	case DELTA_OP_INSERT:
+		delta->len = delta->arg[0];
+		delta->state = delta->len ? STATE_INSERT : STATE_OP;
+		return 0;
+	}
+	return delta_fail(delta, "unknown operation");
+}
+
+/**
+ * @brief Set up the patch stage.
+ *
+ * Data that does not start with the patch magic is passed on unchanged, so
+ * the stage can stay in place for full images.
+ * @param[out] delta			The patch stage.
+ * @param[in] next				Where the new image goes.
+ * @param[in] read				Reads the source (running) image.
+ * @param[in] read_arg			Passed to read.
+ * @param[in] source_sha256		SHA-256 of the source image, to check the patch against.
+ */
+void sq_fota_delta_init(sq_fota_delta_t *delta, const sq_fota_sink_t *next,
+						sq_fota_read_t read, void *read_arg, const uint8_t *source_sha256)
+{
+	memset(delta, 0, sizeof(*delta));
+	delta->next = *next;
+	delta->read = read;
+	delta->read_arg = read_arg;
+	memcpy(delta->source_sha256, source_sha256, SQ_FOTA_HASH_LEN);
+	delta->state = STATE_HEADER;
+}
+
+/**
+ * @brief Apply the next part of the patch, as a sink.
+ */
+int sq_fota_delta_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_delta_t *delta = (sq_fota_delta_t *) arg;
+	size_t n;
+
+	delta->patch_bytes += len;
+
+	while (len > 0) {
+		switch (delta->state) {
+		case STATE_HEADER:
+			delta->hdr[delta->hdr_len++] = *data++;
+			len--;
+			if (delta->hdr_len == DELTA_MAGIC_LEN &&
+				memcmp(delta->hdr, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0) {
+				/* A full image, pass everything on */
+				delta->state = STATE_PASS;
+				delta->new_size = 0xffffffff;
+				if (delta_output(delta, delta->hdr, delta->hdr_len) != 0) {
+					return -1;
+				}
+			} else if (delta->hdr_len == SQ_FOTA_DELTA_HDR_LEN && delta_header(delta) != 0) {
+				return -1;
+			}
+			break;
+		case STATE_OP:
+			delta->op = *data++;
+			len--;
+			delta->nargs = delta->op == DELTA_OP_INSERT ? 1 : 2;
+			delta->arg_idx = 0;
+			delta->arg[0] = 0;
+			delta->shift = 0;
+			delta->state = STATE_ARGS;
+			break;
+		case STATE_ARGS:
+			if (delta->shift > 28) {
+				return delta_fail(delta, "bad argument");
+			}
+			delta->arg[delta->arg_idx] |= (uint32_t)(*data & 0x7f) << delta->shift;
+			delta->shift += 7;
+			if (!(*data & 0x80)) {
+				delta->arg_idx++;
+				delta->shift = 0;
+				if (delta->arg_idx == delta->nargs) {
+					if (delta_op(delta) != 0) {
+						return -1;
+					}
+				} else {
+					delta->arg[delta->arg_idx] = 0;
+				}
+			}
+			data++;
+			len--;
+			break;
+		case STATE_ADD:
+			n = len < delta->len ? len : delta->len;
+			if (n > sizeof(delta->buf)) {
+				n = sizeof(delta->buf);
+			}
+			if (delta->read(delta->read_arg, delta->off, delta->buf, n) != 0) {
+				return delta_fail(delta, "could not read the source image");
+			}
+			for (size_t i = 0; i < n; i++) {
+				delta->buf[i] += data[i];
+			}
+			delta->state = (delta->len == n) ? STATE_OP : STATE_ADD;
+			if (delta_output(delta, delta->buf, n) != 0) {
+				return -1;
+			}
+			delta->off += n;
+			delta->len -= n;
+			delta->added += n;
+			data += n;
+			len -= n;
+			break;
+		case STATE_INSERT:
+			n = len < delta->len ? len : delta->len;
+			delta->state = (delta->len == n) ? STATE_OP : STATE_INSERT;
+			if (delta_output(delta, data, n) != 0) {
+				return -1;
+			}
+			delta->len -= n;
+			delta->inserted += n;
+			data += n;
+			len -= n;
+			break;
+		case STATE_PASS:
+			return delta_output(delta, data, len);
+		case STATE_DONE:
+			return delta_fail(delta, "data after the end of the patch");
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Check that the whole new image has been produced.
+ *
+ * @return SQ_FOTA_OK when the patch was complete or a full image was passed on.
+ */
+int sq_fota_delta_finish(sq_fota_delta_t *delta)
+{
+	if (delta->state == STATE_PASS) {
+		return SQ_FOTA_OK;
+	}
+	if (delta->state != STATE_DONE) {
+		ESP_LOGE(TAG, "Delta update: patch ended after %u of %u bytes", delta->out, delta->new_size);
+		return SQ_FOTA_ERR_FAIL;
+	}
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - %u byte patch gave %u bytes: %u copied, %u added, %u inserted", __FUNCTION__,
+			 delta->patch_bytes, delta->out, delta->copied, delta->added, delta->inserted);
+#endif
+	return SQ_FOTA_OK;
+}
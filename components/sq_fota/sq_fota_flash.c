@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "esp_image_format.h"
+#include "esp_timer.h"
+
+#include "squidward/sq_fota_flash.h"
+
+/**
+ * @brief Start writing the image at offset.
+ *
+ * @param[out] flash	The flash writer.
+ * @param[in] part		The update partition.
+ * @param[in] offset	Where to continue, 0 for a new image. Everything
+ *						before it is kept, as is the rest of its sector.
+ */
+int sq_fota_flash_begin(sq_fota_flash_t *flash, const esp_partition_t *part, size_t offset)
+{
+	memset(flash, 0, sizeof(*flash));
+	if (part == NULL || offset > part->size) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	flash->part = part;
+	flash->offset = offset;
+	flash->erased = (offset + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1);
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Writing partition at 0x%x from offset %u", __FUNCTION__,
+			 part->address, (unsigned int)offset);
+#endif
+	return SQ_FOTA_OK;
+}
+
+/**
+ * @brief Give the size of the image, from the manifest, to erase ahead up to.
+ *
+ * Without it nothing is erased ahead, erasing past the end of the image
+ * would only cost time and flash wear.
+ */
+void sq_fota_flash_set_size(sq_fota_flash_t *flash, size_t size)
+{
+	size = (size + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1);
+	flash->end = size < flash->part->size ? size : flash->part->size;
+	flash->ahead = SQ_FOTA_ERASE_AHEAD;
+}
+
+/**
+ * @brief Erase the next sector ahead of the write pointer, if there is one
+ * to erase. Usable as idle work of the writer task.
+ *
+ * @return 1 if a sector was erased, 0 if far enough ahead.
+ */
+int sq_fota_flash_erase_ahead(void *arg)
+{
+	sq_fota_flash_t *flash = (sq_fota_flash_t *) arg;
+	size_t limit = flash->offset + flash->ahead;
+	int64_t start;
+	esp_err_t err;
+
+	if (limit > flash->end) {
+		limit = flash->end;
+	}
+	if (flash->erased >= limit) {
+		return 0;
+	}
+
+	start = esp_timer_get_time();
+	err = esp_partition_erase_range(flash->part, flash->erased, SQ_FOTA_SECTOR_SIZE);
+	if (err != ESP_OK) {
+		/* Tried again, and reported, when the write gets there */
+		flash->end = flash->erased;
+		return 0;
+	}
+	flash->erased += SQ_FOTA_SECTOR_SIZE;
+	flash->sectors_erased++;
+	flash->sectors_ahead++;
+	flash->ahead_us += esp_timer_get_time() - start;
+
+	return 1;
+}
+
+/**
+ * @brief Append to the image, like esp_ota_write. Usable as a sink.
+ */
+int sq_fota_flash_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_flash_t *flash = (sq_fota_flash_t *) arg;
+	int64_t start;
+	esp_err_t err;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (flash->offset + len > flash->part->size) {
+		ESP_LOGE(TAG, "Image larger than the partition (%u bytes)", flash->part->size);
+		return -1;
+	}
+	if (flash->offset == 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+		ESP_LOGE(TAG, "Image does not start with the image header magic");
+		return -1;
+	}
+
+	start = esp_timer_get_time();
+	while (flash->erased < flash->offset + len) {
+		err = esp_partition_erase_range(flash->part, flash->erased, SQ_FOTA_SECTOR_SIZE);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG, "Erase at 0x%x failed (%s)", flash->erased, esp_err_to_name(err));
+			return -1;
+		}
+		flash->erased += SQ_FOTA_SECTOR_SIZE;
+		flash->sectors_erased++;
+	}
+	flash->erase_us += esp_timer_get_time() - start;
+
+	start = esp_timer_get_time();
+	err = esp_partition_write(flash->part, flash->offset, data, len);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "Write at 0x%x failed (%s)", flash->offset, esp_err_to_name(err));
+		return -1;
+	}
+	flash->offset += len;
+	flash->write_us += esp_timer_get_time() - start;
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "squidward/sq_fota.h"
+
+/**
+ * @brief Start hashing the image.
+ *
+ * @param[out] hash	The hash stage.
+ * @param[in] next	Where the data goes after it has been hashed.
+ */
+void sq_fota_hash_init(sq_fota_hash_t *hash, const sq_fota_sink_t *next)
+{
+	memset(hash, 0, sizeof(*hash));
+	hash->next = *next;
+	mbedtls_sha256_init(&hash->ctx);
+	mbedtls_sha256_starts_ret(&hash->ctx, 0);
+}
+
+/**
+ * @brief Hash the data and pass it on, as a sink.
+ */
+int sq_fota_hash_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_hash_t *hash = (sq_fota_hash_t *) arg;
+
+	if (mbedtls_sha256_update_ret(&hash->ctx, data, len) != 0) {
+		return -1;
+	}
+	hash->len += len;
+
+	return hash->next.write(hash->next.arg, data, len);
+}
+
+/**
+ * @brief Compare the size and digest of what has been written with the manifest.
+ *
+ * Must be called when all data has passed, i.e. after the flash writer has
+ * finished.
+ * @return SQ_FOTA_OK if the image matches, SQ_FOTA_ERR_VERIFY otherwise.
+ */
+int sq_fota_hash_verify(sq_fota_hash_t *hash, const sq_fota_manifest_t *manifest)
+{
+	int res = SQ_FOTA_OK;
+
+	mbedtls_sha256_finish_ret(&hash->ctx, hash->digest);
+	mbedtls_sha256_free(&hash->ctx);
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	sq_fota_print_sha256(hash->digest, "SHA-256 of received image");
+#endif
+
+	if (!manifest->has_sha256) {
+		ESP_LOGE(TAG, "No SHA-256 in the manifest, can not verify the image");
+		return SQ_FOTA_ERR_VERIFY;
+	}
+	if (manifest->size && hash->len != manifest->size) {
+		ESP_LOGE(TAG, "Image size %u, expected %u", hash->len, manifest->size);
+		res = SQ_FOTA_ERR_VERIFY;
+	}
+	if (memcmp(hash->digest, manifest->sha256, SQ_FOTA_HASH_LEN) != 0) {
+		ESP_LOGE(TAG, "Image SHA-256 does not match the manifest");
+		sq_fota_print_sha256(manifest->sha256, "Expected");
+		res = SQ_FOTA_ERR_VERIFY;
+	}
+
+	return res;
+}
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "squidward/sq_fota.h"
+
+/*
+ * Compressed image, as written by tools/fota_compress.py:
+ *
+ *   "SQZ1" | window bits | lookahead bits | image size (u32 LE)
+ *
+ * followed by a heatshrink stream with those parameters: MSB first, a 1 bit
+ * and 8 bits for a literal, a 0 bit, window bits of (offset - 1) and
+ * lookahead bits of (length - 1) for a back reference. The last byte is
+ * padded with 0 bits.
+ */
+#define LZ_MAGIC			"SQZ1"
+#define LZ_MAGIC_LEN		4
+
+#define STATE_HEADER		(0)
+#define STATE_TAG			(1)
+#define STATE_LITERAL		(2)
+#define STATE_INDEX			(3)
+#define STATE_COUNT			(4)
+#define STATE_PASS			(5)
+#define STATE_ERR			(6)
+
+static int lz_fail(sq_fota_lz_t *lz, const char *msg)
+{
+	ESP_LOGE(TAG, "Compressed image: %s", msg);
+	lz->state = STATE_ERR;
+	return -1;
+}
+
+static int lz_flush(sq_fota_lz_t *lz)
+{
+	if (lz->buf_len == 0) {
+		return 0;
+	}
+	if (lz->next.write(lz->next.arg, lz->buf, lz->buf_len) != 0) {
+		lz->state = STATE_ERR;
+		return -1;
+	}
+	lz->buf_len = 0;
+	return 0;
+}
+
+static int lz_put(sq_fota_lz_t *lz, uint8_t c)
+{
+	if (lz->out == lz->size) {
+		return lz_fail(lz, "larger than announced");
+	}
+	lz->window[lz->head++ & lz->mask] = c;
+	lz->buf[lz->buf_len++] = c;
+	lz->out++;
+	return lz->buf_len == sizeof(lz->buf) ? lz_flush(lz) : 0;
+}
+
+static int lz_header(sq_fota_lz_t *lz)
+{
+	const uint8_t *hdr = lz->hdr;
+
+	lz->window_bits = hdr[4];
+	lz->lookahead_bits = hdr[5];
+	lz->size = hdr[6] | (hdr[7] << 8) | (hdr[8] << 16) | ((uint32_t)hdr[9] << 24);
+	if (lz->window_bits < 4 || lz->window_bits > SQ_FOTA_LZ_WINDOW_BITS ||
+		lz->lookahead_bits < 3 || lz->lookahead_bits >= lz->window_bits) {
+		ESP_LOGE(TAG, "Compressed image: window %u bits, lookahead %u bits, at most %u bits supported",
+				 lz->window_bits, lz->lookahead_bits, SQ_FOTA_LZ_WINDOW_BITS);
+		lz->state = STATE_ERR;
+		return -1;
+	}
+	lz->mask = (1 << lz->window_bits) - 1;
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Compressed %u byte image, window %u bits", __FUNCTION__,
+			 lz->size, lz->window_bits);
+#endif
+	lz->state = STATE_TAG;
+	return 0;
+}
+
+/**
+ * @brief Set up the decompression stage.
+ *
+ * Data that does not start with the compressed image magic is passed on
+ * unchanged, so the stage can stay in place for uncompressed images.
+ * @param[out] lz	The decompression stage.
+ * @param[in] next	Where the decompressed data goes.
+ */
+void sq_fota_lz_init(sq_fota_lz_t *lz, const sq_fota_sink_t *next)
+{
+	memset(lz, 0, sizeof(*lz));
+	lz->next = *next;
+	lz->state = STATE_HEADER;
+}
+
+/**
+ * @brief Decompress the next part of the image, as a sink.
+ */
+int sq_fota_lz_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_lz_t *lz = (sq_fota_lz_t *) arg;
+	unsigned int need;
+	uint32_t val;
+
+	lz->in_bytes += len;
+
+	while (lz->state == STATE_HEADER && len > 0) {
+		lz->hdr[lz->hdr_len++] = *data++;
+		len--;
+		if (lz->hdr_len == LZ_MAGIC_LEN && memcmp(lz->hdr, LZ_MAGIC, LZ_MAGIC_LEN) != 0) {
+			/* Not compressed, pass everything on */
+			lz->state = STATE_PASS;
+			if (lz->next.write(lz->next.arg, lz->hdr, lz->hdr_len) != 0) {
+				lz->state = STATE_ERR;
+				return -1;
+			}
+		} else if (lz->hdr_len == SQ_FOTA_LZ_HDR_LEN && lz_header(lz) != 0) {
+			return -1;
+		}
+	}
+	if (lz->state == STATE_PASS) {
+		lz->out += len;
+		return len ? lz->next.write(lz->next.arg, data, len) : 0;
+	}
+
+	while (lz->state != STATE_ERR) {
+		switch (lz->state) {
+		case STATE_TAG:
+			need = 1;
+			break;
+		case STATE_LITERAL:
+			need = 8;
+			break;
+		case STATE_INDEX:
+			need = lz->window_bits;
+			break;
+		case STATE_COUNT:
+			need = lz->lookahead_bits;
+			break;
+		default:
+			return -1;
+		}
+
+		while (lz->nbits < need && len > 0) {
+			lz->bits = (lz->bits << 8) | *data++;
+			lz->nbits += 8;
+			len--;
+		}
+		if (lz->nbits < need) {
+			break;
+		}
+		lz->nbits -= need;
+		val = (lz->bits >> lz->nbits) & ((1 << need) - 1);
+
+		switch (lz->state) {
+		case STATE_TAG:
+			lz->state = val ? STATE_LITERAL : STATE_INDEX;
+			break;
+		case STATE_LITERAL:
+			lz->state = STATE_TAG;
+			if (lz_put(lz, val) != 0) {
+				return -1;
+			}
+			break;
+		case STATE_INDEX:
+			lz->index = val + 1;
+			lz->state = STATE_COUNT;
+			break;
+		case STATE_COUNT:
+			lz->state = STATE_TAG;
+			for (val++; val > 0; val--) {
+				if (lz_put(lz, lz->window[(lz->head - lz->index) & lz->mask]) != 0) {
+					return -1;
+				}
+			}
+			break;
+		}
+	}
+
+	/* Pass on what this part gave, the next stage may be waiting for it */
+	return lz->state == STATE_ERR ? -1 : lz_flush(lz);
+}
+
+/**
+ * @brief Check that the whole image has been decompressed.
+ *
+ * @return SQ_FOTA_OK when the image was complete or passed on uncompressed.
+ */
+int sq_fota_lz_finish(sq_fota_lz_t *lz)
+{
+	if (lz->state == STATE_PASS) {
+		return SQ_FOTA_OK;
+	}
+	if (lz->state == STATE_HEADER || lz->state == STATE_ERR || lz->out != lz->size) {
+		ESP_LOGE(TAG, "Compressed image: ended after %u of %u bytes", lz->out, lz->size);
+		return SQ_FOTA_ERR_FAIL;
+	}
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - %u compressed bytes gave %u bytes", __FUNCTION__, lz->in_bytes, lz->out);
+#endif
+	return SQ_FOTA_OK;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "squidward/sq_fota.h"
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static int parse_sha256(uint8_t *digest, const char *val, size_t len)
+{
+	int i;
+
+	if (len != SQ_FOTA_HASH_LEN * 2) {
+		return -1;
+	}
+	for (i = 0; i < SQ_FOTA_HASH_LEN; i++) {
+		int hi = hex_nibble(val[i * 2]);
+		int lo = hex_nibble(val[i * 2 + 1]);
+		if (hi < 0 || lo < 0) {
+			return -1;
+		}
+		digest[i] = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+static uint32_t parse_uint(const char *val, size_t len)
+{
+	char num[12];
+
+	if (len >= sizeof(num)) {
+		len = sizeof(num) - 1;
+	}
+	memcpy(num, val, len);
+	num[len] = '\0';
+	return strtoul(num, NULL, 10);
+}
+
+/**
+ * @brief Parse a manifest, see sq_fota_manifest_t for the format.
+ *
+ * Unknown keys are skipped, so that new ones can be added on the server.
+ * @return SQ_FOTA_OK if at least the size or digest was found.
+ */
+int sq_fota_manifest_parse(sq_fota_manifest_t *manifest, const char *text, size_t len)
+{
+	const char *end = text + len;
+
+	memset(manifest, 0, sizeof(*manifest));
+
+	while (text < end) {
+		const char *eol = memchr(text, '\n', end - text);
+		const char *eq;
+		size_t line_len;
+
+		if (eol == NULL) {
+			eol = end;
+		}
+		line_len = eol - text;
+		if (line_len > 0 && text[line_len - 1] == '\r') {
+			line_len--;
+		}
+
+		eq = memchr(text, '=', line_len);
+		if (eq != NULL) {
+			size_t key_len = eq - text;
+			const char *val = eq + 1;
+			size_t val_len = line_len - key_len - 1;
+
+			if (key_len == 7 && memcmp(text, "version", 7) == 0) {
+				if (val_len >= SQ_FOTA_VERSION_LEN) {
+					val_len = SQ_FOTA_VERSION_LEN - 1;
+				}
+				memcpy(manifest->version, val, val_len);
+				manifest->version[val_len] = '\0';
+			} else if (key_len == 4 && memcmp(text, "size", 4) == 0) {
+				manifest->size = parse_uint(val, val_len);
+			} else if (key_len == 6 && memcmp(text, "sha256", 6) == 0) {
+				if (parse_sha256(manifest->sha256, val, val_len) != 0) {
+					ESP_LOGE(TAG, "Bad SHA-256 in manifest");
+					return SQ_FOTA_ERR_FAIL;
+				}
+				manifest->has_sha256 = 1;
+			} else if (key_len == 5 && memcmp(text, "block", 5) == 0) {
+				manifest->block_size = parse_uint(val, val_len);
+			} else if (key_len == 8 && memcmp(text, "image_id", 8) == 0) {
+				if (parse_sha256(manifest->image_id, val, val_len) != 0) {
+					ESP_LOGE(TAG, "Bad image ID in manifest");
+					return SQ_FOTA_ERR_FAIL;
+				}
+				manifest->has_image_id = 1;
+			} else if (key_len == 12 && memcmp(text, "delta_source", 12) == 0) {
+				if (parse_sha256(manifest->delta_source, val, val_len) != 0) {
+					ESP_LOGE(TAG, "Bad delta source in manifest");
+					return SQ_FOTA_ERR_FAIL;
+				}
+				manifest->has_delta = 1;
+			} else if (key_len == 8 && memcmp(text, "encoding", 8) == 0) {
+				manifest->compressed = val_len == 10 && memcmp(val, "heatshrink", 10) == 0;
+			}
+		}
+
+		text = eol + 1;
+	}
+
+	if (!manifest->size && !manifest->has_sha256) {
+		ESP_LOGE(TAG, "Manifest without size and SHA-256");
+		return SQ_FOTA_ERR_FAIL;
+	}
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Manifest: version %s, %u bytes, block size %u", __FUNCTION__,
+			 manifest->version, manifest->size, manifest->block_size);
+#endif
+	return SQ_FOTA_OK;
+}
+
+void sq_fota_print_sha256(const uint8_t *image_hash, const char *label)
+{
+	char hash_print[SQ_FOTA_HASH_LEN * 2 + 1];
+	hash_print[SQ_FOTA_HASH_LEN * 2] = 0;
+	for (int i = 0; i < SQ_FOTA_HASH_LEN; ++i) {
+		sprintf(&hash_print[i * 2], "%02x", image_hash[i]);
+	}
+	ESP_LOGI(TAG, "%s: %s", label, hash_print);
+}
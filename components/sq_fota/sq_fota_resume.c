@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include "squidward/sq_fota.h"
+
+/**
+ * @brief Set up the checkpoint stage, and find out where to resume.
+ *
+ * A stored checkpoint is used if it is for the same image and partition,
+ * the hash stage then continues from the digest state in it.
+ * @param[out] res			The checkpoint stage.
+ * @param[in] next			Where the data goes, the flash.
+ * @param[in] hash			The hash stage in front of this one, initialised.
+ * @param[in] partition		Address of the update partition.
+ * @param[in] sha256		SHA-256 of the image, from the manifest.
+ * @param[in] block_size	Checkpoints are only used at a multiple of it.
+ * @return The offset in the image to resume from, 0 to start over.
+ */
+uint32_t sq_fota_resume_init(sq_fota_resume_t *res, const sq_fota_sink_t *next, sq_fota_hash_t *hash,
+							 uint32_t partition, const uint8_t *sha256, uint32_t block_size)
+{
+	sq_fota_checkpoint_t *ckpt = &res->ckpt;
+
+	memset(res, 0, sizeof(*res));
+	res->next = *next;
+	res->hash = hash;
+	res->interval = SQ_FOTA_CHECKPOINT_INTERVAL;
+
+	if (sq_fota_checkpoint_load(ckpt) == SQ_FOTA_OK &&
+		ckpt->version == SQ_FOTA_CHECKPOINT_VERSION &&
+		ckpt->partition == partition &&
+		memcmp(ckpt->sha256, sha256, SQ_FOTA_HASH_LEN) == 0 &&
+		ckpt->etag_len <= SQ_FOTA_ETAG_LEN &&
+		block_size > 0 && ckpt->offset % block_size == 0) {
+		memcpy(&hash->ctx, &ckpt->hash, sizeof(hash->ctx));
+		hash->len = ckpt->offset;
+		res->saved = ckpt->offset;
+#ifdef CONFIG_SQ_FOTA_DBG
+		ESP_LOGI(TAG, "[%s] - Resuming at %u bytes", __FUNCTION__, ckpt->offset);
+#endif
+		return ckpt->offset;
+	}
+
+	/* Nothing to resume, or for another image */
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->version = SQ_FOTA_CHECKPOINT_VERSION;
+	ckpt->partition = partition;
+	memcpy(ckpt->sha256, sha256, SQ_FOTA_HASH_LEN);
+	sq_fota_checkpoint_clear();
+	return 0;
+}
+
+/**
+ * @brief Remember the ETag of the image, checked when resuming.
+ */
+void sq_fota_resume_set_etag(sq_fota_resume_t *res, const uint8_t *etag, size_t len)
+{
+	if (len > SQ_FOTA_ETAG_LEN) {
+		len = SQ_FOTA_ETAG_LEN;
+	}
+	memcpy(res->ckpt.etag, etag, len);
+	res->ckpt.etag_len = len;
+}
+
+/**
+ * @brief Pass the data on, and save a checkpoint when due. Usable as a sink.
+ */
+int sq_fota_resume_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_resume_t *res = (sq_fota_resume_t *) arg;
+
+	if (res->next.write(res->next.arg, data, len) != 0) {
+		return -1;
+	}
+	res->ckpt.offset += len;
+
+	/* Losing a checkpoint only costs a longer download, never fail on it */
+	if (res->interval && res->ckpt.offset - res->saved >= res->interval) {
+		sq_fota_resume_save(res);
+	}
+	return 0;
+}
+
+/**
+ * @brief Save a checkpoint of what has been written.
+ *
+ * Called by the stage itself, and when the transfer has stopped after the
+ * flash writer has finished.
+ */
+int sq_fota_resume_save(sq_fota_resume_t *res)
+{
+	/* The hash state may be in the SHA accelerator, cloning gets it out */
+	mbedtls_sha256_init(&res->ckpt.hash);
+	mbedtls_sha256_clone(&res->ckpt.hash, &res->hash->ctx);
+
+	if (sq_fota_checkpoint_store(&res->ckpt) != SQ_FOTA_OK) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	res->saved = res->ckpt.offset;
+	res->saves++;
+	return SQ_FOTA_OK;
+}
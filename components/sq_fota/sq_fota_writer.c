@@ -0,0 +1,223 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "squidward/sq_fota.h"
+#include "squidward/sq_uart.h"
+
+/* Sent on the full queue to stop the writer task, or to wake it up */
+#define WRITER_STOP		(-1)
+#define WRITER_WAKE		(-2)
+
+static void sq_fota_writer_task(void *p)
+{
+	sq_fota_writer_t *w = (sq_fota_writer_t *) p;
+	int idx;
+
+	sq_uart_prof_add(NULL);
+	while (1) {
+		if (xQueueReceive(w->full_q, &idx, 0) != pdTRUE) {
+			/* Nothing to write, do the idle work while waiting for the network */
+			if (w->idle && !w->err && w->idle(w->idle_arg)) {
+				w->idle_runs++;
+				continue;
+			}
+			xQueueReceive(w->full_q, &idx, portMAX_DELAY);
+		}
+		if (idx == WRITER_STOP) {
+			break;
+		}
+		if (idx == WRITER_WAKE) {
+			continue;
+		}
+
+		/* After an error, just hand the buffers back so the network side never blocks */
+		if (!w->err && w->sink.write(w->sink.arg, w->buf[idx], w->len[idx]) != 0) {
+			ESP_LOGE(TAG, "Flash write of %d bytes failed", (int)w->len[idx]);
+			w->err = 1;
+		}
+		w->len[idx] = 0;
+		xQueueSend(w->free_q, &idx, portMAX_DELAY);
+		if (w->freed) {
+			w->freed(w->freed_arg);
+		}
+	}
+
+	sq_uart_prof_remove(NULL);
+	xSemaphoreGive(w->done);
+	vTaskDelete(NULL);
+}
+
+/**
+ * @brief Set up the buffers and start the flash writer task.
+ *
+ * @param[out] w	The writer.
+ * @param[in] sink	Where the writer task writes the data, e.g. esp_ota_write.
+ */
+int sq_fota_writer_init(sq_fota_writer_t *w, const sq_fota_sink_t *sink)
+{
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	w->sink = *sink;
+	w->fill = -1;
+
+	w->free_q = xQueueCreate(SQ_FOTA_WRITER_BUFFERS, sizeof(int));
+	w->full_q = xQueueCreate(SQ_FOTA_WRITER_BUFFERS + 1, sizeof(int));
+	w->done = xSemaphoreCreateBinary();
+	if (!w->free_q || !w->full_q || !w->done) {
+		ESP_LOGE(TAG, "Could not create the flash writer queues");
+		goto fail;
+	}
+
+	for (i = 0; i < SQ_FOTA_WRITER_BUFFERS; i++) {
+		w->buf[i] = malloc(SQ_FOTA_SECTOR_SIZE);
+		if (w->buf[i] == NULL) {
+			ESP_LOGE(TAG, "Could not allocate flash writer buffer");
+			goto fail;
+		}
+		xQueueSend(w->free_q, &i, 0);
+	}
+
+	if (xTaskCreate(sq_fota_writer_task, "sq_fota_writer", SQ_FOTA_WRITER_STACK, w,
+					SQ_FOTA_WRITER_PRIO, NULL) != pdPASS) {
+		ESP_LOGE(TAG, "Could not start the flash writer task");
+		goto fail;
+	}
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Flash writer started, %d x %d bytes", __FUNCTION__,
+			 SQ_FOTA_WRITER_BUFFERS, SQ_FOTA_SECTOR_SIZE);
+#endif
+	return SQ_FOTA_OK;
+
+fail:
+	for (i = 0; i < SQ_FOTA_WRITER_BUFFERS; i++) {
+		free(w->buf[i]);
+		w->buf[i] = NULL;
+	}
+	if (w->free_q) vQueueDelete(w->free_q);
+	if (w->full_q) vQueueDelete(w->full_q);
+	if (w->done) vSemaphoreDelete(w->done);
+	return SQ_FOTA_ERR_FAIL;
+}
+
+/**
+ * @brief Give the writer task something to do while it waits for data.
+ *
+ * The idle work runs in the writer task, so it may use the sink without
+ * locking, e.g. sq_fota_flash_erase_ahead.
+ */
+void sq_fota_writer_set_idle(sq_fota_writer_t *w, sq_fota_idle_t idle, void *arg)
+{
+	int wake = WRITER_WAKE;
+
+	w->idle_arg = arg;
+	w->idle = idle;
+	/* Start on it now, not when the first data arrives */
+	xQueueSend(w->full_q, &wake, portMAX_DELAY);
+}
+
+/**
+ * @brief Be told when the writer task has made room for more data.
+ *
+ * To be set before the first sq_fota_writer_write. The callback runs in
+ * the writer task.
+ */
+void sq_fota_writer_set_freed(sq_fota_writer_t *w, sq_fota_freed_t freed, void *arg)
+{
+	w->freed_arg = arg;
+	w->freed = freed;
+}
+
+/**
+ * @brief Queue data for the flash, as a sink for the network side.
+ *
+ * Only blocks when all buffers are waiting to be written, use
+ * sq_fota_writer_space to hold back before that happens.
+ * @return 0 on success, -1 if the flash writer has failed.
+ */
+int sq_fota_writer_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_writer_t *w = (sq_fota_writer_t *) arg;
+	size_t n;
+
+	while (len > 0 && !w->err) {
+		if (w->fill < 0) {
+			if (xQueueReceive(w->free_q, &w->fill, 0) != pdTRUE) {
+				w->stalls++;
+				xQueueReceive(w->free_q, &w->fill, portMAX_DELAY);
+			}
+		}
+
+		n = SQ_FOTA_SECTOR_SIZE - w->len[w->fill];
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->buf[w->fill] + w->len[w->fill], data, n);
+		w->len[w->fill] += n;
+		w->written += n;
+		data += n;
+		len -= n;
+
+		if (w->len[w->fill] == SQ_FOTA_SECTOR_SIZE) {
+			xQueueSend(w->full_q, &w->fill, portMAX_DELAY);
+			w->fill = -1;
+		}
+	}
+
+	return w->err ? -1 : 0;
+}
+
+/**
+ * @brief Number of bytes that sq_fota_writer_write takes without blocking.
+ *
+ * This is the back-pressure towards the network, e.g. to hold back block
+ * requests while the flash is busy.
+ */
+size_t sq_fota_writer_space(void *arg)
+{
+	sq_fota_writer_t *w = (sq_fota_writer_t *) arg;
+	size_t space = uxQueueMessagesWaiting(w->free_q) * SQ_FOTA_SECTOR_SIZE;
+
+	if (w->fill >= 0) {
+		space += SQ_FOTA_SECTOR_SIZE - w->len[w->fill];
+	}
+	return space;
+}
+
+/**
+ * @brief Write what is left in the buffers, stop the task and free the writer.
+ *
+ * @return SQ_FOTA_OK if all data was written.
+ */
+int sq_fota_writer_finish(sq_fota_writer_t *w)
+{
+	int stop = WRITER_STOP;
+	int i;
+
+	if (w->fill >= 0) {
+		if (w->len[w->fill] > 0) {
+			xQueueSend(w->full_q, &w->fill, portMAX_DELAY);
+		} else {
+			xQueueSend(w->free_q, &w->fill, portMAX_DELAY);
+		}
+		w->fill = -1;
+	}
+	xQueueSend(w->full_q, &stop, portMAX_DELAY);
+	xSemaphoreTake(w->done, portMAX_DELAY);
+
+#ifdef CONFIG_SQ_FOTA_DBG
+	ESP_LOGI(TAG, "[%s] - Flash writer done, %u bytes, %u stalls, %u idle runs", __FUNCTION__,
+			 w->written, w->stalls, w->idle_runs);
+#endif
+
+	for (i = 0; i < SQ_FOTA_WRITER_BUFFERS; i++) {
+		free(w->buf[i]);
+		w->buf[i] = NULL;
+	}
+	vQueueDelete(w->free_q);
+	vQueueDelete(w->full_q);
+	vSemaphoreDelete(w->done);
+
+	return w->err ? SQ_FOTA_ERR_FAIL : SQ_FOTA_OK;
+}
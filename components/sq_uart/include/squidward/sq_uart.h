@@ -1,9 +1,52 @@
 #ifndef SQ_UART_H
 #define SQ_UART_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 extern const char *TAG;
 
 void sq_uart_init();
 void sq_uart_send(const char *, size_t);
 
+/* Annotation events, sent in the way chosen with SQ_UART_ANT_MODE */
+#include "squidward/sq_uart_ant.h"
+
+#ifdef CONFIG_SQ_UART_PROFILE
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define SQ_UART_PROF_TASKS	CONFIG_SQ_UART_PROF_TASKS
+#define SQ_UART_PROF_LEN	160	/* longest record, with all task names */
+
+/*
+ * Sampled by sq_uart_send, at the annotation point, and sent right after
+ * the annotation as one line:
+ *
+ *   P <cycles> <heap free> <largest free block> <heap min free> <task>:<stack> ...
+ *
+ * with the stack high-water mark (bytes never used) of the calling task
+ * first and then of each task added with sq_uart_prof_add. The cycle count
+ * is that of the CPU running the caller and wraps every few seconds, the
+ * Otii timestamps tell how many times.
+ */
+typedef struct {
+	uint32_t		cycles;
+	uint32_t		heap_free;
+	uint32_t		heap_largest;
+	uint32_t		heap_min;
+	unsigned int	tasks;
+	TaskHandle_t	task[SQ_UART_PROF_TASKS + 1];
+	uint32_t		stack[SQ_UART_PROF_TASKS + 1];
+} sq_uart_prof_t;
+
+void sq_uart_prof_add(TaskHandle_t);
+void sq_uart_prof_remove(TaskHandle_t);
+void sq_uart_prof_sample(sq_uart_prof_t *);
+size_t sq_uart_prof_format(const sq_uart_prof_t *, char *buf, size_t size);
+#else
+#define sq_uart_prof_add(task)		((void)(task))
+#define sq_uart_prof_remove(task)	((void)(task))
+#endif
+
 #endif
@@ -0,0 +1,95 @@
+#ifndef SQ_UART_ANT_H
+#define SQ_UART_ANT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Annotation events. The number of an event is what is sent, the text is
+ * what tools/ant_decode.py prints for it (and what is sent in text mode),
+ * with the argument of the event in place of %u. Numbers must not change
+ * once used, the decoder reads them from this list.
+ */
+#define SQ_UART_ANT_EVENTS(X)																\
+	X(SQ_UART_ANT_SYNC,					1,	"Sync")											\
+	X(SQ_UART_ANT_START,				2,	"Annotations started, %u MHz")					\
+	X(SQ_UART_ANT_DROPPED,				3,	"Annotations dropped, %u in total")				\
+	X(SQ_UART_ANT_DEVICE_STARTED,		10,	"Device started")								\
+	X(SQ_UART_ANT_SETUP_PLAIN,			20,	"Setting up plain conn")						\
+	X(SQ_UART_ANT_SETUP_PSK,			21,	"Setting up PSK conn")							\
+	X(SQ_UART_ANT_SETUP_PKI,			22,	"Setting up PKI conn")							\
+	X(SQ_UART_ANT_SETUP_DONE,			23,	"Setup done")									\
+	X(SQ_UART_ANT_CONN_SETUP,			24,	"CoAP set up connection")						\
+	X(SQ_UART_ANT_CONN_FIN,				25,	"CoAP shut down connection done")				\
+	X(SQ_UART_ANT_POST_SEND,			30,	"CoAP POST send %u bytes")						\
+	X(SQ_UART_ANT_POST_SEND_DONE,		31,	"CoAP POST send done")							\
+	X(SQ_UART_ANT_BATCH_SEND,			32,	"CoAP POST batch %u records")					\
+	X(SQ_UART_ANT_BATCH_TOTAL,			33,	"CoAP POST batch %u records total")				\
+	X(SQ_UART_ANT_BATCH_SEND_DONE,		34,	"CoAP POST batch done")							\
+	X(SQ_UART_ANT_ASYNC_SEND,			35,	"CoAP POST async %u bytes")						\
+	X(SQ_UART_ANT_ASYNC_SEND_DONE,		36,	"CoAP POST async done")							\
+	X(SQ_UART_ANT_TELEMETRY_CON,		37,	"CoAP telemetry CON %u messages")				\
+	X(SQ_UART_ANT_TELEMETRY_NON,		38,	"CoAP telemetry NON %u messages")				\
+	X(SQ_UART_ANT_TELEMETRY_DONE,		39,	"CoAP telemetry done")							\
+	X(SQ_UART_ANT_UPLOAD_SEND,			40,	"CoAP POST Block1 %u bytes")					\
+	X(SQ_UART_ANT_UPLOAD_SEND_DONE,		41,	"CoAP POST Block1 done")						\
+	X(SQ_UART_ANT_GET_SEND,				50,	"CoAP GET send")								\
+	X(SQ_UART_ANT_GET_SEND_DONE,		51,	"CoAP GET send done")							\
+	X(SQ_UART_ANT_GET_RESP,				52,	"CoAP Got Response")							\
+	X(SQ_UART_ANT_GET_MANIFEST,			53,	"CoAP GET manifest")							\
+	X(SQ_UART_ANT_GET_MANIFEST_DONE,	54,	"CoAP GET manifest done")						\
+	X(SQ_UART_ANT_OTA_WRITE,			60,	"OTA write block")								\
+	X(SQ_UART_ANT_OTA_WRITE_DONE,		61,	"OTA write done")								\
+	X(SQ_UART_ANT_MQTT_SETUP,			70,	"MQTT setup")									\
+	X(SQ_UART_ANT_MQTT_CONN,			71,	"MQTT connected")								\
+	X(SQ_UART_ANT_MQTT_PUB,				72,	"MQTT publish %u bytes")						\
+	X(SQ_UART_ANT_MQTT_PUB_DONE,		73,	"MQTT publish done")							\
+	X(SQ_UART_ANT_MQTT_SUB,				74,	"MQTT subscribe")								\
+	X(SQ_UART_ANT_MQTT_SUB_DONE,		75,	"MQTT subscribe done")
+
+#define SQ_UART_ANT_ENUM(name, id, text)	name = id,
+typedef enum {
+	SQ_UART_ANT_EVENTS(SQ_UART_ANT_ENUM)
+} sq_uart_ant_id_t;
+#undef SQ_UART_ANT_ENUM
+
+/* Modes, see the SQ_UART_ANT_MODE choice */
+#define SQ_UART_ANT_MODE_RING	(0)	/* binary events through a ring buffer and a drain task */
+#define SQ_UART_ANT_MODE_TEXT	(1)	/* annotation text, sent by the caller with sq_uart_send */
+#define SQ_UART_ANT_MODE_GPIO	(2)	/* only an edge on the control pin */
+
+#if defined(CONFIG_SQ_UART_ANT_TEXT)
+#define SQ_UART_ANT_MODE		SQ_UART_ANT_MODE_TEXT
+#elif defined(CONFIG_SQ_UART_ANT_GPIO)
+#define SQ_UART_ANT_MODE		SQ_UART_ANT_MODE_GPIO
+#else
+#define SQ_UART_ANT_MODE		SQ_UART_ANT_MODE_RING
+#endif
+
+/*
+ * Frames sent by the drain task, little-endian:
+ *
+ *   event    A5 <id:2> <arg:4> <cycles:4> <flags:1> <check:1>
+ *   profile  A6 <len:1> <heap free:4> <largest:4> <heap min:4> <tasks:1>
+ *               { <stack:4> <name length:1> <name> } ... <check:1>
+ *
+ * The check byte is the XOR of the bytes between the first and itself. A
+ * profile frame (SQ_UART_PROFILE) follows the event it was sampled at,
+ * which has SQ_UART_ANT_PROF set. Cycles are those of CPU 0: the ones of
+ * CPU 1 are corrected by the offset measured when starting. The drain task
+ * starts every batch with a SQ_UART_ANT_SYNC event, whose argument is
+ * esp_timer_get_time() (us) at its cycle count, and switches the Otii to
+ * the UART right after it, so the edge on the control pin is at that time.
+ */
+#define SQ_UART_ANT_FRAME_EVENT		0xa5
+#define SQ_UART_ANT_FRAME_PROF		0xa6
+#define SQ_UART_ANT_EVENT_LEN		13
+#define SQ_UART_ANT_CORE			0x01	/* flags: made on CPU 1 */
+#define SQ_UART_ANT_PROF			0x80	/* flags: a profile frame follows */
+
+void sq_uart_ant_init(void);
+void sq_uart_ant(sq_uart_ant_id_t id, uint32_t arg);
+void sq_uart_ant_flush(void);
+const char *sq_uart_ant_text(sq_uart_ant_id_t id);
+
+#endif
@@ -32,6 +32,8 @@ void sq_uart_init()
 	};
 
 	gpio_config(&io_conf);
+
+	sq_uart_ant_init();
 }
 
 void sq_uart_send(const char *data, size_t len)
@@ -40,12 +42,25 @@ void sq_uart_send(const char *data, size_t len)
 	ESP_LOGI(TAG, "[%s] - Sending %d bytes of data: %s", __FUNCTION__, len, data);
 #endif
 
+#ifdef CONFIG_SQ_UART_PROFILE
+	/* Sampled before waiting for the UART, that is the state of the phase ending here */
+	sq_uart_prof_t prof;
+	char record[SQ_UART_PROF_LEN];
+	size_t record_len;
+
+	sq_uart_prof_sample(&prof);
+	record_len = sq_uart_prof_format(&prof, record, sizeof(record));
+#endif
+
 	/* Turn on output switch for Otii, and transmit an array of bytes for annotation.
 	 * Wait until TX buffer is empty, preventing bogus data to be sent.
 	 */
 	ESP_ERROR_CHECK(uart_wait_tx_done(UART_NUM_0, 1000));
 	gpio_set_level(CTRL_PIN, 1);
 	int res = uart_write_bytes(UART_NUM_0, data, len);
+#ifdef CONFIG_SQ_UART_PROFILE
+	uart_write_bytes(UART_NUM_0, record, record_len);
+#endif
 	/* Again, wait until finished before turning off the output. */
 	ESP_ERROR_CHECK(uart_wait_tx_done(UART_NUM_0, 1000));
 	gpio_set_level(CTRL_PIN, 0);
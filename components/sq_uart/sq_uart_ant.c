@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "esp_timer.h"
+#include "esp_clk.h"
+#include "esp_ipc.h"
+#include "esp_log.h"
+#include "xtensa/hal.h"
+
+#include "squidward/sq_uart.h"
+#include "squidward/sq_uart_ant.h"
+
+#define CTRL_PIN				CONFIG_SQ_UART_CTRL_PIN
+#define SQ_UART_ANT_RING		CONFIG_SQ_UART_ANT_RING
+#define SQ_UART_ANT_DRAIN_MS	CONFIG_SQ_UART_ANT_DRAIN_MS
+#define SQ_UART_ANT_PRIO		CONFIG_SQ_UART_ANT_PRIO
+#define SQ_UART_ANT_STACK		2048
+
+#if (SQ_UART_ANT_RING & (SQ_UART_ANT_RING - 1)) != 0
+#error "CONFIG_SQ_UART_ANT_RING must be a power of two"
+#endif
+
+#define SQ_UART_ANT_TEXT_ENTRY(name, id, text)	[id] = text,
+static const char *const ant_text[] = {
+	SQ_UART_ANT_EVENTS(SQ_UART_ANT_TEXT_ENTRY)
+};
+#undef SQ_UART_ANT_TEXT_ENTRY
+
+/**
+ * @brief The text of an event, with %u for its argument, or NULL.
+ */
+const char *sq_uart_ant_text(sq_uart_ant_id_t id)
+{
+	if ((unsigned int)id >= sizeof(ant_text) / sizeof(ant_text[0])) {
+		return NULL;
+	}
+	return ant_text[id];
+}
+
+#if SQ_UART_ANT_MODE == SQ_UART_ANT_MODE_RING
+
+typedef struct {
+	uint32_t			cycles;
+	uint32_t			arg;
+	uint16_t			id;
+	uint8_t				flags;
+	volatile uint8_t	ready;		/* written, the drain task may take it */
+} sq_uart_ant_event_t;
+
+/*
+ * Any number of callers, tasks on both CPUs or interrupts, reserve a slot
+ * by moving head forward and set ready when they have filled it in. The
+ * drain task is the only one moving tail. Nothing blocks: when the ring is
+ * full the event is counted as dropped instead.
+ */
+static sq_uart_ant_event_t ring[SQ_UART_ANT_RING];
+#ifdef CONFIG_SQ_UART_PROFILE
+static sq_uart_prof_t ring_prof[SQ_UART_ANT_RING];
+#endif
+static uint32_t head;
+static uint32_t tail;
+static uint32_t dropped;
+static TaskHandle_t drain_task;
+static SemaphoreHandle_t drain_lock;
+
+/* Subtracted from the cycle count of CPU 1 to get the one of CPU 0 */
+static uint32_t core_offset[portNUM_PROCESSORS];
+
+/* Largest batch: a sync, a dropped count and a full ring */
+#ifdef CONFIG_SQ_UART_PROFILE
+#define SQ_UART_ANT_PROF_MAX	(16 + (SQ_UART_PROF_TASKS + 1) * (5 + configMAX_TASK_NAME_LEN) + 1)
+#else
+#define SQ_UART_ANT_PROF_MAX	0
+#endif
+#define SQ_UART_ANT_BATCH		((SQ_UART_ANT_RING + 2) * SQ_UART_ANT_EVENT_LEN + \
+								 SQ_UART_ANT_RING * SQ_UART_ANT_PROF_MAX)
+
+static uint8_t batch[SQ_UART_ANT_BATCH];
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+static void put_check(uint8_t *frame, uint8_t *end)
+{
+	uint8_t check = 0;
+	uint8_t *p;
+
+	for (p = frame + 1; p < end; p++) {
+		check ^= *p;
+	}
+	*end = check;
+}
+
+static size_t put_event(uint8_t *buf, uint16_t id, uint32_t arg, uint32_t cycles, uint8_t flags)
+{
+	uint8_t *p = buf;
+
+	*p++ = SQ_UART_ANT_FRAME_EVENT;
+	*p++ = id;
+	*p++ = id >> 8;
+	p = put_u32(p, arg);
+	p = put_u32(p, cycles);
+	*p++ = flags;
+	put_check(buf, p);
+	return SQ_UART_ANT_EVENT_LEN;
+}
+
+#ifdef CONFIG_SQ_UART_PROFILE
+static size_t put_prof(uint8_t *buf, const sq_uart_prof_t *prof)
+{
+	uint8_t *p = buf + 2;
+	const char *name;
+	size_t n;
+	int i;
+
+	p = put_u32(p, prof->heap_free);
+	p = put_u32(p, prof->heap_largest);
+	p = put_u32(p, prof->heap_min);
+	*p++ = prof->tasks;
+	for (i = 0; i < prof->tasks; i++) {
+		name = pcTaskGetTaskName(prof->task[i]);
+		n = strnlen(name, configMAX_TASK_NAME_LEN);
+		p = put_u32(p, prof->stack[i]);
+		*p++ = n;
+		memcpy(p, name, n);
+		p += n;
+	}
+	buf[0] = SQ_UART_ANT_FRAME_PROF;
+	buf[1] = p - buf - 2;
+	put_check(buf, p);
+	return p + 1 - buf;
+}
+#endif
+
+/**
+ * @brief Record an event, without waiting for anything.
+ *
+ * @param[in] id	The event.
+ * @param[in] arg	Its argument, e.g. a number of bytes, 0 if it has none.
+ */
+void sq_uart_ant(sq_uart_ant_id_t id, uint32_t arg)
+{
+	uint32_t cycles = xthal_get_ccount();
+	int core = xPortGetCoreID();
+	uint32_t idx, used;
+	sq_uart_ant_event_t *ev;
+
+	idx = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	do {
+		if (idx - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= SQ_UART_ANT_RING) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&head, &idx, idx + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	ev = &ring[idx & (SQ_UART_ANT_RING - 1)];
+	ev->cycles = cycles - core_offset[core];
+	ev->arg = arg;
+	ev->id = id;
+	ev->flags = core ? SQ_UART_ANT_CORE : 0;
+#ifdef CONFIG_SQ_UART_PROFILE
+	if (!xPortInIsrContext()) {
+		sq_uart_prof_sample(&ring_prof[idx & (SQ_UART_ANT_RING - 1)]);
+		ev->flags |= SQ_UART_ANT_PROF;
+	}
+#endif
+	__atomic_store_n(&ev->ready, 1, __ATOMIC_RELEASE);
+
+	/* Only hurry the drain task when the ring fills up, it wakes up on its own otherwise */
+	used = idx + 1 - __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	if (used >= SQ_UART_ANT_RING / 2 && drain_task != NULL) {
+		if (xPortInIsrContext()) {
+			vTaskNotifyGiveFromISR(drain_task, NULL);
+		} else {
+			xTaskNotifyGive(drain_task);
+		}
+	}
+}
+
+/*
+ * Send what is in the ring, behind a sync event. From the drain task, or
+ * from sq_uart_ant_flush, one at a time.
+ */
+static void sq_uart_ant_drain(void)
+{
+	static uint32_t dropped_sent;
+	sq_uart_ant_event_t *ev;
+	uint32_t lost;
+	uint32_t end;
+	size_t len = 0;
+
+	if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == tail &&
+		__atomic_load_n(&dropped, __ATOMIC_RELAXED) == dropped_sent) {
+		return;
+	}
+
+	/* The edge of the control pin is at this time, see sq_uart_ant.h */
+	ESP_ERROR_CHECK(uart_wait_tx_done(UART_NUM_0, portMAX_DELAY));
+	len += put_event(batch + len, SQ_UART_ANT_SYNC, (uint32_t)esp_timer_get_time(),
+					 xthal_get_ccount() - core_offset[xPortGetCoreID()], 0);
+	gpio_set_level(CTRL_PIN, 1);
+
+	lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost != dropped_sent) {
+		len += put_event(batch + len, SQ_UART_ANT_DROPPED, lost,
+						 xthal_get_ccount() - core_offset[xPortGetCoreID()], 0);
+		dropped_sent = lost;
+	}
+
+	/*
+	 * No further than the head seen here: tasks that preempt the drain
+	 * keep adding events, and batch only holds one ring of them.
+	 */
+	end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	while (tail != end) {
+		ev = &ring[tail & (SQ_UART_ANT_RING - 1)];
+		if (!__atomic_load_n(&ev->ready, __ATOMIC_ACQUIRE)) {
+			/* Still being written, the rest goes with the next batch */
+			break;
+		}
+		len += put_event(batch + len, ev->id, ev->arg, ev->cycles, ev->flags);
+#ifdef CONFIG_SQ_UART_PROFILE
+		if (ev->flags & SQ_UART_ANT_PROF) {
+			len += put_prof(batch + len, &ring_prof[tail & (SQ_UART_ANT_RING - 1)]);
+		}
+#endif
+		ev->ready = 0;
+		__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	uart_write_bytes(UART_NUM_0, (const char *)batch, len);
+	ESP_ERROR_CHECK(uart_wait_tx_done(UART_NUM_0, portMAX_DELAY));
+	gpio_set_level(CTRL_PIN, 0);
+}
+
+static void sq_uart_ant_task(void *p)
+{
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SQ_UART_ANT_DRAIN_MS));
+		xSemaphoreTake(drain_lock, portMAX_DELAY);
+		sq_uart_ant_drain();
+		xSemaphoreGive(drain_lock);
+	}
+}
+
+#if portNUM_PROCESSORS > 1
+static void read_ccount(void *arg)
+{
+	*(uint32_t *)arg = xthal_get_ccount();
+}
+
+/*
+ * The cycle counts of the CPUs are not the same. Read the one of the other
+ * CPU between two reads of this one, the offset is then known to within
+ * half the time between the reads.
+ */
+static void measure_core_offset(void)
+{
+	uint32_t before, after, other, mid;
+	int self = xPortGetCoreID();
+
+	before = xthal_get_ccount();
+	if (esp_ipc_call_blocking(!self, read_ccount, &other) != ESP_OK) {
+		return;
+	}
+	after = xthal_get_ccount();
+	mid = before + (after - before) / 2;
+	core_offset[1] = self == 0 ? other - mid : mid - other;
+}
+#endif
+
+/**
+ * @brief Start the drain task, called by sq_uart_init.
+ */
+void sq_uart_ant_init(void)
+{
+#if portNUM_PROCESSORS > 1
+	measure_core_offset();
+#endif
+
+	drain_lock = xSemaphoreCreateMutex();
+	sq_uart_ant(SQ_UART_ANT_START, esp_clk_cpu_freq() / 1000000);
+
+	/* The sync events are made on CPU 0 */
+	if (xTaskCreatePinnedToCore(sq_uart_ant_task, "sq_uart_ant", SQ_UART_ANT_STACK, NULL,
+								SQ_UART_ANT_PRIO, &drain_task, 0) != pdPASS) {
+		ESP_LOGE(TAG, "[%s] - Could not start the annotation task", __FUNCTION__);
+	}
+	sq_uart_prof_add(drain_task);
+}
+
+/**
+ * @brief Send everything recorded so far, e.g. before a restart.
+ *
+ * Blocks until it is sent, do not use it on the measured path.
+ */
+void sq_uart_ant_flush(void)
+{
+	if (drain_lock == NULL) {
+		return;
+	}
+	xSemaphoreTake(drain_lock, portMAX_DELAY);
+	sq_uart_ant_drain();
+	xSemaphoreGive(drain_lock);
+}
+
+#elif SQ_UART_ANT_MODE == SQ_UART_ANT_MODE_TEXT
+
+/**
+ * @brief Send the text of an event with sq_uart_send, as before there were events.
+ */
+void sq_uart_ant(sq_uart_ant_id_t id, uint32_t arg)
+{
+	char text[64];
+	const char *fmt = sq_uart_ant_text(id);
+	int n;
+
+	if (fmt == NULL) {
+		return;
+	}
+	n = snprintf(text, sizeof(text) - 1, fmt, arg);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n > sizeof(text) - 2) {
+		n = sizeof(text) - 2;
+	}
+	text[n++] = '\n';
+	text[n] = '\0';
+	sq_uart_send(text, n);
+}
+
+void sq_uart_ant_init(void)
+{
+}
+
+void sq_uart_ant_flush(void)
+{
+}
+
+#elif SQ_UART_ANT_MODE == SQ_UART_ANT_MODE_GPIO
+
+/**
+ * @brief Toggle the control pin, nothing else.
+ *
+ * The edge is all there is of the event, so the decoder has to know the
+ * order of the events. Written to the GPIO registers directly, the pin
+ * changes within a few cycles of the call.
+ */
+void sq_uart_ant(sq_uart_ant_id_t id, uint32_t arg)
+{
+	(void)id;
+	(void)arg;
+
+#if CTRL_PIN < 32
+	if (REG_READ(GPIO_OUT_REG) & BIT(CTRL_PIN)) {
+		REG_WRITE(GPIO_OUT_W1TC_REG, BIT(CTRL_PIN));
+	} else {
+		REG_WRITE(GPIO_OUT_W1TS_REG, BIT(CTRL_PIN));
+	}
+#else
+	if (REG_READ(GPIO_OUT1_REG) & BIT(CTRL_PIN - 32)) {
+		REG_WRITE(GPIO_OUT1_W1TC_REG, BIT(CTRL_PIN - 32));
+	} else {
+		REG_WRITE(GPIO_OUT1_W1TS_REG, BIT(CTRL_PIN - 32));
+	}
+#endif
+}
+
+void sq_uart_ant_init(void)
+{
+}
+
+void sq_uart_ant_flush(void)
+{
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "xtensa/hal.h"
+
+#include "squidward/sq_uart.h"
+
+#ifdef CONFIG_SQ_UART_PROFILE
+
+/* Tasks sampled at every annotation, besides the one sending it */
+static TaskHandle_t prof_task[SQ_UART_PROF_TASKS];
+static portMUX_TYPE prof_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Sample the stack of a task at every annotation.
+ *
+ * A task that is deleted must be removed first, see sq_uart_prof_remove.
+ * @param[in] task	The task, NULL for the calling one.
+ */
+void sq_uart_prof_add(TaskHandle_t task)
+{
+	int i;
+
+	if (task == NULL) {
+		task = xTaskGetCurrentTaskHandle();
+	}
+
+	portENTER_CRITICAL(&prof_mux);
+	for (i = 0; i < SQ_UART_PROF_TASKS; i++) {
+		if (prof_task[i] == task) {
+			break;
+		}
+		if (prof_task[i] == NULL) {
+			prof_task[i] = task;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&prof_mux);
+
+#ifdef CONFIG_SQ_UART_DBG
+	if (i == SQ_UART_PROF_TASKS) {
+		ESP_LOGW(TAG, "[%s] - No room for task %s", __FUNCTION__, pcTaskGetTaskName(task));
+	}
+#endif
+}
+
+/**
+ * @brief Stop sampling a task, before it is deleted.
+ *
+ * @param[in] task	The task, NULL for the calling one.
+ */
+void sq_uart_prof_remove(TaskHandle_t task)
+{
+	int i;
+
+	if (task == NULL) {
+		task = xTaskGetCurrentTaskHandle();
+	}
+
+	portENTER_CRITICAL(&prof_mux);
+	for (i = 0; i < SQ_UART_PROF_TASKS; i++) {
+		if (prof_task[i] == task) {
+			prof_task[i] = NULL;
+		}
+	}
+	portEXIT_CRITICAL(&prof_mux);
+}
+
+/**
+ * @brief Sample the cycle count, the heap and the stacks.
+ *
+ * The cycle count is read first, so the sampling is not part of the phase
+ * before it.
+ */
+void sq_uart_prof_sample(sq_uart_prof_t *p)
+{
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	int i;
+
+	p->cycles = xthal_get_ccount();
+	p->heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	p->heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+	p->heap_min = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+
+	p->tasks = 0;
+	p->task[p->tasks++] = self;
+
+	portENTER_CRITICAL(&prof_mux);
+	for (i = 0; i < SQ_UART_PROF_TASKS; i++) {
+		if (prof_task[i] != NULL && prof_task[i] != self) {
+			p->task[p->tasks++] = prof_task[i];
+		}
+	}
+	portEXIT_CRITICAL(&prof_mux);
+
+	/* Stack sizes are in bytes in ESP-IDF, and so are the high-water marks */
+	for (i = 0; i < p->tasks; i++) {
+		p->stack[i] = uxTaskGetStackHighWaterMark(p->task[i]);
+	}
+}
+
+/**
+ * @brief Format a sample as the line sent after the annotation.
+ *
+ * @return The length of the line, at most size - 1.
+ */
+size_t sq_uart_prof_format(const sq_uart_prof_t *p, char *buf, size_t size)
+{
+	size_t len;
+	int n, i;
+
+	n = snprintf(buf, size, "P %u %u %u %u", p->cycles, p->heap_free,
+				 p->heap_largest, p->heap_min);
+	len = (n < 0 || (size_t)n >= size) ? size - 1 : (size_t)n;
+
+	for (i = 0; i < p->tasks && len + 1 < size; i++) {
+		n = snprintf(buf + len, size - len, " %s:%u", pcTaskGetTaskName(p->task[i]), p->stack[i]);
+		len = (n < 0 || (size_t)n >= size - len) ? size - 1 : len + n;
+	}
+
+	/* Always end the line, even if a task did not fit */
+	if (len + 1 >= size) {
+		len = size - 2;
+	}
+	buf[len++] = '\n';
+	buf[len] = '\0';
+	return len;
+}
+
+#endif /* CONFIG_SQ_UART_PROFILE */
@@ -0,0 +1,604 @@
+/*
+ * Host benchmark driver for the squidward CoAP component.
+ *
+ * Runs the same POST sweep as src/coaps (1 B to 16 KiB, above one PDU
+ * in Block1 blocks through sq_coap_block1, then 2 to 16
+ * packets of 1 KiB, the same packets with several in flight through
+ * sq_coap_req, then telemetry records through sq_coap_batch and as
+ * single CON and NON messages through sq_coap_telemetry)
+ * against a local libcoap server and prints one CSV row
+ * per phase with wall time, CPU time, CPU cycles and what was put on and
+ * taken off the wire. The security mode is chosen at compile time, see
+ * the host Makefile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "squidward/sq_coap.h"
+#include "squidward/sq_coap_batch.h"
+#include "squidward/sq_coap_block1.h"
+#include "squidward/sq_coap_req.h"
+#include "squidward/sq_coap_telemetry.h"
+#include "squidward/sq_uart.h"
+
+#ifndef SQ_BENCH_CONFIG
+#define SQ_BENCH_CONFIG "none"
+#endif
+
+const char *TAG = "coaps_bench";
+
+static coap_context_t	*ctx = NULL;
+static coap_session_t	*session = NULL;
+
+static int resp_wait = 1;
+static int wait_ms;
+static uint8_t post_token;	/* of the single POST, to tell its response from late ones */
+static sq_coap_req_t req;
+static sq_coap_block1_t upload;
+static sq_coap_telemetry_t telemetry;
+
+#define POST_SIZE 1024
+#define UPLOAD_SIZE (16 * 1024)
+static unsigned char post_data[UPLOAD_SIZE];
+
+/* Telemetry records sent through a batch, as in src/coaps */
+#define TELEMETRY_RECORDS		64
+#define TELEMETRY_RECORD_SIZE	48
+
+/*
+ * Wire counters and I/O loop wakeups. The socket calls used by coap_io.c
+ * and coap_run_once are wrapped at link time (-Wl,--wrap=...), which also
+ * catches the ClientHello that is sent from within sq_coap_init before the
+ * context is handed back to us.
+ */
+typedef struct {
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint32_t tx_dgrams;
+	uint32_t rx_dgrams;
+	uint32_t wakeups;	/* returns from coap_run_once, each one a CPU wakeup on the ESP32 */
+	uint32_t retransmits;	/* CON retransmissions of libcoap and those of the sq_coap engines */
+	uint32_t dtls_resends;	/* handshake flights sent again by the DTLS timer */
+} bench_wire_t;
+
+static bench_wire_t wire;
+
+ssize_t __real_send(int, const void *, size_t, int);
+ssize_t __real_sendto(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+ssize_t __real_sendmsg(int, const struct msghdr *, int);
+ssize_t __real_recv(int, void *, size_t, int);
+ssize_t __real_recvfrom(int, void *, size_t, int, struct sockaddr *, socklen_t *);
+ssize_t __real_recvmsg(int, struct msghdr *, int);
+int __real_coap_run_once(coap_context_t *, unsigned int);
+coap_tid_t __real_coap_retransmit(coap_context_t *, coap_queue_t *);
+void __real_coap_dtls_handle_timeout(coap_session_t *);
+
+static ssize_t count_tx(ssize_t res)
+{
+	if (res > 0) {
+		wire.tx_bytes += res;
+		wire.tx_dgrams++;
+	}
+	return res;
+}
+
+static ssize_t count_rx(ssize_t res)
+{
+	if (res > 0) {
+		wire.rx_bytes += res;
+		wire.rx_dgrams++;
+	}
+	return res;
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+	return count_tx(__real_send(fd, buf, len, flags));
+}
+
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+					  const struct sockaddr *addr, socklen_t addrlen)
+{
+	return count_tx(__real_sendto(fd, buf, len, flags, addr, addrlen));
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	return count_tx(__real_sendmsg(fd, msg, flags));
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags)
+{
+	return count_rx(__real_recv(fd, buf, len, flags));
+}
+
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags,
+						struct sockaddr *addr, socklen_t *addrlen)
+{
+	return count_rx(__real_recvfrom(fd, buf, len, flags, addr, addrlen));
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	return count_rx(__real_recvmsg(fd, msg, flags));
+}
+
+int __wrap_coap_run_once(coap_context_t *ctx, unsigned int timeout_ms)
+{
+	wire.wakeups++;
+	return __real_coap_run_once(ctx, timeout_ms);
+}
+
+/* Called for a CON message without an ACK, sent again unless it has run out of retries */
+coap_tid_t __wrap_coap_retransmit(coap_context_t *ctx, coap_queue_t *node)
+{
+	if (node && node->retransmit_cnt < node->session->max_retransmit) {
+		wire.retransmits++;
+	}
+	return __real_coap_retransmit(ctx, node);
+}
+
+/* Called when the DTLS timer expires, the last flight is sent again unless it has run out of retries */
+void __wrap_coap_dtls_handle_timeout(coap_session_t *s)
+{
+	if (s->state != COAP_SESSION_STATE_HANDSHAKE || s->dtls_timeout_count < s->max_retransmit) {
+		wire.dtls_resends++;
+	}
+	__real_coap_dtls_handle_timeout(s);
+}
+
+/*
+ * CPU cycles are read from the hardware counter of this process when the
+ * kernel allows it (perf_event_paranoid), otherwise only CPU time is given.
+ */
+static int cycles_fd = -1;
+
+static void cycles_init(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type			= PERF_TYPE_HARDWARE;
+	attr.size			= sizeof(attr);
+	attr.config			= PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel	= 1;
+	attr.exclude_hv		= 1;
+
+	cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (cycles_fd < 0) {
+		ESP_LOGW(TAG, "CPU cycle counter not available, reporting CPU time only");
+		return;
+	}
+	ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static int64_t cycles_read(void)
+{
+	uint64_t val;
+
+	if (cycles_fd < 0 || read(cycles_fd, &val, sizeof(val)) != sizeof(val)) {
+		return -1;
+	}
+	return (int64_t)val;
+}
+
+/*
+ * Airtime of the datagrams on 802.11g at 54 Mbit/s, a first order figure
+ * of radio on-time for comparing modes: each frame costs DIFS, the mean
+ * backoff, the preamble, SIFS and the MAC ACK, and carries UDP, IPv4 and
+ * 802.11 headers on top of the UDP payload.
+ */
+#define AIR_FRAME_US	(34 + 68 + 20 + 16 + 24)
+#define AIR_HDR_BYTES	(8 + 20 + 36)
+#define AIR_MBPS		54
+
+static uint64_t airtime_us(uint64_t bytes, uint32_t dgrams)
+{
+	return dgrams * AIR_FRAME_US + (bytes + (uint64_t)dgrams * AIR_HDR_BYTES) * 8 / AIR_MBPS;
+}
+
+typedef struct {
+	struct timespec wall;
+	struct timespec cpu;
+	int64_t cycles;
+	bench_wire_t wire;
+} bench_snap_t;
+
+static void bench_snap(bench_snap_t *snap)
+{
+	clock_gettime(CLOCK_MONOTONIC, &snap->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &snap->cpu);
+	snap->cycles = cycles_read();
+	snap->wire = wire;
+}
+
+static long diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static void bench_report(int run, const char *phase, int bytes, const bench_snap_t *start)
+{
+	bench_snap_t end;
+
+	uint64_t tx_bytes, rx_bytes;
+	uint32_t tx_dgrams, rx_dgrams;
+
+	bench_snap(&end);
+	tx_bytes = end.wire.tx_bytes - start->wire.tx_bytes;
+	rx_bytes = end.wire.rx_bytes - start->wire.rx_bytes;
+	tx_dgrams = end.wire.tx_dgrams - start->wire.tx_dgrams;
+	rx_dgrams = end.wire.rx_dgrams - start->wire.rx_dgrams;
+	printf("%s,%d,%s,%d,%ld,%ld,%lld,%llu,%llu,%u,%u,%llu,%u,%u,%u\n",
+		   SQ_BENCH_CONFIG, run, phase, bytes,
+		   diff_us(&start->wall, &end.wall),
+		   diff_us(&start->cpu, &end.cpu),
+		   (start->cycles < 0 || end.cycles < 0) ? -1LL : (long long)(end.cycles - start->cycles),
+		   (unsigned long long)tx_bytes, (unsigned long long)rx_bytes, tx_dgrams, rx_dgrams,
+		   (unsigned long long)(airtime_us(tx_bytes, tx_dgrams) + airtime_us(rx_bytes, rx_dgrams)),
+		   end.wire.wakeups - start->wire.wakeups,
+		   end.wire.retransmits - start->wire.retransmits,
+		   end.wire.dtls_resends - start->wire.dtls_resends);
+	fflush(stdout);
+}
+
+static void coap_message_handler(coap_context_t *ctx, coap_session_t *session,
+							coap_pdu_t *sent, coap_pdu_t *received,
+							const coap_tid_t id)
+{
+	if (sq_coap_req_response(&req, received) ||
+		sq_coap_telemetry_response(&telemetry, received)) {
+		return;
+	}
+	if (sq_coap_block1_match(received)) {
+		sq_coap_block1_response(&upload, received);
+		return;
+	}
+	if (received->token_length == 1 && received->token[0] == post_token) {
+		resp_wait = 0;
+	}
+}
+
+/* Run the CoAP I/O loop until resp_wait is cleared or the timeout expires */
+static int bench_wait(void)
+{
+	wait_ms = SQ_COAP_TIME_SEC * 1000;
+
+	while (resp_wait) {
+		int result = coap_run_once(ctx, wait_ms);
+		if (result >= 0) {
+			if (result >= wait_ms) {
+				ESP_LOGE(TAG, "select timeout");
+				return -1;
+			} else {
+				wait_ms -= result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * The loop iterations go to the log. Without loss a DTLS handshake takes one
+ * per flight received, the retransmission timer adds one per retransmission.
+ */
+static int bench_handshake(void)
+{
+	uint32_t wakeups = wire.wakeups;
+
+	wait_ms = SQ_COAP_TIME_SEC * 1000;
+
+	while (session->state != COAP_SESSION_STATE_ESTABLISHED) {
+		if (session->state == COAP_SESSION_STATE_NONE) {
+			ESP_LOGE(TAG, "Session closed during handshake");
+			return -1;
+		}
+		int result = coap_run_once(ctx, wait_ms);
+		if (result >= 0) {
+			if (result >= wait_ms) {
+				ESP_LOGE(TAG, "handshake timeout");
+				return -1;
+			} else {
+				wait_ms -= result;
+			}
+		}
+	}
+	ESP_LOGI(TAG, "Handshake in %u loop iterations", wire.wakeups - wakeups);
+	return 0;
+}
+
+/* Blocks and retransmissions go to the log, the datagrams to the CSV row */
+static int bench_upload(unsigned char *msg, int msglen)
+{
+	sq_coap_block1_start(&upload, COAP_REQUEST_POST, msg, msglen);
+	while (upload.status == SQ_COAP_BLOCK_BUSY) {
+		int block_ms = sq_coap_block1_poll(&upload);
+		if (upload.status != SQ_COAP_BLOCK_BUSY) {
+			break;
+		}
+		coap_run_once(ctx, block_ms);
+	}
+	ESP_LOGI(TAG, "%d bytes in %u blocks, %u retransmitted", msglen, upload.blocks, upload.retransmits);
+	wire.retransmits += upload.retransmits;
+	if (upload.status != SQ_COAP_BLOCK_DONE) {
+		ESP_LOGE(TAG, "Upload of %d bytes failed", msglen);
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_post(unsigned char *msg, int msglen)
+{
+	coap_pdu_t *request = NULL;
+
+	if (sq_coap_block1_needed(session, msglen)) {
+		return bench_upload(msg, msglen);
+	}
+
+	request = coap_new_pdu(session);
+	if (!request) {
+		ESP_LOGE(TAG, "coap_new_pdu() failed");
+		return -1;
+	}
+	request->type = COAP_MESSAGE_CON;
+	request->tid = coap_new_message_id(session);
+	request->code = COAP_REQUEST_POST;
+	post_token++;
+	coap_add_token(request, 1, &post_token);
+	coap_add_optlist_pdu(request, &optlist);
+	coap_add_data(request, msglen, msg);
+
+	resp_wait = 1;
+	if (coap_send(session, request) == COAP_INVALID_TID) {
+		ESP_LOGE(TAG, "coap_send() failed");
+		return -1;
+	}
+
+	return bench_wait();
+}
+
+static void bench_async_done(void *arg, int status, coap_pdu_t *received)
+{
+	if (status == SQ_COAP_REQ_OK) {
+		(*(int *) arg)--;
+	}
+}
+
+/* num POSTs submitted at once, SQ_COAP_REQ_NSTART of them in flight */
+static int bench_async(int num)
+{
+	uint32_t retransmits = req.retransmits;
+	int pending = 0;
+	int res = 0;
+
+	for (int i = 0; i < num; i++) {
+		while (sq_coap_req_pending(&req) == SQ_COAP_REQ_MAX) {
+			coap_run_once(ctx, sq_coap_req_poll(&req));
+		}
+		if (sq_coap_req_submit(&req, COAP_REQUEST_POST, NULL, post_data, POST_SIZE, 0,
+							   bench_async_done, &pending) < 0) {
+			res = -1;
+			break;
+		}
+		pending++;
+	}
+	if (res == 0 && (sq_coap_req_run(&req, ctx) != SQ_COAP_OK || pending > 0)) {
+		ESP_LOGE(TAG, "%d of %d POSTs without a response", pending, num);
+		res = -1;
+	}
+	wire.retransmits += req.retransmits - retransmits;
+	return res;
+}
+
+static int bench_batch_send(void *arg, const uint8_t *data, size_t len, unsigned int records)
+{
+	return bench_post((unsigned char *) data, len);
+}
+
+/* Records per POST go to the log, the datagrams to the CSV row */
+static int bench_batch(void)
+{
+	sq_coap_batch_t batch;
+	int res = 0;
+
+	if (sq_coap_batch_init(&batch, SQ_COAP_BATCH_BYTES, SQ_COAP_BATCH_RECORDS, SQ_COAP_BATCH_DEADLINE,
+						   bench_batch_send, NULL) != SQ_COAP_OK) {
+		return -1;
+	}
+	for (int i = 0; i < TELEMETRY_RECORDS && res == 0; i++) {
+		res = sq_coap_batch_add(&batch, post_data, TELEMETRY_RECORD_SIZE);
+	}
+	if (res == 0) {
+		res = sq_coap_batch_flush(&batch);
+	}
+	ESP_LOGI(TAG, "%u records in %u POSTs, %u full, %u at the record limit", batch.sent_records, batch.batches,
+			 batch.flushes[SQ_COAP_BATCH_FLUSH_BYTES], batch.flushes[SQ_COAP_BATCH_FLUSH_RECORDS]);
+	sq_coap_batch_free(&batch);
+	return res == SQ_COAP_OK ? 0 : -1;
+}
+
+/* CON waits for each message, NON only when the retransmit buffer is full */
+static int bench_telemetry(int mode)
+{
+	unsigned int window = mode == SQ_COAP_TELEMETRY_CON ? 1 : SQ_COAP_TELEMETRY_BUFFER;
+	int wait_ms;
+
+	sq_coap_telemetry_init(&telemetry, session, mode);
+	for (int i = 0; i < TELEMETRY_RECORDS; i++) {
+		while (sq_coap_telemetry_pending(&telemetry) >= window &&
+			   (wait_ms = sq_coap_telemetry_poll(&telemetry)) >= 0) {
+			coap_run_once(ctx, wait_ms);
+		}
+		if (i == TELEMETRY_RECORDS - 1) {
+			sq_coap_telemetry_ask(&telemetry);
+		}
+		if (sq_coap_telemetry_send(&telemetry, post_data, TELEMETRY_RECORD_SIZE) != SQ_COAP_OK) {
+			return -1;
+		}
+	}
+	while ((wait_ms = sq_coap_telemetry_poll(&telemetry)) >= 0) {
+		coap_run_once(ctx, wait_ms);
+	}
+	ESP_LOGI(TAG, "%s: %u messages in %u datagrams, %u retransmitted, %u acknowledgements, %u dropped",
+			 mode == SQ_COAP_TELEMETRY_CON ? "CON" : "NON", telemetry.messages, telemetry.datagrams,
+			 telemetry.retransmits, telemetry.acks, telemetry.dropped);
+	wire.retransmits += telemetry.retransmits;
+	return telemetry.dropped == 0 ? 0 : -1;
+}
+
+#ifdef CONFIG_COAP_MEM_POOL
+/*
+ * Peak allocator usage in each phase of the run, and what is still
+ * allocated after the cleanup (the cached DTLS session for resumption is
+ * kept on purpose, anything else is a leak).
+ */
+static void bench_mem_report(int run, size_t in_use_start)
+{
+	coap_mem_stats_t mem;
+
+	coap_mem_get_stats(&mem);
+	ESP_LOGI(TAG, "Run %d memory peak: setup %zu, handshake %zu, steady %zu, teardown %zu bytes",
+			 run, mem.peak[COAP_MEM_PHASE_SETUP], mem.peak[COAP_MEM_PHASE_HANDSHAKE],
+			 mem.peak[COAP_MEM_PHASE_STEADY], mem.peak[COAP_MEM_PHASE_TEARDOWN]);
+	ESP_LOGI(TAG, "Run %d arena peak %zu bytes, %zd bytes retained; so far %u arena resets, %u heap allocations (%u untracked)",
+			 run, mem.arena_peak, (ssize_t)(mem.in_use - in_use_start),
+			 mem.arena_resets, mem.heap, mem.untracked);
+}
+#endif
+
+static int bench_run(int run)
+{
+	bench_snap_t start;
+	char phase[32];
+#ifdef CONFIG_COAP_MEM_POOL
+	coap_mem_stats_t mem;
+
+	coap_mem_reset_peaks();
+	coap_mem_get_stats(&mem);
+#endif
+
+	bench_snap(&start);
+	if (sq_coap_init(&ctx, &session) != SQ_COAP_OK) {
+		ESP_LOGE(TAG, "sq_coap_init failed");
+		return -1;
+	}
+	sq_coap_req_init(&req, session, SQ_COAP_REQ_NSTART);
+	sq_coap_block1_init(&upload, session, SQ_COAP_BLOCK1_WINDOW, SQ_COAP_BLOCK1_SZX);
+	coap_register_response_handler(ctx, coap_message_handler);
+	if (bench_handshake() != 0) {
+		sq_coap_cleanup(ctx, session);
+		return -1;
+	}
+	bench_report(run, "handshake", 0, &start);
+
+	int post_len = 1;
+	for (int i = 0; i <= 14; i++) {
+		bench_snap(&start);
+		if (bench_post(post_data, post_len) != 0) goto fail;
+		bench_report(run, "post", post_len, &start);
+		post_len *= 2;
+	}
+
+	int num_pkts = 2;
+	for (int i = 0; i < 4; i++) {
+		snprintf(phase, sizeof(phase), "post_x%d", num_pkts);
+		bench_snap(&start);
+		for (int j = 0; j < num_pkts; j++) {
+			if (bench_post(post_data, POST_SIZE) != 0) goto fail;
+		}
+		bench_report(run, phase, num_pkts * POST_SIZE, &start);
+		num_pkts *= 2;
+	}
+
+	num_pkts = 2;
+	for (int i = 0; i < 4; i++) {
+		snprintf(phase, sizeof(phase), "async_x%d", num_pkts);
+		bench_snap(&start);
+		if (bench_async(num_pkts) != 0) goto fail;
+		bench_report(run, phase, num_pkts * POST_SIZE, &start);
+		num_pkts *= 2;
+	}
+	ESP_LOGI(TAG, "%u requests, %u retransmitted, at most %u in flight",
+			 req.submitted, req.retransmits, req.max_inflight);
+
+	snprintf(phase, sizeof(phase), "batch_x%d", TELEMETRY_RECORDS);
+	bench_snap(&start);
+	if (bench_batch() != 0) goto fail;
+	bench_report(run, phase, TELEMETRY_RECORDS * TELEMETRY_RECORD_SIZE, &start);
+
+	snprintf(phase, sizeof(phase), "tlm_con_x%d", TELEMETRY_RECORDS);
+	bench_snap(&start);
+	if (bench_telemetry(SQ_COAP_TELEMETRY_CON) != 0) goto fail;
+	bench_report(run, phase, TELEMETRY_RECORDS * TELEMETRY_RECORD_SIZE, &start);
+
+	snprintf(phase, sizeof(phase), "tlm_non_x%d", TELEMETRY_RECORDS);
+	bench_snap(&start);
+	if (bench_telemetry(SQ_COAP_TELEMETRY_NON) != 0) goto fail;
+	bench_report(run, phase, TELEMETRY_RECORDS * TELEMETRY_RECORD_SIZE, &start);
+
+	bench_snap(&start);
+	sq_coap_cleanup(ctx, session);
+	bench_report(run, "cleanup", 0, &start);
+#ifdef CONFIG_COAP_MEM_POOL
+	bench_mem_report(run, mem.in_use);
+#endif
+	ctx = NULL;
+	session = NULL;
+	return 0;
+
+fail:
+	sq_coap_cleanup(ctx, session);
+	ctx = NULL;
+	session = NULL;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	coap_dtls_handshake_stats_t stats;
+	coap_dtls_rx_stats_t rx_stats;
+	int runs = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r runs]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	memset(post_data, 'a', sizeof(post_data));
+	sq_uart_init();
+	cycles_init();
+
+	printf("config,run,phase,bytes,wall_us,cpu_us,cycles,tx_bytes,rx_bytes,tx_dgrams,rx_dgrams,airtime_us,wakeups,retransmits,dtls_resends\n");
+	for (int run = 0; run < runs; run++) {
+		if (bench_run(run) != 0) {
+			return 1;
+		}
+	}
+
+	coap_dtls_get_handshake_stats(&stats);
+	ESP_LOGI(TAG, "DTLS handshakes: %u full, %u resumed", stats.full, stats.resumed);
+	coap_dtls_get_rx_stats(&rx_stats);
+	if (rx_stats.pdus > 0) {
+		ESP_LOGI(TAG, "DTLS receive: %u PDUs, %zu bytes copied, %zu per PDU", rx_stats.pdus,
+				 rx_stats.copied, rx_stats.copied / rx_stats.pdus);
+	}
+
+	return 0;
+}
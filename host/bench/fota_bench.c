@@ -0,0 +1,306 @@
+/*
+ * Host benchmark driver for the squidward FOTA stages.
+ *
+ * Feeds a firmware image in network sized blocks into a file backed
+ * partition with simulated flash timing (see sq_fota_part.h), either
+ * through the flash writer task or writing synchronously like the apps
+ * used to do, and prints one CSV row per mode. The "ahead" mode also
+ * erases sectors ahead of the write pointer while the writer task waits
+ * for blocks, so erase_stall_us shows how much erasing still holds up
+ * writes. The partition is read back
+ * and compared with the image at the end. With a manifest (-m), the image
+ * is also hashed on its way to the partition and verified against it, and
+ * a resumed download is run as well: the transfer is stopped halfway, and
+ * continued from the checkpoint with new stages, as after a reboot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "squidward/sq_fota.h"
+#include "sq_fota_part.h"
+
+const char *TAG = "fota_bench";
+
+static uint8_t *image;
+static size_t image_len;
+
+static const char *part_path = "build/fota/partition.bin";
+static char ckpt_path[256];
+static size_t block_size = 1024;
+static uint32_t net_us = 10000;		/* time to receive one block */
+static sq_fota_manifest_t manifest;
+static int has_manifest;
+
+static long diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static int load_image(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Could not open %s", path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	image = malloc(len);
+	if (image == NULL || fread(image, 1, len, f) != (size_t)len) {
+		ESP_LOGE(TAG, "Could not read %s", path);
+		fclose(f);
+		return -1;
+	}
+	image_len = len;
+	fclose(f);
+	return 0;
+}
+
+static int load_manifest(const char *path)
+{
+	char buf[512];
+	size_t len;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Could not open %s", path);
+		return -1;
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	if (sq_fota_manifest_parse(&manifest, buf, len) != SQ_FOTA_OK) {
+		return -1;
+	}
+	has_manifest = 1;
+	return 0;
+}
+
+static int check_partition(sq_fota_part_t *part)
+{
+	uint8_t *data = malloc(image_len);
+	int res;
+
+	if (data == NULL) {
+		return -1;
+	}
+	res = sq_fota_part_read(part, 0, data, image_len) == 0 && memcmp(data, image, image_len) == 0 ? 0 : -1;
+	free(data);
+	return res;
+}
+
+static int bench_mode(const char *mode, int async, int ahead)
+{
+	sq_fota_part_t part;
+	sq_fota_writer_t writer;
+	sq_fota_hash_t hash;
+	sq_fota_sink_t sink;
+	struct timespec start, end;
+	size_t off;
+	int res = 0;
+
+	/* Partitions are a whole number of sectors */
+	if (sq_fota_part_open(&part, part_path,
+						  (image_len + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1)) != SQ_FOTA_OK) {
+		return -1;
+	}
+	sink.write = sq_fota_part_write;
+	sink.arg = &part;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (has_manifest) {
+		sq_fota_hash_init(&hash, &sink);
+		sink.write = sq_fota_hash_write;
+		sink.arg = &hash;
+	}
+	if (async && sq_fota_writer_init(&writer, &sink) != SQ_FOTA_OK) {
+		sq_fota_part_close(&part);
+		return -1;
+	}
+	if (async) {
+		sink.write = sq_fota_writer_write;
+		sink.arg = &writer;
+	}
+	if (async && ahead) {
+		/* The manifest size, the image is all there is */
+		sq_fota_part_set_size(&part, image_len);
+		sq_fota_writer_set_idle(&writer, sq_fota_part_erase_ahead, &part);
+	}
+
+	for (off = 0; off < image_len && res == 0; off += block_size) {
+		size_t len = image_len - off < block_size ? image_len - off : block_size;
+
+		/* Waiting for the next block from the network */
+		usleep(net_us);
+		res = sink.write(sink.arg, image + off, len);
+	}
+
+	if (async && sq_fota_writer_finish(&writer) != SQ_FOTA_OK) {
+		res = -1;
+	}
+	if (res == 0 && has_manifest && sq_fota_hash_verify(&hash, &manifest) != SQ_FOTA_OK) {
+		res = -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (res == 0 && check_partition(&part) != 0) {
+		ESP_LOGE(TAG, "Partition differs from the image");
+		res = -1;
+	}
+
+	printf("%s,%u,%u,%ld,%llu,%u,%u,%u,%llu,%s\n",
+		   mode, (unsigned int)image_len, (unsigned int)((image_len + block_size - 1) / block_size),
+		   diff_us(&start, &end), (unsigned long long)part.busy_us,
+		   async ? writer.stalls : 0, part.sectors_erased, part.sectors_ahead,
+		   (unsigned long long)part.stall_us, res == 0 ? "ok" : "fail");
+	fflush(stdout);
+
+	sq_fota_part_close(&part);
+	return res;
+}
+
+/**
+ * @brief Feed the image from off to end through the writer, hash and checkpoint stages.
+ */
+static int resume_run(sq_fota_part_t *part, size_t end, uint32_t *offset, uint32_t *saves)
+{
+	sq_fota_writer_t writer;
+	sq_fota_hash_t hash;
+	sq_fota_resume_t resume;
+	sq_fota_sink_t sink = { .write = sq_fota_part_write, .arg = part };
+	sq_fota_sink_t resume_sink = { .write = sq_fota_resume_write, .arg = &resume };
+	size_t off;
+	int res = 0;
+
+	sq_fota_hash_init(&hash, &resume_sink);
+	off = sq_fota_resume_init(&resume, &sink, &hash, 0, manifest.sha256, block_size);
+	if (sq_fota_part_seek(part, off) != SQ_FOTA_OK) {
+		return -1;
+	}
+	sink.write = sq_fota_hash_write;
+	sink.arg = &hash;
+	if (sq_fota_writer_init(&writer, &sink) != SQ_FOTA_OK) {
+		return -1;
+	}
+
+	for (; off < end && res == 0; off += block_size) {
+		size_t len = end - off < block_size ? end - off : block_size;
+
+		usleep(net_us);
+		res = sq_fota_writer_write(&writer, image + off, len);
+	}
+	if (sq_fota_writer_finish(&writer) != SQ_FOTA_OK) {
+		res = -1;
+	}
+
+	if (res == 0 && end < image_len) {
+		/* Link lost, keep what is in flash */
+		res = sq_fota_resume_save(&resume) == SQ_FOTA_OK ? 0 : -1;
+	} else if (res == 0) {
+		sq_fota_checkpoint_clear();
+		res = sq_fota_hash_verify(&hash, &manifest) == SQ_FOTA_OK ? 0 : -1;
+	}
+	*offset = resume.ckpt.offset;
+	*saves += resume.saves;
+	return res;
+}
+
+static int bench_resume(void)
+{
+	sq_fota_part_t part;
+	struct timespec start, end;
+	uint32_t stopped = 0, offset = 0, saves = 0;
+	uint32_t erased;
+	int res;
+
+	sq_fota_checkpoint_clear();
+	if (sq_fota_part_open(&part, part_path,
+						  (image_len + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1)) != SQ_FOTA_OK) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Stopped halfway, at a block boundary */
+	res = resume_run(&part, image_len / 2 / block_size * block_size, &stopped, &saves);
+	erased = part.sectors_erased;
+	if (res == 0) {
+		res = resume_run(&part, image_len, &offset, &saves);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (res == 0 && check_partition(&part) != 0) {
+		ESP_LOGE(TAG, "Partition differs from the image");
+		res = -1;
+	}
+	ESP_LOGI(TAG, "Resumed at %u bytes, %u sectors erased before, %u checkpoints", stopped, erased, saves);
+
+	printf("%s,%u,%u,%ld,%llu,%u,%u,%u,%llu,%s\n",
+		   "resume", (unsigned int)image_len, (unsigned int)((image_len + block_size - 1) / block_size),
+		   diff_us(&start, &end), (unsigned long long)part.busy_us,
+		   0, part.sectors_erased, part.sectors_ahead, (unsigned long long)part.stall_us,
+		   res == 0 ? "ok" : "fail");
+	fflush(stdout);
+
+	sq_fota_part_close(&part);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image_path = NULL;
+	const char *slash;
+	int opt;
+	int res = 0;
+
+	while ((opt = getopt(argc, argv, "i:m:p:b:n:")) != -1) {
+		switch (opt) {
+			case 'i':
+				image_path = optarg;
+				break;
+			case 'm':
+				if (load_manifest(optarg) != 0) {
+					return 1;
+				}
+				break;
+			case 'p':
+				part_path = optarg;
+				break;
+			case 'b':
+				block_size = atoi(optarg);
+				break;
+			case 'n':
+				net_us = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s -i image [-m manifest] [-p partition file] [-b block size] [-n us per block]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (image_path == NULL || block_size == 0 || load_image(image_path) != 0) {
+		fprintf(stderr, "Usage: %s -i image [-m manifest] [-p partition file] [-b block size] [-n us per block]\n", argv[0]);
+		return 1;
+	}
+	/* Checkpoints go next to the partition file */
+	slash = strrchr(part_path, '/');
+	snprintf(ckpt_path, sizeof(ckpt_path), "%.*scheckpoint.bin",
+			 slash ? (int)(slash - part_path + 1) : 0, part_path);
+	sq_fota_checkpoint_path = ckpt_path;
+
+	printf("mode,bytes,blocks,wall_us,flash_busy_us,stalls,sectors_erased,sectors_ahead,erase_stall_us,result\n");
+	res |= bench_mode("sync", 0, 0);
+	res |= bench_mode("writer", 1, 0);
+	res |= bench_mode("ahead", 1, 1);
+	if (has_manifest) {
+		res |= bench_resume();
+	}
+
+	free(image);
+	return res ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Host harness for delta updates.
+ *
+ * The source image is written to one file backed partition, standing in
+ * for the running one, and the patch (see tools/fota_delta.py) is fed in
+ * network sized blocks through the flash writer and the patch stage into a
+ * second partition, like the apps do. A compressed patch (see
+ * tools/fota_compress.py) is decompressed on its way. The result is hashed on its way and,
+ * with -n, compared with the new image. Prints one CSV row.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "squidward/sq_fota.h"
+#include "sq_fota_part.h"
+
+const char *TAG = "fota_delta";
+
+static const char *source_path = "build/fota/running.bin";
+static const char *part_path = "build/fota/partition.bin";
+static size_t block_size = 1024;
+
+static long diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static uint8_t *load_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *data;
+	long size;
+
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Could not open %s", path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if (data == NULL || fread(data, 1, size, f) != (size_t)size) {
+		ESP_LOGE(TAG, "Could not read %s", path);
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+/* What esp_partition_get_sha256 gives for an app partition */
+static void image_id(const uint8_t *image, size_t len, uint8_t *sha256)
+{
+	if (len > 24 + SQ_FOTA_HASH_LEN && image[0] == 0xe9 && image[23] == 1) {
+		memcpy(sha256, image + len - SQ_FOTA_HASH_LEN, SQ_FOTA_HASH_LEN);
+	} else {
+		mbedtls_sha256_ret(image, len, sha256, 0);
+	}
+}
+
+static int source_read(void *arg, size_t offset, uint8_t *data, size_t len)
+{
+	return sq_fota_part_read((sq_fota_part_t *) arg, offset, data, len);
+}
+
+static size_t part_size(size_t len)
+{
+	return (len + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *usage = "Usage: %s -s source image -d patch [-n new image] [-b block size]\n";
+	uint8_t *source = NULL, *patch = NULL, *expect = NULL, *result = NULL;
+	size_t source_len = 0, patch_len = 0, expect_len = 0;
+	uint8_t source_sha256[SQ_FOTA_HASH_LEN];
+	sq_fota_part_t running, part;
+	sq_fota_writer_t writer;
+	sq_fota_delta_t delta;
+	static sq_fota_lz_t lz;
+	sq_fota_hash_t hash;
+	sq_fota_sink_t sink;
+	struct timespec start, end;
+	size_t off;
+	int opt;
+	int res = 0;
+
+	while ((opt = getopt(argc, argv, "s:d:n:b:")) != -1) {
+		switch (opt) {
+			case 's':
+				source = load_file(optarg, &source_len);
+				break;
+			case 'd':
+				patch = load_file(optarg, &patch_len);
+				break;
+			case 'n':
+				expect = load_file(optarg, &expect_len);
+				break;
+			case 'b':
+				block_size = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				return 1;
+		}
+	}
+	if (source == NULL || patch == NULL || block_size == 0) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	/* The running partition, flashed beforehand */
+	if (sq_fota_part_open(&running, source_path, part_size(source_len)) != SQ_FOTA_OK) {
+		return 1;
+	}
+	running.erase_us = running.write_us = 0;
+	if (sq_fota_part_write(&running, source, source_len) != 0) {
+		return 1;
+	}
+	image_id(source, source_len, source_sha256);
+
+	/* The update partition, as large as the patch could make the image */
+	if (sq_fota_part_open(&part, part_path, part_size(expect ? expect_len : 4 * 1024 * 1024)) != SQ_FOTA_OK) {
+		return 1;
+	}
+	sink.write = sq_fota_part_write;
+	sink.arg = &part;
+	sq_fota_hash_init(&hash, &sink);
+	sink.write = sq_fota_hash_write;
+	sink.arg = &hash;
+	sq_fota_delta_init(&delta, &sink, source_read, &running, source_sha256);
+	sink.write = sq_fota_delta_write;
+	sink.arg = &delta;
+	sq_fota_lz_init(&lz, &sink);
+	sink.write = sq_fota_lz_write;
+	sink.arg = &lz;
+	if (sq_fota_writer_init(&writer, &sink) != SQ_FOTA_OK) {
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (off = 0; off < patch_len && res == 0; off += block_size) {
+		size_t len = patch_len - off < block_size ? patch_len - off : block_size;
+		res = sq_fota_writer_write(&writer, patch + off, len);
+	}
+	if (sq_fota_writer_finish(&writer) != SQ_FOTA_OK || sq_fota_lz_finish(&lz) != SQ_FOTA_OK ||
+		sq_fota_delta_finish(&delta) != SQ_FOTA_OK) {
+		res = -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* The patch header carries the size and digest of the new image */
+	if (res == 0 && delta.new_size != 0xffffffff) {
+		sq_fota_manifest_t manifest = { .size = delta.new_size, .has_sha256 = 1 };
+
+		memcpy(manifest.sha256, delta.hdr + 8 + SQ_FOTA_HASH_LEN, SQ_FOTA_HASH_LEN);
+		if (sq_fota_hash_verify(&hash, &manifest) != SQ_FOTA_OK) {
+			res = -1;
+		}
+	}
+	if (res == 0 && expect != NULL) {
+		result = malloc(expect_len ? expect_len : 1);
+		if (result == NULL || hash.len != expect_len ||
+			sq_fota_part_read(&part, 0, result, expect_len) != 0 || memcmp(result, expect, expect_len) != 0) {
+			ESP_LOGE(TAG, "Partition differs from the new image");
+			res = -1;
+		}
+	}
+
+	printf("patch_bytes,image_bytes,copied,added,inserted,wall_us,flash_busy_us,result\n");
+	printf("%u,%u,%u,%u,%u,%ld,%llu,%s\n", lz.in_bytes, hash.len, delta.copied, delta.added,
+		   delta.inserted, diff_us(&start, &end), (unsigned long long)part.busy_us, res == 0 ? "ok" : "fail");
+
+	sq_fota_part_close(&running);
+	sq_fota_part_close(&part);
+	free(source);
+	free(patch);
+	free(expect);
+	free(result);
+	return res ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Host round trip of compressed images through the decompression stage.
+ *
+ * A compressed image (see tools/fota_compress.py) is fed through
+ * sq_fota_lz in chunks of random size, as they come from the network, and
+ * the result is compared with the original image. Prints one CSV row with
+ * the compression ratio and the time spent decompressing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "squidward/sq_fota.h"
+
+const char *TAG = "fota_lz";
+
+static uint8_t *result;
+static size_t result_len;
+static size_t result_max;
+
+static long diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static uint8_t *load_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *data;
+	long size;
+
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Could not open %s", path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if (data == NULL || fread(data, 1, size, f) != (size_t)size) {
+		ESP_LOGE(TAG, "Could not read %s", path);
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+static int result_write(void *arg, const uint8_t *data, size_t len)
+{
+	if (result_len + len > result_max) {
+		ESP_LOGE(TAG, "Decompressed image larger than the original");
+		return -1;
+	}
+	memcpy(result + result_len, data, len);
+	result_len += len;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *usage = "Usage: %s -i image -z compressed image [-b largest chunk] [-s seed]\n";
+	uint8_t *image = NULL, *comp = NULL;
+	size_t image_len = 0, comp_len = 0;
+	size_t max_chunk = 1024;
+	unsigned int seed = 1;
+	sq_fota_sink_t sink = { .write = result_write, .arg = NULL };
+	static sq_fota_lz_t lz;
+	struct timespec start, end;
+	unsigned int chunks = 0;
+	size_t off;
+	int opt;
+	int res = 0;
+
+	while ((opt = getopt(argc, argv, "i:z:b:s:")) != -1) {
+		switch (opt) {
+			case 'i':
+				image = load_file(optarg, &image_len);
+				break;
+			case 'z':
+				comp = load_file(optarg, &comp_len);
+				break;
+			case 'b':
+				max_chunk = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				return 1;
+		}
+	}
+	if (image == NULL || comp == NULL || max_chunk == 0) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	result_max = image_len;
+	result = malloc(result_max ? result_max : 1);
+	if (result == NULL) {
+		return 1;
+	}
+	srand(seed);
+	sq_fota_lz_init(&lz, &sink);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (off = 0; off < comp_len && res == 0; chunks++) {
+		size_t len = 1 + rand() % max_chunk;
+
+		if (len > comp_len - off) {
+			len = comp_len - off;
+		}
+		res = sq_fota_lz_write(&lz, comp + off, len);
+		off += len;
+	}
+	if (res == 0 && sq_fota_lz_finish(&lz) != SQ_FOTA_OK) {
+		res = -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (res == 0 && (result_len != image_len || memcmp(result, image, image_len) != 0)) {
+		ESP_LOGE(TAG, "Decompressed image differs from the original");
+		res = -1;
+	}
+
+	printf("image_bytes,compressed_bytes,ratio,chunks,decode_us,result\n");
+	printf("%u,%u,%.3f,%u,%ld,%s\n", (unsigned int)image_len, (unsigned int)comp_len,
+		   image_len ? (double)comp_len / image_len : 0.0, chunks, diff_us(&start, &end),
+		   res == 0 ? "ok" : "fail");
+
+	free(image);
+	free(comp);
+	free(result);
+	return res ? 1 : 0;
+}
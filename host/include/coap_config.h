@@ -0,0 +1,57 @@
+/*
+ * libcoap configure implementation for the host (Linux) build.
+ *
+ * Same as the ESP32 port header, but without ESPIDF_VERSION so that
+ * coap_mbedtls.c uses the plain mbedTLS code paths.
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#ifndef WITH_POSIX
+#define WITH_POSIX
+#endif
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+#define HAVE_SYS_SOCKET_H
+#define HAVE_SYS_SELECT_H
+#define HAVE_SYS_UIO_H
+#define HAVE_UNISTD_H
+#define HAVE_MALLOC
+#define HAVE_ARPA_INET_H
+#define HAVE_TIME_H
+#define HAVE_NETDB_H
+#define HAVE_NETINET_IN_H
+#define HAVE_STDIO_H
+#define HAVE_ASSERT_H
+#define HAVE_LIMITS_H
+#define HAVE_STRNLEN 1
+
+#define HAVE_MBEDTLS
+#define COAP_CONSTRAINED_STACK 0
+
+#define PACKAGE_NAME "libcoap-posix"
+#define PACKAGE_VERSION "?"
+#define PACKAGE_STRING PACKAGE_NAME PACKAGE_VERSION
+
+#define COAP_RESOURCES_NOHASH
+
+#ifdef CONFIG_COAP_MEM_POOL
+/*
+ * libcoap allocates with malloc() and realloc() directly (mem.c, pdu.c),
+ * route those through the pools.
+ */
+#include <stdlib.h>
+#include "coap_mem_pool.h"
+#define malloc(size) coap_mem_malloc(size)
+#define calloc(nmemb, size) coap_mem_calloc(nmemb, size)
+#define realloc(ptr, size) coap_mem_realloc(ptr, size)
+#define free(ptr) coap_mem_free(ptr)
+#endif
+
+#endif /* _CONFIG_H_ */
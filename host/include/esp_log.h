@@ -0,0 +1,16 @@
+/*
+ * Minimal replacement of the ESP-IDF logging macros for the host build.
+ * Everything is written to stderr, so that stdout only holds results.
+ */
+#ifndef SQ_HOST_ESP_LOG_H
+#define SQ_HOST_ESP_LOG_H
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...)	fprintf(stderr, "E (%s): " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...)	fprintf(stderr, "W (%s): " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)	fprintf(stderr, "I (%s): " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...)	fprintf(stderr, "D (%s): " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...)	fprintf(stderr, "V (%s): " fmt "\n", tag, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Host replacement for the parts of FreeRTOS used by the squidward
+ * components, implemented with pthreads in host/port/freertos_host.c.
+ */
+#ifndef SQ_HOST_FREERTOS_H
+#define SQ_HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t	TickType_t;
+typedef long		BaseType_t;
+typedef unsigned long	UBaseType_t;
+
+#define pdTRUE		((BaseType_t)1)
+#define pdFALSE		((BaseType_t)0)
+#define pdPASS		pdTRUE
+#define pdFAIL		pdFALSE
+
+#define portMAX_DELAY			((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS		((TickType_t)1)
+#define portTICK_RATE_MS		portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)		((TickType_t)(ms))
+
+#endif
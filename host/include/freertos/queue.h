@@ -0,0 +1,15 @@
+#ifndef SQ_HOST_FREERTOS_QUEUE_H
+#define SQ_HOST_FREERTOS_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sq_host_queue *QueueHandle_t;
+typedef QueueHandle_t xQueueHandle;
+
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+BaseType_t xQueueSend(QueueHandle_t, const void *, TickType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void *, TickType_t);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t);
+void vQueueDelete(QueueHandle_t);
+
+#endif
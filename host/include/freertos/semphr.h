@@ -0,0 +1,14 @@
+#ifndef SQ_HOST_FREERTOS_SEMPHR_H
+#define SQ_HOST_FREERTOS_SEMPHR_H
+
+#include "freertos/queue.h"
+
+/* Like in FreeRTOS, a binary semaphore is a queue of length one without data */
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary()	xQueueCreate(1, 0)
+#define xSemaphoreGive(s)			xQueueSend((s), NULL, 0)
+#define xSemaphoreTake(s, t)		xQueueReceive((s), NULL, (t))
+#define vSemaphoreDelete(s)			vQueueDelete(s)
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef SQ_HOST_FREERTOS_TASK_H
+#define SQ_HOST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct sq_host_task *TaskHandle_t;
+
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *);
+void vTaskDelete(TaskHandle_t);
+void vTaskDelay(TickType_t);
+TickType_t xTaskGetTickCount(void);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Host replacement for the sdkconfig.h generated by menuconfig.
+ *
+ * The security mode (CONFIG_COAP_MBEDTLS_PSK or CONFIG_COAP_MBEDTLS_PKI)
+ * and the server URI are given by the host Makefile, one binary per
+ * configuration, just as the config folders do for the ESP32 builds.
+ */
+#ifndef SQ_HOST_SDKCONFIG_H
+#define SQ_HOST_SDKCONFIG_H
+
+#ifndef CONFIG_SQ_COAP_URI
+#define CONFIG_SQ_COAP_URI			"coaps://127.0.0.1"
+#endif
+#define CONFIG_SQ_COAP_LOG_LEVEL	4
+#define CONFIG_SQ_COAP_TIME_SEC		5
+#define CONFIG_SQ_COAP_PSK_KEY		"password"
+#define CONFIG_SQ_COAP_PSK_IDENTITY	"squidward"
+#define CONFIG_SQ_COAP_BLOCK_WINDOW	4
+#define CONFIG_SQ_COAP_BLOCK_SZX	6
+#define CONFIG_SQ_COAP_BLOCK_ADAPTIVE	1
+#define CONFIG_SQ_COAP_BLOCK_SZX_MIN	2
+#define CONFIG_SQ_COAP_BLOCK_TIMEOUT_MS	2000
+#define CONFIG_SQ_COAP_BLOCK1_SZX	6
+#define CONFIG_SQ_COAP_BLOCK1_WINDOW	1
+#define CONFIG_SQ_COAP_BATCH_BYTES		1024
+#define CONFIG_SQ_COAP_BATCH_RECORDS	16
+#define CONFIG_SQ_COAP_BATCH_DEADLINE_MS	5000
+#define CONFIG_SQ_COAP_REQ_MAX		8
+#define CONFIG_SQ_COAP_REQ_NSTART	4
+#define CONFIG_SQ_COAP_REQ_ACK_TIMEOUT_MS	2000
+#define CONFIG_SQ_COAP_TELEMETRY_NON	1
+#define CONFIG_SQ_COAP_TELEMETRY_BUFFER	16
+#define CONFIG_SQ_COAP_TELEMETRY_MSG_MAX	128
+#define CONFIG_SQ_COAP_TELEMETRY_ACK_EVERY	8
+#define CONFIG_SQ_COAP_TELEMETRY_ACK_TIMEOUT_MS	2000
+
+#define CONFIG_SQ_FOTA_WRITER_BUFFERS	2
+#define CONFIG_SQ_FOTA_WRITER_PRIO		4
+#define CONFIG_SQ_FOTA_WRITER_STACK		3072
+#define CONFIG_SQ_FOTA_ERASE_AHEAD_KB	64
+#define CONFIG_SQ_FOTA_LZ				1
+#define CONFIG_SQ_FOTA_RESUME			1
+#define CONFIG_SQ_FOTA_CHECKPOINT_KB	32
+#define CONFIG_SQ_FOTA_LZ_WINDOW		12
+
+#define CONFIG_COAP_MEM_POOL_SMALL_BLOCKS	32
+#define CONFIG_COAP_MEM_POOL_PDU_BLOCKS	8
+#define CONFIG_COAP_MEM_POOL_MTU_BLOCKS	4
+#define CONFIG_COAP_MEM_ARENA_KB		24
+
+#define CONFIG_MBEDTLS_TLS_CLIENT	1
+
+#endif
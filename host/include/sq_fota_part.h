@@ -0,0 +1,46 @@
+/*
+ * File backed stand-in for an OTA partition, used as the last sink of the
+ * FOTA stages in the host build. Flash timing is simulated: a sector is
+ * erased on the first write to it, or ahead of the write pointer by
+ * sq_fota_part_erase_ahead like sq_fota_flash does, and erase and program
+ * take the time given in erase_us and write_us.
+ */
+#ifndef SQ_HOST_FOTA_PART_H
+#define SQ_HOST_FOTA_PART_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Typical SPI NOR flash, 4 KiB sector erase and page program per KiB */
+#define SQ_FOTA_PART_ERASE_US	45000
+#define SQ_FOTA_PART_WRITE_US	2800
+
+typedef struct {
+	int			fd;
+	size_t		size;
+	size_t		offset;		/* write pointer */
+	size_t		erased;		/* bytes erased from the start of the partition */
+	size_t		end;		/* erase ahead no further than this */
+	size_t		ahead;		/* bytes to keep erased ahead of offset */
+	uint32_t	erase_us;
+	uint32_t	write_us;
+
+	/* Statistics */
+	uint32_t	sectors_erased;
+	uint32_t	sectors_ahead;	/* of those, erased while idle */
+	uint64_t	busy_us;		/* simulated flash busy time */
+	uint64_t	stall_us;		/* in erases holding up a write */
+} sq_fota_part_t;
+
+int sq_fota_part_open(sq_fota_part_t *, const char *path, size_t size);
+int sq_fota_part_seek(sq_fota_part_t *, size_t offset);
+void sq_fota_part_set_size(sq_fota_part_t *, size_t);
+int sq_fota_part_erase_ahead(void *);
+int sq_fota_part_write(void *, const uint8_t *, size_t);
+int sq_fota_part_read(sq_fota_part_t *, size_t offset, uint8_t *, size_t);
+void sq_fota_part_close(sq_fota_part_t *);
+
+/* File the checkpoints of the FOTA stages go to instead of NVS, sq_fota_checkpoint_host.c */
+extern const char *sq_fota_checkpoint_path;
+
+#endif
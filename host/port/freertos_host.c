@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+/*
+ * Host version of the FreeRTOS tasks and queues used by the components.
+ * Tasks are detached threads, queues are ring buffers protected by a mutex.
+ * Priorities and stack sizes are ignored.
+ */
+
+struct sq_host_queue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint8_t			*items;
+	UBaseType_t		length;
+	UBaseType_t		item_size;
+	UBaseType_t		count;
+	UBaseType_t		head;
+};
+
+typedef struct {
+	TaskFunction_t	func;
+	void			*arg;
+} host_task_start_t;
+
+static void *host_task_start(void *p)
+{
+	host_task_start_t start = *(host_task_start_t *) p;
+
+	free(p);
+	start.func(start.arg);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack, void *arg,
+					   UBaseType_t prio, TaskHandle_t *handle)
+{
+	pthread_t thread;
+	host_task_start_t *start = malloc(sizeof(*start));
+
+	if (start == NULL) {
+		return pdFAIL;
+	}
+	start->func = func;
+	start->arg = arg;
+	if (pthread_create(&thread, NULL, host_task_start, start) != 0) {
+		free(start);
+		return pdFAIL;
+	}
+	pthread_detach(thread);
+	if (handle) {
+		*handle = NULL;
+	}
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	/* Only deleting the calling task is supported */
+	pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	struct timespec ts = {
+		.tv_sec = ticks / 1000,
+		.tv_nsec = (ticks % 1000) * 1000000L
+	};
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+		;
+	}
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	QueueHandle_t q = calloc(1, sizeof(*q));
+
+	if (q == NULL) {
+		return NULL;
+	}
+	q->items = calloc(length, item_size ? item_size : 1);
+	if (q->items == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->length = length;
+	q->item_size = item_size;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	return q;
+}
+
+/* Wait on the queue condition, returns 0 on timeout */
+static int host_queue_wait(QueueHandle_t q, TickType_t ticks, const struct timespec *deadline)
+{
+	if (ticks == 0) {
+		return 0;
+	}
+	if (ticks == portMAX_DELAY) {
+		pthread_cond_wait(&q->cond, &q->lock);
+		return 1;
+	}
+	return pthread_cond_timedwait(&q->cond, &q->lock, deadline) != ETIMEDOUT;
+}
+
+static void host_deadline(TickType_t ticks, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += ticks / 1000;
+	deadline->tv_nsec += (ticks % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+	struct timespec deadline;
+
+	host_deadline(ticks, &deadline);
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->length) {
+		if (!host_queue_wait(q, ticks, &deadline)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	if (q->item_size) {
+		memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+	}
+	q->count++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+	struct timespec deadline;
+
+	host_deadline(ticks, &deadline);
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0) {
+		if (!host_queue_wait(q, ticks, &deadline)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	if (q->item_size) {
+		memcpy(item, q->items + q->head * q->item_size, q->item_size);
+	}
+	q->head = (q->head + 1) % q->length;
+	q->count--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	UBaseType_t count;
+
+	pthread_mutex_lock(&q->lock);
+	count = q->count;
+	pthread_mutex_unlock(&q->lock);
+	return count;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->items);
+	free(q);
+}
@@ -0,0 +1,40 @@
+/*
+ * Host replacement for the NVS storage of FOTA checkpoints, a file.
+ */
+#include <stdio.h>
+
+#include "squidward/sq_fota.h"
+#include "sq_fota_part.h"
+
+const char *sq_fota_checkpoint_path = "build/fota/checkpoint.bin";
+
+int sq_fota_checkpoint_load(sq_fota_checkpoint_t *ckpt)
+{
+	FILE *f = fopen(sq_fota_checkpoint_path, "rb");
+	size_t len;
+
+	if (f == NULL) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	len = fread(ckpt, 1, sizeof(*ckpt), f);
+	fclose(f);
+	return len == sizeof(*ckpt) ? SQ_FOTA_OK : SQ_FOTA_ERR_FAIL;
+}
+
+int sq_fota_checkpoint_store(const sq_fota_checkpoint_t *ckpt)
+{
+	FILE *f = fopen(sq_fota_checkpoint_path, "wb");
+	size_t len;
+
+	if (f == NULL) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	len = fwrite(ckpt, 1, sizeof(*ckpt), f);
+	fclose(f);
+	return len == sizeof(*ckpt) ? SQ_FOTA_OK : SQ_FOTA_ERR_FAIL;
+}
+
+void sq_fota_checkpoint_clear(void)
+{
+	remove(sq_fota_checkpoint_path);
+}
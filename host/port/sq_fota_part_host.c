@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "sq_fota_part.h"
+#include "squidward/sq_fota.h"
+
+static void part_busy(sq_fota_part_t *part, uint64_t us)
+{
+	part->busy_us += us;
+	if (us > 0) {
+		usleep(us);
+	}
+}
+
+/**
+ * @brief Open (or create) the file backing a partition of size bytes.
+ */
+int sq_fota_part_open(sq_fota_part_t *part, const char *path, size_t size)
+{
+	memset(part, 0, sizeof(*part));
+	part->erase_us = SQ_FOTA_PART_ERASE_US;
+	part->write_us = SQ_FOTA_PART_WRITE_US;
+	part->size = size;
+
+	part->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (part->fd < 0) {
+		ESP_LOGE(TAG, "Could not open partition file %s", path);
+		return SQ_FOTA_ERR_FAIL;
+	}
+	if (ftruncate(part->fd, size) != 0) {
+		ESP_LOGE(TAG, "Could not resize partition file %s", path);
+		close(part->fd);
+		return SQ_FOTA_ERR_FAIL;
+	}
+	return SQ_FOTA_OK;
+}
+
+/**
+ * @brief Continue writing at offset, like sq_fota_flash_begin does when resuming.
+ *
+ * What is before offset is kept, and so is the rest of its sector.
+ */
+int sq_fota_part_seek(sq_fota_part_t *part, size_t offset)
+{
+	if (offset > part->size) {
+		return SQ_FOTA_ERR_FAIL;
+	}
+	part->offset = offset;
+	part->erased = (offset + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1);
+	return SQ_FOTA_OK;
+}
+
+/**
+ * @brief Erase ahead up to the image size, like sq_fota_flash_set_size.
+ */
+void sq_fota_part_set_size(sq_fota_part_t *part, size_t size)
+{
+	size = (size + SQ_FOTA_SECTOR_SIZE - 1) & ~(SQ_FOTA_SECTOR_SIZE - 1);
+	part->end = size < part->size ? size : part->size;
+	part->ahead = SQ_FOTA_ERASE_AHEAD;
+}
+
+static int part_erase(sq_fota_part_t *part)
+{
+	static const uint8_t erased[SQ_FOTA_SECTOR_SIZE] = { [0 ... SQ_FOTA_SECTOR_SIZE - 1] = 0xff };
+
+	if (pwrite(part->fd, erased, sizeof(erased), part->erased) != sizeof(erased)) {
+		return -1;
+	}
+	part->erased += SQ_FOTA_SECTOR_SIZE;
+	part->sectors_erased++;
+	part_busy(part, part->erase_us);
+	return 0;
+}
+
+/**
+ * @brief Erase the next sector ahead of the write pointer, like
+ * sq_fota_flash_erase_ahead. Usable as idle work of the writer task.
+ */
+int sq_fota_part_erase_ahead(void *arg)
+{
+	sq_fota_part_t *part = (sq_fota_part_t *) arg;
+	size_t limit = part->offset + part->ahead;
+
+	if (limit > part->end) {
+		limit = part->end;
+	}
+	if (part->erased >= limit || part_erase(part) != 0) {
+		return 0;
+	}
+	part->sectors_ahead++;
+	return 1;
+}
+
+/**
+ * @brief Append to the partition, like esp_ota_write. Usable as a sink.
+ */
+int sq_fota_part_write(void *arg, const uint8_t *data, size_t len)
+{
+	sq_fota_part_t *part = (sq_fota_part_t *) arg;
+
+	if (part->offset + len > part->size) {
+		ESP_LOGE(TAG, "Write of %u bytes at 0x%x is outside of the partition",
+				 (unsigned int)len, (unsigned int)part->offset);
+		return -1;
+	}
+
+	while (part->erased < part->offset + len) {
+		if (part_erase(part) != 0) {
+			return -1;
+		}
+		part->stall_us += part->erase_us;
+	}
+
+	if (pwrite(part->fd, data, len, part->offset) != (ssize_t)len) {
+		return -1;
+	}
+	part->offset += len;
+	part_busy(part, (uint64_t)part->write_us * len / 1024);
+
+	return 0;
+}
+
+int sq_fota_part_read(sq_fota_part_t *part, size_t offset, uint8_t *data, size_t len)
+{
+	if (offset + len > part->size) {
+		return -1;
+	}
+	return pread(part->fd, data, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+void sq_fota_part_close(sq_fota_part_t *part)
+{
+	if (part->fd >= 0) {
+		close(part->fd);
+		part->fd = -1;
+	}
+}
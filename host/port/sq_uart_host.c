@@ -0,0 +1,64 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+
+#include "squidward/sq_uart.h"
+
+/*
+ * Host version of the annotation UART. There is no Otii to switch, so the
+ * annotations are written to stderr together with a monotonic timestamp,
+ * events as their text.
+ */
+
+#define SQ_UART_ANT_TEXT_ENTRY(name, id, text)	[id] = text,
+static const char *const ant_text[] = {
+	SQ_UART_ANT_EVENTS(SQ_UART_ANT_TEXT_ENTRY)
+};
+#undef SQ_UART_ANT_TEXT_ENTRY
+
+void sq_uart_init()
+{
+}
+
+void sq_uart_ant_init(void)
+{
+}
+
+void sq_uart_ant_flush(void)
+{
+}
+
+const char *sq_uart_ant_text(sq_uart_ant_id_t id)
+{
+	if ((unsigned int)id >= sizeof(ant_text) / sizeof(ant_text[0])) {
+		return NULL;
+	}
+	return ant_text[id];
+}
+
+void sq_uart_ant(sq_uart_ant_id_t id, uint32_t arg)
+{
+	char text[64];
+	const char *fmt = sq_uart_ant_text(id);
+
+	if (fmt != NULL) {
+		snprintf(text, sizeof(text), fmt, arg);
+		sq_uart_send(text, sizeof(text));
+	}
+}
+
+void sq_uart_send(const char *data, size_t len)
+{
+	struct timespec ts;
+	size_t n = strnlen(data, len);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* Annotations normally end with a newline, strip it */
+	if (n > 0 && data[n - 1] == '\n') {
+		n--;
+	}
+	fprintf(stderr, "A %ld.%06ld %.*s\n", (long)ts.tv_sec, ts.tv_nsec / 1000, (int)n, data);
+}
@@ -41,6 +41,7 @@
 #include <mbedtls/platform.h>
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/ssl.h>
+#include <mbedtls/ssl_internal.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/error.h>
@@ -54,6 +55,23 @@
 #include <errno.h>
 #include <arpa/inet.h>
 
+#if defined(CONFIG_COAP_MEM_POOL) && defined(MBEDTLS_PLATFORM_MEMORY) && \
+    (defined(MBEDTLS_PLATFORM_CALLOC_MACRO) || defined(MBEDTLS_PLATFORM_FREE_MACRO))
+/* Blocks allocated here are freed with mbedtls_free() and the other way round */
+#error "CONFIG_COAP_MEM_POOL needs mbedtls_platform_set_calloc_free()"
+#endif /* CONFIG_COAP_MEM_POOL && MBEDTLS_PLATFORM_*_MACRO */
+
+#if defined(CONFIG_COAP_MEM_POOL) && !defined(MBEDTLS_PLATFORM_MEMORY)
+/*
+ * mbedtls_calloc() is calloc() then, which coap_config.h sends to the pools,
+ * while mbedTLS itself frees with the libc free(). Blocks that mbedTLS frees
+ * must come from the libc calloc().
+ */
+#define mbedtls_lib_calloc(n, size) (calloc)(n, size)
+#else /* ! (CONFIG_COAP_MEM_POOL && !MBEDTLS_PLATFORM_MEMORY) */
+#define mbedtls_lib_calloc(n, size) mbedtls_calloc(n, size)
+#endif /* ! (CONFIG_COAP_MEM_POOL && !MBEDTLS_PLATFORM_MEMORY) */
+
 #define mbedtls_malloc(a) malloc(a)
 #define mbedtls_realloc(a,b) realloc(a,b)
 #define mbedtls_strdup(a) strdup(a)
@@ -71,6 +89,19 @@
 
 #define CONFIG_MBEDTLS_DEBUG_LEVEL 4
 
+/*
+ * DTLS retransmission timer given to mbedtls_ssl_set_timer_cb(). The
+ * deadlines are kept in coap_ticks(), a monotonic clock, so that
+ * coap_dtls_get_timeout() can hand the final one to coap_write() as it is
+ * and the run loop sleeps until then. mbedTLS only acts on the final delay
+ * (mbedtls_timing_get_delay() returns 2), the intermediate one is kept for
+ * the callback contract.
+ */
+typedef struct coap_dtls_timer_t {
+  coap_tick_t int_at;   /* intermediate deadline */
+  coap_tick_t fin_at;   /* final deadline, 0 if the timer is cancelled */
+} coap_dtls_timer_t;
+
 typedef struct coap_ssl_t {
   const uint8_t *pdu;
   unsigned pdu_len;
@@ -85,26 +116,43 @@ typedef struct coap_ssl_t {
  */
 typedef struct coap_mbedtls_env_t {
   mbedtls_ssl_context ssl;
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
   mbedtls_ssl_config conf;
-  mbedtls_timing_delay_context timer;
-  mbedtls_x509_crt cacert;
-  mbedtls_x509_crt public_cert;
-  mbedtls_pk_context private_key;
+  coap_dtls_timer_t timer;
   mbedtls_ssl_cookie_ctx cookie_ctx;
   /* If not set, need to do do_mbedtls_handshake */
   int established;
   int seen_client_hello;
+  /* Set if a cached session was offered for an abbreviated handshake */
+  int resume_offered;
+  /* Set while the handshake allocates from the arena of coap_mem_pool.c */
+  int arena_phase;
   coap_ssl_t coap_ssl_data;
+  /* Credentials the configuration points to, see coap_mbedtls_pki_t */
+  struct coap_mbedtls_pki_t *pki;
 } coap_mbedtls_env_t;
 
-typedef struct pki_sni_entry {
-  char *sni;
-  coap_dtls_key_t pki_key;
+/*
+ * Parsed PKI credentials. The ones given by coap_dtls_context_set_pki() are
+ * parsed on first use and then shared by all sessions that use the same
+ * setup data, see pki_cache. The configuration of each session points into
+ * them, so they are counted: the cache holds a reference until other
+ * credentials are needed, each session one until it is freed.
+ */
+typedef struct coap_mbedtls_pki_t {
   mbedtls_x509_crt cacert;
   mbedtls_x509_crt public_cert;
   mbedtls_pk_context private_key;
+  int has_own_cert;
+  int has_ca;
+  int has_root_ca;
+  int loaded;
+  unsigned int refs;
+} coap_mbedtls_pki_t;
+
+typedef struct pki_sni_entry {
+  char *sni;
+  coap_dtls_key_t pki_key;
+  coap_mbedtls_pki_t pki;
 } pki_sni_entry;
 
 #ifdef PSK2_PR
@@ -116,6 +164,10 @@ typedef struct psk_sni_entry {
 
 typedef struct coap_mbedtls_context_t {
   coap_dtls_pki_t setup_data;
+  /* One DRBG for all sessions of the context, seeded on first use */
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  int drbg_seeded;
   size_t pki_sni_count;
   pki_sni_entry *pki_sni_entry_list;
 #ifdef PSK2_PR
@@ -127,6 +179,75 @@ typedef struct coap_mbedtls_context_t {
   int psk_pki_enabled;
 } coap_mbedtls_context_t;
 
+static coap_dtls_handshake_stats_t handshake_stats;
+static coap_dtls_rx_stats_t rx_stats;
+
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+/*
+ * Client session cache, used to offer the last negotiated session (session
+ * ID or session ticket) when connecting to the same server again. It is kept
+ * outside of the coap_context_t, as clients normally set up a new context
+ * for every connection.
+ */
+typedef struct coap_mbedtls_resume_t {
+  int valid;
+  coap_address_t remote;
+  mbedtls_ssl_session session;
+} coap_mbedtls_resume_t;
+
+static coap_mbedtls_resume_t resume_cache;
+
+/*
+ * The PKI credentials parsed last and what they were parsed from. Kept
+ * outside of the coap_context_t like resume_cache, so that the new context
+ * of the next connection does not parse the same PEM/ASN1 data again. The
+ * setup data is compared by pointer, the buffers it points to must not
+ * change while they are in use.
+ */
+typedef struct coap_mbedtls_pki_cache_t {
+  struct coap_mbedtls_pki_t *pki;
+  coap_dtls_pki_t setup_data;
+  coap_dtls_role_t role;
+  char *root_ca_file;
+  char *root_ca_path;
+} coap_mbedtls_pki_cache_t;
+
+static coap_mbedtls_pki_cache_t pki_cache;
+
+/*
+ * Serialized form of resume_cache, see coap_dtls_client_session_export().
+ * The ticket (if any) follows directly after the structure.
+ */
+#define RESUME_BLOB_MAGIC 0x53515253
+
+typedef struct coap_mbedtls_resume_blob_t {
+  uint32_t magic;
+  uint32_t mbedtls_version;
+  coap_address_t remote;
+  int64_t start;
+  int32_t ciphersuite;
+  int32_t compression;
+  uint32_t id_len;
+  unsigned char id[32];
+  unsigned char master[48];
+  uint32_t verify_result;
+  uint32_t ticket_len;
+  uint32_t ticket_lifetime;
+  uint8_t mfl_code;
+  uint8_t trunc_hmac;
+  uint8_t encrypt_then_mac;
+} coap_mbedtls_resume_blob_t;
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+
+/* Nothing to copy when the datagram was received in place, see coap_dtls_rx_buffer() */
+static void coap_dgram_copy(unsigned char *out, const uint8_t *in, size_t len)
+{
+  if (out != in) {
+    memcpy(out, in, len);
+    rx_stats.copied += len;
+  }
+}
+
 static int coap_dgram_read(void *ctx, unsigned char *out, size_t outl)
 {
   ssize_t ret = 0;
@@ -141,13 +262,13 @@ static int coap_dgram_read(void *ctx, unsigned char *out, size_t outl)
   if (out != NULL) {
     if (data != NULL && data->pdu_len > 0) {
       if (outl < data->pdu_len) {
-         memcpy(out, data->pdu, outl);
+         coap_dgram_copy(out, data->pdu, outl);
          ret = outl;
          data->pdu += outl;
          data->pdu_len -= outl;
       }
       else {
-         memcpy(out, data->pdu, data->pdu_len);
+         coap_dgram_copy(out, data->pdu, data->pdu_len);
          ret = data->pdu_len;
          if (!data->peekmode) {
            data->pdu_len = 0;
@@ -190,6 +311,46 @@ coap_dgram_write(void *ctx, const unsigned char *send_buffer,
   return result;
 }
 
+/* callback function given to mbedtls to start or cancel the DTLS timer */
+static void
+coap_dtls_timer_set(void *ctx, uint32_t int_ms, uint32_t fin_ms)
+{
+  coap_dtls_timer_t *timer = (coap_dtls_timer_t *)ctx;
+  coap_tick_t now;
+
+  if (fin_ms == 0) {
+    timer->int_at = 0;
+    timer->fin_at = 0;
+    return;
+  }
+  coap_ticks(&now);
+  timer->int_at = now + (coap_tick_t)int_ms * COAP_TICKS_PER_SECOND / 1000;
+  timer->fin_at = now + (coap_tick_t)fin_ms * COAP_TICKS_PER_SECOND / 1000;
+}
+
+/*
+ * return -1 cancelled
+ *        0   no delay passed
+ *        1   intermediate delay passed
+ *        2   final delay passed
+ */
+/* callback function given to mbedtls to check the DTLS timer */
+static int
+coap_dtls_timer_get(void *ctx)
+{
+  coap_dtls_timer_t *timer = (coap_dtls_timer_t *)ctx;
+  coap_tick_t now;
+
+  if (timer->fin_at == 0)
+    return -1;
+  coap_ticks(&now);
+  if (now >= timer->fin_at)
+    return 2;
+  if (now >= timer->int_at)
+    return 1;
+  return 0;
+}
+
 #if !defined(ESPIDF_VERSION) || defined(CONFIG_MBEDTLS_SSL_PROTO_DTLS)
 static char*
 get_ip_addr(const struct coap_address_t *addr)
@@ -488,15 +649,137 @@ cert_verify_callback_mbedtls(void *data, mbedtls_x509_crt *crt,
   return 0;
 }
 
+static void
+pki_credentials_init(coap_mbedtls_pki_t *pki)
+{
+  mbedtls_x509_crt_init(&pki->cacert);
+  mbedtls_x509_crt_init(&pki->public_cert);
+  mbedtls_pk_init(&pki->private_key);
+  pki->has_own_cert = 0;
+  pki->has_ca = 0;
+  pki->has_root_ca = 0;
+  pki->loaded = 0;
+}
+
+static void
+pki_credentials_free(coap_mbedtls_pki_t *pki)
+{
+  mbedtls_x509_crt_free(&pki->cacert);
+  mbedtls_x509_crt_free(&pki->public_cert);
+  mbedtls_pk_free(&pki->private_key);
+  pki_credentials_init(pki);
+}
+
+static void
+pki_cache_release(coap_mbedtls_pki_t *pki)
+{
+  if (pki && --pki->refs == 0) {
+    pki_credentials_free(pki);
+    free(pki);
+  }
+}
+
+/* Drops the reference of the cache, sessions keep theirs */
+static void
+pki_cache_clear(void)
+{
+  pki_cache_release(pki_cache.pki);
+  free(pki_cache.root_ca_file);
+  free(pki_cache.root_ca_path);
+  memset(&pki_cache, 0, sizeof(pki_cache));
+}
+
 static int
-setup_pki_credentials(mbedtls_x509_crt *cacert,
-                      mbedtls_x509_crt *public_cert,
-                      mbedtls_pk_context *private_key,
-                      coap_mbedtls_env_t *m_env,
-                      coap_mbedtls_context_t *m_context,
-                      coap_session_t *c_session,
-                      coap_dtls_pki_t *setup_data,
-                      coap_dtls_role_t role)
+str_same(const char *a, const char *b)
+{
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/*
+ * Whether new setup data gives the same credentials as the current one, in
+ * which case the parsed ones are kept. libcoap sets it again for every new
+ * client session.
+ */
+static int
+pki_setup_same(const coap_dtls_pki_t *a, const coap_dtls_pki_t *b)
+{
+  const coap_dtls_key_t *ka = &a->pki_key;
+  const coap_dtls_key_t *kb = &b->pki_key;
+
+  if (ka->key_type != kb->key_type)
+    return 0;
+
+  switch (ka->key_type) {
+  case COAP_PKI_KEY_PEM:
+    return ka->key.pem.ca_file == kb->key.pem.ca_file &&
+           ka->key.pem.public_cert == kb->key.pem.public_cert &&
+           ka->key.pem.private_key == kb->key.pem.private_key;
+  case COAP_PKI_KEY_PEM_BUF:
+    return ka->key.pem_buf.ca_cert == kb->key.pem_buf.ca_cert &&
+           ka->key.pem_buf.ca_cert_len == kb->key.pem_buf.ca_cert_len &&
+           ka->key.pem_buf.public_cert == kb->key.pem_buf.public_cert &&
+           ka->key.pem_buf.public_cert_len == kb->key.pem_buf.public_cert_len &&
+           ka->key.pem_buf.private_key == kb->key.pem_buf.private_key &&
+           ka->key.pem_buf.private_key_len == kb->key.pem_buf.private_key_len;
+  case COAP_PKI_KEY_ASN1:
+    return ka->key.asn1.ca_cert == kb->key.asn1.ca_cert &&
+           ka->key.asn1.ca_cert_len == kb->key.asn1.ca_cert_len &&
+           ka->key.asn1.public_cert == kb->key.asn1.public_cert &&
+           ka->key.asn1.public_cert_len == kb->key.asn1.public_cert_len &&
+           ka->key.asn1.private_key == kb->key.asn1.private_key &&
+           ka->key.asn1.private_key_len == kb->key.asn1.private_key_len;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * The cached credentials if they come from the same setup data, otherwise
+ * new ones (not yet parsed) that replace them in the cache.
+ */
+static coap_mbedtls_pki_t *
+pki_cache_get(coap_mbedtls_context_t *m_context,
+              const coap_dtls_pki_t *setup_data,
+              coap_dtls_role_t role)
+{
+  if (pki_cache.pki && pki_cache.role == role &&
+      pki_setup_same(&pki_cache.setup_data, setup_data) &&
+      str_same(pki_cache.root_ca_file, m_context->root_ca_file) &&
+      str_same(pki_cache.root_ca_path, m_context->root_ca_path)) {
+    return pki_cache.pki;
+  }
+
+  pki_cache_clear();
+  pki_cache.pki = (coap_mbedtls_pki_t *)calloc(1, sizeof(coap_mbedtls_pki_t));
+  if (!pki_cache.pki)
+    return NULL;
+  pki_credentials_init(pki_cache.pki);
+  pki_cache.pki->refs = 1;
+  pki_cache.setup_data = *setup_data;
+  pki_cache.role = role;
+  if (m_context->root_ca_file)
+    pki_cache.root_ca_file = mbedtls_strdup(m_context->root_ca_file);
+  if (m_context->root_ca_path)
+    pki_cache.root_ca_path = mbedtls_strdup(m_context->root_ca_path);
+  if ((m_context->root_ca_file && !pki_cache.root_ca_file) ||
+      (m_context->root_ca_path && !pki_cache.root_ca_path)) {
+    pki_cache_clear();
+    return NULL;
+  }
+  return pki_cache.pki;
+}
+
+/*
+ * Parse the certificates and private key given in setup_data.
+ *
+ * return 0 All OK
+ *        -ve Error Code
+ */
+static int
+load_pki_credentials(coap_mbedtls_pki_t *pki,
+                     coap_mbedtls_context_t *m_context,
+                     coap_dtls_pki_t *setup_data,
+                     coap_dtls_role_t role)
 {
   int ret;
 
@@ -507,51 +790,40 @@ setup_pki_credentials(mbedtls_x509_crt *cacert,
         setup_data->pki_key.key.pem.private_key &&
         setup_data->pki_key.key.pem.private_key[0]) {
 
-      mbedtls_x509_crt_init(public_cert);
-      mbedtls_pk_init(private_key);
-
-      ret = mbedtls_x509_crt_parse_file(public_cert,
+      ret = mbedtls_x509_crt_parse_file(&pki->public_cert,
                                     setup_data->pki_key.key.pem.public_cert);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse_file returned -0x%x\n\n",
                  -ret);
-        return ret;
+        goto fail;
       }
 
-      ret = mbedtls_pk_parse_keyfile(private_key,
+      ret = mbedtls_pk_parse_keyfile(&pki->private_key,
                               setup_data->pki_key.key.pem.private_key, NULL);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_pk_parse_keyfile returned -0x%x\n\n", -ret);
-        return ret;
-      }
-
-      ret = mbedtls_ssl_conf_own_cert(&m_env->conf, public_cert, private_key);
-      if (ret < 0) {
-        coap_log(LOG_ERR, "mbedtls_ssl_conf_own_cert returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
+      pki->has_own_cert = 1;
     }
     else if (role == COAP_DTLS_ROLE_SERVER) {
       coap_log(LOG_ERR,
                "***setup_pki: (D)TLS: No %s Certificate + Private "
                "Key defined\n",
                 role == COAP_DTLS_ROLE_SERVER ? "Server" : "Client");
-      return -1;
+      ret = -1;
+      goto fail;
     }
 
     if (setup_data->pki_key.key.pem.ca_file &&
         setup_data->pki_key.key.pem.ca_file[0]) {
-      mbedtls_x509_crt_init(cacert);
-      ret = mbedtls_x509_crt_parse_file(cacert,
+      ret = mbedtls_x509_crt_parse_file(&pki->cacert,
                                         setup_data->pki_key.key.pem.ca_file);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
-      mbedtls_ssl_conf_authmode(&m_env->conf, setup_data->require_peer_cert ?
-                                              MBEDTLS_SSL_VERIFY_REQUIRED :
-                                              MBEDTLS_SSL_VERIFY_OPTIONAL);
-      mbedtls_ssl_conf_ca_chain(&m_env->conf, cacert, NULL);
+      pki->has_ca = 1;
     }
     break;
   case COAP_PKI_KEY_PEM_BUF:
@@ -559,51 +831,41 @@ setup_pki_credentials(mbedtls_x509_crt *cacert,
         setup_data->pki_key.key.pem_buf.public_cert_len &&
         setup_data->pki_key.key.pem_buf.private_key &&
         setup_data->pki_key.key.pem_buf.private_key_len > 0) {
-      mbedtls_x509_crt_init(public_cert);
-      mbedtls_pk_init(private_key);
-      ret = mbedtls_x509_crt_parse(public_cert,
+      ret = mbedtls_x509_crt_parse(&pki->public_cert,
             (const unsigned char *)setup_data->pki_key.key.pem_buf.public_cert,
             setup_data->pki_key.key.pem_buf.public_cert_len);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
 
-      ret = mbedtls_pk_parse_key(private_key,
+      ret = mbedtls_pk_parse_key(&pki->private_key,
             (const unsigned char *)setup_data->pki_key.key.pem_buf.private_key,
             setup_data->pki_key.key.pem_buf.private_key_len, NULL, 0);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_pk_parse_keyfile returned -0x%x\n\n", -ret);
-        return ret;
-      }
-
-      ret = mbedtls_ssl_conf_own_cert(&m_env->conf, public_cert, private_key);
-      if (ret < 0) {
-        coap_log(LOG_ERR, "mbedtls_ssl_conf_own_cert returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
+      pki->has_own_cert = 1;
     } else if (role == COAP_DTLS_ROLE_SERVER) {
       coap_log(LOG_ERR,
               "***setup_pki: (D)TLS: No %s Certificate + Private "
               "Key defined\n",
               role == COAP_DTLS_ROLE_SERVER ? "Server" : "Client");
-      return -1;
+      ret = -1;
+      goto fail;
     }
 
     if (setup_data->pki_key.key.pem_buf.ca_cert &&
         setup_data->pki_key.key.pem_buf.ca_cert_len > 0) {
-      mbedtls_x509_crt_init(cacert);
-      ret = mbedtls_x509_crt_parse(cacert,
+      ret = mbedtls_x509_crt_parse(&pki->cacert,
               (const unsigned char *)setup_data->pki_key.key.pem_buf.ca_cert,
               setup_data->pki_key.key.pem_buf.ca_cert_len);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
-      mbedtls_ssl_conf_authmode(&m_env->conf, setup_data->require_peer_cert ?
-                                              MBEDTLS_SSL_VERIFY_REQUIRED :
-                                              MBEDTLS_SSL_VERIFY_OPTIONAL);
-      mbedtls_ssl_conf_ca_chain(&m_env->conf, cacert, NULL);
+      pki->has_ca = 1;
     }
     break;
   case COAP_PKI_KEY_ASN1:
@@ -612,75 +874,125 @@ setup_pki_credentials(mbedtls_x509_crt *cacert,
         setup_data->pki_key.key.asn1.private_key &&
         setup_data->pki_key.key.asn1.private_key_len > 0) {
 
-      mbedtls_x509_crt_init(public_cert);
-      mbedtls_pk_init(private_key);
-      ret = mbedtls_x509_crt_parse(public_cert,
+      ret = mbedtls_x509_crt_parse(&pki->public_cert,
               (const unsigned char *)setup_data->pki_key.key.asn1.public_cert,
               setup_data->pki_key.key.asn1.public_cert_len);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
 
-      ret = mbedtls_pk_parse_key(private_key,
+      ret = mbedtls_pk_parse_key(&pki->private_key,
               (const unsigned char *)setup_data->pki_key.key.asn1.private_key,
               setup_data->pki_key.key.asn1.private_key_len, NULL, 0);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_pk_parse_keyfile returned -0x%x\n\n", -ret);
-        return ret;
-      }
-
-      ret = mbedtls_ssl_conf_own_cert(&m_env->conf, public_cert, private_key);
-      if (ret < 0) {
-        coap_log(LOG_ERR, "mbedtls_ssl_conf_own_cert returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
+      pki->has_own_cert = 1;
     } else if (role == COAP_DTLS_ROLE_SERVER) {
       coap_log(LOG_ERR,
                "***setup_pki: (D)TLS: No %s Certificate + Private "
                "Key defined\n",
                role == COAP_DTLS_ROLE_SERVER ? "Server" : "Client");
-      return -1;
+      ret = -1;
+      goto fail;
     }
 
     if (setup_data->pki_key.key.asn1.ca_cert &&
         setup_data->pki_key.key.asn1.ca_cert_len > 0) {
-      mbedtls_x509_crt_init(cacert);
-      ret = mbedtls_x509_crt_parse(cacert,
+      ret = mbedtls_x509_crt_parse(&pki->cacert,
                   (const unsigned char *)setup_data->pki_key.key.asn1.ca_cert,
                   setup_data->pki_key.key.asn1.ca_cert_len);
       if (ret < 0) {
         coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-        return ret;
+        goto fail;
       }
-      mbedtls_ssl_conf_authmode(&m_env->conf, setup_data->require_peer_cert ?
-                                              MBEDTLS_SSL_VERIFY_REQUIRED :
-                                              MBEDTLS_SSL_VERIFY_OPTIONAL);
-      mbedtls_ssl_conf_ca_chain(&m_env->conf, cacert, NULL);
+      pki->has_ca = 1;
     }
     break;
   default:
     coap_log(LOG_ERR,
              "***setup_pki: (D)TLS: Unknown key type %d\n",
              setup_data->pki_key.key_type);
-      return -1;
+    ret = -1;
+    goto fail;
   }
 
   if (m_context->root_ca_file) {
-    ret = mbedtls_x509_crt_parse_file(cacert, m_context->root_ca_file);
+    ret = mbedtls_x509_crt_parse_file(&pki->cacert, m_context->root_ca_file);
     if (ret < 0) {
       coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
-      return ret;
+      goto fail;
     }
-    mbedtls_ssl_conf_ca_chain(&m_env->conf, cacert, NULL);
+    pki->has_root_ca = 1;
   }
   if (m_context->root_ca_path) {
-    ret = mbedtls_x509_crt_parse_file(cacert, m_context->root_ca_path);
+    ret = mbedtls_x509_crt_parse_file(&pki->cacert, m_context->root_ca_path);
     if (ret < 0) {
       coap_log(LOG_ERR, "mbedtls_x509_crt_parse returned -0x%x\n\n", -ret);
+      goto fail;
+    }
+    pki->has_root_ca = 1;
+  }
+
+  pki->loaded = 1;
+  return 0;
+
+fail:
+  pki_credentials_free(pki);
+  return ret;
+}
+
+/*
+ * Set up the session configuration with the (cached) PKI credentials. The
+ * session keeps them until it is freed.
+ *
+ * return 0 All OK
+ *        -ve Error Code
+ */
+static int
+setup_pki_credentials(coap_mbedtls_env_t *m_env,
+                      coap_mbedtls_context_t *m_context,
+                      coap_session_t *c_session,
+                      coap_dtls_pki_t *setup_data,
+                      coap_dtls_role_t role)
+{
+  coap_mbedtls_pki_t *pki = pki_cache_get(m_context, setup_data, role);
+  int ret;
+
+  if (!pki) {
+    return -1;
+  }
+  if (!pki->loaded) {
+    ret = load_pki_credentials(pki, m_context, setup_data, role);
+    if (ret < 0) {
+      /* Parsed again from the start next time */
+      pki_cache_clear();
       return ret;
     }
-    mbedtls_ssl_conf_ca_chain(&m_env->conf, cacert, NULL);
+  }
+  if (m_env->pki != pki) {
+    pki_cache_release(m_env->pki);
+    m_env->pki = pki;
+    pki->refs++;
+  }
+
+  if (pki->has_own_cert) {
+    ret = mbedtls_ssl_conf_own_cert(&m_env->conf, &pki->public_cert,
+                                    &pki->private_key);
+    if (ret < 0) {
+      coap_log(LOG_ERR, "mbedtls_ssl_conf_own_cert returned -0x%x\n\n", -ret);
+      return ret;
+    }
+  }
+  if (pki->has_ca) {
+    mbedtls_ssl_conf_authmode(&m_env->conf, setup_data->require_peer_cert ?
+                                            MBEDTLS_SSL_VERIFY_REQUIRED :
+                                            MBEDTLS_SSL_VERIFY_OPTIONAL);
+  }
+  if (pki->has_ca || pki->has_root_ca) {
+    mbedtls_ssl_conf_ca_chain(&m_env->conf, &pki->cacert, NULL);
   }
 
   /*
@@ -693,6 +1005,29 @@ setup_pki_credentials(mbedtls_x509_crt *cacert,
   return 0;
 }
 
+/*
+ * Seed the DRBG of the context, only done for the first session.
+ *
+ * return 0 All OK
+ *        -ve Error Code
+ */
+static int
+seed_context_drbg(coap_mbedtls_context_t *m_context)
+{
+  int ret;
+
+  if (m_context->drbg_seeded) {
+    return 0;
+  }
+  if ((ret = mbedtls_ctr_drbg_seed(&m_context->ctr_drbg,
+                  mbedtls_entropy_func, &m_context->entropy, NULL, 0)) != 0) {
+    coap_log(LOG_ERR, "mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+    return ret;
+  }
+  m_context->drbg_seeded = 1;
+  return 0;
+}
+
 /*
  * PKI SNI callback.
  */
@@ -703,7 +1038,6 @@ pki_sni_callback(void *p_info, mbedtls_ssl_context *ssl,
   unsigned int i;
   coap_dtls_pki_t sni_setup_data;
   coap_session_t *c_session = (coap_session_t *)p_info;
-  coap_mbedtls_env_t *m_env = (coap_mbedtls_env_t *)c_session->tls;
   coap_mbedtls_context_t *m_context =
            (coap_mbedtls_context_t *)c_session->context->dtls_context;
   int ret = 0;
@@ -741,12 +1075,9 @@ pki_sni_callback(void *p_info, mbedtls_ssl_context *ssl,
     m_context->pki_sni_entry_list[i].pki_key = *new_entry;
     sni_setup_data = m_context->setup_data;
     sni_setup_data.pki_key = *new_entry;
-    if ((ret = setup_pki_credentials(&m_context->pki_sni_entry_list[i].cacert,
-                         &m_context->pki_sni_entry_list[i].public_cert,
-                         &m_context->pki_sni_entry_list[i].private_key,
-                         m_env,
+    pki_credentials_init(&m_context->pki_sni_entry_list[i].pki);
+    if ((ret = load_pki_credentials(&m_context->pki_sni_entry_list[i].pki,
                          m_context,
-                         c_session,
                          &sni_setup_data, COAP_DTLS_ROLE_SERVER)) < 0) {
       ret = -1;
       mbedtls_free(name);
@@ -757,11 +1088,11 @@ pki_sni_callback(void *p_info, mbedtls_ssl_context *ssl,
 
 end:
   if (ret != -1) {
-    mbedtls_ssl_set_hs_ca_chain(ssl, &m_context->pki_sni_entry_list[i].cacert,
+    mbedtls_ssl_set_hs_ca_chain(ssl, &m_context->pki_sni_entry_list[i].pki.cacert,
                                 NULL);
     return mbedtls_ssl_set_hs_own_cert(ssl,
-                                &m_context->pki_sni_entry_list[i].public_cert,
-                                &m_context->pki_sni_entry_list[i].private_key);
+                                &m_context->pki_sni_entry_list[i].pki.public_cert,
+                                &m_context->pki_sni_entry_list[i].pki.private_key);
   }
   return ret;
 }
@@ -857,7 +1188,8 @@ static int setup_server_ssl_session(coap_session_t *c_session,
     goto fail;
   }
 
-  mbedtls_ssl_conf_rng(&m_env->conf, mbedtls_ctr_drbg_random, &m_env->ctr_drbg);
+  mbedtls_ssl_conf_rng(&m_env->conf, mbedtls_ctr_drbg_random,
+                       &m_context->ctr_drbg);
 
 #if !defined(ESPIDF_VERSION) || defined(CONFIG_MBEDTLS_SSL_PROTO_DTLS)
   mbedtls_ssl_conf_handshake_timeout(&m_env->conf, 1000, 60000);
@@ -875,8 +1207,7 @@ static int setup_server_ssl_session(coap_session_t *c_session,
 #endif /* !ESPIDF_VERSION || CONFIG_MBEDTLS_SSL_PROTO_DTLS */
 
   if (m_context->psk_pki_enabled & IS_PKI) {
-    ret = setup_pki_credentials(&m_env->cacert, &m_env->public_cert,
-                                &m_env->private_key, m_env, m_context,
+    ret = setup_pki_credentials(m_env, m_context,
                                 c_session, &m_context->setup_data,
                                 COAP_DTLS_ROLE_SERVER);
     if (ret < 0) {
@@ -890,7 +1221,7 @@ static int setup_server_ssl_session(coap_session_t *c_session,
 
   if ((ret = mbedtls_ssl_cookie_setup(&m_env->cookie_ctx,
                                   mbedtls_ctr_drbg_random,
-                                  &m_env->ctr_drbg)) != 0) {
+                                  &m_context->ctr_drbg)) != 0) {
     coap_log(LOG_ERR, "mbedtls_ssl_cookie_setup: returned -0x%x\n", -ret);
     goto fail;
   }
@@ -987,7 +1318,13 @@ static int setup_client_ssl_session(coap_session_t *c_session,
 #endif /* !ESPIDF_VERSION || CONFIG_MBEDTLS_SSL_PROTO_DTLS */
 
   mbedtls_ssl_conf_authmode(&m_env->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-  mbedtls_ssl_conf_rng(&m_env->conf, mbedtls_ctr_drbg_random, &m_env->ctr_drbg);
+  mbedtls_ssl_conf_rng(&m_env->conf, mbedtls_ctr_drbg_random,
+                       &m_context->ctr_drbg);
+
+#if defined(CONFIG_COAP_MBEDTLS_SESSION_RESUME) && defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&m_env->conf,
+                                   MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME && MBEDTLS_SSL_SESSION_TICKETS */
 
   if (m_context->psk_pki_enabled & IS_PSK) {
 #if !defined(ESPIDF_VERSION) || defined(CONFIG_MBEDTLS_PSK_MODES)
@@ -1037,8 +1374,7 @@ static int setup_client_ssl_session(coap_session_t *c_session,
     if ((m_context->psk_pki_enabled & (IS_PSK | IS_PKI)) == 0) {
       mbedtls_ssl_conf_authmode(&m_env->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
     }
-    ret = setup_pki_credentials(&m_env->cacert, &m_env->public_cert,
-                                &m_env->private_key, m_env, m_context,
+    ret = setup_pki_credentials(m_env, m_context,
                                 c_session, &m_context->setup_data,
                                 COAP_DTLS_ROLE_CLIENT);
     if (ret < 0) {
@@ -1075,24 +1411,120 @@ static void mbedtls_cleanup(coap_mbedtls_env_t *m_env)
     return;
   }
 
-  mbedtls_x509_crt_free(&m_env->cacert);
-  mbedtls_x509_crt_free(&m_env->public_cert);
-  mbedtls_pk_free(&m_env->private_key);
-  mbedtls_entropy_free(&m_env->entropy);
   mbedtls_ssl_config_free(&m_env->conf);
-  mbedtls_ctr_drbg_free(&m_env->ctr_drbg);
   mbedtls_ssl_free(&m_env->ssl);
   mbedtls_ssl_cookie_free(&m_env->cookie_ctx);
+  pki_cache_release(m_env->pki);
+  m_env->pki = NULL;
+}
+
+/*
+ * Leaves the handshake phase of the memory pools when the client handshake
+ * completes, fails or its session is freed, whichever comes first.
+ */
+static void
+handshake_phase_end(coap_mbedtls_env_t *m_env)
+{
+#ifdef CONFIG_COAP_MEM_POOL
+  if (m_env->arena_phase) {
+    m_env->arena_phase = 0;
+    coap_mem_set_phase(COAP_MEM_PHASE_STEADY);
+  }
+#else /* ! CONFIG_COAP_MEM_POOL */
+  (void)m_env;
+#endif /* ! CONFIG_COAP_MEM_POOL */
 }
 
 static void
 coap_dtls_free_mbedtls_env(coap_mbedtls_env_t *m_env) {
   if (m_env) {
+    handshake_phase_end(m_env);
     mbedtls_cleanup(m_env);
     free(m_env);
   }
 }
 
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+static void
+resume_cache_clear(void)
+{
+  mbedtls_ssl_session_free(&resume_cache.session);
+  mbedtls_ssl_session_init(&resume_cache.session);
+  resume_cache.valid = 0;
+}
+
+/*
+ * Offer the cached session, if it was negotiated with the same server.
+ * Must be called after mbedtls_ssl_setup() and before the handshake.
+ */
+static void
+resume_client_session(coap_session_t *c_session, coap_mbedtls_env_t *m_env)
+{
+  int ret;
+
+  if (!resume_cache.valid ||
+      !coap_address_equals(&resume_cache.remote, &c_session->remote_addr)) {
+    return;
+  }
+
+  ret = mbedtls_ssl_set_session(&m_env->ssl, &resume_cache.session);
+  if (ret != 0) {
+    coap_log(LOG_WARNING, "mbedtls_ssl_set_session returned -0x%x\n", -ret);
+    return;
+  }
+  m_env->resume_offered = 1;
+  coap_log(LOG_DEBUG, "*  %s: Offering session resumption\n",
+           coap_session_str(c_session));
+}
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+
+/*
+ * Called when a client handshake completes. Counts full and resumed
+ * handshakes and keeps the negotiated session for the next connection.
+ */
+static void
+client_handshake_done(coap_session_t *c_session, coap_mbedtls_env_t *m_env)
+{
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+  int ret;
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+
+  /* The cached session below outlives the handshake, keep it out of the arena */
+  handshake_phase_end(m_env);
+
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+
+  /*
+   * The master secret is only carried over from the cached session on an
+   * abbreviated handshake, a full handshake always derives a new one.
+   */
+  if (m_env->resume_offered && resume_cache.valid && m_env->ssl.session &&
+      memcmp(m_env->ssl.session->master, resume_cache.session.master,
+             sizeof(resume_cache.session.master)) == 0) {
+    handshake_stats.resumed++;
+    coap_log(LOG_DEBUG, "*  %s: MbedTLS session resumed\n",
+             coap_session_str(c_session));
+  } else {
+    handshake_stats.full++;
+  }
+
+  /* Keep the session, the server may have issued a new ticket */
+  resume_cache_clear();
+  ret = mbedtls_ssl_get_session(&m_env->ssl, &resume_cache.session);
+  if (ret != 0) {
+    coap_log(LOG_WARNING, "mbedtls_ssl_get_session returned -0x%x\n", -ret);
+    resume_cache_clear();
+    return;
+  }
+  resume_cache.remote = c_session->remote_addr;
+  resume_cache.valid = 1;
+#else /* ! CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+  (void)c_session;
+  (void)m_env;
+  handshake_stats.full++;
+#endif /* ! CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+}
+
 /*
  * return -1  failure
  *         0  not completed
@@ -1109,6 +1541,9 @@ static int do_mbedtls_handshake(coap_session_t *c_session,
     m_env->established = 1;
     coap_log(LOG_DEBUG, "*  %s: MbedTLS established\n",
                                             coap_session_str(c_session));
+    if (m_env->conf.endpoint == MBEDTLS_SSL_IS_CLIENT) {
+      client_handshake_done(c_session, m_env);
+    }
     ret = 1;
     break;
   case MBEDTLS_ERR_SSL_WANT_READ:
@@ -1134,6 +1569,16 @@ static int do_mbedtls_handshake(coap_session_t *c_session,
     ret = -1;
     break;
   }
+  if (ret == -1) {
+    /* Nothing more is allocated for this handshake */
+    handshake_phase_end(m_env);
+  }
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+  if (ret == -1 && m_env->resume_offered) {
+    /* Do not offer a session that may be the reason for the failure again */
+    resume_cache_clear();
+  }
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME */
   return ret;
 }
 
@@ -1164,6 +1609,8 @@ static coap_mbedtls_env_t *coap_dtls_new_mbedtls_env(coap_session_t *c_session,
 {
   int ret = 0;
   coap_mbedtls_env_t *m_env = (coap_mbedtls_env_t *)c_session->tls;
+  coap_mbedtls_context_t *m_context =
+           (coap_mbedtls_context_t *)c_session->context->dtls_context;
 
   if (m_env)
       return m_env;
@@ -1174,16 +1621,12 @@ static coap_mbedtls_env_t *coap_dtls_new_mbedtls_env(coap_session_t *c_session,
   }
 
   mbedtls_ssl_init(&m_env->ssl);
-  mbedtls_ctr_drbg_init(&m_env->ctr_drbg);
   mbedtls_ssl_config_init(&m_env->conf);
-  mbedtls_entropy_init(&m_env->entropy);
 
 #if defined(ESPIDF_VERSION) && defined(CONFIG_MBEDTLS_DEBUG)
   mbedtls_esp_enable_debug_log(&m_env->conf, CONFIG_MBEDTLS_DEBUG_LEVEL);
 #endif /* ESPIDF_VERSION && CONFIG_MBEDTLS_DEBUG */
-  if ((ret = mbedtls_ctr_drbg_seed(&m_env->ctr_drbg,
-                  mbedtls_entropy_func, &m_env->entropy, NULL, 0)) != 0) {
-    coap_log(LOG_ERR, "mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+  if (seed_context_drbg(m_context) != 0) {
     goto fail;
   }
 
@@ -1202,19 +1645,22 @@ static coap_mbedtls_env_t *coap_dtls_new_mbedtls_env(coap_session_t *c_session,
   if ((ret = mbedtls_ssl_setup(&m_env->ssl, &m_env->conf)) != 0) {
     goto fail;
   }
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+  if (role == COAP_DTLS_ROLE_CLIENT) {
+    resume_client_session(c_session, m_env);
+  }
+#endif /* CONFIG_COAP_MBEDTLS_SESSION_RESUME */
   mbedtls_ssl_set_bio(&m_env->ssl, c_session, coap_dgram_write,
                       coap_dgram_read, NULL);
   mbedtls_ssl_set_timer_cb(&m_env->ssl, &m_env->timer,
-                           mbedtls_timing_set_delay,
-                           mbedtls_timing_get_delay);
+                           coap_dtls_timer_set,
+                           coap_dtls_timer_get);
 
   mbedtls_ssl_conf_dbg(&m_env->conf, mbedtls_debug_out, stdout);
   return m_env;
 
 fail:
-  if (m_env) {
-    free(m_env);
-  }
+  coap_dtls_free_mbedtls_env(m_env);
   return NULL;
 }
 
@@ -1242,6 +1688,8 @@ void *coap_dtls_new_context(struct coap_context_t *c_context)
   m_context = (coap_mbedtls_context_t *)calloc(1, sizeof(coap_mbedtls_context_t));
   if (m_context) {
       memset(m_context, 0, sizeof(coap_mbedtls_context_t));
+      mbedtls_entropy_init(&m_context->entropy);
+      mbedtls_ctr_drbg_init(&m_context->ctr_drbg);
   }
   return m_context;
 }
@@ -1306,6 +1754,7 @@ int coap_dtls_context_set_pki(struct coap_context_t *c_context,
   coap_mbedtls_context_t *m_context =
              ((coap_mbedtls_context_t *)c_context->dtls_context);
 
+  /* Only parsed again on next use if the credentials changed, see pki_cache */
   m_context->setup_data = *setup_data;
   m_context->psk_pki_enabled |= IS_PKI;
   return 1;
@@ -1365,11 +1814,7 @@ void coap_dtls_free_context(void *dtls_context)
   for (i = 0; i < m_context->pki_sni_count; i++) {
     mbedtls_free(m_context->pki_sni_entry_list[i].sni);
 
-    mbedtls_x509_crt_free(&m_context->pki_sni_entry_list[i].public_cert);
-
-    mbedtls_pk_free(&m_context->pki_sni_entry_list[i].private_key);
-
-    mbedtls_x509_crt_free(&m_context->pki_sni_entry_list[i].cacert);
+    pki_credentials_free(&m_context->pki_sni_entry_list[i].pki);
   }
 #ifdef PSK2_PR
   for (i = 0; i < m_context->psk_sni_count; i++) {
@@ -1380,6 +1825,8 @@ void coap_dtls_free_context(void *dtls_context)
 
 #endif /* PSK2_PR */
 
+  mbedtls_ctr_drbg_free(&m_context->ctr_drbg);
+  mbedtls_entropy_free(&m_context->entropy);
   free(m_context);
 }
 
@@ -1390,6 +1837,10 @@ void *coap_dtls_new_client_session(coap_session_t *c_session)
   int ret;
 
   if (m_env) {
+#ifdef CONFIG_COAP_MEM_POOL
+    coap_mem_set_phase(COAP_MEM_PHASE_HANDSHAKE);
+    m_env->arena_phase = 1;
+#endif /* CONFIG_COAP_MEM_POOL */
     ret = do_mbedtls_handshake(c_session, m_env);
     if (ret == -1) {
       coap_dtls_free_mbedtls_env(m_env);
@@ -1504,21 +1955,13 @@ coap_tick_t coap_dtls_get_context_timeout(void *dtls_context UNUSED)
 coap_tick_t coap_dtls_get_timeout(coap_session_t *c_session, coap_tick_t now)
 {
   coap_mbedtls_env_t *m_env = (coap_mbedtls_env_t *)c_session->tls;
-  int ret = mbedtls_timing_get_delay(&m_env->timer);
 
-  switch (ret) {
-  case 0:
-  case 1:
-    /* int_ms has timed out, but not fin_ms */
-    return now + 1;
-  case 2:
-    /* fin_ms has timed out - time for a retry */
+  if (m_env->timer.fin_at == 0)
+    return 0;
+  /* Passed, time for a retry */
+  if (m_env->timer.fin_at <= now)
     return now;
-  default:
-    break;
-  }
-
-  return 0;
+  return m_env->timer.fin_at;
 }
 
 void coap_dtls_handle_timeout(coap_session_t *c_session)
@@ -1535,6 +1978,105 @@ void coap_dtls_handle_timeout(coap_session_t *c_session)
   return;
 }
 
+#ifdef CONFIG_COAP_MBEDTLS_ZERO_COPY
+/*
+ * Decrypt the next record straight into the storage of a PDU and parse it
+ * there, instead of through a receive buffer and coap_handle_dgram(), which
+ * copies it once more. The plaintext is never longer than the datagram.
+ *
+ * return the mbedtls_ssl_read() result, with that of the PDU in result
+ */
+static int read_dgram(coap_session_t *c_session, coap_mbedtls_env_t *m_env,
+                      size_t data_len, int *result)
+{
+  coap_pdu_t *pdu;
+  int ret;
+
+  pdu = coap_pdu_init(0, 0, 0, data_len);
+  if (pdu == NULL)
+    return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+  if (!coap_pdu_resize(pdu, data_len)) {
+    coap_delete_pdu(pdu);
+    return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+  }
+
+  ret = mbedtls_ssl_read(&m_env->ssl, pdu->token - COAP_PDU_MAX_UDP_HEADER_SIZE,
+                         pdu->alloc_size + COAP_PDU_MAX_UDP_HEADER_SIZE);
+  if (ret > 0) {
+    rx_stats.pdus++;
+    /* Out of the record, by mbedtls_ssl_read() */
+    rx_stats.copied += (size_t)ret;
+    *result = -1;
+    if (ret >= COAP_PDU_MAX_UDP_HEADER_SIZE) {
+      pdu->hdr_size = COAP_PDU_MAX_UDP_HEADER_SIZE;
+      pdu->used_size = (size_t)ret - COAP_PDU_MAX_UDP_HEADER_SIZE;
+      if (coap_pdu_parse_header(pdu, c_session->proto) && coap_pdu_parse_opt(pdu)) {
+        coap_dispatch(c_session->context, c_session, pdu);
+        *result = 0;
+      }
+    }
+    if (*result < 0)
+      coap_log(LOG_WARNING, "discard malformed PDU\n");
+  }
+  coap_delete_pdu(pdu);
+  return ret;
+}
+
+uint8_t *coap_dtls_rx_buffer(coap_session_t *c_session, size_t *len)
+{
+  coap_mbedtls_env_t *m_env = (coap_mbedtls_env_t *)c_session->tls;
+  mbedtls_ssl_context *ssl;
+
+  if (m_env == NULL || !m_env->established)
+    return NULL;
+  ssl = &m_env->ssl;
+  /* The last datagram is overwritten, every record of it must be consumed */
+  if (ssl->in_left != ssl->next_record_offset || ssl->in_offt != NULL ||
+      ssl->keep_current_message || ssl->in_hslen != 0)
+    return NULL;
+  *len = MBEDTLS_SSL_IN_BUFFER_LEN - (size_t)(ssl->in_hdr - ssl->in_buf);
+  return ssl->in_hdr;
+}
+#else /* ! CONFIG_COAP_MBEDTLS_ZERO_COPY */
+/*
+ * return the mbedtls_ssl_read() result, with that of coap_handle_dgram() in
+ * result
+ */
+static int read_dgram(coap_session_t *c_session, coap_mbedtls_env_t *m_env,
+                      size_t data_len UNUSED, int *result)
+{
+#if COAP_CONSTRAINED_STACK
+  static coap_mutex_t b_static_mutex = COAP_MUTEX_INITIALIZER;
+  static uint8_t pdu[COAP_RXBUFFER_SIZE];
+#else /* ! COAP_CONSTRAINED_STACK */
+  uint8_t pdu[COAP_RXBUFFER_SIZE];
+#endif /* ! COAP_CONSTRAINED_STACK */
+  int ret;
+
+#if COAP_CONSTRAINED_STACK
+  coap_mutex_lock(&b_static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+
+  ret = mbedtls_ssl_read(&m_env->ssl, pdu, (int)sizeof(pdu));
+  if (ret > 0) {
+    rx_stats.pdus++;
+    /* Out of the record, and into the PDU by coap_handle_dgram() */
+    rx_stats.copied += 2 * (size_t)ret;
+    *result = coap_handle_dgram(c_session->context, c_session, pdu, (size_t)ret);
+  }
+
+#if COAP_CONSTRAINED_STACK
+  coap_mutex_unlock(&b_static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+  return ret;
+}
+
+uint8_t *coap_dtls_rx_buffer(coap_session_t *c_session UNUSED, size_t *len UNUSED)
+{
+  return NULL;
+}
+#endif /* ! CONFIG_COAP_MBEDTLS_ZERO_COPY */
+
 int coap_dtls_receive(coap_session_t *c_session,
                       const uint8_t *data,
                       size_t data_len)
@@ -1554,16 +2096,7 @@ int coap_dtls_receive(coap_session_t *c_session,
   ssl_data->pdu_len = (unsigned)data_len;
 
   if (m_env->established) {
-#if COAP_CONSTRAINED_STACK
-    static coap_mutex_t b_static_mutex = COAP_MUTEX_INITIALIZER;
-    static uint8_t pdu[COAP_RXBUFFER_SIZE];
-#else /* ! COAP_CONSTRAINED_STACK */
-    uint8_t pdu[COAP_RXBUFFER_SIZE];
-#endif /* ! COAP_CONSTRAINED_STACK */
-
-#if COAP_CONSTRAINED_STACK
-    coap_mutex_lock(&b_static_mutex);
-#endif /* COAP_CONSTRAINED_STACK */
+    int result;
 
     if (c_session->state == COAP_SESSION_STATE_HANDSHAKE) {
       coap_handle_event(c_session->context, COAP_EVENT_DTLS_CONNECTED,
@@ -1571,13 +2104,9 @@ int coap_dtls_receive(coap_session_t *c_session,
       coap_session_connected(c_session);
     }
 
-    ret = mbedtls_ssl_read(&m_env->ssl, pdu, (int)sizeof(pdu));
+    ret = read_dgram(c_session, m_env, data_len, &result);
     if (ret > 0) {
-      ret = coap_handle_dgram(c_session->context, c_session, pdu, (size_t)ret);
-#if COAP_CONSTRAINED_STACK
-      coap_mutex_unlock(&b_static_mutex);
-#endif /* COAP_CONSTRAINED_STACK */
-      return ret;
+      return result;
     }
     else if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
       c_session->dtls_event = COAP_EVENT_DTLS_CLOSED;
@@ -1591,9 +2120,6 @@ int coap_dtls_receive(coap_session_t *c_session,
                "returned -0x%x: '%s' (length %zd)\n",
                -ret, buf, data_len);
     }
-#if COAP_CONSTRAINED_STACK
-    coap_mutex_unlock(&b_static_mutex);
-#endif /* COAP_CONSTRAINED_STACK */
     ret = -1;
   }
   else {
@@ -1740,6 +2266,10 @@ ssize_t coap_tls_read(coap_session_t *c_session UNUSED,
 
 void coap_dtls_startup(void)
 {
+#if defined(CONFIG_COAP_MEM_POOL) && defined(MBEDTLS_PLATFORM_MEMORY)
+  /* Without MBEDTLS_PLATFORM_MEMORY mbedtls_free() is free(), see coap_config.h */
+  mbedtls_platform_set_calloc_free(coap_mem_calloc, coap_mem_free);
+#endif /* CONFIG_COAP_MEM_POOL && MBEDTLS_PLATFORM_MEMORY */
   return;
 }
 
@@ -1775,6 +2305,149 @@ int coap_dtls_get_log_level(void)
   return keep_log_level;
 }
 
+void coap_dtls_get_handshake_stats(coap_dtls_handshake_stats_t *stats)
+{
+  *stats = handshake_stats;
+}
+
+void coap_dtls_get_rx_stats(coap_dtls_rx_stats_t *stats)
+{
+  *stats = rx_stats;
+}
+
+#ifdef CONFIG_COAP_MBEDTLS_SESSION_RESUME
+size_t coap_dtls_client_session_export(uint8_t *buf, size_t buf_len)
+{
+  coap_mbedtls_resume_blob_t blob;
+  const mbedtls_ssl_session *session = &resume_cache.session;
+  size_t ticket_len = 0;
+
+  if (!resume_cache.valid) {
+    return 0;
+  }
+
+  memset(&blob, 0, sizeof(blob));
+  blob.magic = RESUME_BLOB_MAGIC;
+  blob.mbedtls_version = MBEDTLS_VERSION_NUMBER;
+  blob.remote = resume_cache.remote;
+#if defined(MBEDTLS_HAVE_TIME)
+  blob.start = (int64_t)session->start;
+#endif /* MBEDTLS_HAVE_TIME */
+  blob.ciphersuite = session->ciphersuite;
+  blob.compression = session->compression;
+  blob.id_len = (uint32_t)session->id_len;
+  memcpy(blob.id, session->id, sizeof(blob.id));
+  memcpy(blob.master, session->master, sizeof(blob.master));
+  blob.verify_result = session->verify_result;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+  ticket_len = session->ticket ? session->ticket_len : 0;
+  blob.ticket_len = (uint32_t)ticket_len;
+  blob.ticket_lifetime = session->ticket_lifetime;
+#endif /* MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C */
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  blob.mfl_code = session->mfl_code;
+#endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+  blob.trunc_hmac = session->trunc_hmac;
+#endif /* MBEDTLS_SSL_TRUNCATED_HMAC */
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+  blob.encrypt_then_mac = session->encrypt_then_mac;
+#endif /* MBEDTLS_SSL_ENCRYPT_THEN_MAC */
+
+  if (buf_len < sizeof(blob) + ticket_len) {
+    coap_log(LOG_WARNING,
+             "coap_dtls_client_session_export: buffer too small (%zu < %zu)\n",
+             buf_len, sizeof(blob) + ticket_len);
+    return 0;
+  }
+  memcpy(buf, &blob, sizeof(blob));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+  if (ticket_len) {
+    memcpy(buf + sizeof(blob), session->ticket, ticket_len);
+  }
+#endif /* MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C */
+  return sizeof(blob) + ticket_len;
+}
+
+int coap_dtls_client_session_import(const uint8_t *buf, size_t buf_len)
+{
+  coap_mbedtls_resume_blob_t blob;
+  mbedtls_ssl_session *session = &resume_cache.session;
+
+  if (buf_len < sizeof(blob)) {
+    return 0;
+  }
+  memcpy(&blob, buf, sizeof(blob));
+  if (blob.magic != RESUME_BLOB_MAGIC ||
+      blob.mbedtls_version != MBEDTLS_VERSION_NUMBER ||
+      blob.id_len > sizeof(session->id) ||
+      buf_len != sizeof(blob) + blob.ticket_len) {
+    coap_log(LOG_INFO, "coap_dtls_client_session_import: stale session\n");
+    return 0;
+  }
+
+  resume_cache_clear();
+#if defined(MBEDTLS_HAVE_TIME)
+  session->start = (mbedtls_time_t)blob.start;
+#endif /* MBEDTLS_HAVE_TIME */
+  session->ciphersuite = blob.ciphersuite;
+  session->compression = blob.compression;
+  session->id_len = blob.id_len;
+  memcpy(session->id, blob.id, sizeof(session->id));
+  memcpy(session->master, blob.master, sizeof(session->master));
+  session->verify_result = blob.verify_result;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+  if (blob.ticket_len) {
+    /* Freed by mbedtls_ssl_session_free() */
+    session->ticket = mbedtls_lib_calloc(1, blob.ticket_len);
+    if (!session->ticket) {
+      coap_log(LOG_ERR, "Memory allocation failed\n");
+      resume_cache_clear();
+      return 0;
+    }
+    memcpy(session->ticket, buf + sizeof(blob), blob.ticket_len);
+    session->ticket_len = blob.ticket_len;
+  }
+  session->ticket_lifetime = blob.ticket_lifetime;
+#else /* ! (MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C) */
+  if (blob.ticket_len) {
+    return 0;
+  }
+#endif /* ! (MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C) */
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  session->mfl_code = blob.mfl_code;
+#endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+  session->trunc_hmac = blob.trunc_hmac;
+#endif /* MBEDTLS_SSL_TRUNCATED_HMAC */
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+  session->encrypt_then_mac = blob.encrypt_then_mac;
+#endif /* MBEDTLS_SSL_ENCRYPT_THEN_MAC */
+  resume_cache.remote = blob.remote;
+  resume_cache.valid = 1;
+  return 1;
+}
+
+void coap_dtls_client_session_forget(void)
+{
+  resume_cache_clear();
+}
+#else /* ! CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+size_t coap_dtls_client_session_export(uint8_t *buf UNUSED, size_t buf_len UNUSED)
+{
+  return 0;
+}
+
+int coap_dtls_client_session_import(const uint8_t *buf UNUSED, size_t buf_len UNUSED)
+{
+  return 0;
+}
+
+void coap_dtls_client_session_forget(void)
+{
+}
+#endif /* ! CONFIG_COAP_MBEDTLS_SESSION_RESUME */
+
 coap_tls_version_t * coap_get_tls_library_version(void)
 {
   static coap_tls_version_t version;
@@ -0,0 +1,362 @@
+/*
+ * coap_mem_pool.c -- Pool and arena allocator for libcoap and mbedTLS
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/*
+ * Not built on coap_config.h, which maps malloc() and friends onto the
+ * functions here: the heap fallback needs the real ones.
+ */
+#include "sdkconfig.h"
+
+#ifdef CONFIG_COAP_MEM_POOL
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "coap_mem_pool.h"
+
+#define MEM_ALIGN 16
+#define MEM_ALIGN_UP(x) (((x) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
+
+#define POOL_BLOCKS { CONFIG_COAP_MEM_POOL_SMALL_BLOCKS, CONFIG_COAP_MEM_POOL_SMALL_BLOCKS, \
+                      CONFIG_COAP_MEM_POOL_SMALL_BLOCKS, CONFIG_COAP_MEM_POOL_PDU_BLOCKS, \
+                      CONFIG_COAP_MEM_POOL_MTU_BLOCKS }
+#define POOL_BYTES (CONFIG_COAP_MEM_POOL_SMALL_BLOCKS * (32 + 64 + 128) + \
+                    CONFIG_COAP_MEM_POOL_PDU_BLOCKS * 272 + \
+                    CONFIG_COAP_MEM_POOL_MTU_BLOCKS * 1536)
+
+#define ARENA_BYTES (CONFIG_COAP_MEM_ARENA_KB * 1024)
+#define ARENA_NONE UINT32_MAX
+
+/* The heap blocks are tracked to know their size when they are freed */
+#define HEAP_TRACKED 64
+
+typedef struct {
+  uint8_t *start;
+  uint8_t *end;
+  void *free;              /* list through the first word of each free block */
+  unsigned int used;
+} mem_pool_t;
+
+/* In front of each arena block */
+typedef struct {
+  uint32_t size;           /* header included */
+  uint32_t prev;           /* offset of the block below, or ARENA_NONE */
+  uint32_t freed;
+  uint32_t pad;
+} arena_hdr_t;
+
+typedef struct {
+  void *ptr;
+  size_t size;
+} heap_entry_t;
+
+static const size_t pool_size[COAP_MEM_POOL_CLASSES] = COAP_MEM_POOL_SIZES;
+static const unsigned int pool_blocks[COAP_MEM_POOL_CLASSES] = POOL_BLOCKS;
+
+static uint8_t pool_mem[POOL_BYTES] __attribute__((aligned(MEM_ALIGN)));
+static mem_pool_t pool[COAP_MEM_POOL_CLASSES];
+static int pool_ready;
+
+static uint8_t arena[ARENA_BYTES] __attribute__((aligned(MEM_ALIGN)));
+static uint32_t arena_top;
+static uint32_t arena_last = ARENA_NONE;
+static unsigned int arena_live;
+
+static heap_entry_t heap[HEAP_TRACKED];
+
+static coap_mem_phase_t phase = COAP_MEM_PHASE_SETUP;
+static coap_mem_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+pool_init(void) {
+  uint8_t *p = pool_mem;
+  int c;
+  unsigned int i;
+
+  for (c = 0; c < COAP_MEM_POOL_CLASSES; c++) {
+    pool[c].start = p;
+    pool[c].free = NULL;
+    for (i = 0; i < pool_blocks[c]; i++) {
+      *(void **)p = pool[c].free;
+      pool[c].free = p;
+      p += pool_size[c];
+    }
+    pool[c].end = p;
+  }
+  pool_ready = 1;
+}
+
+static void
+account(size_t add, size_t sub) {
+  stats.in_use = stats.in_use + add - sub;
+  if (stats.in_use > stats.peak[phase])
+    stats.peak[phase] = stats.in_use;
+}
+
+static int
+pool_of(const void *ptr) {
+  int c;
+
+  for (c = 0; c < COAP_MEM_POOL_CLASSES; c++) {
+    if ((const uint8_t *)ptr >= pool[c].start && (const uint8_t *)ptr < pool[c].end)
+      return c;
+  }
+  return -1;
+}
+
+static int
+in_arena(const void *ptr) {
+  return (const uint8_t *)ptr >= arena && (const uint8_t *)ptr < arena + ARENA_BYTES;
+}
+
+static arena_hdr_t *
+arena_hdr(uint32_t offset) {
+  return (arena_hdr_t *)(arena + offset);
+}
+
+static void *
+arena_alloc(size_t size) {
+  size_t need = sizeof(arena_hdr_t) + MEM_ALIGN_UP(size);
+  arena_hdr_t *hdr;
+
+  if (need > ARENA_BYTES - arena_top)
+    return NULL;
+
+  hdr = arena_hdr(arena_top);
+  hdr->size = need;
+  hdr->prev = arena_last;
+  hdr->freed = 0;
+  arena_last = arena_top;
+  arena_top += need;
+  arena_live++;
+  if (arena_top > stats.arena_peak)
+    stats.arena_peak = arena_top;
+  account(need, 0);
+  return hdr + 1;
+}
+
+/*
+ * Blocks below the top are only marked, and given back when everything
+ * above them is gone.
+ */
+static void
+arena_free(void *ptr) {
+  arena_hdr_t *hdr = (arena_hdr_t *)ptr - 1;
+
+  hdr->freed = 1;
+  arena_live--;
+  account(0, hdr->size);
+
+  while (arena_last != ARENA_NONE && arena_hdr(arena_last)->freed) {
+    arena_top = arena_last;
+    arena_last = arena_hdr(arena_last)->prev;
+  }
+  if (arena_live == 0 && arena_top == 0)
+    stats.arena_resets++;
+}
+
+static void *
+heap_alloc(size_t size) {
+  void *ptr = malloc(size);
+  int i;
+
+  if (!ptr)
+    return NULL;
+
+  stats.heap++;
+  for (i = 0; i < HEAP_TRACKED; i++) {
+    if (!heap[i].ptr) {
+      heap[i].ptr = ptr;
+      heap[i].size = size;
+      account(size, 0);
+      return ptr;
+    }
+  }
+  stats.untracked++;
+  return ptr;
+}
+
+static heap_entry_t *
+heap_find(const void *ptr) {
+  int i;
+
+  for (i = 0; i < HEAP_TRACKED; i++) {
+    if (heap[i].ptr == ptr)
+      return &heap[i];
+  }
+  return NULL;
+}
+
+static void *
+mem_alloc(size_t size) {
+  int c;
+  void *ptr;
+
+  if (!pool_ready)
+    pool_init();
+  if (size == 0)
+    size = 1;
+
+  for (c = 0; c < COAP_MEM_POOL_CLASSES; c++) {
+    if (phase == COAP_MEM_PHASE_HANDSHAKE && c >= COAP_MEM_POOL_SMALL)
+      break;
+    if (size > pool_size[c] || !pool[c].free)
+      continue;
+
+    ptr = pool[c].free;
+    pool[c].free = *(void **)ptr;
+    if (++pool[c].used > stats.pool_peak[c])
+      stats.pool_peak[c] = pool[c].used;
+    account(pool_size[c], 0);
+    return ptr;
+  }
+
+  if (phase == COAP_MEM_PHASE_HANDSHAKE) {
+    ptr = arena_alloc(size);
+    if (ptr)
+      return ptr;
+  }
+  return heap_alloc(size);
+}
+
+static void
+mem_free(void *ptr) {
+  heap_entry_t *entry;
+  int c;
+
+  if (!ptr)
+    return;
+
+  c = pool_of(ptr);
+  if (c >= 0) {
+    *(void **)ptr = pool[c].free;
+    pool[c].free = ptr;
+    pool[c].used--;
+    account(0, pool_size[c]);
+  } else if (in_arena(ptr)) {
+    arena_free(ptr);
+  } else if ((entry = heap_find(ptr)) != NULL) {
+    account(0, entry->size);
+    entry->ptr = NULL;
+    free(ptr);
+  } else {
+    free(ptr);
+  }
+}
+
+void *
+coap_mem_malloc(size_t size) {
+  void *ptr;
+
+  pthread_mutex_lock(&lock);
+  ptr = mem_alloc(size);
+  pthread_mutex_unlock(&lock);
+  return ptr;
+}
+
+void *
+coap_mem_calloc(size_t nmemb, size_t size) {
+  void *ptr;
+
+  if (size && nmemb > SIZE_MAX / size)
+    return NULL;
+
+  ptr = coap_mem_malloc(nmemb * size);
+  if (ptr)
+    memset(ptr, 0, nmemb * size);
+  return ptr;
+}
+
+void *
+coap_mem_realloc(void *ptr, size_t size) {
+  heap_entry_t *entry;
+  size_t capacity;
+  void *new_ptr;
+  int c;
+
+  if (!ptr)
+    return coap_mem_malloc(size);
+  if (size == 0) {
+    coap_mem_free(ptr);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock);
+  c = pool_of(ptr);
+  if (c >= 0) {
+    capacity = pool_size[c];
+  } else if (in_arena(ptr)) {
+    capacity = ((arena_hdr_t *)ptr - 1)->size - sizeof(arena_hdr_t);
+  } else {
+    /* Stays on the heap */
+    entry = heap_find(ptr);
+    new_ptr = realloc(ptr, size);
+    if (new_ptr && entry) {
+      account(size, entry->size);
+      entry->ptr = new_ptr;
+      entry->size = size;
+    }
+    pthread_mutex_unlock(&lock);
+    return new_ptr;
+  }
+
+  if (size <= capacity) {
+    pthread_mutex_unlock(&lock);
+    return ptr;
+  }
+
+  new_ptr = mem_alloc(size);
+  if (new_ptr) {
+    memcpy(new_ptr, ptr, capacity);
+    mem_free(ptr);
+  }
+  pthread_mutex_unlock(&lock);
+  return new_ptr;
+}
+
+void
+coap_mem_free(void *ptr) {
+  pthread_mutex_lock(&lock);
+  mem_free(ptr);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+coap_mem_set_phase(coap_mem_phase_t new_phase) {
+  if (new_phase >= COAP_MEM_PHASES)
+    return;
+
+  pthread_mutex_lock(&lock);
+  phase = new_phase;
+  account(0, 0);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+coap_mem_get_stats(coap_mem_stats_t *out) {
+  pthread_mutex_lock(&lock);
+  *out = stats;
+  pthread_mutex_unlock(&lock);
+}
+
+void
+coap_mem_reset_peaks(void) {
+  int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < COAP_MEM_PHASES; i++)
+    stats.peak[i] = stats.in_use;
+  for (i = 0; i < COAP_MEM_POOL_CLASSES; i++)
+    stats.pool_peak[i] = pool[i].used;
+  stats.arena_peak = arena_top;
+  pthread_mutex_unlock(&lock);
+}
+
+#endif /* CONFIG_COAP_MEM_POOL */
@@ -42,6 +42,14 @@ extern "C" {
 #include "str.h"
 #include "subscribe.h"
 #include "uri.h"
+#include "coap_mem_pool.h"
+
+/**
+ * Wake coap_run_once() up from another task, e.g. on a button press, the
+ * same as a socket event would. Has no effect before the first call of
+ * coap_run_once(), and is not to be called from an interrupt handler.
+ */
+void coap_run_once_wake(void);
 
 #ifdef __cplusplus
 }
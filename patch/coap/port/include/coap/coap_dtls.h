@@ -608,6 +608,78 @@ ssize_t coap_tls_read(struct coap_session_t *coap_session,
  */
 void coap_dtls_startup(void);
 
+/**
+ * Handshake counters of the (D)TLS client sessions.
+ */
+typedef struct coap_dtls_handshake_stats_t {
+  unsigned int full;    /**< Completed full handshakes */
+  unsigned int resumed; /**< Completed abbreviated (resumed) handshakes */
+} coap_dtls_handshake_stats_t;
+
+/**
+ * Get the number of full and resumed client handshakes since startup.
+ *
+ * @param stats Where to store the counters.
+ */
+void coap_dtls_get_handshake_stats(coap_dtls_handshake_stats_t *stats);
+
+/**
+ * Receive counters of the DTLS sessions, for the application data records.
+ */
+typedef struct coap_dtls_rx_stats_t {
+  unsigned int pdus;    /**< PDUs received */
+  size_t copied;        /**< Bytes copied between the datagram and the PDU */
+} coap_dtls_rx_stats_t;
+
+/**
+ * Get the receive counters since startup.
+ *
+ * @param stats Where to store the counters.
+ */
+void coap_dtls_get_rx_stats(coap_dtls_rx_stats_t *stats);
+
+/**
+ * Get the buffer to receive the next datagram of an established DTLS
+ * session in, the record input buffer of the (D)TLS library. The datagram
+ * is then decrypted where it is, instead of being copied there first by
+ * coap_dtls_receive(). Only with CONFIG_COAP_MBEDTLS_ZERO_COPY.
+ *
+ * @param session The DTLS session.
+ * @param len     Where to store the size of the buffer.
+ *
+ * @return        The buffer, or @c NULL if the datagram has to be received
+ *                elsewhere and given to coap_dtls_receive() as usual.
+ */
+uint8_t *coap_dtls_rx_buffer(struct coap_session_t *session, size_t *len);
+
+/**
+ * Serialize the cached client session, so that it can be kept across a
+ * reboot or deep sleep. Only available with session resumption enabled.
+ *
+ * @param buf     Where to store the session.
+ * @param buf_len Size of @p buf.
+ *
+ * @return        The number of bytes written, or @c 0 if there is no
+ *                cached session or @p buf is too small.
+ */
+size_t coap_dtls_client_session_export(uint8_t *buf, size_t buf_len);
+
+/**
+ * Restore a client session serialized by coap_dtls_client_session_export(),
+ * to be offered on the next connection to the same server.
+ *
+ * @param buf     The serialized session.
+ * @param buf_len Length of @p buf.
+ *
+ * @return        @c 1 if the session was restored, else @c 0.
+ */
+int coap_dtls_client_session_import(const uint8_t *buf, size_t buf_len);
+
+/**
+ * Drop the cached client session, the next handshake will be a full one.
+ */
+void coap_dtls_client_session_forget(void);
+
 /** @} */
 
 /**
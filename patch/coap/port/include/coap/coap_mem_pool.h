@@ -0,0 +1,88 @@
+/*
+ * coap_mem_pool.h -- Pool and arena allocator for libcoap and mbedTLS
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+#ifndef COAP_MEM_POOL_H_
+#define COAP_MEM_POOL_H_
+
+#include <stddef.h>
+
+/**
+ * @defgroup mem_pool Pool allocator
+ * With CONFIG_COAP_MEM_POOL, libcoap allocates from fixed-size pools (PDUs,
+ * options, sessions) and mbedTLS from the pools and a static arena during
+ * the handshake, so that neither fragments the heap. What does not fit
+ * falls back to the heap.
+ *
+ * Small blocks come from the pools in every phase. The PDU sized pools are
+ * kept for the PDUs and not used during the handshake, where everything
+ * larger than a small block goes to the arena instead. The arena is a bump
+ * allocator: a freed block at the top gives its space back, with every
+ * freed block below it, so the temporaries of the handshake are reclaimed
+ * when it completes, and the arena is reset once it is empty.
+ * @{
+ */
+
+/** Block sizes of the pools, the first COAP_MEM_POOL_SMALL are small */
+#define COAP_MEM_POOL_SIZES { 32, 64, 128, 272, 1536 }
+#define COAP_MEM_POOL_CLASSES 5
+#define COAP_MEM_POOL_SMALL 3
+
+/**
+ * Phases of a connection, the peak usage is kept for each of them.
+ */
+typedef enum coap_mem_phase_t {
+  COAP_MEM_PHASE_SETUP,      /**< Context and session set up */
+  COAP_MEM_PHASE_HANDSHAKE,  /**< DTLS handshake, larger blocks from the arena */
+  COAP_MEM_PHASE_STEADY,     /**< Requests and responses */
+  COAP_MEM_PHASE_TEARDOWN,   /**< Session and context released */
+  COAP_MEM_PHASES
+} coap_mem_phase_t;
+
+typedef struct coap_mem_stats_t {
+  size_t in_use;                                  /**< Bytes allocated now */
+  size_t peak[COAP_MEM_PHASES];                   /**< Highest in_use in each phase */
+  size_t arena_peak;                              /**< Highest use of the arena */
+  unsigned int pool_peak[COAP_MEM_POOL_CLASSES];  /**< Most blocks in use at once, per pool */
+  unsigned int heap;                              /**< Allocations that went to the heap */
+  unsigned int untracked;                         /**< Of those, the ones not counted in in_use */
+  unsigned int arena_resets;                      /**< Times the arena was empty again */
+} coap_mem_stats_t;
+
+void *coap_mem_malloc(size_t size);
+void *coap_mem_calloc(size_t nmemb, size_t size);
+void *coap_mem_realloc(void *ptr, size_t size);
+
+/**
+ * Free a block. Pointers that were not allocated here, e.g. by the C library
+ * before the allocator was in place, are passed on to free().
+ */
+void coap_mem_free(void *ptr);
+
+/**
+ * Start a phase. Done by coap_mbedtls.c for the handshake and by the
+ * application for the others.
+ *
+ * @param phase The phase allocations are counted in from now on.
+ */
+void coap_mem_set_phase(coap_mem_phase_t phase);
+
+/**
+ * Get the counters.
+ *
+ * @param stats Where to store them.
+ */
+void coap_mem_get_stats(coap_mem_stats_t *stats);
+
+/**
+ * Start measuring the peaks again from what is allocated now, e.g. for each
+ * run of a benchmark.
+ */
+void coap_mem_reset_peaks(void);
+
+/** @} */
+
+#endif /* COAP_MEM_POOL_H_ */
@@ -23,6 +23,7 @@
 #define WITH_POSIX
 #endif
 
+#include "sdkconfig.h"
 #include "coap_config_posix.h"
 
 #define HAVE_STDIO_H
@@ -39,4 +40,17 @@
 
 #define COAP_RESOURCES_NOHASH
 
+#ifdef CONFIG_COAP_MEM_POOL
+/*
+ * libcoap allocates with malloc() and realloc() directly (mem.c, pdu.c),
+ * route those through the pools.
+ */
+#include <stdlib.h>
+#include "coap_mem_pool.h"
+#define malloc(size) coap_mem_malloc(size)
+#define calloc(nmemb, size) coap_mem_calloc(nmemb, size)
+#define realloc(ptr, size) coap_mem_realloc(ptr, size)
+#define free(ptr) coap_mem_free(ptr)
+#endif
+
 #endif /* _CONFIG_H_ */
@@ -40,6 +40,14 @@
 # include <unistd.h>
 #endif
 #include <errno.h>
+#include <stddef.h>
+
+/* Event driven wait of coap_run_once, see coap_io_wait() */
+#if defined(__linux__) && !defined(COAP_IO_NO_EPOLL)
+#define COAP_IO_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif /* __linux__ */
 
 #ifdef WITH_CONTIKI
 # include "uip.h"
@@ -625,8 +633,15 @@ error:
   return 0;
 }
 
+#ifdef COAP_IO_EPOLL
+static void coap_io_wait_forget(coap_fd_t fd);
+#endif /* COAP_IO_EPOLL */
+
 void coap_socket_close(coap_socket_t *sock) {
   if (sock->fd != COAP_INVALID_SOCKET) {
+#ifdef COAP_IO_EPOLL
+    coap_io_wait_forget(sock->fd);
+#endif /* COAP_IO_EPOLL */
     coap_closesocket(sock->fd);
     sock->fd = COAP_INVALID_SOCKET;
   }
@@ -916,9 +931,19 @@ coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint
 
 #define SIN6(A) ((struct sockaddr_in6 *)(A))
 
+/*
+ * Where coap_network_read() received the last datagram, when it was not in
+ * the packet but in the record buffer of its DTLS session.
+ */
+static coap_packet_t *coap_io_rx_packet = NULL;
+static uint8_t *coap_io_rx_direct = NULL;
+
 void
 coap_packet_get_memmapped(coap_packet_t *packet, unsigned char **address, size_t *length) {
-  *address = packet->payload;
+  if (packet == coap_io_rx_packet && coap_io_rx_direct)
+    *address = coap_io_rx_direct;
+  else
+    *address = packet->payload;
   *length = packet->length;
 }
 
@@ -936,12 +961,32 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
     sock->flags &= ~COAP_SOCKET_CAN_READ;
   }
 
+  coap_io_rx_direct = NULL;
+
 #ifndef WITH_CONTIKI
   if (sock->flags & COAP_SOCKET_CONNECTED) {
+    uint8_t *buf = packet->payload;
+    size_t buf_len = COAP_RXBUFFER_SIZE;
+#ifdef HAVE_MBEDTLS
+    /* The socket of a client session, read DTLS records where they are decrypted */
+    coap_session_t *session = (coap_session_t *)((uint8_t *)sock - offsetof(coap_session_t, sock));
+
+    if (session->type == COAP_SESSION_TYPE_CLIENT && session->proto == COAP_PROTO_DTLS &&
+        session->tls) {
+      uint8_t *rx_buf = coap_dtls_rx_buffer(session, &buf_len);
+      if (rx_buf) {
+        buf = rx_buf;
+        coap_io_rx_packet = packet;
+        coap_io_rx_direct = rx_buf;
+      } else {
+        buf_len = COAP_RXBUFFER_SIZE;
+      }
+    }
+#endif /* HAVE_MBEDTLS */
 #ifdef _WIN32
-    len = recv(sock->fd, (char *)packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, (char *)buf, (int)buf_len, 0);
 #else
-    len = recv(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, buf, buf_len, 0);
 #endif
     if (len < 0) {
 #ifdef _WIN32
@@ -1326,31 +1371,230 @@ coap_write(coap_context_t *ctx,
   return (unsigned int)((timeout * 1000 + COAP_TICKS_PER_SECOND - 1) / COAP_TICKS_PER_SECOND);
 }
 
-int
-coap_run_once(coap_context_t *ctx, unsigned timeout_ms) {
+/*
+ * coap_io_wait(), the wait of coap_run_once(), until a socket event, the
+ * next deadline of libcoap or the caller, or coap_run_once_wake().
+ *
+ * On Linux the sockets stay registered with an epoll instance between the
+ * calls, only changes in what libcoap waits for are passed to the kernel,
+ * and coap_run_once_wake() signals an eventfd. Elsewhere (lwIP) it is
+ * select(), which sleeps on a semaphore that the socket event callback of
+ * lwIP gives, and coap_run_once_wake() sends a datagram to a socket bound
+ * to the loopback interface. One context at a time is expected, the epoll
+ * registrations are dropped when another one is run.
+ */
+#define COAP_IO_MAX_SOCKETS 64
+
+static coap_fd_t coap_io_wake_fd = COAP_INVALID_SOCKET;
+
+#ifdef COAP_IO_EPOLL
+
+typedef struct {
+  coap_fd_t fd;
+  uint32_t events;
+} coap_io_reg_t;
+
+static int coap_io_epfd = -1;
+static coap_context_t *coap_io_ctx = NULL;
+static coap_io_reg_t coap_io_reg[COAP_IO_MAX_SOCKETS];
+static unsigned int coap_io_num_reg = 0;
+
+static int
+coap_io_wait_init(coap_context_t *ctx) {
+  struct epoll_event ev;
+
+  if (coap_io_epfd >= 0 && coap_io_ctx == ctx)
+    return 1;
+  if (coap_io_epfd >= 0)
+    close(coap_io_epfd);
+  coap_io_num_reg = 0;
+  coap_io_ctx = ctx;
+  coap_io_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (coap_io_epfd < 0) {
+    coap_log(LOG_WARNING, "coap_run_once: epoll_create1: %s\n", coap_socket_strerror());
+    return 0;
+  }
+  if (coap_io_wake_fd == COAP_INVALID_SOCKET)
+    coap_io_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (coap_io_wake_fd != COAP_INVALID_SOCKET) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = coap_io_wake_fd;
+    epoll_ctl(coap_io_epfd, EPOLL_CTL_ADD, coap_io_wake_fd, &ev);
+  }
+  return 1;
+}
+
+/* A closed descriptor leaves the epoll set by itself, and may come back as another socket */
+static void
+coap_io_wait_forget(coap_fd_t fd) {
+  unsigned int i;
+
+  for (i = 0; i < coap_io_num_reg; i++) {
+    if (coap_io_reg[i].fd == fd) {
+      coap_io_reg[i] = coap_io_reg[--coap_io_num_reg];
+      return;
+    }
+  }
+}
+
+static uint32_t
+coap_io_events(coap_socket_flags_t flags) {
+  uint32_t events = 0;
+
+  if (flags & (COAP_SOCKET_WANT_READ | COAP_SOCKET_WANT_ACCEPT))
+    events |= EPOLLIN;
+  if (flags & (COAP_SOCKET_WANT_WRITE | COAP_SOCKET_WANT_CONNECT))
+    events |= EPOLLOUT;
+  return events;
+}
+
+static void
+coap_io_epoll_ctl(coap_fd_t fd, uint32_t events, int add) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(coap_io_epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0) {
+    if (errno == EEXIST || errno == ENOENT)
+      epoll_ctl(coap_io_epfd, add ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+/* Bring the epoll set up to date with the sockets libcoap waits on */
+static void
+coap_io_epoll_sync(coap_socket_t *sockets[], unsigned int num_sockets) {
+  coap_io_reg_t reg[COAP_IO_MAX_SOCKETS];
+  unsigned int num_reg = 0, i, j;
+
+  for (i = 0; i < num_sockets; i++) {
+    for (j = 0; j < num_reg && reg[j].fd != sockets[i]->fd; j++)
+      ;
+    if (j == num_reg) {
+      reg[num_reg].fd = sockets[i]->fd;
+      reg[num_reg++].events = 0;
+    }
+    reg[j].events |= coap_io_events(sockets[i]->flags);
+  }
+
+  for (i = 0; i < num_reg; i++) {
+    for (j = 0; j < coap_io_num_reg && coap_io_reg[j].fd != reg[i].fd; j++)
+      ;
+    if (j == coap_io_num_reg)
+      coap_io_epoll_ctl(reg[i].fd, reg[i].events, 1);
+    else if (coap_io_reg[j].events != reg[i].events)
+      coap_io_epoll_ctl(reg[i].fd, reg[i].events, 0);
+  }
+  for (j = 0; j < coap_io_num_reg; j++) {
+    for (i = 0; i < num_reg && reg[i].fd != coap_io_reg[j].fd; i++)
+      ;
+    if (i == num_reg)
+      epoll_ctl(coap_io_epfd, EPOLL_CTL_DEL, coap_io_reg[j].fd, NULL);
+  }
+
+  memcpy(coap_io_reg, reg, num_reg * sizeof(reg[0]));
+  coap_io_num_reg = num_reg;
+}
+
+static int
+coap_io_wait(coap_socket_t *sockets[], unsigned int num_sockets, unsigned int timeout) {
+  struct epoll_event events[COAP_IO_MAX_SOCKETS];
+  int result, k;
+  unsigned int i;
+
+  coap_io_epoll_sync(sockets, num_sockets);
+
+  result = epoll_wait(coap_io_epfd, events, COAP_IO_MAX_SOCKETS, timeout > 0 ? (int)timeout : -1);
+
+  for (k = 0; k < result; k++) {
+    uint32_t ev = events[k].events;
+    int readable = (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+    int writable = (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+
+    if (events[k].data.fd == coap_io_wake_fd) {
+      uint64_t count;
+      if (read(coap_io_wake_fd, &count, sizeof(count)) < 0)
+        coap_log(LOG_DEBUG, "coap_run_once: eventfd: %s\n", coap_socket_strerror());
+      continue;
+    }
+    for (i = 0; i < num_sockets; i++) {
+      if (sockets[i]->fd != events[k].data.fd)
+        continue;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_READ) && readable)
+        sockets[i]->flags |= COAP_SOCKET_CAN_READ;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_ACCEPT) && readable)
+        sockets[i]->flags |= COAP_SOCKET_CAN_ACCEPT;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_WRITE) && writable)
+        sockets[i]->flags |= COAP_SOCKET_CAN_WRITE;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_CONNECT) && writable)
+        sockets[i]->flags |= COAP_SOCKET_CAN_CONNECT;
+    }
+  }
+  return result;
+}
+
+void
+coap_run_once_wake(void) {
+  uint64_t one = 1;
+
+  if (coap_io_wake_fd != COAP_INVALID_SOCKET &&
+      write(coap_io_wake_fd, &one, sizeof(one)) < 0)
+    coap_log(LOG_DEBUG, "coap_run_once_wake: %s\n", coap_socket_strerror());
+}
+
+#else /* ! COAP_IO_EPOLL */
+
+#ifndef _WIN32
+static struct sockaddr_in coap_io_wake_addr;
+#endif /* _WIN32 */
+
+static int
+coap_io_wait_init(coap_context_t *ctx) {
+#ifndef _WIN32
+  socklen_t addr_len = sizeof(coap_io_wake_addr);
+  int on = 1;
+  coap_fd_t fd;
+
+  (void)ctx;
+  if (coap_io_wake_fd != COAP_INVALID_SOCKET)
+    return 1;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == COAP_INVALID_SOCKET)
+    goto error;
+  memset(&coap_io_wake_addr, 0, sizeof(coap_io_wake_addr));
+  coap_io_wake_addr.sin_family = AF_INET;
+  coap_io_wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&coap_io_wake_addr, sizeof(coap_io_wake_addr)) == COAP_SOCKET_ERROR ||
+      getsockname(fd, (struct sockaddr *)&coap_io_wake_addr, &addr_len) == COAP_SOCKET_ERROR ||
+      ioctl(fd, FIONBIO, &on) == COAP_SOCKET_ERROR) {
+    coap_closesocket(fd);
+    goto error;
+  }
+  coap_io_wake_fd = fd;
+  return 1;
+
+error:
+  /* Not fatal, coap_run_once_wake() just has no effect */
+  coap_log(LOG_WARNING, "coap_run_once: wake socket: %s\n", coap_socket_strerror());
+#else
+  (void)ctx;
+#endif /* _WIN32 */
+  return 1;
+}
+
+static int
+coap_io_wait(coap_socket_t *sockets[], unsigned int num_sockets, unsigned int timeout) {
 #if COAP_CONSTRAINED_STACK
-  static coap_mutex_t static_mutex = COAP_MUTEX_INITIALIZER;
   static fd_set readfds, writefds, exceptfds;
-  static coap_socket_t *sockets[64];
 #else /* ! COAP_CONSTRAINED_STACK */
   fd_set readfds, writefds, exceptfds;
-  coap_socket_t *sockets[64];
 #endif /* ! COAP_CONSTRAINED_STACK */
   coap_fd_t nfds = 0;
   struct timeval tv;
-  coap_tick_t before, now;
   int result;
-  unsigned int num_sockets = 0, i, timeout;
-
-#if COAP_CONSTRAINED_STACK
-  coap_mutex_lock(&static_mutex);
-#endif /* COAP_CONSTRAINED_STACK */
-
-  coap_ticks(&before);
-
-  timeout = coap_write(ctx, sockets, (unsigned int)(sizeof(sockets) / sizeof(sockets[0])), &num_sockets, before);
-  if (timeout == 0 || timeout_ms < timeout)
-    timeout = timeout_ms;
+  unsigned int i;
 
   FD_ZERO(&readfds);
   FD_ZERO(&writefds);
@@ -1369,6 +1613,11 @@ coap_run_once(coap_context_t *ctx, unsigned timeout_ms) {
       FD_SET(sockets[i]->fd, &exceptfds);
     }
   }
+  if (coap_io_wake_fd != COAP_INVALID_SOCKET) {
+    if (coap_io_wake_fd + 1 > nfds)
+      nfds = coap_io_wake_fd + 1;
+    FD_SET(coap_io_wake_fd, &readfds);
+  }
 
   if ( timeout > 0 ) {
     tv.tv_usec = (timeout % 1000) * 1000;
@@ -1377,6 +1626,72 @@ coap_run_once(coap_context_t *ctx, unsigned timeout_ms) {
 
   result = select(nfds, &readfds, &writefds, &exceptfds, timeout > 0 ? &tv : NULL);
 
+  if (result > 0) {
+    if (coap_io_wake_fd != COAP_INVALID_SOCKET && FD_ISSET(coap_io_wake_fd, &readfds)) {
+      uint8_t buf[8];
+      while (recv(coap_io_wake_fd, (char *)buf, sizeof(buf), 0) > 0)
+        ;
+    }
+    for (i = 0; i < num_sockets; i++) {
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_READ) && FD_ISSET(sockets[i]->fd, &readfds))
+        sockets[i]->flags |= COAP_SOCKET_CAN_READ;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_ACCEPT) && FD_ISSET(sockets[i]->fd, &readfds))
+        sockets[i]->flags |= COAP_SOCKET_CAN_ACCEPT;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_WRITE) && FD_ISSET(sockets[i]->fd, &writefds))
+        sockets[i]->flags |= COAP_SOCKET_CAN_WRITE;
+      if ((sockets[i]->flags & COAP_SOCKET_WANT_CONNECT) && (FD_ISSET(sockets[i]->fd, &writefds) || FD_ISSET(sockets[i]->fd, &exceptfds)))
+        sockets[i]->flags |= COAP_SOCKET_CAN_CONNECT;
+    }
+  }
+  return result;
+}
+
+void
+coap_run_once_wake(void) {
+#ifndef _WIN32
+  uint8_t b = 0;
+
+  if (coap_io_wake_fd != COAP_INVALID_SOCKET &&
+      sendto(coap_io_wake_fd, (const char *)&b, 1, 0,
+             (struct sockaddr *)&coap_io_wake_addr, sizeof(coap_io_wake_addr)) < 0)
+    coap_log(LOG_DEBUG, "coap_run_once_wake: %s\n", coap_socket_strerror());
+#endif /* _WIN32 */
+}
+
+#endif /* ! COAP_IO_EPOLL */
+
+int
+coap_run_once(coap_context_t *ctx, unsigned timeout_ms) {
+#if COAP_CONSTRAINED_STACK
+  static coap_mutex_t static_mutex = COAP_MUTEX_INITIALIZER;
+  static coap_socket_t *sockets[COAP_IO_MAX_SOCKETS];
+#else /* ! COAP_CONSTRAINED_STACK */
+  coap_socket_t *sockets[COAP_IO_MAX_SOCKETS];
+#endif /* ! COAP_CONSTRAINED_STACK */
+  coap_tick_t before, now;
+  int result;
+  unsigned int num_sockets = 0, timeout;
+
+#if COAP_CONSTRAINED_STACK
+  coap_mutex_lock(&static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+
+  coap_ticks(&before);
+
+  timeout = coap_write(ctx, sockets, (unsigned int)(sizeof(sockets) / sizeof(sockets[0])), &num_sockets, before);
+  /* 0 is no deadline on either side, it must not hide the one of libcoap */
+  if (timeout_ms > 0 && (timeout == 0 || timeout_ms < timeout))
+    timeout = timeout_ms;
+
+  if (!coap_io_wait_init(ctx)) {
+#if COAP_CONSTRAINED_STACK
+    coap_mutex_unlock(&static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+    return -1;
+  }
+
+  result = coap_io_wait(sockets, num_sockets, timeout);
+
   if (result < 0) {   /* error */
 #ifdef _WIN32
     if (WSAGetLastError() != WSAEINVAL) { /* May happen because of ICMP */
@@ -1391,19 +1706,6 @@ coap_run_once(coap_context_t *ctx, unsigned timeout_ms) {
     }
   }
 
-  if (result > 0) {
-    for (i = 0; i < num_sockets; i++) {
-      if ((sockets[i]->flags & COAP_SOCKET_WANT_READ) && FD_ISSET(sockets[i]->fd, &readfds))
-        sockets[i]->flags |= COAP_SOCKET_CAN_READ;
-      if ((sockets[i]->flags & COAP_SOCKET_WANT_ACCEPT) && FD_ISSET(sockets[i]->fd, &readfds))
-        sockets[i]->flags |= COAP_SOCKET_CAN_ACCEPT;
-      if ((sockets[i]->flags & COAP_SOCKET_WANT_WRITE) && FD_ISSET(sockets[i]->fd, &writefds))
-        sockets[i]->flags |= COAP_SOCKET_CAN_WRITE;
-      if ((sockets[i]->flags & COAP_SOCKET_WANT_CONNECT) && (FD_ISSET(sockets[i]->fd, &writefds) || FD_ISSET(sockets[i]->fd, &exceptfds)))
-        sockets[i]->flags |= COAP_SOCKET_CAN_CONNECT;
-    }
-  }
-
   coap_ticks(&now);
   coap_read(ctx, now);
 
@@ -1419,6 +1721,9 @@ int coap_run_once(coap_context_t *ctx, unsigned int timeout_ms) {
   return -1;
 }
 
+void coap_run_once_wake(void) {
+}
+
 unsigned int
 coap_write(coap_context_t *ctx,
            coap_socket_t *sockets[],
@@ -35,12 +35,16 @@
 
 #if !defined(MBEDTLS_ESP_TIMING_C)
 
-#include <sys/time.h>
+#include "esp_timer.h"
 #include "mbedtls/timing.h"
 
+/*
+ * On esp_timer, monotonic and in microseconds, instead of gettimeofday(),
+ * which jumps when SNTP sets the time.
+ */
 struct _hr_time
 {
-    struct timeval start;
+    int64_t start;
 };
 
 unsigned long mbedtls_timing_get_timer( struct mbedtls_timing_hr_time *val, int reset )
@@ -49,17 +53,12 @@ unsigned long mbedtls_timing_get_timer( struct mbedtls_timing_hr_time *val, int
 
     if( reset )
     {
-        gettimeofday( &t->start, NULL );
+        t->start = esp_timer_get_time();
         return( 0 );
     }
     else
     {
-        unsigned long delta;
-        struct timeval now;
-        gettimeofday( &now, NULL );
-        delta = ( now.tv_sec  - t->start.tv_sec  ) * 1000ul
-              + ( now.tv_usec - t->start.tv_usec ) / 1000;
-        return( delta );
+        return( (unsigned long)( ( esp_timer_get_time() - t->start ) / 1000 ) );
     }
 }
 
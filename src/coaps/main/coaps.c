@@ -15,119 +15,127 @@
 
 #include "squidward/sq_wifi.h"
 #include "squidward/sq_coap.h"
+#include "squidward/sq_coap_batch.h"
+#include "squidward/sq_coap_block1.h"
+#include "squidward/sq_coap_req.h"
+#include "squidward/sq_coap_telemetry.h"
 #include "squidward/sq_uart.h"
 
 
 const int CONNECTED_BIT = BIT0;
 EventGroupHandle_t wifi_event_group;
 
-static int resp_wait = 1;
-static int wait_ms;
-
 const char *TAG = "coaps";
 
 coap_context_t  *ctx = NULL;
 coap_session_t  *session = NULL;
 
-/* Annotation strings */
-const char ant_post_send[32]			= "CoAP POST send";
-const char ant_post_send_done[]			= "CoAP POST send done\n";
-const char ant_get_block_send[]			= "CoAP GET block send\n";
-const char ant_get_block_send_done[]	= "CoAP GET block send done\n";
-
 #define POST_SIZE 16 * 1024
 unsigned char post_data[POST_SIZE];
 
+/* Telemetry records sent through a batch */
+#define TELEMETRY_RECORDS		64
+#define TELEMETRY_RECORD_SIZE	48
+
+static sq_coap_batch_t batch;
+
+/* POSTs in flight in the async phase */
+static sq_coap_req_t req;
+
+/* Single CON POST of the sweep, its response is matched by the one byte token */
+static int resp_wait = 1;
+static int wait_ms;
+static uint8_t post_token;
+
+/* POSTs larger than a PDU */
+static sq_coap_block1_t upload;
+
+static sq_coap_telemetry_t telemetry;
+
+/**
+ * @brief Print the response to a POST, and count down the POSTs in flight.
+ */
+static void post_done(void *arg, int status, coap_pdu_t *received)
+{
+	int *pending = (int *) arg;
+	unsigned char *data = NULL;
+	size_t data_len;
+
+	if (status != SQ_COAP_REQ_OK) {
+		ESP_LOGE(TAG, "No response to POST (%d)", status);
+		return;
+	}
+	if (COAP_RESPONSE_CLASS(received->code) == 2 && coap_get_data(received, &data_len, &data)) {
+		printf("Received: %.*s\n", (int)data_len, data);
+	}
+	(*pending)--;
+}
+
 static void coap_message_handler(coap_context_t *ctx, coap_session_t *session,
 							coap_pdu_t *sent, coap_pdu_t *received,
 							const coap_tid_t id)
 {
 	unsigned char *data = NULL;
 	size_t data_len;
-	coap_pdu_t *pdu = NULL;
-	coap_opt_t *block_opt;
-	coap_opt_iterator_t opt_iter;
-	unsigned char buf[4];
-	coap_optlist_t *option;
-	coap_tid_t tid;
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Got response", __FUNCTION__);
 #endif
 
-	if (COAP_RESPONSE_CLASS(received->code) == 2) {
-		/* Need to see if blocked response */
-		block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
-		if (block_opt) {
-			uint16_t blktype = opt_iter.type;
+	if (sq_coap_req_response(&req, received) ||
+		sq_coap_telemetry_response(&telemetry, received)) {
+		return;
+	}
+	if (sq_coap_block1_match(received)) {
+		sq_coap_block1_response(&upload, received);
+		return;
+	}
+	if (received->token_length != 1 || received->token[0] != post_token) {
+		/* Late answer to an earlier POST */
+		return;
+	}
 
-			if (coap_opt_block_num(block_opt) == 0) {
-				printf("Received:\n");
-			}
-			if (coap_get_data(received, &data_len, &data)) {
-				printf("%.*s", (int)data_len, data);
-			}
-			if (COAP_OPT_BLOCK_MORE(block_opt)) {
-				/* more bit is set */
-
-				/* create pdu with request for next block */
-				pdu = coap_new_pdu(session);
-				if (!pdu) {
-					ESP_LOGE(TAG, "coap_new_pdu() failed");
-					goto clean_up;
-				}
-				pdu->type = COAP_MESSAGE_CON;
-				pdu->tid = coap_new_message_id(session);
-				pdu->code = COAP_REQUEST_GET;
-
-				/* add URI components from optlist */
-				for (option = optlist; option; option = option->next ) {
-					switch (option->number) {
-					case COAP_OPTION_URI_HOST :
-					case COAP_OPTION_URI_PORT :
-					case COAP_OPTION_URI_PATH :
-					case COAP_OPTION_URI_QUERY :
-						coap_add_option(pdu, option->number, option->length,
-										option->data);
-						break;
-					default:
-						;     /* skip other options */
-					}
-				}
-
-				/* finally add updated block option from response, clear M bit */
-				/* blocknr = (blocknr & 0xfffffff7) + 0x10; */
-				coap_add_option(pdu,
-								blktype,
-								coap_encode_var_safe(buf, sizeof(buf),
-													 ((coap_opt_block_num(block_opt) + 1) << 4) |
-													 COAP_OPT_BLOCK_SZX(block_opt)), buf);
-				sq_uart_send(ant_get_block_send, sizeof(ant_get_block_send));
-				tid = coap_send(session, pdu);
-				sq_uart_send(ant_get_block_send_done, sizeof(ant_get_block_send_done));
-
-				if (tid != COAP_INVALID_TID) {
-					resp_wait = 1;
-					wait_ms = SQ_COAP_TIME_SEC * 1000;
-					return;
-				}
-			}
-			printf("\n");
-		} else {
-			if (coap_get_data(received, &data_len, &data)) {
-				printf("Received: %.*s\n", (int)data_len, data);
-			}
-		}
+	if (COAP_RESPONSE_CLASS(received->code) == 2 && coap_get_data(received, &data_len, &data)) {
+		printf("Received: %.*s\n", (int)data_len, data);
 	}
-clean_up:
 	resp_wait = 0;
 }
 
+/**
+ * @brief POST msg in blocks, and run the I/O loop until all have been answered.
+ */
+static int sq_coap_upload(unsigned char *msg, int msglen)
+{
+	sq_uart_ant(SQ_UART_ANT_UPLOAD_SEND, msglen);
+	sq_coap_block1_start(&upload, COAP_REQUEST_POST, msg, msglen);
+	while (upload.status == SQ_COAP_BLOCK_BUSY) {
+		/* Lost blocks are sent again from here */
+		int block_ms = sq_coap_block1_poll(&upload);
+		if (upload.status != SQ_COAP_BLOCK_BUSY) {
+			break;
+		}
+		coap_run_once(ctx, block_ms);
+	}
+	sq_uart_ant(SQ_UART_ANT_UPLOAD_SEND_DONE, 0);
+
+	if (upload.status != SQ_COAP_BLOCK_DONE) {
+		ESP_LOGE(TAG, "Upload of %d bytes failed", msglen);
+	}
+	ESP_LOGI(TAG, "%d bytes in %u blocks, %u retransmitted, response %d.%02d", msglen,
+			 upload.blocks, upload.retransmits, upload.resp_code >> 5, upload.resp_code & 0x1f);
+	return 0;
+}
+
+/**
+ * @brief POST msg as CON, and run the I/O loop until it has been answered.
+ */
 int sq_coap_send(unsigned char *msg, int msglen)
 {
 	coap_pdu_t *request = NULL;
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
+
+	if (sq_coap_block1_needed(session, msglen)) {
+		return sq_coap_upload(msg, msglen);
+	}
 
 	request = coap_new_pdu(session);
 	if (!request) {
@@ -138,16 +146,15 @@ int sq_coap_send(unsigned char *msg, int msglen)
 	request->type = COAP_MESSAGE_CON;
 	request->tid = coap_new_message_id(session);
 	request->code = COAP_REQUEST_POST;
+	post_token++;
+	coap_add_token(request, 1, &post_token);
 	coap_add_optlist_pdu(request, &optlist);
-
-	/* Add POST data, double the size each time */
 	coap_add_data(request, msglen, msg);
 
 	resp_wait = 1;
-	snprintf(annotation_msg, ANT_BUF_SIZE, "%s %d bytes\n", ant_post_send, msglen);
-	sq_uart_send(annotation_msg, strlen(annotation_msg));
+	sq_uart_ant(SQ_UART_ANT_POST_SEND, msglen);
 	coap_send(session, request);
-	sq_uart_send(ant_post_send_done, sizeof(ant_post_send_done));
+	sq_uart_ant(SQ_UART_ANT_POST_SEND_DONE, 0);
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - CoAP message sent, awaiting response", __FUNCTION__);
@@ -156,7 +163,7 @@ int sq_coap_send(unsigned char *msg, int msglen)
 	wait_ms = SQ_COAP_TIME_SEC * 1000;
 
 	while (resp_wait) {
-		int result = coap_run_once(ctx, wait_ms > 1000 ? 1000 : wait_ms);
+		int result = coap_run_once(ctx, wait_ms);
 		if (result >= 0) {
 			if (result >= wait_ms) {
 				ESP_LOGE(TAG, "select timeout");
@@ -170,11 +177,78 @@ int sq_coap_send(unsigned char *msg, int msglen)
 	return 0;
 }
 
-void sq_main(void *p)
+/**
+ * @brief Send num POSTs of len bytes at once, up to SQ_COAP_REQ_NSTART in flight.
+ *
+ * @return The number of POSTs without a response, or -1.
+ */
+static int sq_coap_send_many(unsigned char *msg, int msglen, int num)
+{
+	int pending = 0;
+
+	for (int i = 0; i < num; i++) {
+		/* Table full, wait for a slot */
+		while (sq_coap_req_pending(&req) == SQ_COAP_REQ_MAX) {
+			coap_run_once(ctx, sq_coap_req_poll(&req));
+		}
+		if (sq_coap_req_submit(&req, COAP_REQUEST_POST, NULL, msg, msglen, 0, post_done, &pending) < 0) {
+			break;
+		}
+		pending++;
+	}
+	if (sq_coap_req_run(&req, ctx) != SQ_COAP_OK) {
+		return -1;
+	}
+	return pending;
+}
+
+/**
+ * @brief Send a batch of telemetry records as one POST.
+ */
+static int batch_send(void *arg, const uint8_t *data, size_t len, unsigned int records)
 {
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
+	sq_uart_ant(SQ_UART_ANT_BATCH_SEND, records);
+	return sq_coap_send((unsigned char *) data, len);
+}
+
+/**
+ * @brief Send the telemetry records one message each, in the given mode.
+ *
+ * CON waits for each message to be answered, like sq_coap_send. NON only
+ * waits when the retransmit buffer is full, and for the ranges at the end.
+ */
+static int telemetry_run(int mode)
+{
+	unsigned int window = mode == SQ_COAP_TELEMETRY_CON ? 1 : SQ_COAP_TELEMETRY_BUFFER;
+	int wait_ms;
+
+	sq_coap_telemetry_init(&telemetry, session, mode);
+	sq_uart_ant(mode == SQ_COAP_TELEMETRY_CON ? SQ_UART_ANT_TELEMETRY_CON : SQ_UART_ANT_TELEMETRY_NON,
+				TELEMETRY_RECORDS);
+	for (int i = 0; i < TELEMETRY_RECORDS; i++) {
+		while (sq_coap_telemetry_pending(&telemetry) >= window &&
+			   (wait_ms = sq_coap_telemetry_poll(&telemetry)) >= 0) {
+			coap_run_once(ctx, wait_ms);
+		}
+		if (i == TELEMETRY_RECORDS - 1) {
+			sq_coap_telemetry_ask(&telemetry);
+		}
+		if (sq_coap_telemetry_send(&telemetry, post_data, TELEMETRY_RECORD_SIZE) != SQ_COAP_OK) {
+			return -1;
+		}
+	}
+	while ((wait_ms = sq_coap_telemetry_poll(&telemetry)) >= 0) {
+		coap_run_once(ctx, wait_ms);
+	}
+	sq_uart_ant(SQ_UART_ANT_TELEMETRY_DONE, 0);
 
+	ESP_LOGI(TAG, "%u messages in %u datagrams, %u retransmitted, %u acknowledgements, %u dropped",
+			 telemetry.messages, telemetry.datagrams, telemetry.retransmits, telemetry.acks, telemetry.dropped);
+	return 0;
+}
+
+void sq_main(void *p)
+{
 	/* Initialize data to be sent */
 	for (int i = 0; i < POST_SIZE; i++) {
 		post_data[i] = 'a';
@@ -214,13 +288,16 @@ void sq_main(void *p)
 		}
 	}
 
+	sq_coap_req_init(&req, session, SQ_COAP_REQ_NSTART);
+	sq_coap_block1_init(&upload, session, SQ_COAP_BLOCK1_WINDOW, SQ_COAP_BLOCK1_SZX);
 	coap_register_response_handler(ctx, coap_message_handler);
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Registered response handler", __FUNCTION__);
 #endif
 
+	/* Above one PDU the POSTs go in Block1 blocks */
 	int post_len = 1;
-	for (int i = 0; i <= 10; i++) {
+	for (int i = 0; i <= 14; i++) {
 		if (sq_coap_send(post_data, post_len) != 0) goto exit;
 		post_len *= 2;
 		sleep(1);
@@ -228,17 +305,48 @@ void sq_main(void *p)
 
 	int num_pkts = 2;
 	for (int i = 0; i < 4; i++) {
-		snprintf(annotation_msg, ANT_BUF_SIZE, "%s %d bytes\n", ant_post_send, num_pkts * 1024);
-		sq_uart_send(annotation_msg, strlen(annotation_msg));
+		sq_uart_ant(SQ_UART_ANT_POST_SEND, num_pkts * 1024);
 		for (int j = 0; j < num_pkts; j++) {
 			if (sq_coap_send(post_data, 1024) != 0) goto exit;
 		}
-		sq_uart_send(ant_post_send_done, sizeof(ant_post_send_done));
+		sq_uart_ant(SQ_UART_ANT_POST_SEND_DONE, 0);
 
 		num_pkts *= 2;
 		sleep(1);
 	}
 
+	/* The same packets again, several in flight instead of one after another */
+	num_pkts = 2;
+	for (int i = 0; i < 4; i++) {
+		sq_uart_ant(SQ_UART_ANT_ASYNC_SEND, num_pkts * 1024);
+		if (sq_coap_send_many(post_data, 1024, num_pkts) < 0) goto exit;
+		sq_uart_ant(SQ_UART_ANT_ASYNC_SEND_DONE, 0);
+
+		num_pkts *= 2;
+		sleep(1);
+	}
+	ESP_LOGI(TAG, "%u requests, %u retransmitted, at most %u in flight",
+			 req.submitted, req.retransmits, req.max_inflight);
+
+	/* Telemetry records, as few POSTs as the batch limits allow */
+	if (sq_coap_batch_init(&batch, SQ_COAP_BATCH_BYTES, SQ_COAP_BATCH_RECORDS, SQ_COAP_BATCH_DEADLINE,
+						   batch_send, NULL) != SQ_COAP_OK) {
+		goto exit;
+	}
+	sq_uart_ant(SQ_UART_ANT_BATCH_TOTAL, TELEMETRY_RECORDS);
+	for (int i = 0; i < TELEMETRY_RECORDS; i++) {
+		if (sq_coap_batch_add(&batch, post_data, TELEMETRY_RECORD_SIZE) != SQ_COAP_OK) goto exit;
+	}
+	if (sq_coap_batch_flush(&batch) != SQ_COAP_OK) goto exit;
+	sq_uart_ant(SQ_UART_ANT_BATCH_SEND_DONE, 0);
+	ESP_LOGI(TAG, "%u records in %u POSTs", batch.sent_records, batch.batches);
+	sq_coap_batch_free(&batch);
+
+	/* The records again, one message each, CON and then NON */
+	if (telemetry_run(SQ_COAP_TELEMETRY_CON) != 0) goto exit;
+	sleep(1);
+	if (telemetry_run(SQ_COAP_TELEMETRY_NON) != 0) goto exit;
+
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Response handled, exiting", __FUNCTION__);
 #endif
@@ -17,15 +17,19 @@
 #include "esp_http_client.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_timer.h"
 
 #include "driver/gpio.h"
 
 #include "squidward/sq_wifi.h"
 #include "squidward/sq_coap.h"
+#include "squidward/sq_coap_block.h"
+#include "squidward/sq_coap_observe.h"
+#include "squidward/sq_fota.h"
+#include "squidward/sq_fota_flash.h"
 #include "squidward/sq_uart.h"
 
 #define OTA_BUFSIZE 1024
-#define HASH_LEN 32 /* SHA-256 digest length */
 
 static xQueueHandle gpio_evt_queue = NULL;
 #define UPDATE_BTN	GPIO_NUM_5
@@ -36,7 +40,7 @@ static xQueueHandle gpio_evt_queue = NULL;
  */
 #define ESP_INTR_FLAG_DEFAULT 0
 
-static esp_ota_handle_t update_handle = 0;
+static sq_fota_flash_t flash;
 //static char ota_write_data[OTA_BUFSIZE + 1] = { 0 };
 
 const int CONNECTED_BIT = BIT0;
@@ -44,19 +48,50 @@ EventGroupHandle_t wifi_event_group;
 
 static int resp_wait = 1;
 static int wait_ms;
-static unsigned int next_block = 0;
+static sq_coap_block_t block;
+static sq_fota_writer_t writer;
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+#define SQ_MAIN_MANIFEST_PATH	CONFIG_SQ_MAIN_MANIFEST_PATH
+#define MANIFEST_BUFSIZE		512
+
+static sq_fota_hash_t hash;
+static sq_fota_manifest_t manifest;
+static char manifest_buf[MANIFEST_BUFSIZE];
+static size_t manifest_len;
+static uint8_t running_sha256[SQ_FOTA_HASH_LEN];
+#endif
 
-const char *TAG = "coaps_fota";
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+#define SQ_MAIN_TELEMETRY_CONFIG_PATH	CONFIG_SQ_MAIN_TELEMETRY_CONFIG_PATH
+
+static sq_coap_observe_t manifest_obs;
+static sq_coap_observe_t config_obs;
+static int notified;
+static volatile int button_pressed;
+#endif
+
+#if defined(CONFIG_SQ_FOTA_LZ) && defined(CONFIG_SQ_FOTA_VERIFY)
+#define SQ_MAIN_COMPRESSED_PATH	CONFIG_SQ_MAIN_COMPRESSED_PATH
+#endif
+
+#ifdef CONFIG_SQ_FOTA_RESUME
+#define SQ_MAIN_RESUME_ATTEMPTS	CONFIG_SQ_MAIN_RESUME_ATTEMPTS
+
+static sq_fota_resume_t resume;
+#endif
+
+#ifdef CONFIG_SQ_FOTA_DELTA
+#define SQ_MAIN_DELTA_PATH	CONFIG_SQ_MAIN_DELTA_PATH
+
+static sq_fota_delta_t delta;
+#endif
 
-/* Annotation strings */
-const char ant_main[]					= "Device started\n";
-const char ant_get_send[]				= "CoAP GET send\n";
-const char ant_get_send_done[]			= "CoAP GET send done\n";
-const char ant_get_resp[]				= "CoAP Got Response\n";
-const char ant_get_block_send[]			= "CoAP GET block send\n";
-const char ant_get_block_send_done[]	= "CoAP GET block send done\n";
-const char ant_ota_write[]				= "OTA write block\n";
-const char ant_ota_write_done[]			= "OTA write done\n";
+#ifdef CONFIG_SQ_FOTA_LZ
+static sq_fota_lz_t lz;
+#endif
+
+const char *TAG = "coaps_fota";
 
 static void __attribute__((noreturn)) task_fatal_error()
 {
@@ -68,127 +103,296 @@ static void __attribute__((noreturn)) task_fatal_error()
 	}
 }
 
+/**
+ * @brief Write firmware to flash, called from the flash writer task.
+ */
+static int ota_write_block(void *arg, const uint8_t *data, size_t len)
+{
+	int res;
+
+#ifdef CONFIG_SQ_MAIN_DBG
+	ESP_LOGI(TAG, "Writing %d bytes of OTA data", len);
+#endif
+	sq_uart_ant(SQ_UART_ANT_OTA_WRITE, 0);
+	res = sq_fota_flash_write(&flash, data, len);
+	sq_uart_ant(SQ_UART_ANT_OTA_WRITE_DONE, 0);
+
+	return res;
+}
+
+#ifdef CONFIG_SQ_FOTA_DELTA
+/**
+ * @brief Read the running image, for the patch stage.
+ */
+static int running_read(void *arg, size_t offset, uint8_t *data, size_t len)
+{
+	return esp_partition_read((const esp_partition_t *) arg, offset, data, len) == ESP_OK ? 0 : -1;
+}
+#endif
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+static int manifest_write(void *arg, const uint8_t *data, size_t len)
+{
+	if (manifest_len + len > sizeof(manifest_buf)) {
+		ESP_LOGE(TAG, "Manifest larger than %d bytes", MANIFEST_BUFSIZE);
+		return -1;
+	}
+	memcpy(manifest_buf + manifest_len, data, len);
+	manifest_len += len;
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+/**
+ * @brief The manifest has changed, or this is the first notification after registering.
+ */
+static void manifest_notify(void *arg, const uint8_t *data, size_t len)
+{
+	/* A manifest that fits in one notification is used as is, otherwise it is fetched */
+	manifest_len = 0;
+	if (manifest_obs.more || manifest_write(NULL, data, len) != 0) {
+		manifest_len = 0;
+	}
+	notified = 1;
+}
+
+static void config_notify(void *arg, const uint8_t *data, size_t len)
+{
+	ESP_LOGI(TAG, "Telemetry configuration: %.*s", (int)len, (const char *) data);
+}
+#endif
+
 static void coap_message_handler(coap_context_t *ctx, coap_session_t *session,
 							coap_pdu_t *sent, coap_pdu_t *received,
 							const coap_tid_t id)
 {
 	
-	sq_uart_send(ant_get_resp, sizeof(ant_get_resp));
+	sq_uart_ant(SQ_UART_ANT_GET_RESP, 0);
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Got response", __FUNCTION__);
 #endif
 
-	unsigned char *data = NULL;
-	size_t data_len;
-	coap_pdu_t *pdu = NULL;
-	coap_opt_t *block_opt;
-	coap_opt_iterator_t opt_iter;
-	unsigned char buf[4];
-	coap_optlist_t *option;
-	coap_tid_t tid;
-	esp_err_t err;
-	unsigned int block_num;
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+	/* Notifications come at any time, also during a block transfer */
+	if (sq_coap_observe_response(&manifest_obs, received) ||
+		sq_coap_observe_response(&config_obs, received)) {
+		return;
+	}
+#endif
+
+	int status = sq_coap_block_response(&block, received);
+
+#ifdef CONFIG_SQ_FOTA_RESUME
+	/* Saved with the checkpoints, the first one is well after the first block */
+	if (block.etag_len > 0 && resume.ckpt.etag_len == 0) {
+		sq_fota_resume_set_etag(&resume, block.etag, block.etag_len);
+	}
+#endif
+
+	if (status == SQ_COAP_BLOCK_BUSY) {
+		/* Still making progress, restart the timeout */
+		wait_ms = SQ_COAP_TIME_SEC * 1000;
+		return;
+	}
+
+	resp_wait = 0;
+}
+
+/**
+ * @brief Send the block requests held back for the flash writer, see sq_coap_block_set_space.
+ */
+static void writer_freed(void *arg)
+{
+	coap_run_once_wake();
+}
+
+/**
+ * @brief Run the I/O loop until the block transfer is done or times out.
+ */
+static void block_transfer(coap_context_t *ctx)
+{
+	resp_wait = 1;
+	wait_ms = SQ_COAP_TIME_SEC * 1000;
 
-	if (COAP_RESPONSE_CLASS(received->code) == 2) {
-		/* Need to see if blocked response */
-		block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
-		if (block_opt) {
-			uint16_t blktype = opt_iter.type;
+	while (resp_wait) {
+		/* Lost block requests are sent again from here */
+		int block_ms = sq_coap_block_poll(&block);
+		if (block.status != SQ_COAP_BLOCK_BUSY) {
+			break;
+		}
+		if (block_ms > wait_ms) {
+			block_ms = wait_ms;
+		}
+		int result = coap_run_once(ctx, block_ms);
+		if (result >= 0) {
+			if (result >= wait_ms) {
+				ESP_LOGE(TAG, "select timeout");
+				break;
+			} else {
+				wait_ms -= result;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Set up the CoAP context and session, retrying DNS lookups.
+ */
+static int coap_connect(coap_context_t **ctx, coap_session_t **session)
+{
+	int res;
 
-			block_num = coap_opt_block_num(block_opt);
+	*ctx = NULL;
+	*session = NULL;
 
-			if (block_num == 0) {
+	while (1) {
+		res = sq_coap_init(ctx, session);
+		if (res == SQ_COAP_OK) {
 #ifdef CONFIG_SQ_MAIN_DBG
-				ESP_LOGI(TAG, "[%s] - Got block message", __FUNCTION__);
+			ESP_LOGI(TAG, "[%s] - CoAP init OK", __FUNCTION__);
+			ESP_LOGI(TAG, "[%s] - ctx: %p, session: %p", __FUNCTION__, *ctx, *session);
 #endif
-			}
+			break;
+		} else if (res == SQ_COAP_ERR_DNS) {
+			/* Wait a while, the retry */
+#ifdef CONFIG_SQ_MAIN_DBG
+			ESP_LOGI(TAG, "[%s] - DNS lookup error, wait and try again...", __FUNCTION__);
+#endif
+			vTaskDelay(1000 / portTICK_PERIOD_MS);
+			continue;
+		} else if (res == SQ_COAP_ERR_FAIL) {
+			ESP_LOGE(TAG, "Caught unrecoverable error when initializing CoAP, exiting...");
+			return res;
+		}
+	}
 
-			if (block_num != next_block) {
+	coap_register_response_handler(*ctx, coap_message_handler);
 #ifdef CONFIG_SQ_MAIN_DBG
-				ESP_LOGE(TAG, "[%s] - Got wrong block nr %d, expected block nr %d", __FUNCTION__, block_num, next_block);
+	ESP_LOGI(TAG, "[%s] - Registered response handler", __FUNCTION__);
 #endif
-				return;
-			}
+	return SQ_COAP_OK;
+}
 
-			if (coap_get_data(received, &data_len, &data)) {
-				//printf("%.*s", (int)data_len, data);
+#ifdef CONFIG_SQ_FOTA_VERIFY
+/**
+ * @brief Fetch the manifest and find out if there is anything to download.
+ *
+ * The ETag of the last manifest that matched the running image is sent
+ * along, a server that still has it answers 2.03 without any payload.
+ * @return 1 if there is a new image, 0 if the running one is up to date
+ *         and -1 on failure.
+ */
+static int manifest_check(coap_context_t *ctx, coap_session_t *session)
+{
+	uint8_t etag[SQ_FOTA_ETAG_LEN];
+	size_t etag_len;
+	const uint8_t *new_etag = block.etag;
+	size_t *new_etag_len = &block.etag_len;
+
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+	if (notified && manifest_len > 0) {
+		/* Came with the notification, nothing to fetch */
+		new_etag = manifest_obs.etag;
+		new_etag_len = &manifest_obs.etag_len;
+	} else
+#endif
+	{
+		manifest_len = 0;
+		if (sq_coap_block_init(&block, session, 1, SQ_COAP_BLOCK_SZX,
+							   manifest_write, NULL) != SQ_COAP_OK ||
+			sq_coap_block_set_path(&block, SQ_MAIN_MANIFEST_PATH) != SQ_COAP_OK) {
+			return -1;
+		}
+		if (sq_fota_manifest_etag_load(etag, &etag_len) == SQ_FOTA_OK) {
+			sq_coap_block_set_known_etag(&block, etag, etag_len);
+		}
 
-				/* Write firmware to FLASH */
-#ifdef CONFIG_SQ_MAIN_DBG
-				ESP_LOGI(TAG, "Writing %d bytes of OTA data", data_len);
-#endif
-				sq_uart_send(ant_ota_write, sizeof(ant_ota_write));
-				err = esp_ota_write(update_handle, (const void *) data, data_len);
-				sq_uart_send(ant_get_block_send_done, sizeof(ant_ota_write_done));
-				if (err != ESP_OK) {
-					ESP_ERROR_CHECK(err);
-					sq_coap_cleanup(ctx, session);
-					task_fatal_error();
-				}
+		sq_uart_ant(SQ_UART_ANT_GET_MANIFEST, 0);
+		sq_coap_block_start(&block);
+		block_transfer(ctx);
+		sq_uart_ant(SQ_UART_ANT_GET_MANIFEST_DONE, 0);
+		sq_coap_block_free(&block);
 
-				next_block++;
-			}
+		if (block.status == SQ_COAP_BLOCK_VALID) {
+			ESP_LOGI(TAG, "Manifest unchanged, the firmware is up to date");
+			return 0;
+		}
+		if (block.status != SQ_COAP_BLOCK_DONE) {
+			ESP_LOGE(TAG, "Could not get the firmware manifest");
+			return -1;
+		}
+	}
 
-			if (COAP_OPT_BLOCK_MORE(block_opt)) {
-				/* more bit is set */
+	if (sq_fota_manifest_parse(&manifest, manifest_buf, manifest_len) != SQ_FOTA_OK) {
+		ESP_LOGE(TAG, "Could not get the firmware manifest");
+		return -1;
+	}
 
-				/* create pdu with request for next block */
-				pdu = coap_new_pdu(session);
-				if (!pdu) {
-					ESP_LOGE(TAG, "coap_new_pdu() failed");
-					goto clean_up;
-				}
-				pdu->type = COAP_MESSAGE_CON;
-				pdu->tid = coap_new_message_id(session);
-				pdu->code = COAP_REQUEST_GET;
-
-				/* add URI components from optlist */
-				for (option = optlist; option; option = option->next ) {
-					switch (option->number) {
-					case COAP_OPTION_URI_HOST :
-					case COAP_OPTION_URI_PORT :
-					case COAP_OPTION_URI_PATH :
-					case COAP_OPTION_URI_QUERY :
-						coap_add_option(pdu, option->number, option->length,
-										option->data);
-						break;
-					default:
-						;     /* skip other options */
-					}
-				}
+	if (manifest.has_image_id && memcmp(manifest.image_id, running_sha256, SQ_FOTA_HASH_LEN) == 0) {
+		ESP_LOGI(TAG, "Already running version %s", manifest.version);
+		sq_fota_manifest_etag_store(new_etag, *new_etag_len);
+		return 0;
+	}
+	return 1;
+}
+#endif
 
-				/* finally add updated block option from response, clear M bit */
-				/* blocknr = (blocknr & 0xfffffff7) + 0x10; */
-				coap_add_option(pdu, blktype, coap_encode_var_safe(buf, sizeof(buf),
-								((coap_opt_block_num(block_opt) + 1) << 4) |
-								COAP_OPT_BLOCK_SZX(block_opt)), buf);
-				sq_uart_send(ant_get_block_send, sizeof(ant_get_block_send));
-				tid = coap_send(session, pdu);
-				sq_uart_send(ant_get_block_send_done, sizeof(ant_get_block_send_done));
-
-				if (tid != COAP_INVALID_TID) {
-					resp_wait = 1;
-					wait_ms = SQ_COAP_TIME_SEC * 1000;
-					return;
-				}
-			}
-			printf("\n");
-		} else {
-			if (coap_get_data(received, &data_len, &data)) {
-				//printf("Received: %.*s\n", (int)data_len, data);
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+/**
+ * @brief Register on the manifest, and the telemetry configuration.
+ */
+static int observe_start(coap_session_t *session)
+{
+	if (sq_coap_observe_init(&manifest_obs, session, SQ_MAIN_MANIFEST_PATH,
+							 manifest_notify, NULL) != SQ_COAP_OK ||
+		sq_coap_observe_start(&manifest_obs) != SQ_COAP_OK) {
+		return SQ_COAP_ERR_FAIL;
+	}
+	if (strlen(SQ_MAIN_TELEMETRY_CONFIG_PATH) > 0 &&
+		(sq_coap_observe_init(&config_obs, session, SQ_MAIN_TELEMETRY_CONFIG_PATH,
+							  config_notify, NULL) != SQ_COAP_OK ||
+		 sq_coap_observe_start(&config_obs) != SQ_COAP_OK)) {
+		return SQ_COAP_ERR_FAIL;
+	}
+	return SQ_COAP_OK;
+}
+
+/**
+ * @brief Listen for notifications until the manifest changes or the button is pressed.
+ *
+ * The radio only wakes up for notifications and the re-registrations,
+ * instead of a request every poll interval.
+ */
+static void observe_wait(coap_context_t *ctx)
+{
+	int ms;
+
+	notified = 0;
+	while (!notified) {
+		if (button_pressed) {
+			button_pressed = 0;
+			manifest_len = 0;
+			break;
+		}
+		ms = sq_coap_observe_poll(&manifest_obs);
+		if (config_obs.active) {
+			int config_ms = sq_coap_observe_poll(&config_obs);
+			if (config_ms < ms) {
+				ms = config_ms;
 			}
 		}
+		/* Until the next re-registration, a notification or button_task */
+		coap_run_once(ctx, ms);
 	}
-clean_up:
-	resp_wait = 0;
 }
+#endif
 
 void sq_main(void *p)
 {
 	coap_context_t  *ctx = NULL;
 	coap_session_t  *session = NULL;
-	coap_pdu_t      *request = NULL;
 
 	esp_err_t err;
 
@@ -196,7 +400,12 @@ void sq_main(void *p)
 	const esp_partition_t	*configured = esp_ota_get_boot_partition();
 	const esp_partition_t	*running = esp_ota_get_running_partition();
 
+#ifndef CONFIG_SQ_MAIN_OBSERVE
 	uint32_t upd_btn;
+#endif
+	uint32_t offset = 0;
+	int64_t t_check = 0, t_transfer, t_written;
+	int resumable = 0;
 
 	if (configured != running) {
 		ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08x, but running from offset 0x%08x",
@@ -206,8 +415,6 @@ void sq_main(void *p)
 	ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)",
 			running->type, running->subtype, running->address);
 
-	int res;
-
 	/* Wait for WiFi connection */
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Wait for WiFi...", __FUNCTION__);
@@ -219,32 +426,10 @@ void sq_main(void *p)
 	ESP_LOGI(TAG, "[%s] - Connected to WiFi", __FUNCTION__);
 #endif
 
-	while (1) {
-		res = sq_coap_init(&ctx, &session);
-		if (res == SQ_COAP_OK) {
-#ifdef CONFIG_SQ_MAIN_DBG
-			ESP_LOGI(TAG, "[%s] - CoAP init OK", __FUNCTION__);
-			ESP_LOGI(TAG, "[%s] - ctx: %p, session: %p", __FUNCTION__, ctx, session);
-#endif
-			break;
-		} else if (res == SQ_COAP_ERR_DNS) {
-			/* Wait a while, the retry */
-#ifdef CONFIG_SQ_MAIN_DBG
-			ESP_LOGI(TAG, "[%s] - DNS lookup error, wait and try again...", __FUNCTION__);
-#endif
-			vTaskDelay(1000 / portTICK_PERIOD_MS);
-			continue;
-		} else if (res == SQ_COAP_ERR_FAIL) {
-			ESP_LOGE(TAG, "Caught unrecoverable error when initializing CoAP, exiting...");
-			goto exit;
-		}
+	if (coap_connect(&ctx, &session) != SQ_COAP_OK) {
+		goto exit;
 	}
 
-	coap_register_response_handler(ctx, coap_message_handler);
-#ifdef CONFIG_SQ_MAIN_DBG
-	ESP_LOGI(TAG, "[%s] - Registered response handler", __FUNCTION__);
-#endif
-
 	/* Setup OTA handlers etc. */
 
 	update_partition = esp_ota_get_next_update_partition(NULL);
@@ -254,67 +439,249 @@ void sq_main(void *p)
 #endif
 	assert(update_partition != NULL);
 
-	err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
-	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* The digest appended to the image, no need to hash the partition */
+	esp_partition_get_sha256(running, running_sha256);
+#endif
+
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+	if (observe_start(session) != SQ_COAP_OK) {
 		sq_coap_cleanup(ctx, session);
 		task_fatal_error();
 	}
+#endif
+
+	while (1) {
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+		/* Until the manifest changes, the first notification is the current one */
 #ifdef CONFIG_SQ_MAIN_DBG
-	ESP_LOGI(TAG, "esp_ota_begin succeeded");
+		ESP_LOGI(TAG, "Waiting for a manifest notification...");
+#endif
+		observe_wait(ctx);
+#else
+		/* Wait for user input before retrieving the firmware */
+#ifdef CONFIG_SQ_MAIN_DBG
+		ESP_LOGI(TAG, "Waiting for user to initiate update...");
+#endif
+		while (1) {
+			if (xQueueReceive(gpio_evt_queue, &upd_btn, portMAX_DELAY)) break;
+		}
+#endif
+
+		t_check = esp_timer_get_time();
+#ifdef CONFIG_SQ_FOTA_VERIFY
+		/* Fetch the manifest first, nothing is erased if there is no new image */
+		int res = manifest_check(ctx, session);
+		if (res < 0) {
+			sq_coap_cleanup(ctx, session);
+			task_fatal_error();
+		}
+		if (res > 0) {
+			break;
+		}
+#else
+		break;
+#endif
+	}
+
+	/* Start with the block size the server prefers, if it is smaller */
+	unsigned int szx = SQ_COAP_BLOCK_SZX;
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	while (szx > 0 && manifest.block_size > 0 && (1u << (szx + 4)) > manifest.block_size) {
+		szx--;
+	}
+#endif
+
+	/* The manifest tells which forms of the image the server has */
+	const char *image_path = NULL;
+#if defined(CONFIG_SQ_FOTA_LZ) && defined(CONFIG_SQ_FOTA_VERIFY)
+	if (manifest.compressed) {
+		image_path = SQ_MAIN_COMPRESSED_PATH;
+	}
+#endif
+#ifdef CONFIG_SQ_FOTA_DELTA
+	if (manifest.has_delta && memcmp(manifest.delta_source, running_sha256, SQ_FOTA_HASH_LEN) == 0) {
+		image_path = SQ_MAIN_DELTA_PATH;
+	}
+#endif
+
+	/* Stages from the flash and up, run by the flash writer task */
+	sq_fota_sink_t ota_sink = {
+		.write	= ota_write_block,
+		.arg	= NULL
+	};
+#ifdef CONFIG_SQ_FOTA_RESUME
+	/* Only full images are resumed, the other stages have state of their own */
+	resumable = image_path == NULL;
+	if (resumable) {
+		sq_fota_sink_t resume_sink = {
+			.write	= sq_fota_resume_write,
+			.arg	= &resume
+		};
+		sq_fota_hash_init(&hash, &resume_sink);
+		offset = sq_fota_resume_init(&resume, &ota_sink, &hash, update_partition->address,
+									 manifest.sha256, SQ_COAP_BLOCK_MIN_SIZE);
+		ota_sink.write = sq_fota_hash_write;
+		ota_sink.arg = &hash;
+	}
+#endif
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* The image is hashed on its way to the flash */
+	if (!resumable) {
+		sq_fota_hash_init(&hash, &ota_sink);
+		ota_sink.write = sq_fota_hash_write;
+		ota_sink.arg = &hash;
+	}
+#endif
+#ifdef CONFIG_SQ_FOTA_DELTA
+	/* A patch is applied before hashing, the digest is the one of the new image */
+	sq_fota_delta_init(&delta, &ota_sink, running_read, (void *) running, running_sha256);
+	ota_sink.write = sq_fota_delta_write;
+	ota_sink.arg = &delta;
+#endif
+#ifdef CONFIG_SQ_FOTA_LZ
+	/* Decompressed in the writer task, uncompressed data passes through */
+	sq_fota_lz_init(&lz, &ota_sink);
+	ota_sink.write = sq_fota_lz_write;
+	ota_sink.arg = &lz;
 #endif
 
-	request = coap_new_pdu(session);
-	if (!request) {
-		ESP_LOGE(TAG, "coap_new_pdu() failed");
+	/* Sectors are erased as the image gets to them, not all up front */
+	if (sq_fota_flash_begin(&flash, update_partition, offset) != SQ_FOTA_OK) {
 		sq_coap_cleanup(ctx, session);
-		goto exit;
+		task_fatal_error();
 	}
-	request->type = COAP_MESSAGE_CON;
-	request->tid = coap_new_message_id(session);
-	request->code = COAP_REQUEST_GET;
-	coap_add_optlist_pdu(request, &optlist);
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* and ahead of the write pointer while waiting for blocks, up to the image size */
+	sq_fota_flash_set_size(&flash, manifest.size);
+#endif
+	t_transfer = esp_timer_get_time();
 
-	resp_wait = 1;
+	unsigned int attempts = 0;
 
-	/* Wait for user input before retrieving the firmware */
+	while (1) {
+		/* Flash is written from a separate task, while the next blocks are received */
+		if (sq_fota_writer_init(&writer, &ota_sink) != SQ_FOTA_OK) {
+			sq_coap_cleanup(ctx, session);
+			task_fatal_error();
+		}
+		sq_fota_writer_set_idle(&writer, sq_fota_flash_erase_ahead, &flash);
+		sq_fota_writer_set_freed(&writer, writer_freed, NULL);
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+		if (resumable && offset >= manifest.size) {
+			/* All of it was in flash already */
+			block.status = SQ_COAP_BLOCK_DONE;
+		} else
+#endif
+		{
+			if (sq_coap_block_init(&block, session, SQ_COAP_BLOCK_WINDOW, szx,
+								   sq_fota_writer_write, &writer) != SQ_COAP_OK ||
+				(image_path != NULL && sq_coap_block_set_path(&block, image_path) != SQ_COAP_OK)) {
+				sq_coap_cleanup(ctx, session);
+				task_fatal_error();
+			}
+			sq_coap_block_set_space(&block, sq_fota_writer_space);
+#ifdef CONFIG_SQ_FOTA_RESUME
+			if (resumable) {
+				sq_coap_block_set_size(&block, manifest.size);
+				if (offset > 0 && resume.ckpt.etag_len > 0) {
+					sq_coap_block_set_etag(&block, resume.ckpt.etag, resume.ckpt.etag_len);
+				}
+			}
+#endif
 #ifdef CONFIG_SQ_MAIN_DBG
-	ESP_LOGI(TAG, "Waiting for user to initiate update...");
+			ESP_LOGI(TAG, "[%s] - Fetching the image%s%s from %u bytes", __FUNCTION__,
+					 image_path ? " from " : "", image_path ? image_path : "", offset);
 #endif
-	while (1) {
-		if (xQueueReceive(gpio_evt_queue, &upd_btn, portMAX_DELAY)) break;
-	}
 
-	/* Perform GET request to retrieve new firmware.
-	 * The data retrieval is done in the message handler.
-	 */
-	sq_uart_send(ant_get_send, sizeof(ant_get_send));
-	coap_send(session, request);
-	sq_uart_send(ant_get_send_done, sizeof(ant_get_send_done));
+			/* Perform GET request to retrieve new firmware.
+			 * The rest of the blocks are requested by the block transfer, with up
+			 * to SQ_COAP_BLOCK_WINDOW requests in flight.
+			 */
+			sq_uart_ant(SQ_UART_ANT_GET_SEND, 0);
+			sq_coap_block_start_at(&block, offset);
+			sq_uart_ant(SQ_UART_ANT_GET_SEND_DONE, 0);
 
 #ifdef CONFIG_SQ_MAIN_DBG
-	ESP_LOGI(TAG, "[%s] - CoAP message sent, awaiting response", __FUNCTION__);
+			ESP_LOGI(TAG, "[%s] - CoAP message sent, awaiting response", __FUNCTION__);
 #endif
 
-	wait_ms = SQ_COAP_TIME_SEC * 1000;
+			block_transfer(ctx);
 
-	while (resp_wait) {
-		int result = coap_run_once(ctx, wait_ms > 1000 ? 1000 : wait_ms);
-		if (result >= 0) {
-			if (result >= wait_ms) {
-				ESP_LOGE(TAG, "select timeout");
-				break;
-			} else {
-				wait_ms -= result;
+#ifdef CONFIG_SQ_MAIN_DBG
+			ESP_LOGI(TAG, "[%s] - %u requests, %u retransmitted, %u out of order, %u duplicates, %u throttled",
+					__FUNCTION__, block.requests, block.retransmits,
+					block.reordered, block.duplicates, block.throttled);
+			ESP_LOGI(TAG, "[%s] - %u block size changes, ended at %u bytes, srtt %u ms, min %u ms",
+					__FUNCTION__, block.resizes, 1u << (block.szx + 4), block.srtt_ms, block.rtt_min_ms);
+#endif
+			sq_coap_block_free(&block);
+		}
+
+		/* Wait for the last sectors to be written */
+		if (sq_fota_writer_finish(&writer) != SQ_FOTA_OK) {
+			ESP_LOGE(TAG, "Flash writer failed");
+			sq_coap_cleanup(ctx, session);
+			task_fatal_error();
+		}
+
+		if (block.status == SQ_COAP_BLOCK_DONE) {
+			t_written = esp_timer_get_time();
+			break;
+		}
+
+#ifdef CONFIG_SQ_FOTA_RESUME
+		/* Keep what has been written, and continue from there on a new session */
+		if (resumable && !block.changed && resume.ckpt.offset % SQ_COAP_BLOCK_MIN_SIZE == 0) {
+			if (resume.ckpt.offset > offset) {
+				attempts = 0;
+			}
+			if (attempts++ < SQ_MAIN_RESUME_ATTEMPTS) {
+				sq_fota_resume_save(&resume);
+				offset = resume.ckpt.offset;
+				ESP_LOGW(TAG, "Block transfer stopped at %u bytes, resuming", offset);
+
+				sq_coap_cleanup(ctx, session);
+				if (coap_connect(&ctx, &session) != SQ_COAP_OK) {
+					task_fatal_error();
+				}
+				continue;
 			}
 		}
+		sq_fota_checkpoint_clear();
+#endif
+		ESP_LOGE(TAG, "Block transfer failed");
+		sq_coap_cleanup(ctx, session);
+		task_fatal_error();
+	}
+
+#ifdef CONFIG_SQ_FOTA_LZ
+	if (sq_fota_lz_finish(&lz) != SQ_FOTA_OK) {
+		sq_coap_cleanup(ctx, session);
+		task_fatal_error();
+	}
+#endif
+#ifdef CONFIG_SQ_FOTA_DELTA
+	if (sq_fota_delta_finish(&delta) != SQ_FOTA_OK) {
+		sq_coap_cleanup(ctx, session);
+		task_fatal_error();
 	}
+#endif
 
-	if (esp_ota_end(update_handle) != ESP_OK) {
-		ESP_LOGE(TAG, "esp_ota_end failed!");
+#ifdef CONFIG_SQ_FOTA_RESUME
+	/* Whatever the outcome, this download is over */
+	sq_fota_checkpoint_clear();
+#endif
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* Digest computed while writing, no need to read the partition back */
+	if (sq_fota_hash_verify(&hash, &manifest) != SQ_FOTA_OK) {
+		ESP_LOGE(TAG, "Image verification failed, not booting it");
 		sq_coap_cleanup(ctx, session);
 		task_fatal_error();
 	}
+#endif
 
 	if (esp_partition_check_identity(esp_ota_get_running_partition(), update_partition) == true) {
 		ESP_LOGI(TAG, "The current running firmware is same as the firmware just downloaded");
@@ -326,6 +693,7 @@ void sq_main(void *p)
 		}
 	}
 
+	/* Also validates the image, as esp_ota_end did */
 	err = esp_ota_set_boot_partition(update_partition);
 	if (err != ESP_OK) {
 		ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
@@ -333,7 +701,17 @@ void sq_main(void *p)
 		task_fatal_error();
 	}
 
+	/* Where the time went, erases holding up writes are what erasing ahead saves */
+	ESP_LOGI(TAG, "Phases: check %u ms, transfer %u ms, validate %u ms",
+			 (unsigned int)((t_transfer - t_check) / 1000), (unsigned int)((t_written - t_transfer) / 1000),
+			 (unsigned int)((esp_timer_get_time() - t_written) / 1000));
+	ESP_LOGI(TAG, "Flash: %u sectors erased, %u ahead in %u ms, %u ms of erase in writes, %u ms writing",
+			 flash.sectors_erased, flash.sectors_ahead, (unsigned int)(flash.ahead_us / 1000),
+			 (unsigned int)(flash.erase_us / 1000), (unsigned int)(flash.write_us / 1000));
+
 	ESP_LOGI(TAG, "Prepare to restart system!");
+	/* The annotations still waiting in the ring would be lost */
+	sq_uart_ant_flush();
 	esp_restart();
 
 #ifdef CONFIG_SQ_MAIN_DBG
@@ -344,21 +722,12 @@ exit:
 	vTaskDelete(NULL);
 }
 
-void print_sha256 (const uint8_t *image_hash, const char *label)
-{
-	char hash_print[HASH_LEN * 2 + 1];
-	hash_print[HASH_LEN * 2] = 0;
-	for (int i = 0; i < HASH_LEN; ++i) {
-		sprintf(&hash_print[i * 2], "%02x", image_hash[i]);
-	}
-	ESP_LOGI(TAG, "%s: %s", label, hash_print);
-}
-
 void blink(void *pvParameter)
 {
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "Starting blink task...");
 #endif
+	sq_uart_prof_add(NULL);
 
 	gpio_config_t io_conf = {
 		.pin_bit_mask	= (1ULL << LED),
@@ -386,6 +755,24 @@ static void gpio_isr_handler(void *arg)
 	}
 }
 
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+/**
+ * @brief Pass button presses on to observe_wait, waking up the CoAP I/O loop.
+ */
+static void button_task(void *p)
+{
+	uint32_t upd_btn;
+
+	sq_uart_prof_add(NULL);
+	while (1) {
+		if (xQueueReceive(gpio_evt_queue, &upd_btn, portMAX_DELAY)) {
+			button_pressed = 1;
+			coap_run_once_wake();
+		}
+	}
+}
+#endif
+
 void app_main(void)
 {
 #ifndef CONFIG_SQ_MAIN_DBG
@@ -395,7 +782,7 @@ void app_main(void)
 #endif
 
 	sq_uart_init();
-	sq_uart_send(ant_main, sizeof(ant_main));
+	sq_uart_ant(SQ_UART_ANT_DEVICE_STARTED, 0);
 
 	/* Initialize NVS. */
 	esp_err_t err = nvs_flash_init();
@@ -429,5 +816,8 @@ void app_main(void)
 	gpio_isr_handler_add(UPDATE_BTN, gpio_isr_handler, (void *) UPDATE_BTN);
 
 	xTaskCreate(blink, "blink_task", 2048, NULL, 10, NULL);
+#ifdef CONFIG_SQ_MAIN_OBSERVE
+	xTaskCreate(button_task, "button_task", 2048, NULL, 6, NULL);
+#endif
 	xTaskCreate(sq_main, "coaps_fota", 8 * 1024, NULL, 5, NULL);
 }
@@ -29,14 +29,6 @@ const char *TAG = "coaps";
 coap_context_t  *ctx = NULL;
 coap_session_t  *session = NULL;
 
-/* Annotation strings */
-const char ant_post_send[32]			= "CoAP POST send";
-const char ant_post_send_done[]			= "CoAP POST send done\n";
-const char ant_get_block_send[]			= "CoAP GET block send\n";
-const char ant_get_block_send_done[]	= "CoAP GET block send done\n";
-const char ant_fin[]					= "CoAP shut down connection done\n";
-const char ant_conn_setup[]				= "CoAP set up connection\n";
-
 #define POST_SIZE 16
 unsigned char post_data[POST_SIZE];
 
@@ -46,90 +38,23 @@ static void coap_message_handler(coap_context_t *ctx, coap_session_t *session,
 {
 	unsigned char *data = NULL;
 	size_t data_len;
-	coap_pdu_t *pdu = NULL;
-	coap_opt_t *block_opt;
-	coap_opt_iterator_t opt_iter;
-	unsigned char buf[4];
-	coap_optlist_t *option;
-	coap_tid_t tid;
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Got response", __FUNCTION__);
 #endif
 
-	if (COAP_RESPONSE_CLASS(received->code) == 2) {
-		/* Need to see if blocked response */
-		block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
-		if (block_opt) {
-			uint16_t blktype = opt_iter.type;
-
-			if (coap_opt_block_num(block_opt) == 0) {
-				printf("Received:\n");
-			}
-			if (coap_get_data(received, &data_len, &data)) {
-				printf("%.*s", (int)data_len, data);
-			}
-			if (COAP_OPT_BLOCK_MORE(block_opt)) {
-				/* more bit is set */
-
-				/* create pdu with request for next block */
-				pdu = coap_new_pdu(session);
-				if (!pdu) {
-					ESP_LOGE(TAG, "coap_new_pdu() failed");
-					goto clean_up;
-				}
-				pdu->type = COAP_MESSAGE_CON;
-				pdu->tid = coap_new_message_id(session);
-				pdu->code = COAP_REQUEST_GET;
-
-				/* add URI components from optlist */
-				for (option = optlist; option; option = option->next ) {
-					switch (option->number) {
-					case COAP_OPTION_URI_HOST :
-					case COAP_OPTION_URI_PORT :
-					case COAP_OPTION_URI_PATH :
-					case COAP_OPTION_URI_QUERY :
-						coap_add_option(pdu, option->number, option->length,
-										option->data);
-						break;
-					default:
-						;     /* skip other options */
-					}
-				}
-
-				/* finally add updated block option from response, clear M bit */
-				/* blocknr = (blocknr & 0xfffffff7) + 0x10; */
-				coap_add_option(pdu,
-								blktype,
-								coap_encode_var_safe(buf, sizeof(buf),
-													 ((coap_opt_block_num(block_opt) + 1) << 4) |
-													 COAP_OPT_BLOCK_SZX(block_opt)), buf);
-				sq_uart_send(ant_get_block_send, sizeof(ant_get_block_send));
-				tid = coap_send(session, pdu);
-				sq_uart_send(ant_get_block_send_done, sizeof(ant_get_block_send_done));
-
-				if (tid != COAP_INVALID_TID) {
-					resp_wait = 1;
-					wait_ms = SQ_COAP_TIME_SEC * 1000;
-					return;
-				}
-			}
-			printf("\n");
-		} else {
-			if (coap_get_data(received, &data_len, &data)) {
-				printf("Received: %.*s\n", (int)data_len, data);
-			}
-		}
+	if (COAP_RESPONSE_CLASS(received->code) == 2 && coap_get_data(received, &data_len, &data)) {
+		printf("Received: %.*s\n", (int)data_len, data);
 	}
-clean_up:
 	resp_wait = 0;
 }
 
+/**
+ * @brief POST msg as CON, the reference message of the handshake measurement.
+ */
 int sq_coap_send(unsigned char *msg, int msglen)
 {
 	coap_pdu_t *request = NULL;
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
 
 	request = coap_new_pdu(session);
 	if (!request) {
@@ -141,15 +66,12 @@ int sq_coap_send(unsigned char *msg, int msglen)
 	request->tid = coap_new_message_id(session);
 	request->code = COAP_REQUEST_POST;
 	coap_add_optlist_pdu(request, &optlist);
-
-	/* Add POST data, double the size each time */
 	coap_add_data(request, msglen, msg);
 
 	resp_wait = 1;
-	snprintf(annotation_msg, ANT_BUF_SIZE, "%s %d bytes\n", ant_post_send, msglen);
-	sq_uart_send(annotation_msg, strlen(annotation_msg));
+	sq_uart_ant(SQ_UART_ANT_POST_SEND, msglen);
 	coap_send(session, request);
-	sq_uart_send(ant_post_send_done, sizeof(ant_post_send_done));
+	sq_uart_ant(SQ_UART_ANT_POST_SEND_DONE, 0);
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - CoAP message sent, awaiting response", __FUNCTION__);
@@ -158,7 +80,7 @@ int sq_coap_send(unsigned char *msg, int msglen)
 	wait_ms = SQ_COAP_TIME_SEC * 1000;
 
 	while (resp_wait) {
-		int result = coap_run_once(ctx, wait_ms > 1000 ? 1000 : wait_ms);
+		int result = coap_run_once(ctx, wait_ms);
 		if (result >= 0) {
 			if (result >= wait_ms) {
 				ESP_LOGE(TAG, "select timeout");
@@ -174,9 +96,6 @@ int sq_coap_send(unsigned char *msg, int msglen)
 
 void sq_main(void *p)
 {
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
-
 	/* Initialize data to be sent */
 	for (int i = 0; i < POST_SIZE; i++) {
 		post_data[i] = 'a';
@@ -199,7 +118,7 @@ void sq_main(void *p)
 	for (int i = 0; i < 10; i++) {
 
 		while (1) {
-			sq_uart_send(ant_conn_setup, sizeof(ant_conn_setup));
+			sq_uart_ant(SQ_UART_ANT_CONN_SETUP, 0);
 			res = sq_coap_init(&ctx, &session);
 			if (res == SQ_COAP_OK) {
 #ifdef CONFIG_SQ_MAIN_DBG
@@ -233,7 +152,7 @@ void sq_main(void *p)
 #endif	
 		
 		sq_coap_cleanup(ctx, session);
-		sq_uart_send(ant_fin, sizeof(ant_fin));
+		sq_uart_ant(SQ_UART_ANT_CONN_FIN, 0);
 	}
 
 exit:
@@ -33,9 +33,6 @@ static int mqtt_data_len = 1;
 EventGroupHandle_t wifi_event_group;
 const int CONNECTED_BIT = BIT0;
 
-const char ant_pub[]		= "MQTT publish";
-const char ant_pub_done[]	= "MQTT publish done\n";
-
 
 //#if CONFIG_BROKER_CERTIFICATE_OVERRIDDEN == 1
 //static const uint8_t mqtt_server_ca_pem_start[]  = "-----BEGIN CERTIFICATE-----\n" CONFIG_BROKER_CERTIFICATE_OVERRIDE "\n-----END CERTIFICATE-----";
@@ -55,9 +52,6 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 	esp_mqtt_client_handle_t client = event->client;
 	int msg_id;
 
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
-
 	// your_context_t *context = event->context;
 	switch (event->event_id) {
 		case MQTT_EVENT_CONNECTED:
@@ -87,10 +81,9 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 #endif
 
 			while (mqtt_data_len <= MQTT_DATA_BUF_SIZE) {
-				snprintf(annotation_msg, ANT_BUF_SIZE, "%s %d bytes\n", ant_pub, mqtt_data_len);
-				sq_uart_send(annotation_msg, strlen(annotation_msg));
+				sq_uart_ant(SQ_UART_ANT_MQTT_PUB, mqtt_data_len);
 				msg_id = esp_mqtt_client_publish(client, MQTT_TOPIC, mqtt_data, mqtt_data_len, 0, 0);
-				sq_uart_send(ant_pub_done, sizeof(ant_pub_done));
+				sq_uart_ant(SQ_UART_ANT_MQTT_PUB_DONE, 0);
 #ifdef CONFIG_SQ_MAIN_DBG
 				ESP_LOGI(TAG, "published %d byte(s) of data", mqtt_data_len);
 				ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
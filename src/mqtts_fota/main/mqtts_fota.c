@@ -30,13 +30,13 @@
 
 #include "squidward/sq_wifi.h"
 #include "squidward/sq_uart.h"
+#include "squidward/sq_fota.h"
 
 const char *TAG = "mqtts_fota";
 
 #define MQTT_TOPIC "/squidward"
 
 #define OTA_BUFSIZE 1024
-#define HASH_LEN 32 /* SHA-256 digest length */
 
 static volatile int fota_wait = 1;
 
@@ -48,21 +48,32 @@ static volatile int fota_wait = 1;
 #define ESP_INTR_FLAG_DEFAULT 0
 
 static esp_ota_handle_t update_handle = 0;
+static sq_fota_writer_t writer;
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+#define SQ_MAIN_MANIFEST_TOPIC	CONFIG_SQ_MAIN_MANIFEST_TOPIC
+#define MANIFEST_BUFSIZE		512
+#define MANIFEST_WAIT_MS		10000	/* after the image, the topics are not ordered */
+
+static sq_fota_hash_t hash;
+static sq_fota_manifest_t manifest;
+static char manifest_buf[MANIFEST_BUFSIZE];
+static volatile int manifest_ok = 0;
+#endif
+
+#ifdef CONFIG_SQ_FOTA_DELTA
+static sq_fota_delta_t delta;
+static uint8_t running_sha256[SQ_FOTA_HASH_LEN];
+#endif
+
+#ifdef CONFIG_SQ_FOTA_LZ
+static sq_fota_lz_t lz;
+#endif
 //static char ota_write_data[OTA_BUFSIZE + 1] = { 0 };
 
 EventGroupHandle_t wifi_event_group;
 const int CONNECTED_BIT = BIT0;
 
-const char ant_sub[]		= "MQTT subscribe\n";
-const char ant_sub_done[]	= "MQTT subscribe done\n";
-const char ant_pub[]		= "MQTT publish";
-const char ant_pub_done[]	= "MQTT publish done\n";
-const char ant_mqtt_setup[]	= "MQTT setup\n";
-const char ant_mqtt_conn[]	= "MQTT connected\n";
-
-const char ant_ota_write[]		= "OTA write block\n";
-const char ant_ota_write_done[]	= "OTA write done\n";
-
 
 //#if CONFIG_BROKER_CERTIFICATE_OVERRIDDEN == 1
 //static const uint8_t mqtt_server_ca_pem_start[]  = "-----BEGIN CERTIFICATE-----\n" CONFIG_BROKER_CERTIFICATE_OVERRIDE "\n-----END CERTIFICATE-----";
@@ -95,12 +106,62 @@ static void __attribute__((noreturn)) task_fatal_error()
 	}
 }
 
+/**
+ * @brief Write firmware to flash, called from the flash writer task.
+ */
+static int ota_write_block(void *arg, const uint8_t *data, size_t len)
+{
+	esp_err_t err;
+
+	sq_uart_ant(SQ_UART_ANT_OTA_WRITE, 0);
+	err = esp_ota_write(update_handle, (const void *) data, len);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_SQ_FOTA_DELTA
+/**
+ * @brief Read the running image, for the patch stage.
+ */
+static int running_read(void *arg, size_t offset, uint8_t *data, size_t len)
+{
+	return esp_partition_read((const esp_partition_t *) arg, offset, data, len) == ESP_OK ? 0 : -1;
+}
+#endif
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+/**
+ * @brief Collect the manifest, which may come in several parts like the image.
+ */
+static void manifest_data(esp_mqtt_event_handle_t event)
+{
+	if (event->total_data_len > MANIFEST_BUFSIZE ||
+		event->current_data_offset + event->data_len > event->total_data_len) {
+		ESP_LOGE(TAG, "Manifest larger than %d bytes", MANIFEST_BUFSIZE);
+		return;
+	}
+	memcpy(manifest_buf + event->current_data_offset, event->data, event->data_len);
+
+	if (event->current_data_offset + event->data_len == event->total_data_len) {
+		if (sq_fota_manifest_parse(&manifest, manifest_buf, event->total_data_len) == SQ_FOTA_OK) {
+			manifest_ok = 1;
+		}
+	}
+}
+#endif
+
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 {
 	esp_mqtt_client_handle_t client = event->client;
-	esp_err_t err;
 	static int total_written = 0;
 	int total_fota_size = 0;
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	static int is_manifest = 0;
+#endif
 
 	// your_context_t *context = event->context;
 	switch (event->event_id) {
@@ -110,9 +171,12 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 			ESP_LOGI(TAG, "Subscribing to /updates");
 #endif
 
-			sq_uart_send(ant_sub, sizeof(ant_sub));
+			sq_uart_ant(SQ_UART_ANT_MQTT_SUB, 0);
 			esp_mqtt_client_subscribe(client, "/updates", 0);
-			sq_uart_send(ant_sub_done, sizeof(ant_sub_done));
+#ifdef CONFIG_SQ_FOTA_VERIFY
+			esp_mqtt_client_subscribe(client, SQ_MAIN_MANIFEST_TOPIC, 0);
+#endif
+			sq_uart_ant(SQ_UART_ANT_MQTT_SUB_DONE, 0);
 			break;
 		case MQTT_EVENT_DISCONNECTED:
 #ifdef CONFIG_SQ_MAIN_DBG
@@ -141,16 +205,29 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 			//printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
 			//printf("DATA=%.*s\r\n", event->data_len, event->data);
 
+#ifdef CONFIG_SQ_FOTA_VERIFY
+			/* The topic is only given with the first part of a message */
+			if (event->topic_len > 0) {
+				is_manifest = event->topic_len == strlen(SQ_MAIN_MANIFEST_TOPIC) &&
+							  memcmp(event->topic, SQ_MAIN_MANIFEST_TOPIC, event->topic_len) == 0;
+			}
+			if (is_manifest) {
+				manifest_data(event);
+				break;
+			}
+#endif
+
 			total_fota_size = event->total_data_len;
 
 			/* Write firmware to FLASH */
 #ifdef CONFIG_SQ_MAIN_DBG
 			ESP_LOGI(TAG, "[%s] - Writing %d bytes of OTA data", __FUNCTION__, event->data_len);
 #endif
-			sq_uart_send(ant_ota_write, sizeof(ant_ota_write));
-			err = esp_ota_write(update_handle, (const void *) event->data, event->data_len);
-			if (err != ESP_OK) {
-				ESP_ERROR_CHECK(err);
+			/* Only blocks when all writer buffers are in use, which holds
+			 * back the MQTT task and with it the TCP window.
+			 */
+			if (sq_fota_writer_write(&writer, (const uint8_t *) event->data, event->data_len) != 0) {
+				ESP_LOGE(TAG, "Flash writer failed");
 				task_fatal_error();
 			}
 
@@ -195,7 +272,7 @@ static void mqtt_app_start(void)
 	};
 
 	ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
-	sq_uart_send(ant_mqtt_setup, sizeof(ant_mqtt_setup));
+	sq_uart_ant(SQ_UART_ANT_MQTT_SETUP, 0);
 	esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
 	esp_mqtt_client_start(client);
 }
@@ -205,6 +282,7 @@ void blink(void *pvParameter)
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "Starting blink task...");
 #endif
+	sq_uart_prof_add(NULL);
 
 	gpio_config_t io_conf = {
 		.pin_bit_mask	= (1ULL << LED),
@@ -266,6 +344,36 @@ void mqtts_fota(void *pvParameter)
 		ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
 		task_fatal_error();
 	}
+
+	/* Flash is written from a separate task, while the next data is received */
+	sq_fota_sink_t ota_sink = {
+		.write	= ota_write_block,
+		.arg	= NULL
+	};
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* The image is hashed on its way to the flash */
+	sq_fota_hash_init(&hash, &ota_sink);
+	ota_sink.write = sq_fota_hash_write;
+	ota_sink.arg = &hash;
+#endif
+#ifdef CONFIG_SQ_FOTA_DELTA
+	/* Either a patch or the full image is published on /updates, the
+	 * patch stage tells them apart and passes a full image on as it is.
+	 */
+	esp_partition_get_sha256(running, running_sha256);
+	sq_fota_delta_init(&delta, &ota_sink, running_read, (void *) running, running_sha256);
+	ota_sink.write = sq_fota_delta_write;
+	ota_sink.arg = &delta;
+#endif
+#ifdef CONFIG_SQ_FOTA_LZ
+	/* Likewise for a compressed image or patch */
+	sq_fota_lz_init(&lz, &ota_sink);
+	ota_sink.write = sq_fota_lz_write;
+	ota_sink.arg = &lz;
+#endif
+	if (sq_fota_writer_init(&writer, &ota_sink) != SQ_FOTA_OK) {
+		task_fatal_error();
+	}
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - esp_ota_begin succeeded", __FUNCTION__);
 	ESP_LOGI(TAG, "[%s] - Awaiting firmware ...", __FUNCTION__);
@@ -277,7 +385,39 @@ void mqtts_fota(void *pvParameter)
 		vTaskDelay(10 / portTICK_PERIOD_MS);
 	}
 
-	sq_uart_send(ant_ota_write_done, sizeof(ant_ota_write_done));
+	/* Wait for the last sectors to be written */
+	if (sq_fota_writer_finish(&writer) != SQ_FOTA_OK) {
+		ESP_LOGE(TAG, "Flash writer failed");
+		task_fatal_error();
+	}
+#ifdef CONFIG_SQ_FOTA_LZ
+	if (sq_fota_lz_finish(&lz) != SQ_FOTA_OK) {
+		task_fatal_error();
+	}
+#endif
+#ifdef CONFIG_SQ_FOTA_DELTA
+	if (sq_fota_delta_finish(&delta) != SQ_FOTA_OK) {
+		task_fatal_error();
+	}
+#endif
+
+#ifdef CONFIG_SQ_FOTA_VERIFY
+	/* Digest computed while writing, no need to read the partition back */
+	for (int waited = 0; !manifest_ok && waited < MANIFEST_WAIT_MS; waited += 10) {
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+	}
+	if (!manifest_ok) {
+		ESP_LOGE(TAG, "No manifest received on %s, can not verify the image", SQ_MAIN_MANIFEST_TOPIC);
+		task_fatal_error();
+	}
+	if (sq_fota_hash_verify(&hash, &manifest) != SQ_FOTA_OK) {
+		ESP_LOGE(TAG, "Image verification failed, not booting it");
+		esp_ota_end(update_handle);
+		task_fatal_error();
+	}
+#endif
+
+	sq_uart_ant(SQ_UART_ANT_OTA_WRITE_DONE, 0);
 
 #ifdef CONFIG_SQ_MAIN_DBG
 	ESP_LOGI(TAG, "[%s] - Firmware received, checking ...", __FUNCTION__);
@@ -305,6 +445,8 @@ void mqtts_fota(void *pvParameter)
 	}
 
 	ESP_LOGI(TAG, "Prepare to restart system!");
+	/* The annotations still waiting in the ring would be lost */
+	sq_uart_ant_flush();
 	esp_restart();
 
 }
@@ -33,11 +33,6 @@ static char mqtt_data[MQTT_DATA_BUF_SIZE];
 EventGroupHandle_t wifi_event_group;
 const int CONNECTED_BIT = BIT0;
 
-const char ant_pub[]		= "MQTT publish";
-const char ant_pub_done[]	= "MQTT publish done\n";
-const char ant_mqtt_setup[]	= "MQTT setup\n";
-const char ant_mqtt_conn[]	= "MQTT connected\n";
-
 
 //#if CONFIG_BROKER_CERTIFICATE_OVERRIDDEN == 1
 //static const uint8_t mqtt_server_ca_pem_start[]  = "-----BEGIN CERTIFICATE-----\n" CONFIG_BROKER_CERTIFICATE_OVERRIDE "\n-----END CERTIFICATE-----";
@@ -65,9 +60,6 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 	esp_mqtt_client_handle_t client = event->client;
 	int msg_id;
 
-#define ANT_BUF_SIZE 64
-	char annotation_msg[ANT_BUF_SIZE];
-
 	// your_context_t *context = event->context;
 	switch (event->event_id) {
 		case MQTT_EVENT_CONNECTED:
@@ -75,12 +67,11 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
 #endif
 
-			sq_uart_send(ant_mqtt_conn, sizeof(ant_mqtt_conn));
+			sq_uart_ant(SQ_UART_ANT_MQTT_CONN, 0);
 
-			snprintf(annotation_msg, ANT_BUF_SIZE, "%s %d bytes\n", ant_pub, MQTT_DATA_BUF_SIZE);
-			sq_uart_send(annotation_msg, strlen(annotation_msg));
+			sq_uart_ant(SQ_UART_ANT_MQTT_PUB, MQTT_DATA_BUF_SIZE);
 			msg_id = esp_mqtt_client_publish(client, MQTT_TOPIC, mqtt_data, MQTT_DATA_BUF_SIZE, 0, 0);
-			sq_uart_send(ant_pub_done, sizeof(ant_pub_done));
+			sq_uart_ant(SQ_UART_ANT_MQTT_PUB_DONE, 0);
 
 			break;
 		case MQTT_EVENT_DISCONNECTED:
@@ -146,7 +137,7 @@ static void mqtt_app_start(void)
 	}
 
 	ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
-	sq_uart_send(ant_mqtt_setup, sizeof(ant_mqtt_setup));
+	sq_uart_ant(SQ_UART_ANT_MQTT_SETUP, 0);
 	esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
 	esp_mqtt_client_start(client);
 }
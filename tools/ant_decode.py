@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+
+# Decode the binary annotation events of sq_uart_ant.c (SQ_UART_ANT_RING_MODE)
+# from a raw capture of the annotation UART, e.g.
+#
+#   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > capture.bin
+#
+# and print the timeline as CSV, one line per event. Times are in us since
+# the boot of the device, on the esp_timer clock: each batch starts with a
+# sync event giving esp_timer at a cycle count, the events in it are placed
+# from their cycle counts. The control pin goes high right after the sync,
+# which lines the timeline up with an Otii trace. Anything that is not a
+# valid frame (boot messages, logs) is skipped. The capture is read as it
+# comes, so the UART can also be piped in.
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+FRAME_EVENT = 0xA5
+FRAME_PROF = 0xA6
+EVENT_LEN = 13
+FLAG_CORE = 0x01
+FLAG_PROF = 0x80
+
+SYNC = 1
+START = 2
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "components", "sq_uart",
+                      "include", "squidward", "sq_uart_ant.h")
+
+
+def read_events(path):
+    """Numbers, names and texts of the events, from the list in sq_uart_ant.h."""
+    events = {}
+    with open(path) as f:
+        for m in re.finditer(r'X\((SQ_UART_ANT_\w+),\s*(\d+),\s*"([^"]*)"\)', f.read()):
+            events[int(m.group(2))] = (m.group(1)[len("SQ_UART_ANT_"):], m.group(3))
+    return events
+
+
+def check(frame):
+    c = 0
+    for b in frame[1:-1]:
+        c ^= b
+    return c == frame[-1]
+
+
+def frames(stream):
+    """Event and profile frames in a byte stream, resynchronising on garbage."""
+    buf = bytearray()
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            return
+        buf += chunk
+        i = 0
+        while True:
+            while i < len(buf) and buf[i] not in (FRAME_EVENT, FRAME_PROF):
+                i += 1
+            if i >= len(buf):
+                break
+            if buf[i] == FRAME_EVENT:
+                n = EVENT_LEN
+            else:
+                if i + 1 >= len(buf):
+                    break
+                n = buf[i + 1] + 3
+            if i + n > len(buf):
+                break
+            frame = bytes(buf[i:i + n])
+            if check(frame):
+                yield frame
+                i += n
+            else:
+                i += 1
+        del buf[:i]
+
+
+def parse_prof(frame):
+    heap_free, largest, heap_min, tasks = struct.unpack_from("<IIIB", frame, 2)
+    pos = 15
+    stacks = []
+    for _ in range(tasks):
+        stack, n = struct.unpack_from("<IB", frame, pos)
+        pos += 5
+        stacks.append("%s:%d" % (frame[pos:pos + n].decode(errors="replace"), stack))
+        pos += n
+    return [heap_free, largest, heap_min, " ".join(stacks)]
+
+
+class Timeline:
+    def __init__(self, mhz):
+        self.mhz = mhz
+        self.sync = None      # (cycles, us) of the last sync
+        self.us_high = 0      # esp_timer bits above the 32 sent
+        self.last_us = None
+
+    def add_sync(self, cycles, us):
+        if self.last_us is not None and us < self.last_us:
+            self.us_high += 1 << 32
+        self.last_us = us
+        self.sync = (cycles, self.us_high + us)
+
+    def time(self, cycles):
+        if self.sync is None:
+            return None
+        # Cycle counts wrap every few seconds, the sync is never that far off
+        diff = (cycles - self.sync[0]) & 0xffffffff
+        if diff >= 1 << 31:
+            diff -= 1 << 32
+        return self.sync[1] + diff / self.mhz
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a capture of binary annotations")
+    parser.add_argument("capture", nargs="?", help="raw UART capture, stdin if not given")
+    parser.add_argument("--events", default=HEADER, help="sq_uart_ant.h with the list of events")
+    parser.add_argument("--mhz", type=float, default=240,
+                        help="CPU clock, until the start event of the device gives it")
+    parser.add_argument("--sync", action="store_true", help="also print the sync events")
+    args = parser.parse_args()
+
+    events = read_events(args.events)
+    timeline = Timeline(args.mhz)
+    stream = open(args.capture, "rb") if args.capture else sys.stdin.buffer
+    out = sys.stdout
+
+    out.write("time_us,core,event,text,heap_free,heap_largest,heap_min,stacks\n")
+    pending = None
+    for frame in frames(stream):
+        if frame[0] == FRAME_PROF:
+            if pending is not None:
+                out.write(",".join(str(v) for v in pending + parse_prof(frame)) + "\n")
+                pending = None
+            continue
+
+        if pending is not None:
+            out.write(",".join(str(v) for v in pending) + ",,,,\n")
+            pending = None
+
+        eid, arg, cycles, flags = struct.unpack_from("<HIIB", frame, 1)
+        if eid == SYNC:
+            timeline.add_sync(cycles, arg)
+            if not args.sync:
+                continue
+        elif eid == START and arg:
+            timeline.mhz = arg
+
+        name, text = events.get(eid, ("UNKNOWN_%d" % eid, "Unknown event %d (%%u)" % eid))
+        t = timeline.time(cycles)
+        row = ["" if t is None else "%.1f" % t, 1 if flags & FLAG_CORE else 0, name,
+               '"%s"' % (text.replace("%u", str(arg)) if "%u" in text else text)]
+        if flags & FLAG_PROF:
+            pending = row
+        else:
+            out.write(",".join(str(v) for v in row) + ",,,,\n")
+
+    if pending is not None:
+        out.write(",".join(str(v) for v in pending) + ",,,,\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,456 @@
+#!/usr/bin/env python3
+
+# Energy of each phase of a run, from a current trace exported by the Otii
+# (CSV with time, current and optionally voltage and GPI columns) and the
+# annotations of the run, one of
+#
+#   - the CSV of tools/ant_decode.py (ring buffer mode), best with --sync
+#   - a "time,text" CSV, e.g. the UART log exported by the Otii (text mode)
+#   - "A <time> <text>" lines, as logged by the host build
+#
+# A phase runs from an annotation to the next one and is named after the
+# event of the first, e.g. POST_SEND from "CoAP POST send" to "CoAP POST send
+# done", then POST_SEND_DONE until whatever comes next. The trace is read
+# sample by sample, so captures of hours are fine; only the annotations are
+# kept in memory.
+#
+#   tools/energy_trace.py analyze trace.csv events.csv --config psk-ecdsa > psk-ecdsa.csv
+#   tools/energy_trace.py compare none.csv psk-ecdsa.csv pki-rsa.csv pki-ecdsa.csv
+#
+# Decoded annotations are on the clock of the device. When the trace has the
+# GPI the control pin is wired to and the annotations have the sync events,
+# the n-th sync is put at the n-th rising edge, which also follows the drift
+# between the two clocks. Otherwise give the offset with --offset.
+#
+#   tools/energy_trace.py test
+#
+# checks the analysis against a synthetic trace with clock drift and noise,
+# and exits non-zero if an energy is off by more than the tolerance.
+
+import argparse
+import csv
+import os
+import random
+import re
+import sys
+import tempfile
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "components", "sq_uart",
+                      "include", "squidward", "sq_uart_ant.h")
+
+UNITS = {"s": 1, "ms": 1e-3, "us": 1e-6, "a": 1, "ma": 1e-3, "ua": 1e-6, "na": 1e-9,
+         "v": 1, "mv": 1e-3}
+
+CONFIGS = {"SETUP_PLAIN": "none", "SETUP_PSK": "psk", "SETUP_PKI": "pki"}
+
+# Phases of the synthetic trace: (event, argument, current A, duration s)
+SYNTH_CYCLE = [("SETUP_PSK", 0, 0.100, 0.8), ("SETUP_DONE", 0, 0.030, 0.2),
+               ("POST_SEND", 1024, 0.150, 0.1), ("POST_SEND_DONE", 0, 0.020, 0.9)]
+SYNTH_VOLTAGE = 3.3
+
+FIELDS = ["config", "phase", "count", "time_s", "charge_mC", "energy_mJ", "mean_mA", "bytes",
+          "uJ_per_byte"]
+
+
+def read_events(path):
+    """Event names and texts from the list in sq_uart_ant.h, the texts as patterns."""
+    events = []
+    with open(path) as f:
+        for m in re.finditer(r'X\((SQ_UART_ANT_\w+),\s*(\d+),\s*"([^"]*)"\)', f.read()):
+            pattern = re.escape(m.group(3)).replace("%u", r"(\d+)")
+            events.append((m.group(1)[len("SQ_UART_ANT_"):], m.group(3), re.compile(pattern + "$")))
+    return events
+
+
+def match_text(events, text):
+    """Name and argument of an annotation text, None for texts that are not events."""
+    text = text.strip()
+    for name, _, pattern in events:
+        m = pattern.match(text)
+        if m:
+            return name, int(m.group(1)) if m.groups() else 0
+    return None
+
+
+def read_annotations(path, events):
+    """Annotations as (time, name, arg, bytes) sorted by time, and the times of the syncs."""
+    texts = {name: text for name, text, _ in events}
+    anns = []
+    syncs = []
+
+    with open(path, newline="") as f:
+        first = f.readline()
+        f.seek(0)
+
+        if first.startswith("time_us,"):
+            for row in csv.DictReader(f):
+                if not row["time_us"]:
+                    continue
+                t = float(row["time_us"]) * 1e-6
+                if row["event"] == "SYNC":
+                    syncs.append(t)
+                    continue
+                m = match_text(events, row["text"])
+                anns.append((t, row["event"], m[1] if m else 0))
+        elif first.startswith("A "):
+            for line in f:
+                parts = line.rstrip("\n").split(" ", 2)
+                if len(parts) == 3 and parts[0] == "A":
+                    m = match_text(events, parts[2])
+                    if m:
+                        anns.append((float(parts[1]), m[0], m[1]))
+        else:
+            reader = csv.reader(f)
+            scale = unit_scale(next(reader)[0])
+            for row in reader:
+                m = match_text(events, row[1]) if len(row) > 1 else None
+                if m:
+                    anns.append((float(row[0]) * scale, m[0], m[1]))
+
+    anns.sort(key=lambda a: a[0])
+    return [(t, name, arg, arg if "bytes" in texts.get(name, "") else 0) for t, name, arg in anns], syncs
+
+
+def unit_scale(name):
+    m = re.search(r"\((\w+)\)", name)
+    return UNITS.get(m.group(1).lower(), 1) if m else 1
+
+
+def read_trace(path):
+    """Samples of the trace as (time s, current A, voltage V or None, GPI high or None)."""
+    with open(path, newline="") as f:
+        reader = csv.reader(f)
+        header = [h.lower() for h in next(reader)]
+
+        def find(*words):
+            for i, h in enumerate(header):
+                if any(w in h for w in words):
+                    return i, unit_scale(h)
+            return None, 1
+
+        t_col, t_scale = find("time")
+        i_col, i_scale = find("current")
+        v_col, v_scale = find("voltage")
+        g_col, _ = find("gpi", "digital")
+        if t_col is None or i_col is None:
+            sys.exit("%s: no time or current column in %s" % (path, ",".join(header)))
+
+        for row in reader:
+            if len(row) <= i_col or not row[i_col]:
+                continue
+            yield (float(row[t_col]) * t_scale, float(row[i_col]) * i_scale,
+                   float(row[v_col]) * v_scale if v_col is not None and row[v_col] else None,
+                   float(row[g_col]) > 0.5 if g_col is not None and row[g_col] else None)
+
+
+def first_edge(path):
+    prev = None
+    for t, _, _, gpi in read_trace(path):
+        if gpi is None:
+            return None
+        if gpi and prev is False:
+            return t
+        prev = gpi
+    return None
+
+
+def integrate(samples, anns, offset, syncs, voltage):
+    """Time, charge and energy of each phase, going through the samples once."""
+    phases = {}
+    order = []
+    state = {"phase": "BEFORE"}
+
+    def add(name, dt, charge, energy):
+        if name not in phases:
+            phases[name] = [0, 0.0, 0.0, 0.0, 0]
+            order.append(name)
+        p = phases[name]
+        p[1] += dt
+        p[2] += charge
+        p[3] += energy
+
+    def start(ann):
+        add(ann[1], 0, 0, 0)
+        phases[ann[1]][0] += 1
+        phases[ann[1]][4] += ann[3]
+        state["phase"] = ann[1]
+
+    i = 0
+    edges = 0
+    prev = None
+    last_gpi = None
+    for t, amp, volt, gpi in samples:
+        if volt is None:
+            if voltage is None:
+                sys.exit("No voltage in the trace, give it with --voltage")
+            volt = voltage
+        power = amp * volt
+
+        if gpi and last_gpi is False and syncs is not None:
+            if edges < len(syncs):
+                offset = t - syncs[edges]
+            edges += 1
+        last_gpi = gpi
+
+        if prev is None:
+            while i < len(anns) and anns[i][0] + offset <= t:
+                start(anns[i])
+                i += 1
+            prev = (t, amp, power)
+            continue
+
+        t0, a0, p0 = prev
+        while i < len(anns) and anns[i][0] + offset <= t:
+            # Split the sample interval at the annotation
+            tb = max(anns[i][0] + offset, t0)
+            f = (tb - t0) / (t - t0) if t > t0 else 0
+            ab = a0 + (amp - a0) * f
+            pb = p0 + (power - p0) * f
+            add(state["phase"], tb - t0, (a0 + ab) / 2 * (tb - t0), (p0 + pb) / 2 * (tb - t0))
+            t0, a0, p0 = tb, ab, pb
+            start(anns[i])
+            i += 1
+        add(state["phase"], t - t0, (a0 + amp) / 2 * (t - t0), (p0 + power) / 2 * (t - t0))
+        prev = (t, amp, power)
+
+    if syncs is not None and edges != len(syncs):
+        print("%d rising edges for %d syncs, the alignment may be off" % (edges, len(syncs)),
+              file=sys.stderr)
+    return [(name,) + tuple(phases[name]) for name in order]
+
+
+def row(config, name, count, dt, charge, energy, nbytes):
+    return [config, name, count, "%.6f" % dt, "%.3f" % (charge * 1e3), "%.3f" % (energy * 1e3),
+            "%.3f" % (charge / dt * 1e3) if dt > 0 else "",
+            nbytes, "%.3f" % (energy * 1e6 / nbytes) if nbytes else ""]
+
+
+def phases_of(events, trace, annotations, offset=None, voltage=None):
+    """Configuration named by the setup event, and the phases of integrate()."""
+    anns, syncs = read_annotations(annotations, events)
+    if not anns:
+        sys.exit("No annotations in %s" % annotations)
+    config = next((CONFIGS[a[1]] for a in anns if a[1] in CONFIGS), "run")
+
+    use_syncs = None
+    if offset is None:
+        edge = first_edge(trace) if syncs else None
+        if edge is not None:
+            offset = edge - syncs[0]
+            use_syncs = syncs
+        else:
+            offset = 0.0
+            if syncs:
+                print("No GPI edges in the trace, annotations are not aligned (--offset)",
+                      file=sys.stderr)
+
+    return config, integrate(read_trace(trace), anns, offset, use_syncs, voltage)
+
+
+def analyze(args):
+    config, phases = phases_of(read_events(args.events), args.trace, args.annotations,
+                               args.offset, args.voltage)
+    if args.config is not None:
+        config = args.config
+
+    out = csv.writer(sys.stdout, lineterminator="\n")
+    out.writerow(FIELDS)
+    total = [0, 0.0, 0.0, 0.0, 0]
+    for name, count, dt, charge, energy, nbytes in phases:
+        out.writerow(row(config, name, count, dt, charge, energy, nbytes))
+        for k, v in enumerate((count, dt, charge, energy, nbytes)):
+            total[k] += v
+    out.writerow(row(config, "total", *total))
+
+
+def compare(args):
+    configs = []
+    values = {}
+    phases = []
+    for path in args.results:
+        with open(path, newline="") as f:
+            for r in csv.DictReader(f):
+                if r["config"] not in configs:
+                    configs.append(r["config"])
+                if r["phase"] not in phases:
+                    phases.append(r["phase"])
+                values[(r["phase"], r["config"])] = r
+
+    def energy(r):
+        count = int(r["count"])
+        return float(r["energy_mJ"]) / count if count else None
+
+    def per_byte(r):
+        return float(r["uJ_per_byte"]) if r["uJ_per_byte"] else None
+
+    def time_ms(r):
+        count = int(r["count"])
+        return float(r["time_s"]) * 1e3 / count if count else None
+
+    def current(r):
+        return float(r["mean_mA"]) if r["mean_mA"] else None
+
+    metrics = {"energy": ("Energy per occurrence (mJ)", energy),
+               "per_byte": ("Energy per byte sent (uJ)", per_byte),
+               "time": ("Time per occurrence (ms)", time_ms),
+               "current": ("Mean current (mA)", current)}
+
+    for metric in args.metric or ["energy", "per_byte"]:
+        title, value = metrics[metric]
+        rows = []
+        for phase in phases:
+            if phase == "total" and metric in ("energy", "time"):
+                continue
+            cells = [value(values[(phase, c)]) if (phase, c) in values else None for c in configs]
+            if any(v is not None for v in cells):
+                rows.append([phase] + ["" if v is None else "%.3f" % v for v in cells])
+        if not rows:
+            continue
+        print("%s\n" % title)
+        print("| Phase | " + " | ".join(configs) + " |")
+        print("| --- |" + " --- |" * len(configs))
+        for r in rows:
+            print("| " + " | ".join(r) + " |")
+        print()
+
+
+def write_synth(events, trace, annotations, seconds, rate, drift, noise):
+    """A trace of repeated connections with the currents of SYNTH_CYCLE, and its annotations."""
+    cycle = SYNTH_CYCLE
+    volt = SYNTH_VOLTAGE
+    length = sum(c[3] for c in cycle)
+    texts = {name: text for name, text, _ in events}
+    rng = random.Random(1)
+    dt = 1.0 / rate
+    # Device clock: starts 0.5 s into the trace and runs drift ppm fast
+    device = lambda t: (t - 0.5) * (1 + drift * 1e-6)
+
+    cycles = int(seconds // length)
+    with open(trace, "w") as tf, open(annotations, "w") as af:
+        tf.write("Timestamp (s),Main current (A),Main voltage (V),GPI1 (V)\n")
+        af.write("time_us,core,event,text,heap_free,heap_largest,heap_min,stacks\n")
+        n = 0
+        for k in range(cycles):
+            t = k * length
+            for name, arg, _, duration in cycle:
+                af.write('%.1f,0,%s,"%s",,,,\n' % (device(t) * 1e6, name,
+                                                   texts[name].replace("%u", str(arg))))
+                t += duration
+            # The drain task sends a batch near the end of the cycle
+            af.write('%.1f,0,SYNC,"Sync",,,,\n' % (device(t - 0.05) * 1e6))
+
+            t0 = k * length
+            while n * dt < t0 + length - dt / 2:
+                ts = n * dt
+                offset = ts - t0
+                for _, _, amp, duration in cycle:
+                    if offset < duration:
+                        break
+                    offset -= duration
+                pin = 1 if 0 <= ts - (t0 + length - 0.05) < 0.005 else 0
+                err = rng.gauss(0, noise) if noise else 0
+                tf.write("%.6f,%.6f,%.3f,%d\n" % (ts, amp + err, volt, pin))
+                n += 1
+    return cycles
+
+
+def synth(args):
+    write_synth(read_events(args.events), args.trace, args.annotations, args.seconds, args.rate,
+                args.drift, args.noise)
+    for name, arg, amp, duration in SYNTH_CYCLE:
+        energy = amp * SYNTH_VOLTAGE * duration
+        print("%s: %.3f mJ per occurrence%s" % (name, energy * 1e3,
+              ", %.3f uJ per byte" % (energy * 1e6 / arg) if arg else ""),
+              file=sys.stderr)
+
+
+def test(args):
+    """Analyzes a synthetic trace and checks the energy of each phase against SYNTH_CYCLE."""
+    events = read_events(args.events)
+    with tempfile.TemporaryDirectory() as tmp:
+        trace = os.path.join(tmp, "trace.csv")
+        annotations = os.path.join(tmp, "events.csv")
+        cycles = write_synth(events, trace, annotations, args.seconds, args.rate, args.drift,
+                             args.noise)
+        config, phases = phases_of(events, trace, annotations)
+    found = {p[0]: p for p in phases}
+
+    failed = 0
+
+    def check(what, value, expected):
+        nonlocal failed
+        error = abs(value - expected) / expected * 100
+        ok = error <= args.tolerance
+        print("%-42s %10.3f %10.3f %7.3f%%  %s" % (what, value, expected, error,
+                                                   "ok" if ok else "FAIL"))
+        if not ok:
+            failed += 1
+
+    if config != "psk":
+        print("configuration %s, expected psk  FAIL" % config)
+        failed += 1
+    for name, arg, amp, duration in SYNTH_CYCLE:
+        if name not in found:
+            print("%s: no phase  FAIL" % name)
+            failed += 1
+            continue
+        _, count, _, _, energy, nbytes = found[name]
+        if count != cycles:
+            print("%s: %d occurrences, expected %d  FAIL" % (name, count, cycles))
+            failed += 1
+            continue
+        expected = amp * SYNTH_VOLTAGE * duration
+        check("%s energy per occurrence (mJ)" % name, energy * 1e3 / count, expected * 1e3)
+        if arg:
+            check("%s energy per byte (uJ)" % name, energy * 1e6 / nbytes,
+                  expected * 1e6 / arg)
+
+    if failed:
+        sys.exit("%d checks failed" % failed)
+    print("All checks passed")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Energy of each phase of an Otii trace")
+    parser.add_argument("--events", default=HEADER, help="sq_uart_ant.h with the list of events")
+    sub = parser.add_subparsers(dest="command")
+    sub.required = True
+
+    p = sub.add_parser("analyze", help="energy of each phase of a run, as CSV")
+    p.add_argument("trace", help="trace exported by the Otii, CSV")
+    p.add_argument("annotations", help="annotations of the run")
+    p.add_argument("--config", help="name of the configuration, from the setup event if not given")
+    p.add_argument("--offset", type=float,
+                   help="seconds to add to the annotation times, instead of the GPI edges")
+    p.add_argument("--voltage", type=float, help="supply voltage, if not in the trace")
+    p.set_defaults(func=analyze)
+
+    p = sub.add_parser("compare", help="tables of the phases of several runs")
+    p.add_argument("results", nargs="+", help="output of analyze")
+    p.add_argument("--metric", action="append", choices=["energy", "per_byte", "time", "current"],
+                   help="what to compare, energy and per_byte if not given")
+    p.set_defaults(func=compare)
+
+    p = sub.add_parser("synth", help="write a synthetic trace and its annotations")
+    p.add_argument("trace")
+    p.add_argument("annotations")
+    p.add_argument("--seconds", type=float, default=60, help="length of the trace")
+    p.add_argument("--rate", type=float, default=4000, help="samples per second")
+    p.add_argument("--drift", type=float, default=20, help="device clock error, ppm")
+    p.add_argument("--noise", type=float, default=0, help="current noise, A (standard deviation)")
+    p.set_defaults(func=synth)
+
+    p = sub.add_parser("test", help="check analyze against a synthetic trace, exit 1 on failure")
+    p.add_argument("--seconds", type=float, default=60, help="length of the trace")
+    p.add_argument("--rate", type=float, default=4000, help="samples per second")
+    p.add_argument("--drift", type=float, default=200, help="device clock error, ppm")
+    p.add_argument("--noise", type=float, default=0.01, help="current noise, A (standard deviation)")
+    p.add_argument("--tolerance", type=float, default=1, help="largest error allowed, percent")
+    p.set_defaults(func=test)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+
+# Compress a firmware image (or a patch from tools/fota_delta.py) for the
+# FOTA clients, see sq_fota_lz.c for the format. The stream after the
+# header is heatshrink with the given window and lookahead, so
+# `heatshrink -e -w W -l L` output can be used as well. Prints the manifest
+# line announcing the compressed image.
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"SQZ1"
+MIN_MATCH = 3
+MAX_CHAIN = 32
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.n = 0
+
+    def put(self, value, bits):
+        self.acc = (self.acc << bits) | value
+        self.n += bits
+        while self.n >= 8:
+            self.n -= 8
+            self.out.append((self.acc >> self.n) & 0xFF)
+        self.acc &= (1 << self.n) - 1
+
+    def flush(self):
+        if self.n:
+            self.out.append((self.acc << (8 - self.n)) & 0xFF)
+            self.acc = self.n = 0
+        return bytes(self.out)
+
+
+def compress(data, window_bits, lookahead_bits):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    # A back reference must be shorter than the literals it replaces
+    min_len = max(MIN_MATCH, (1 + window_bits + lookahead_bits) // 9 + 1)
+
+    out = BitWriter()
+    chains = {}
+    i = 0
+    n = len(data)
+
+    def insert(pos):
+        if pos + MIN_MATCH <= n:
+            chain = chains.setdefault(data[pos:pos + MIN_MATCH], [])
+            chain.append(pos)
+            if len(chain) > MAX_CHAIN:
+                del chain[0]
+
+    while i < n:
+        best_len, best_off = 0, 0
+        for cand in reversed(chains.get(data[i:i + MIN_MATCH], ())):
+            off = i - cand
+            if off > window:
+                break
+            length = 0
+            limit = min(max_len, n - i)
+            while length < limit and data[cand + length] == data[i + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_off = length, off
+                if length == limit:
+                    break
+
+        if best_len >= min_len:
+            out.put(0, 1)
+            out.put(best_off - 1, window_bits)
+            out.put(best_len - 1, lookahead_bits)
+            for pos in range(i, i + best_len):
+                insert(pos)
+            i += best_len
+        else:
+            out.put(1, 1)
+            out.put(data[i], 8)
+            insert(i)
+            i += 1
+
+    return out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress a firmware image")
+    parser.add_argument("image", help="firmware image or patch")
+    parser.add_argument("output", help="compressed image to write")
+    parser.add_argument("-w", "--window", type=int, default=10, help="window bits (default 10)")
+    parser.add_argument("-l", "--lookahead", type=int, default=5, help="lookahead bits (default 5)")
+    args = parser.parse_args()
+
+    if not 4 <= args.window <= 15 or not 3 <= args.lookahead < args.window:
+        parser.error("bad window or lookahead size")
+
+    data = open(args.image, "rb").read()
+    stream = compress(data, args.window, args.lookahead)
+    header = MAGIC + struct.pack("<BBI", args.window, args.lookahead, len(data))
+    with open(args.output, "wb") as f:
+        f.write(header + stream)
+
+    print("%s: %u of %u bytes (%.1f%%)" % (args.output, len(header) + len(stream), len(data),
+          100.0 * (len(header) + len(stream)) / max(len(data), 1)), file=sys.stderr)
+    print("encoding=heatshrink")
+
+
+if __name__ == "__main__":
+    main()
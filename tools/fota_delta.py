@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+
+# Make a patch from the firmware running on the device to a new firmware,
+# to be served instead of the full image (see sq_fota_delta.c for the
+# format). Prints the delta_source line to add to the manifest of the new
+# image, e.g.
+#
+#   tools/fota_manifest.sh new.bin 1.0.1 > manifest
+#   tools/fota_delta.py old.bin new.bin delta.bin >> manifest
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"SQD1"
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_INSERT = 0x03
+
+KEY_LEN = 16        # bytes hashed to find matches
+KEY_STEP = 4        # source positions indexed
+MIN_MATCH = 24      # shorter matches are inserted
+FUZZ_WINDOW = 16    # extend a match while this many bytes are...
+FUZZ_SAME = 8       # ...at least this similar (ADD)
+
+
+def image_id(data):
+    """SHA-256 the device reports for an app partition.
+
+    esp_partition_get_sha256 returns the digest appended to the image when
+    there is one (hash_appended in the image header), which is the digest
+    of the image without it.
+    """
+    if len(data) > 24 + 32 and data[0] == 0xE9 and data[23] == 1:
+        return data[-32:]
+    return hashlib.sha256(data).digest()
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+class Patch:
+    def __init__(self):
+        self.out = bytearray()
+        self.stats = {"copy": 0, "add": 0, "insert": 0}
+
+    def copy(self, off, length):
+        self.out += bytes([OP_COPY]) + varint(off) + varint(length)
+        self.stats["copy"] += length
+
+    def add(self, off, diff):
+        self.out += bytes([OP_ADD]) + varint(off) + varint(len(diff)) + diff
+        self.stats["add"] += len(diff)
+
+    def insert(self, data):
+        if data:
+            self.out += bytes([OP_INSERT]) + varint(len(data)) + data
+            self.stats["insert"] += len(data)
+
+
+def diff(old, new):
+    index = {}
+    for i in range(0, len(old) - KEY_LEN + 1, KEY_STEP):
+        index.setdefault(old[i:i + KEY_LEN], i)
+
+    patch = Patch()
+    literal = 0         # start of the bytes not covered yet
+    j = 0
+    while j + KEY_LEN <= len(new):
+        k = index.get(new[j:j + KEY_LEN])
+        if k is None:
+            j += 1
+            continue
+
+        # Extend the exact match both ways
+        start_new, start_old = j, k
+        while start_new > literal and start_old > 0 and new[start_new - 1] == old[start_old - 1]:
+            start_new -= 1
+            start_old -= 1
+        end_new, end_old = j + KEY_LEN, k + KEY_LEN
+        while end_new < len(new) and end_old < len(old) and new[end_new] == old[end_old]:
+            end_new += 1
+            end_old += 1
+        if end_new - start_new < MIN_MATCH:
+            j += 1
+            continue
+
+        # Then approximately: code that moved keeps most bytes, only the
+        # addresses in it change.
+        fuzz_end = end_new
+        while fuzz_end + FUZZ_WINDOW <= len(new) and end_old + (fuzz_end - end_new) + FUZZ_WINDOW <= len(old):
+            o = end_old + (fuzz_end - end_new)
+            same = sum(1 for a, b in zip(new[fuzz_end:fuzz_end + FUZZ_WINDOW], old[o:o + FUZZ_WINDOW]) if a == b)
+            if same < FUZZ_SAME:
+                break
+            fuzz_end += FUZZ_WINDOW
+
+        patch.insert(new[literal:start_new])
+        patch.copy(start_old, end_new - start_new)
+        if fuzz_end > end_new:
+            src = old[end_old:end_old + fuzz_end - end_new]
+            patch.add(end_old, bytes((a - b) & 0xFF for a, b in zip(new[end_new:fuzz_end], src)))
+        literal = j = fuzz_end
+
+    patch.insert(new[literal:])
+    return patch
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make a delta update patch")
+    parser.add_argument("old", help="firmware running on the device")
+    parser.add_argument("new", help="new firmware")
+    parser.add_argument("patch", help="patch to write")
+    args = parser.parse_args()
+
+    old = open(args.old, "rb").read()
+    new = open(args.new, "rb").read()
+
+    patch = diff(old, new)
+    header = MAGIC + struct.pack("<I", len(new)) + image_id(old) + hashlib.sha256(new).digest()
+    with open(args.patch, "wb") as f:
+        f.write(header + patch.out)
+
+    print("%s: %u bytes for a %u byte image (copy %u, add %u, insert %u)" % (
+        args.patch, len(header) + len(patch.out), len(new),
+        patch.stats["copy"], patch.stats["add"], patch.stats["insert"]), file=sys.stderr)
+    print("delta_source=%s" % image_id(old).hex())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# Print the FOTA manifest of a firmware image, to be served next to the
+# image (CoAP resource or retained MQTT message), see sq_fota.h.
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <firmware.bin> <version> [block size]"
+	exit 1
+fi
+
+echo "version=$2"
+echo "size=$(stat -c %s $1)"
+echo "sha256=$(sha256sum $1 | cut -d ' ' -f 1)"
+echo "block=${3:-1024}"
+
+# The digest esp_partition_get_sha256 gives, appended by esptool (byte 23 set)
+if [ "$(od -An -tu1 -j23 -N1 $1 | tr -d ' ')" = "1" ]; then
+	echo "image_id=$(tail -c 32 $1 | od -An -tx1 -v | tr -d ' \n')"
+fi
@@ -0,0 +1,142 @@
+#!/bin/bash
+
+# Run the host benchmark (host/, see host/README.md) through impaired links,
+# repeatably: the client and a libcoap server run in two network namespaces
+# joined by a veth pair, and each profile of tools/netlab.profiles (loss,
+# burst loss, delay, jitter, reordering, rate, MTU) is applied with tc netem
+# on both ends in turn. Writes <profile>-<config>.csv to the output folder,
+# one row per run and phase of the benchmark:
+#
+#   profile,config,run,phase,bytes,completion_us,retransmits,dtls_resends,tx_dgrams,rx_dgrams,tx_bytes,rx_bytes
+#
+# retransmits and dtls_resends are counted by the benchmark itself (CoAP
+# messages and DTLS handshake flights sent again), so the datagrams that a
+# smaller MTU adds are not taken for losses. Phases that did not complete
+# have no row. The benchmark output and the server log are kept next to it.
+#
+# Needs root. The settings below can be overridden from the environment,
+# e.g. CONFIGS=psk RUNS=20 SEED=1 sudo -E tools/netlab.sh lab burst
+# SEED makes the netem losses repeat from run to run (iproute2 6.5 or later).
+
+SQUIDWARD_PATH=$(cd "$(dirname "$0")/.." && pwd)
+PROFILES=${PROFILES:-$SQUIDWARD_PATH/tools/netlab.profiles}
+CONFIGS=${CONFIGS:-"none psk pki"}
+RUNS=${RUNS:-10}
+TIMEOUT=${TIMEOUT:-900}
+CERTS=${CERTS:-$SQUIDWARD_PATH/src/coaps/main/certs}
+COAP_SERVER=${COAP_SERVER:-coap-server}
+SEED=${SEED:-}
+
+NS_CLI=sq_cli
+NS_SRV=sq_srv
+IP_CLI=10.77.0.2
+IP_SRV=10.77.0.1
+BUILD=build/lab
+
+SERVER_PID=
+
+function cleanup {
+	stop_server
+	ip netns del $NS_CLI 2> /dev/null
+	ip netns del $NS_SRV 2> /dev/null
+}
+
+function setup {
+	cleanup
+	ip netns add $NS_CLI && ip netns add $NS_SRV || exit 1
+	ip link add veth_cli netns $NS_CLI type veth peer name veth_srv netns $NS_SRV || exit 1
+	ip -n $NS_CLI addr add $IP_CLI/24 dev veth_cli
+	ip -n $NS_SRV addr add $IP_SRV/24 dev veth_srv
+	for ns in $NS_CLI $NS_SRV ; do
+		ip -n $ns link set lo up
+		ip -n $ns link set veth_${ns#sq_} up
+	done
+}
+
+# apply <mtu> <netem parameters...>
+function apply {
+	local mtu=$1
+	shift
+	for ns in $NS_CLI $NS_SRV ; do
+		ip -n $ns link set veth_${ns#sq_} mtu $mtu || exit 1
+		tc -n $ns qdisc replace dev veth_${ns#sq_} root netem "$@" ${SEED:+seed $SEED} || exit 1
+	done
+}
+
+function start_server {
+	ip netns exec $NS_SRV $COAP_SERVER -A $IP_SRV -k password \
+		-c $CERTS/coap_server.crt -j $CERTS/coap_server.key -C $CERTS/coap_ca.pem >> $1 2>&1 &
+	SERVER_PID=$!
+	sleep 1
+	if ! kill -0 $SERVER_PID 2> /dev/null; then
+		echo "Could not start $COAP_SERVER, see $1"
+		exit 1
+	fi
+}
+
+function stop_server {
+	if [ -n "$SERVER_PID" ]; then
+		kill $SERVER_PID 2> /dev/null
+		wait $SERVER_PID 2> /dev/null
+		SERVER_PID=
+	fi
+}
+
+# results <profile> <benchmark csv>
+function results {
+	awk -F, -v OFS=, -v profile=$1 '
+		FNR == 1 { next }
+		{ print profile, $1, $2, $3, $4, $5, $14, $15, $10, $11, $8, $9 }' $2
+}
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <output folder> [profile ...]"
+	exit 1
+fi
+
+if [ $(id -u) -ne 0 ]; then
+	echo "$0 needs root for the network namespaces"
+	exit 1
+fi
+
+OUT=$1
+shift
+mkdir -p $OUT || exit 1
+
+SELECTED=
+for profile in ${@:-$(grep -v '^\s*\(#\|$\)' $PROFILES | awk '{ print $1 }')} ; do
+	if ! grep -q "^$profile\s" $PROFILES; then
+		echo "No profile $profile in $PROFILES"
+		exit 1
+	fi
+	SELECTED="$SELECTED $profile"
+done
+
+# The server address is built in, build as the user calling sudo
+for conf in $CONFIGS ; do
+	${SUDO_USER:+sudo -u $SUDO_USER} make -C $SQUIDWARD_PATH/host BUILD=$BUILD SERVER=$IP_SRV \
+		CONFIG=$conf bin > /dev/null || exit 1
+done
+
+trap 'cleanup ; exit 1' SIGINT SIGTERM
+trap cleanup EXIT
+setup
+
+for profile in $SELECTED ; do
+	read -r name mtu netem <<< "$(grep "^$profile\s" $PROFILES)"
+	echo "$profile: MTU $mtu, netem $netem"
+	apply $mtu $netem
+
+	for conf in $CONFIGS ; do
+		base=$OUT/$profile-$conf
+		# A new server for each run set, so that no session is resumed from the previous one
+		start_server $OUT/server.log
+		ip netns exec $NS_CLI timeout $TIMEOUT $SQUIDWARD_PATH/host/$BUILD/$conf/coaps_bench -r $RUNS \
+			2> $base.log > $base.raw.csv || \
+			echo -e "\e[33mBenchmark $conf failed on $profile, see $base.log\e[0m"
+		stop_server
+
+		echo "profile,config,run,phase,bytes,completion_us,retransmits,dtls_resends,tx_dgrams,rx_dgrams,tx_bytes,rx_bytes" > $base.csv
+		results $profile $base.raw.csv >> $base.csv
+	done
+done